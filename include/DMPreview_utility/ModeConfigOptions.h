@@ -16,7 +16,7 @@ public:
     ~ModeConfigOptions() = default;
 
     int GetModeCount(){ return m_modeConfigs.size(); }
-    std::vector<ModeConfig::MODE_CONFIG> GetModes(){ return m_modeConfigs; }
+    const std::vector<ModeConfig::MODE_CONFIG>& GetModes(){ return m_modeConfigs; }
 
     int SelectCurrentIndex(size_t nIndex){
         size_t nVecIndex = TransformDBtoVec(nIndex);
@@ -25,9 +25,9 @@ public:
         return APC_OK;
     }
     int GetCurrentIndex(){ return TransformVectoDB(m_nCurrentIndex); }
-    ModeConfig::MODE_CONFIG GetCurrentModeInfo()
+    const ModeConfig::MODE_CONFIG& GetCurrentModeInfo()
     {
-        ModeConfig::MODE_CONFIG empty;
+        static const ModeConfig::MODE_CONFIG empty;
         if(EOF == m_nCurrentIndex) return empty;
         return m_modeConfigs[m_nCurrentIndex];
     }
@@ -42,9 +42,10 @@ private:
         if (iter != m_DBVecMap.end()) return iter->second;
         else return m_modeConfigs.size();
     }
+    // m_DBVecMap maps iMode to the vector index, so the reverse is the iMode of the entry
     int TransformVectoDB(int nVecIndex) {
-        auto findKey = std::find_if(std::begin(m_DBVecMap), std::end(m_DBVecMap), [&](const std::pair<int, int>&pair){ return pair.second == nVecIndex;});
-        if( findKey != std::end(m_DBVecMap)) return findKey->first;
+        if(nVecIndex < 0 || nVecIndex >= (int)m_modeConfigs.size()) return EOF;
+        return m_modeConfigs[nVecIndex].iMode;
     }
 };
 
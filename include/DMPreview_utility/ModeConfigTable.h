@@ -0,0 +1,106 @@
+#pragma once
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <ModeConfig.h>
+#include <ModeConfigOptions.h>
+#include "base/synchronization/Lock.h"
+
+//
+// Process-wide index of the mode database, keyed by PID and USB type.
+//
+// A ModeConfig opens the SQLite database and reads the tables of every PID
+// each time it is constructed, and the SDK constructs one for each
+// ModeConfigOptions it hands out. ModeConfigTable reads the database once per
+// process and keeps each PID and USB type filtered into its own flat table.
+// Tables are built on first lookup and stay valid until exit, so callers can
+// hold on to the references:
+//
+//      const ModeConfigTable::Modes &modes = ModeConfigTable::Get().Find(usbType, wPID);
+//      const ModeConfig::MODE_CONFIG *mode = modes.FindByDBIndex(iMode);
+//
+// Defining EYS3D_MODE_CONFIG_TABLE_IMPLEMENTATION in exactly one source file of
+// the application makes ModeConfigOptions, thus CameraDevice::getModeConfigOptions(),
+// fill itself from these tables instead of the database. The test programs do
+// this only when configured with -DEYS3D_MODE_CONFIG_TABLE=ON.
+//
+
+class ModeConfigTable
+{
+public:
+    struct Modes
+    {
+        std::vector< ModeConfig::MODE_CONFIG > vecModeConfig;   // modes of the USB type, database order
+        std::unordered_map< int, int > mapDBToVec;              // iMode -> index in vecModeConfig
+        ModeConfig::IMU_TYPE IMU_Type;
+
+        const ModeConfig::MODE_CONFIG *FindByDBIndex( int nDBIndex ) const
+        {
+            auto iter = mapDBToVec.find( nDBIndex );
+            return ( iter != mapDBToVec.end() ) ? &vecModeConfig[ iter->second ] : nullptr;
+        }
+
+        Modes() : IMU_Type( ModeConfig::IMU_NONE ) {}
+    };
+
+    // Never destroyed, devices may ask for their modes after static destructors ran
+    static ModeConfigTable &Get()
+    {
+        static ModeConfigTable *s_pInstance = new ModeConfigTable();
+        return *s_pInstance;
+    }
+
+    const Modes &Find( USB_PORT_TYPE usbType, unsigned short nPID )
+    {
+        const uint32_t nKey = ( ( uint32_t )nPID << 8 ) | ( ( uint32_t )usbType & 0xFF );
+
+        libeYs3D::base::AutoLock lock( m_lock );
+        std::unique_ptr< Modes > &pModes = m_mapModes[ nKey ];
+        if ( !pModes ) pModes = Build( usbType, nPID );
+
+        return *pModes;
+    }
+
+private:
+    ModeConfigTable() = default;
+    ModeConfigTable( const ModeConfigTable & ) = delete;
+    ModeConfigTable &operator=( const ModeConfigTable & ) = delete;
+
+    // guarded by m_lock, same selection as the ModeConfigOptions constructor
+    std::unique_ptr< Modes > Build( USB_PORT_TYPE usbType, unsigned short nPID )
+    {
+        if ( !m_pModeConfig ) m_pModeConfig.reset( new ModeConfig() );   // the one database read
+
+        std::unique_ptr< Modes > pModes( new Modes() );
+        for ( const ModeConfig::MODE_CONFIG &modeConfig : m_pModeConfig->GetModeConfigList( nPID ) )
+        {
+            if ( modeConfig.iUSB_Type != usbType ) continue;
+
+            pModes->mapDBToVec.emplace( modeConfig.iMode, ( int )pModes->vecModeConfig.size() );
+            pModes->vecModeConfig.push_back( modeConfig );
+        }
+        pModes->IMU_Type = m_pModeConfig->GetIMU_Type( nPID );
+
+        return pModes;
+    }
+
+    libeYs3D::base::Lock m_lock;
+    std::unique_ptr< ModeConfig > m_pModeConfig;
+    std::unordered_map< uint32_t, std::unique_ptr< Modes > > m_mapModes;
+};
+
+#ifdef EYS3D_MODE_CONFIG_TABLE_IMPLEMENTATION
+
+// Takes precedence over the constructor of the prebuilt library
+ModeConfigOptions::ModeConfigOptions( USB_PORT_TYPE usbType, unsigned short nPID )
+    : m_nCurrentIndex( EOF )
+{
+    const ModeConfigTable::Modes &modes = ModeConfigTable::Get().Find( usbType, nPID );
+
+    m_modeConfigs = modes.vecModeConfig;
+    m_DBVecMap.insert( modes.mapDBToVec.begin(), modes.mapDBToVec.end() );
+    m_nVecIndex = ( int )m_modeConfigs.size();
+}
+
+#endif // EYS3D_MODE_CONFIG_TABLE_IMPLEMENTATION
@@ -1,4 +1,7 @@
 #pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 #include <string>
 #include <vector>
 #ifdef WIN32
@@ -19,6 +22,8 @@ class PlyWriter {
 	PlyWriter();
 public:
     static int writePly(std::vector<CloudPoint>& cloud,  std::string filename);
+    // Vertices and triangles, 3 indices each (video/OrganizedMesh.h), binary little endian; 0 on success
+    static int writePlyMesh(const std::vector<CloudPoint>& vertices, const std::vector<uint32_t>& indices, std::string filename);
 	//static int apcFrameTo3D(int depthWidth, int depthHeight, std::vector<unsigned char>& dArray, int colorWidth, int colorHeight, std::vector<unsigned char>& colorArray, eSPCtrl_RectLogData* rectLogData, APCImageType::Value depthType, std::vector<CloudPoint>& output,float zNear,float zFar, bool removeINF, bool useDepthResolution, float scale_ratio);
 	//static int apcFrameTo3D(int depthWidth, int depthHeight ,std::vector<unsigned char>& dArray, int colorWidth, int colorHeight, std::vector<unsigned char>& colorArray, eSPCtrl_RectLogData* rectLogData, APCImageType::Value depthType, std::vector<CloudPoint>& output, bool removeINF, bool useDepthResolution, float scale_ratio);
     static int apcFrameTo3D_8029(int depthWidth, int depthHeight, std::vector<unsigned char>& dArray, int colorWidth, int colorHeight, std::vector<unsigned char>& colorArray, eSPCtrl_RectLogData* rectLogData, APCImageType::Value depthType, std::vector<CloudPoint>& output, bool clipping, float zNear, float zFar, bool removeINF, bool useDepthResolution, float scale_ratio);
@@ -39,3 +44,46 @@ public:
 	
 };
 
+inline int PlyWriter::writePlyMesh(const std::vector<CloudPoint>& vertices, const std::vector<uint32_t>& indices, std::string filename) {
+	FILE *file = fopen(filename.c_str(), "wb");
+	if (file == nullptr) return -1;
+
+	const size_t triangles = indices.size() / 3;
+	fprintf(file, "ply\nformat binary_little_endian 1.0\n"
+	              "element vertex %zu\nproperty float x\nproperty float y\nproperty float z\n"
+	              "property uchar red\nproperty uchar green\nproperty uchar blue\n"
+	              "element face %zu\nproperty list uchar int vertex_indices\nend_header\n",
+	        vertices.size(), triangles);
+
+	// packed records, written a block at a time
+	std::vector<uint8_t> buffer;
+	buffer.reserve(4096 * 15);
+	for (size_t i = 0; i < vertices.size(); i++) {
+		const CloudPoint &point = vertices[i];
+		uint8_t record[15];
+		memcpy(record, &point.x, 4);
+		memcpy(record + 4, &point.y, 4);
+		memcpy(record + 8, &point.z, 4);
+		record[12] = point.r;
+		record[13] = point.g;
+		record[14] = point.b;
+		buffer.insert(buffer.end(), record, record + sizeof(record));
+		if (buffer.size() >= 4096 * 15) {
+			fwrite(buffer.data(), 1, buffer.size(), file);
+			buffer.clear();
+		}
+	}
+	for (size_t t = 0; t < triangles; t++) {
+		uint8_t record[13];
+		record[0] = 3;
+		memcpy(record + 1, &indices[t * 3], 3 * sizeof(uint32_t));
+		buffer.insert(buffer.end(), record, record + sizeof(record));
+		if (buffer.size() >= 4096 * 15) {
+			fwrite(buffer.data(), 1, buffer.size(), file);
+			buffer.clear();
+		}
+	}
+	fwrite(buffer.data(), 1, buffer.size(), file);
+
+	return (fclose(file) == 0) ? 0 : -1;
+}
@@ -0,0 +1,608 @@
+/*
+ * Copyright (C) 2021 eYs3D Corporation
+ * All rights reserved.
+ * This project is licensed under the Apache License, Version 2.0.
+ */
+
+#pragma once
+
+#include "debug.h"
+#include "utils.h"
+#include "base/Compiler.h"
+#include "base/synchronization/Lock.h"
+#include "base/synchronization/ConditionVariable.h"
+#include "base/threads/FunctorThread.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <functional>
+#include <initializer_list>
+#include <type_traits>
+#include <vector>
+
+//
+// Asynchronous, allocation-free logging backend.
+//
+// ALOG_ERR / ALOG_WARN / ALOG_INFO / ALOG_DEBUG / ALOG_VERBOSE copy the tag
+// and the format arguments as binary values into a lock-free ring owned by
+// the calling thread; nothing is formatted on the caller side. A single
+// background thread drains every ring, formats the records and hands the text
+// to the regular debug.h backend (LOG_ERR_S, LOG_INFO, ...), so the output
+// destinations configured by initialize_debug_framework() are kept.
+//
+// - The format must be a string literal; %s arguments are copied, so they may
+//   point to temporary buffers.
+// - Levels above EYS3D_LOG_COMPILE_LEVEL are compiled out. The runtime level
+//   (setAsyncLogLevel()) costs one relaxed load and one branch per call site.
+// - When a ring is full the record is dropped and counted, the caller never
+//   blocks and never allocates (the ring itself is allocated on the first log
+//   of each thread).
+//
+// Building with -DEYS3D_ASYNC_LOG routes the debug.h LOG_ERR, LOG_ERR_ERRNO,
+// LOG_WARN, LOG_INFO, LOG_DEBUG and LOG_VERBOSE macros of the including
+// translation unit through this backend.
+//
+
+#define EYS3D_LOG_LEVEL_ERR         0
+#define EYS3D_LOG_LEVEL_WARN        1
+#define EYS3D_LOG_LEVEL_INFO        2
+#define EYS3D_LOG_LEVEL_DEBUG       3
+#define EYS3D_LOG_LEVEL_VERBOSE     4
+
+#ifndef EYS3D_LOG_COMPILE_LEVEL
+#  define EYS3D_LOG_COMPILE_LEVEL EYS3D_LOG_LEVEL_VERBOSE
+#endif
+
+namespace libeYs3D    {
+namespace logging    {
+
+// Constant-initialized so the level check needs no guard
+template <class T = void>
+struct AsyncLogLevel    {
+    static std::atomic<int> value;
+};
+
+template <class T>
+std::atomic<int> AsyncLogLevel<T>::value{EYS3D_LOG_LEVEL_INFO};
+
+inline void setAsyncLogLevel(int level)    {
+    AsyncLogLevel<>::value.store(level, std::memory_order_relaxed);
+}
+
+inline int getAsyncLogLevel()    {
+    return AsyncLogLevel<>::value.load(std::memory_order_relaxed);
+}
+
+namespace internal    {
+
+enum : uint8_t    {
+    ARG_INT = 'i',
+    ARG_UINT = 'u',
+    ARG_DOUBLE = 'd',
+    ARG_POINTER = 'p',
+    ARG_STRING = 's',
+};
+
+enum : uint8_t    {
+    RECORD_PADDING = 0x01,
+    RECORD_ERRNO = 0x02,
+};
+
+static constexpr size_t kMaxStringArgLength = 255;
+
+struct LogRecordHeader    {
+    uint32_t size;      // whole record, 8 bytes aligned
+    uint8_t level;
+    uint8_t flags;
+    uint16_t argCount;
+    int32_t line;
+    int32_t errnoValue;
+    int64_t tsUs;
+    const char *format;
+    const char *file;
+    const char *func;
+    // followed by the tag as a string argument, then the arguments
+};
+
+// Single producer (the owning thread), single consumer (the log thread)
+struct LogRing    {
+    static constexpr size_t kCapacity = 64 * 1024;
+
+    std::atomic<uint64_t> head{0}; // consumer position
+    std::atomic<uint64_t> tail{0}; // producer position
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<bool> orphaned{false};
+    alignas(8) uint8_t buffer[kCapacity];
+
+    // Returns the place for |size| contiguous bytes or nullptr if full
+    uint8_t *reserve(uint32_t size, uint64_t *newTail)    {
+        uint64_t t = tail.load(std::memory_order_relaxed);
+        uint64_t h = head.load(std::memory_order_acquire);
+        size_t offset = t & (kCapacity - 1);
+        size_t padding = (offset + size > kCapacity) ? kCapacity - offset : 0;
+
+        if(t + padding + size - h > kCapacity)    return nullptr;
+
+        if(padding)    {
+            LogRecordHeader *pad = reinterpret_cast<LogRecordHeader *>(&buffer[offset]);
+            pad->size = (uint32_t)padding;
+            pad->flags = RECORD_PADDING;
+            offset = 0;
+        }
+        *newTail = t + padding + size;
+
+        return &buffer[offset];
+    }
+
+    void commit(uint64_t newTail)    { tail.store(newTail, std::memory_order_release); }
+};
+
+inline size_t argSize(const char *s)    {
+    size_t length = (s == nullptr) ? 0 : strnlen(s, kMaxStringArgLength);
+    return 2 + length;
+}
+
+inline size_t argSize(char *s)    { return argSize((const char *)s); }
+
+template <class T>
+inline typename std::enable_if<std::is_arithmetic<T>::value ||
+                               std::is_enum<T>::value ||
+                               std::is_pointer<T>::value, size_t>::type
+argSize(T)    {
+    return 1 + 8;
+}
+
+inline uint8_t *encodeArg(uint8_t *p, const char *s)    {
+    size_t length = (s == nullptr) ? 0 : strnlen(s, kMaxStringArgLength);
+    *p++ = ARG_STRING;
+    *p++ = (uint8_t)length;
+    if(length)    memcpy(p, s, length);
+
+    return p + length;
+}
+
+inline uint8_t *encodeArg(uint8_t *p, char *s)    { return encodeArg(p, (const char *)s); }
+
+template <class T>
+inline typename std::enable_if<std::is_floating_point<T>::value, uint8_t *>::type
+encodeArg(uint8_t *p, T value)    {
+    double d = value;
+    *p++ = ARG_DOUBLE;
+    memcpy(p, &d, 8);
+
+    return p + 8;
+}
+
+template <class T>
+inline typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value, uint8_t *>::type
+encodeArg(uint8_t *p, T value)    {
+    bool isSigned = std::is_signed<typename std::conditional<std::is_enum<T>::value,
+                                                             int, T>::type>::value;
+    int64_t v = (int64_t)value;
+    *p++ = isSigned ? ARG_INT : ARG_UINT;
+    memcpy(p, &v, 8);
+
+    return p + 8;
+}
+
+template <class T>
+inline uint8_t *encodeArg(uint8_t *p, T *pointer)    {
+    uint64_t v = (uint64_t)(uintptr_t)pointer;
+    *p++ = ARG_POINTER;
+    memcpy(p, &v, 8);
+
+    return p + 8;
+}
+
+struct DecodedArg    {
+    uint8_t type;
+    union    {
+        int64_t i;
+        uint64_t u;
+        double d;
+    };
+    const char *s;
+    uint8_t length;
+};
+
+inline const uint8_t *decodeArg(const uint8_t *p, DecodedArg *arg)    {
+    arg->type = *p++;
+    if(arg->type == ARG_STRING)    {
+        arg->length = *p++;
+        arg->s = (const char *)p;
+        return p + arg->length;
+    }
+    memcpy(&arg->u, p, 8);
+
+    return p + 8;
+}
+
+// printf-style rendering of |format| with the captured arguments
+inline int formatRecord(char *out, size_t outLength, const char *format,
+                        const uint8_t *args, int argCount)    {
+    size_t n = 0;
+    int used = 0;
+    auto put = [&](const char *s, size_t length)    {
+        if(n + 1 >= outLength)    return;
+        if(length > outLength - 1 - n)    length = outLength - 1 - n;
+        memcpy(out + n, s, length);
+        n += length;
+    };
+    auto next = [&](DecodedArg *arg) -> bool    {
+        if(used >= argCount)    return false;
+        args = decodeArg(args, arg);
+        used += 1;
+        return true;
+    };
+
+    const char *p = format;
+    while(*p)    {
+        const char *percent = strchr(p, '%');
+        if(percent == nullptr)    {
+            put(p, strlen(p));
+            break;
+        }
+        put(p, percent - p);
+        p = percent + 1;
+        if(*p == '%')    {
+            put("%", 1);
+            p++;
+            continue;
+        }
+
+        // flags, width and precision are kept, length modifiers are replaced
+        char spec[32] = "%";
+        size_t specLength = 1;
+        int star[2] = { 0, 0 }, starCount = 0;
+        while(*p && strchr("-+ #0123456789.*", *p))    {
+            if(*p == '*' && starCount < 2)    {
+                DecodedArg width;
+                star[starCount++] = next(&width) ? (int)width.i : 0;
+            }
+            if(specLength < sizeof(spec) - 4)    spec[specLength++] = *p;
+            p++;
+        }
+        while(*p && strchr("hlLqjzt", *p))    p++;
+        char conversion = *p ? *p++ : '\0';
+        if(conversion == '\0')    break;
+
+        DecodedArg arg;
+        if(!next(&arg))    {
+            put("(?)", 3);
+            continue;
+        }
+
+        char text[512];
+        int length = 0;
+        spec[specLength] = '\0';
+        switch(conversion)    {
+            case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':    {
+                strcat(spec, "ll");
+                size_t l = strlen(spec);
+                spec[l] = conversion;
+                spec[l + 1] = '\0';
+                long long v = (arg.type == ARG_DOUBLE) ? (long long)arg.d : (long long)arg.i;
+                if(starCount == 2)    length = snprintf(text, sizeof(text), spec, star[0], star[1], v);
+                else if(starCount == 1)    length = snprintf(text, sizeof(text), spec, star[0], v);
+                else    length = snprintf(text, sizeof(text), spec, v);
+                break;
+            }
+            case 'c':    {
+                strcat(spec, "c");
+                int v = (arg.type == ARG_DOUBLE) ? (int)arg.d : (int)arg.i;
+                if(starCount == 2)    length = snprintf(text, sizeof(text), spec, star[0], star[1], v);
+                else if(starCount == 1)    length = snprintf(text, sizeof(text), spec, star[0], v);
+                else    length = snprintf(text, sizeof(text), spec, v);
+                break;
+            }
+            case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':    {
+                size_t l = strlen(spec);
+                spec[l] = conversion;
+                spec[l + 1] = '\0';
+                double v = (arg.type == ARG_DOUBLE) ? arg.d :
+                           (arg.type == ARG_INT) ? (double)arg.i : (double)arg.u;
+                if(starCount == 2)    length = snprintf(text, sizeof(text), spec, star[0], star[1], v);
+                else if(starCount == 1)    length = snprintf(text, sizeof(text), spec, star[0], v);
+                else    length = snprintf(text, sizeof(text), spec, v);
+                break;
+            }
+            case 's':    {
+                char value[kMaxStringArgLength + 1];
+                if(arg.type == ARG_STRING)    {
+                    memcpy(value, arg.s, arg.length);
+                    value[arg.length] = '\0';
+                } else    {
+                    strcpy(value, "(?)");
+                }
+                strcat(spec, "s");
+                if(starCount == 2)    length = snprintf(text, sizeof(text), spec, star[0], star[1], value);
+                else if(starCount == 1)    length = snprintf(text, sizeof(text), spec, star[0], value);
+                else    length = snprintf(text, sizeof(text), spec, value);
+                break;
+            }
+            case 'p':
+                length = snprintf(text, sizeof(text), "0x%llx", (unsigned long long)arg.u);
+                break;
+            default:
+                length = 0;
+                break;
+        }
+        if(length > 0)    put(text, MIN((size_t)length, sizeof(text) - 1));
+    }
+
+    out[n] = '\0';
+    return (int)n;
+}
+
+class AsyncLogger    {
+    DISALLOW_COPY_ASSIGN_AND_MOVE(AsyncLogger);
+
+public:
+    // Receives every formatted message on the log thread
+    using Sink = std::function<void(int level, const char *tag, const char *message)>;
+
+    // Never destroyed, so logging from static destructors stays valid
+    static AsyncLogger &get()    {
+        static AsyncLogger *sInstance = new AsyncLogger();
+        return *sInstance;
+    }
+
+    LogRing *threadRing()    {
+        static thread_local RingHolder sHolder;
+        if(sHolder.ring == nullptr)    sHolder.ring = registerRing();
+
+        return sHolder.ring;
+    }
+
+    void setSink(Sink sink)    {
+        base::AutoLock lock(mLock);
+        mSink = std::move(sink);
+        mChanged = true;
+    }
+
+    // Blocks until every record logged before the call has been written
+    void flush()    {
+        base::AutoLock lock(mLock);
+        uint64_t target = ++mRequestedFlushes;
+        mCondition.broadcast();
+        while(mCompletedFlushes < target && mRunning)    {
+            mCondition.timedWait(&mLock, now_in_microsecond_unix_time() + 10000);
+        }
+    }
+
+    uint64_t getDroppedCount()    {
+        base::AutoLock lock(mLock);
+        uint64_t dropped = mRetiredDropped;
+        for(LogRing *ring : mRings)    dropped += ring->dropped.load(std::memory_order_relaxed);
+
+        return dropped;
+    }
+
+private:
+    struct RingHolder    {
+        LogRing *ring = nullptr;
+        ~RingHolder()    {
+            if(ring)    ring->orphaned.store(true, std::memory_order_release);
+        }
+    };
+
+    static constexpr int kIdleSleepUs = 2000;
+
+    AsyncLogger()
+        : mThread([this]() { loop(); })    {
+        mRings.reserve(64);
+        mRunning = mThread.start();
+        atexit([]() { AsyncLogger::get().flush(); });
+    }
+
+    LogRing *registerRing()    {
+        LogRing *ring = new LogRing();
+        base::AutoLock lock(mLock);
+        mRings.push_back(ring);
+        mChanged = true;
+
+        return ring;
+    }
+
+    // The rings and the sink are copied only when they changed, not on every pass
+    void loop()    {
+        std::vector<LogRing *> rings;
+        rings.reserve(64);
+        while(true)    {
+            uint64_t flushTarget;
+            {
+                base::AutoLock lock(mLock);
+                if(mChanged)    {
+                    rings.assign(mRings.begin(), mRings.end());
+                    mLoopSink = mSink;
+                    mChanged = false;
+                }
+                flushTarget = mRequestedFlushes;
+            }
+
+            bool busy = false;
+            bool orphans = false;
+            for(LogRing *ring : rings)    {
+                busy |= drain(ring);
+                orphans |= ring->orphaned.load(std::memory_order_relaxed);
+            }
+            if(orphans)    reapOrphans();
+
+            base::AutoLock lock(mLock);
+            if(flushTarget > mCompletedFlushes)    {
+                mCompletedFlushes = flushTarget;
+                mCondition.broadcast();
+            }
+            if(!busy && mRequestedFlushes == mCompletedFlushes)    {
+                mCondition.timedWait(&mLock, now_in_microsecond_unix_time() + kIdleSleepUs);
+            }
+        }
+    }
+
+    bool drain(LogRing *ring)    {
+        uint64_t h = ring->head.load(std::memory_order_relaxed);
+        uint64_t t = ring->tail.load(std::memory_order_acquire);
+        if(h == t)    return false;
+
+        while(h != t)    {
+            const uint8_t *p = &ring->buffer[h & (LogRing::kCapacity - 1)];
+            const LogRecordHeader *header = reinterpret_cast<const LogRecordHeader *>(p);
+            if(!(header->flags & RECORD_PADDING))    write(header);
+            h += header->size;
+        }
+        ring->head.store(h, std::memory_order_release);
+
+        return true;
+    }
+
+    void write(const LogRecordHeader *header)    {
+        DecodedArg tag;
+        const uint8_t *args = decodeArg(reinterpret_cast<const uint8_t *>(header + 1), &tag);
+        char tagText[kMaxStringArgLength + 1];
+        memcpy(tagText, tag.s, tag.length);
+        tagText[tag.length] = '\0';
+
+        char message[LOGER_BUFFER_SIZE];
+        int n = formatRecord(message, sizeof(message), header->format, args, header->argCount);
+        if(header->level == EYS3D_LOG_LEVEL_ERR || header->level >= EYS3D_LOG_LEVEL_DEBUG)    {
+            char errnoText[128] = "";
+            if(header->flags & RECORD_ERRNO)    {
+                snprintf(errnoText, sizeof(errnoText), ", errno: %s",
+                         header->errnoValue == 0 ? "None" : strerror(header->errnoValue));
+            }
+            snprintf(message + n, sizeof(message) - n, "\n        (%s:%d:%s%s)",
+                     header->file, header->line, header->func, errnoText);
+        }
+
+        if(mLoopSink)    {
+            mLoopSink(header->level, tagText, message);
+            return;
+        }
+
+        switch(header->level)    {
+            case EYS3D_LOG_LEVEL_ERR:    LOG_ERR_S(tagText, "%s", message); break;
+            case EYS3D_LOG_LEVEL_WARN:    (LOG_WARN)(tagText, "%s", message); break;
+            case EYS3D_LOG_LEVEL_INFO:    (LOG_INFO)(tagText, "%s", message); break;
+            case EYS3D_LOG_LEVEL_DEBUG:    LOG_DEBUG_S(tagText, "%s", message); break;
+            default:    LOG_VERBOSE_S(tagText, "%s", message); break;
+        }
+    }
+
+    void reapOrphans()    {
+        base::AutoLock lock(mLock);
+        for(auto it = mRings.begin(); it != mRings.end();)    {
+            LogRing *ring = *it;
+            if(ring->orphaned.load(std::memory_order_acquire) &&
+               ring->head.load(std::memory_order_relaxed) ==
+               ring->tail.load(std::memory_order_acquire))    {
+                mRetiredDropped += ring->dropped.load(std::memory_order_relaxed);
+                delete ring;
+                it = mRings.erase(it);
+                mChanged = true;        // before the loop drains its copy again
+            } else    {
+                ++it;
+            }
+        }
+    }
+
+    base::Lock mLock;
+    base::ConditionVariable mCondition;
+    std::vector<LogRing *> mRings;   // guarded by mLock
+    Sink mSink;                      // guarded by mLock
+    bool mChanged = false;           // guarded by mLock, mRings or mSink changed
+    Sink mLoopSink;                  // the log thread's copy of mSink
+    uint64_t mRequestedFlushes = 0;  // guarded by mLock
+    uint64_t mCompletedFlushes = 0;  // guarded by mLock
+    uint64_t mRetiredDropped = 0;    // guarded by mLock
+    bool mRunning = false;
+    base::FunctorThread mThread;
+};
+
+template <class... Args>
+inline void asyncLog(int level, uint8_t flags, int errnoValue, const char *tag,
+                     const char *format, const char *file, int line, const char *func,
+                     const Args &... args)    {
+    size_t size = sizeof(LogRecordHeader) + argSize(tag);
+    (void)std::initializer_list<int>{ (size += argSize(args), 0)... };
+    size = (size + 7) & ~(size_t)7;
+    if(size > LogRing::kCapacity / 4)    return;
+
+    LogRing *ring = AsyncLogger::get().threadRing();
+    uint64_t newTail;
+    uint8_t *p = ring->reserve((uint32_t)size, &newTail);
+    if(p == nullptr)    {
+        ring->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    LogRecordHeader *header = reinterpret_cast<LogRecordHeader *>(p);
+    header->size = (uint32_t)size;
+    header->level = (uint8_t)level;
+    header->flags = flags;
+    header->argCount = (uint16_t)sizeof...(Args);
+    header->line = line;
+    header->errnoValue = errnoValue;
+    header->tsUs = now_in_microsecond_high_res_time_REALTIME();
+    header->format = format;
+    header->file = file;
+    header->func = func;
+
+    p = encodeArg(reinterpret_cast<uint8_t *>(header + 1), tag);
+    (void)std::initializer_list<int>{ (p = encodeArg(p, args), 0)... };
+    ring->commit(newTail);
+}
+
+}  // namespace internal
+
+inline void flushAsyncLog()    { internal::AsyncLogger::get().flush(); }
+
+inline uint64_t getAsyncLogDroppedCount()    {
+    return internal::AsyncLogger::get().getDroppedCount();
+}
+
+}  // namespace logging
+}  // namespace libeYs3D
+
+#define ALOG_AT(LEVEL, FLAGS, TAG, FMT, ...)                                         \
+    do    {                                                                         \
+        if((LEVEL) <= EYS3D_LOG_COMPILE_LEVEL &&                                    \
+           (LEVEL) <= libeYs3D::logging::AsyncLogLevel<>::value.load(               \
+                          std::memory_order_relaxed))    {                           \
+            libeYs3D::logging::internal::asyncLog((LEVEL), (FLAGS), errno, (TAG),  \
+                                                  "" FMT, __FILE__, __LINE__,       \
+                                                  __func__, ##__VA_ARGS__);          \
+        }                                                                           \
+    } while(0)
+
+#define ALOG_ERR(TAG, FMT, ...)                                                     \
+    ALOG_AT(EYS3D_LOG_LEVEL_ERR, 0, TAG, FMT, ##__VA_ARGS__)
+#define ALOG_ERR_ERRNO(TAG, FMT, ...)                                               \
+    ALOG_AT(EYS3D_LOG_LEVEL_ERR, libeYs3D::logging::internal::RECORD_ERRNO,         \
+            TAG, FMT, ##__VA_ARGS__)
+#define ALOG_WARN(TAG, FMT, ...)                                                    \
+    ALOG_AT(EYS3D_LOG_LEVEL_WARN, 0, TAG, FMT, ##__VA_ARGS__)
+#define ALOG_INFO(TAG, FMT, ...)                                                    \
+    ALOG_AT(EYS3D_LOG_LEVEL_INFO, 0, TAG, FMT, ##__VA_ARGS__)
+#define ALOG_DEBUG(TAG, FMT, ...)                                                   \
+    ALOG_AT(EYS3D_LOG_LEVEL_DEBUG, 0, TAG, FMT, ##__VA_ARGS__)
+#define ALOG_VERBOSE(TAG, FMT, ...)                                                 \
+    ALOG_AT(EYS3D_LOG_LEVEL_VERBOSE, libeYs3D::logging::internal::RECORD_ERRNO,     \
+            TAG, FMT, ##__VA_ARGS__)
+
+#ifdef EYS3D_ASYNC_LOG
+#  undef LOG_ERR
+#  undef LOG_ERR_ERRNO
+#  undef LOG_DEBUG
+#  undef LOG_VERBOSE
+#  define LOG_ERR(TAG, FMT, ...)          ALOG_ERR(TAG, FMT, ##__VA_ARGS__)
+#  define LOG_ERR_ERRNO(TAG, FMT, ...)    ALOG_ERR_ERRNO(TAG, FMT, ##__VA_ARGS__)
+#  define LOG_WARN(TAG, FMT, ...)         ALOG_WARN(TAG, FMT, ##__VA_ARGS__)
+#  define LOG_INFO(TAG, FMT, ...)         ALOG_INFO(TAG, FMT, ##__VA_ARGS__)
+#  define LOG_DEBUG(TAG, FMT, ...)        ALOG_DEBUG(TAG, FMT, ##__VA_ARGS__)
+#  define LOG_VERBOSE(TAG, FMT, ...)      ALOG_VERBOSE(TAG, FMT, ##__VA_ARGS__)
+#endif
@@ -0,0 +1,359 @@
+/*
+ * Copyright (C) 2021 eYs3D Corporation
+ * All rights reserved.
+ * This project is licensed under the Apache License, Version 2.0.
+ */
+
+#pragma once
+
+#include "utils.h"
+#include "base/Compiler.h"
+#include "base/synchronization/ConditionVariable.h"
+#include "base/synchronization/Lock.h"
+#include "base/threads/FunctorThread.h"
+
+#include <stdlib.h>
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+
+//
+// Executor - a fixed set of worker threads shared by all the task sources of
+// the SDK, instead of one thread pool per producer.
+//
+// Every worker owns one task queue per priority. Tasks posted from a worker
+// go to its own queues, tasks posted from other threads are spread over the
+// workers. An idle worker takes the oldest task of the highest priority,
+// looking at its own queues first and stealing from the other workers after,
+// so one slow task only delays the tasks queued behind it until another
+// worker runs out of work.
+//
+// Tasks of one source that must run one at a time and in order go through a
+// Strand:
+//
+//      Executor::Strand strand(Executor::get(), TaskPriority::High);
+//      strand.post([frame]() { deliver(frame); });     // runs after the
+//      strand.post([frame2]() { deliver(frame2); });   // first one returned
+//
+// The SDK-wide instance from get() has one worker per core, at most
+// kMaxDefaultWorkers; EYS3D_EXECUTOR_THREADS overrides it. Tasks must not
+// block on each other: a task waiting for another task can take the last
+// free worker. Fork/join work goes through parallelFor(), which never waits
+// for a task that did not start and runs inline on a worker thread.
+//
+
+namespace libeYs3D {
+namespace base {
+
+enum class TaskPriority {
+    High = 0,   // frame delivery to the app
+    Normal,
+    Low,        // statistics, accuracy computations
+    Count
+};
+
+class Executor {
+    DISALLOW_COPY_ASSIGN_AND_MOVE(Executor);
+
+public:
+    using Task = std::function<void()>;
+
+    class Strand;
+
+    static constexpr int kMaxDefaultWorkers = 8;
+
+    // Never destroyed, producers may post tasks while being torn down
+    static Executor& get() {
+        static Executor* sInstance = new Executor(getDefaultWorkerCount());
+        return *sInstance;
+    }
+
+    static int getDefaultWorkerCount() {
+        const char* value = getenv("EYS3D_EXECUTOR_THREADS");
+        int count = value ? atoi(value) : 0;
+        if (count < 1) {
+            count = get_cpu_core_count();
+            if (count > kMaxDefaultWorkers) count = kMaxDefaultWorkers;
+        }
+        return count < 1 ? 1 : count;
+    }
+
+    explicit Executor(int threads) {
+        if (threads < 1) threads = 1;
+        for (int i = 0; i < threads; i++) {
+            mWorkers.emplace_back(new Worker());
+        }
+        for (int i = 0; i < threads; i++) {
+            mWorkers[i]->thread.reset(new FunctorThread([this, i]() { workerMain(i); }));
+            mWorkers[i]->thread->start();
+        }
+    }
+
+    // Runs the tasks already posted, then stops the workers
+    ~Executor() {
+        {
+            AutoLock lock(mSleepLock);
+            mStopping = true;
+            mSleepCond.broadcast();
+        }
+        for (auto& worker : mWorkers) {
+            worker->thread->wait();
+        }
+    }
+
+    void post(Task&& task, TaskPriority priority = TaskPriority::Normal) {
+        int current = currentWorkerIndex(this);
+        size_t index = (current >= 0)
+                ? (size_t)current
+                : mNextWorkerIndex.fetch_add(1, std::memory_order_relaxed) % mWorkers.size();
+
+        Worker& worker = *mWorkers[index];
+        {
+            AutoLock lock(worker.lock);
+            worker.queues[(int)priority].push_back(std::move(task));
+        }
+        // pairs with the re-check in workerMain(), both sides store then load
+        mPendingCount.fetch_add(1);
+        if (mSleepingCount.load() > 0) {
+            AutoLock lock(mSleepLock);
+            mSleepCond.signal();
+        }
+    }
+
+    int numWorkers() const { return (int)mWorkers.size(); }
+
+    // Whether the calling thread is one of the workers of this executor
+    bool isWorkerThread() const { return currentWorkerIndex(this) >= 0; }
+
+    // Runs task(i) for every i in [0, count) on the caller and up to
+    // maxThreads - 1 workers, returns once all of them ran. Indices are
+    // claimed one at a time and the caller runs every index nobody took yet,
+    // so a busy executor only costs the parallelism. Called from a worker,
+    // everything runs inline on the caller.
+    void parallelFor(int count, int maxThreads, const std::function<void(int)>& task) {
+        if (count <= 0) return;
+        if (maxThreads > count) maxThreads = count;
+        if (maxThreads <= 1 || isWorkerThread()) {
+            for (int i = 0; i < count; i++) task(i);
+            return;
+        }
+
+        struct Job {
+            std::atomic<int> next{0};
+            int count = 0;
+            const std::function<void(int)>* task = nullptr;  // only used for a claimed index
+            Lock lock;
+            ConditionVariable done;
+            int finished = 0;  // guarded by lock
+
+            // false once every index is claimed
+            bool runOne() {
+                const int i = next.fetch_add(1);
+                if (i >= count) return false;
+
+                (*task)(i);
+                AutoLock autoLock(lock);
+                if (++finished == count) done.signal();
+                return true;
+            }
+        };
+
+        // the posted tasks may start after parallelFor() returned, they then find nothing left
+        std::shared_ptr<Job> job = std::make_shared<Job>();
+        job->count = count;
+        job->task = &task;
+        for (int i = 1; i < maxThreads; i++) {
+            post([job]() {
+                while (job->runOne()) continue;
+            });
+        }
+        while (job->runOne()) continue;
+
+        AutoLock autoLock(job->lock);
+        while (job->finished < count) job->done.wait(&autoLock);
+    }
+
+    uint64_t getExecutedCount() const { return mExecutedCount.load(std::memory_order_relaxed); }
+    uint64_t getStolenCount() const { return mStolenCount.load(std::memory_order_relaxed); }
+
+private:
+    struct Worker {
+        Lock lock;
+        std::deque<Task> queues[(int)TaskPriority::Count];  // guarded by lock
+        std::unique_ptr<FunctorThread> thread;
+    };
+
+    // The executor and index of the calling worker thread, if it is one
+    struct CurrentWorker {
+        const Executor* executor = nullptr;
+        int index = -1;
+    };
+
+    static CurrentWorker& currentWorker() {
+        static thread_local CurrentWorker sCurrent;
+        return sCurrent;
+    }
+
+    static int currentWorkerIndex(const Executor* executor) {
+        const CurrentWorker& current = currentWorker();
+        return (current.executor == executor) ? current.index : -1;
+    }
+
+    bool takeTask(int self, Task& task) {
+        const size_t count = mWorkers.size();
+        for (int p = 0; p < (int)TaskPriority::Count; p++) {
+            for (size_t n = 0; n < count; n++) {
+                size_t index = ((size_t)self + n) % count;
+                Worker& worker = *mWorkers[index];
+                // never wait on a busy victim, come back to it on the next pass
+                if (n != 0 && !worker.lock.tryLock()) continue;
+                if (n == 0) worker.lock.lock();
+
+                std::deque<Task>& queue = worker.queues[p];
+                bool found = !queue.empty();
+                if (found) {
+                    task = std::move(queue.front());
+                    queue.pop_front();
+                }
+                worker.lock.unlock();
+
+                if (found) {
+                    if (n != 0) mStolenCount.fetch_add(1, std::memory_order_relaxed);
+                    mPendingCount.fetch_sub(1, std::memory_order_acq_rel);
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    void workerMain(int self) {
+        currentWorker().executor = this;
+        currentWorker().index = self;
+
+        Task task;
+        for (;;) {
+            if (takeTask(self, task)) {
+                task();
+                task = nullptr;
+                mExecutedCount.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+
+            AutoLock lock(mSleepLock);
+            if (mPendingCount.load(std::memory_order_acquire) > 0) continue;
+            if (mStopping) break;
+
+            mSleepingCount.fetch_add(1);
+            // re-check after announcing the sleep, post() may have missed it
+            if (mPendingCount.load() == 0 && !mStopping) {
+                mSleepCond.wait(&lock);
+            }
+            mSleepingCount.fetch_sub(1);
+        }
+
+        currentWorker() = CurrentWorker();
+    }
+
+    std::vector<std::unique_ptr<Worker>> mWorkers;
+    std::atomic<size_t> mNextWorkerIndex{0};
+    std::atomic<int64_t> mPendingCount{0};
+    std::atomic<int> mSleepingCount{0};
+    std::atomic<uint64_t> mExecutedCount{0};
+    std::atomic<uint64_t> mStolenCount{0};
+
+    Lock mSleepLock;
+    ConditionVariable mSleepCond;
+    bool mStopping = false;     // guarded by mSleepLock
+};
+
+// Runs its tasks one at a time, in the order they were posted. At most
+// kMaxBatch tasks run back to back before the strand goes back in line, so a
+// busy source does not keep a worker to itself.
+class Executor::Strand {
+    DISALLOW_COPY_ASSIGN_AND_MOVE(Strand);
+
+public:
+    static constexpr int kMaxBatch = 4;
+
+    explicit Strand(Executor& executor, TaskPriority priority = TaskPriority::Normal)
+        : mExecutor(executor), mPriority((int)priority) {}
+
+    // Waits for the posted tasks, must not be destroyed from one of its tasks
+    ~Strand() { waitForIdle(); }
+
+    void post(Task&& task) {
+        AutoLock lock(mLock);
+        mTasks.push_back(std::move(task));
+        if (mScheduled) return;
+
+        mScheduled = true;
+        lock.unlock();
+        schedule();
+    }
+
+    void setPriority(TaskPriority priority) { mPriority.store((int)priority, std::memory_order_relaxed); }
+
+    size_t size() {
+        AutoLock lock(mLock);
+        return mTasks.size();
+    }
+
+    void waitForIdle() {
+        AutoLock lock(mLock);
+        while (mScheduled) {
+            mIdleCond.wait(&lock);
+        }
+    }
+
+private:
+    void schedule() {
+        mExecutor.post([this]() { drain(); },
+                       (TaskPriority)mPriority.load(std::memory_order_relaxed));
+    }
+
+    // Returns false once the queue is empty and the strand is idle
+    bool next(Task& task) {
+        AutoLock lock(mLock);
+        if (mTasks.empty()) {
+            mScheduled = false;
+            mIdleCond.broadcast();
+            return false;
+        }
+        task = std::move(mTasks.front());
+        mTasks.pop_front();
+        return true;
+    }
+
+    void drain() {
+        Task task;
+        for (int i = 0; i < kMaxBatch; i++) {
+            if (!next(task)) return;
+            task();
+        }
+
+        AutoLock lock(mLock);
+        if (mTasks.empty()) {
+            mScheduled = false;
+            mIdleCond.broadcast();
+            return;
+        }
+        lock.unlock();
+        schedule();
+    }
+
+    Executor& mExecutor;
+    std::atomic<int> mPriority;
+
+    Lock mLock;
+    ConditionVariable mIdleCond;
+    std::deque<Task> mTasks;    // guarded by mLock
+    bool mScheduled = false;    // guarded by mLock, a drain() is posted or running
+};
+
+}  // namespace base
+}  // namespace libeYs3D
@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 2021 eYs3D Corporation
+ * All rights reserved.
+ * This project is licensed under the Apache License, Version 2.0.
+ */
+
+#pragma once
+
+#include "base/Compiler.h"
+#include "base/synchronization/ConditionVariable.h"
+#include "base/synchronization/Lock.h"
+#include "base/threads/Executor.h"
+
+#include <deque>
+#include <functional>
+#include <utility>
+
+//
+// ExecutorThreadPool<Item> - a queue of items processed as tasks of an
+// Executor instead of on threads of its own.
+//
+// Each enqueue() posts at most one run() task. A run() task processes up to
+// kMaxBatch items and then posts itself again behind the other tasks of the
+// executor, so a busy pool cannot starve them. |threads| bounds how many
+// run() tasks of the pool are in flight, 0 meaning the executor's worker
+// count. Items start in enqueue order. With |threads| at 1 they also finish
+// in that order, which is what the frames of a stream need:
+//
+//      ExecutorThreadPool<CallbackWorkItem> pool(1, [](CallbackWorkItem&& item) {
+//          deliver(item);
+//      }, TaskPriority::High);
+//      pool.start();           // items enqueued before are dispatched now
+//      pool.enqueue(std::move(item));
+//      ...
+//      pool.done();            // refuses new items
+//      pool.join();            // waits for the queued ones
+//
+// The destructor does done() and join(). join() on a pool never started
+// drops its items.
+//
+// The member functions mirror ThreadPool<Item>, so a pool can be switched
+// from one to the other. The prebuilt library embeds ThreadPool by value in
+// its producers (FrameProducer, SensorDataProducer, DepthFrameProducer) and
+// keeps its own threads there. Only application code that constructs an
+// ExecutorThreadPool runs on the executor.
+//
+// The processor runs on a worker shared with every other task of the
+// executor: it must not block on other tasks of that executor.
+//
+
+namespace libeYs3D    {
+namespace base {
+
+template <class ItemT>
+class ExecutorThreadPool {
+    DISALLOW_COPY_AND_ASSIGN(ExecutorThreadPool);
+
+public:
+    using Item = ItemT;
+    using Processor = std::function<void(Item&&)>;
+
+    // At most kMaxBatch items run back to back before the pool lets the
+    // other tasks of the executor in
+    static constexpr int kMaxBatch = 4;
+
+    ExecutorThreadPool(int threads, Processor&& processor,
+               TaskPriority priority = TaskPriority::Normal,
+               Executor& executor = Executor::get())
+        : mProcessor(std::move(processor)),
+          mExecutor(executor),
+          mPriority(priority),
+          mMaxRunning((threads < 1 || threads > executor.numWorkers())
+                              ? executor.numWorkers()
+                              : threads) {}
+    explicit ExecutorThreadPool(Processor&& processor)
+        : ExecutorThreadPool(0, std::move(processor)) {}
+    ~ExecutorThreadPool() {
+        done();
+        join();
+    }
+
+    bool start() {
+        AutoLock lock(mLock);
+        mStarted = true;
+        dispatchLocked();
+        return true;
+    }
+
+    // No items are accepted after done(), the queued ones are still processed
+    void done() {
+        AutoLock lock(mLock);
+        mDone = true;
+    }
+
+    // Waits for the queued items, a pool never started drops them
+    void join() {
+        AutoLock lock(mLock);
+        if (!mStarted) {
+            mItems.clear();
+            return;
+        }
+        while (!mItems.empty() || mRunning > 0) {
+            mIdleCond.wait(&lock);
+        }
+    }
+
+    void enqueue(Item&& item) {
+        AutoLock lock(mLock);
+        if (mDone) return;
+
+        mItems.push_back(std::move(item));
+        dispatchLocked();
+    }
+
+    void setPriority(TaskPriority priority) {
+        AutoLock lock(mLock);
+        mPriority = priority;
+    }
+
+    int numWorkers() const { return mMaxRunning; }
+
+private:
+    void dispatchLocked() {
+        // a run() task that is posted but not started yet covers one item
+        int waiting = (int)mItems.size() - mClaimed;
+        while (mStarted && mRunning < mMaxRunning && waiting > 0) {
+            mRunning += 1;
+            mClaimed += 1;
+            waiting -= 1;
+            mExecutor.post([this]() { run(); }, mPriority);
+        }
+    }
+
+    void run() {
+        AutoLock lock(mLock);
+        mClaimed -= 1;
+        for (int i = 0; i < kMaxBatch && !mItems.empty(); i++) {
+            Item item = std::move(mItems.front());
+            mItems.pop_front();
+
+            lock.unlock();
+            mProcessor(std::move(item));
+            lock.lock();
+        }
+
+        if ((int)mItems.size() > mClaimed) {
+            // more to do: back in line behind the other tasks of the executor
+            mClaimed += 1;
+            mExecutor.post([this]() { run(); }, mPriority);
+            return;
+        }
+
+        mRunning -= 1;
+        if (mItems.empty() && mRunning == 0) {
+            mIdleCond.broadcast();
+        }
+    }
+
+    Processor mProcessor;
+    Executor& mExecutor;
+    TaskPriority mPriority;         // guarded by mLock
+    const int mMaxRunning;
+
+    Lock mLock;
+    ConditionVariable mIdleCond;
+    std::deque<Item> mItems;        // guarded by mLock
+    int mRunning = 0;               // guarded by mLock, run() tasks posted or running
+    int mClaimed = 0;               // guarded by mLock, run() tasks posted, not started
+    bool mStarted = false;          // guarded by mLock
+    bool mDone = false;             // guarded by mLock
+};
+
+}  // namespace base
+}  // namespace libeYs3D
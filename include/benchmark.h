@@ -0,0 +1,259 @@
+/*
+ * Copyright (C) 2021 eYs3D Corporation
+ * All rights reserved.
+ * This project is licensed under the Apache License, Version 2.0.
+ */
+
+#pragma once
+
+#include "base/Compiler.h"
+#include "utils.h"
+#include "debug.h"
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <vector>
+
+//
+// Minimal benchmark harness for the kernels of the SDK.
+//
+//      libeYs3D::bench::BenchRunner runner(options);
+//      runner.run("yuy2_to_rgb", 1280, 720, 1280 * 720 * 2,
+//                 nullptr,                     // untimed setup, e.g. restore input
+//                 [&]() { convert(...); });    // timed body
+//      runner.printTable(stdout);
+//      runner.writeJson("bench.json");
+//
+// Every benchmark is warmed up, then run until |minTimeUs| has elapsed (at
+// least |minIterations| times). Each iteration is timed on its own with the
+// MONOTONIC clock so percentiles are reported next to the mean.
+//
+
+namespace libeYs3D    {
+namespace bench    {
+
+inline int64_t now_in_nanosecond_MONOTONIC()    {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+// Keeps the compiler from discarding a result that is otherwise unused
+template <class T>
+inline void do_not_optimize(const T &value)    {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct BenchResult    {
+    std::string name;
+    int32_t width;              // 0 if not resolution dependent
+    int32_t height;
+    uint64_t iterations;
+    uint64_t itemsPerIteration; // e.g. packets parsed per iteration
+    uint64_t bytesPerIteration; // input bytes processed per iteration
+    double minUs;
+    double meanUs;
+    double p50Us;
+    double p99Us;
+    double maxUs;
+    std::string skipped;        // reason, empty if the benchmark ran
+};
+
+class BenchRunner    {
+    DISALLOW_COPY_ASSIGN_AND_MOVE(BenchRunner);
+
+public:
+    struct Options    {
+        int64_t minTimeUs = 500000ll;
+        uint64_t minIterations = 3;
+        uint64_t maxIterations = 1000000;
+        int warmupIterations = 1;
+        std::string filter;     // run only benchmarks whose name contains it
+    };
+
+    explicit BenchRunner(const Options &options) : mOptions(options)    {}
+
+    bool isSelected(const char *name) const    {
+        return mOptions.filter.empty() || strstr(name, mOptions.filter.c_str()) != nullptr;
+    }
+
+    // Returns false if the benchmark was filtered out
+    bool run(const char *name, int32_t width, int32_t height, uint64_t bytesPerIteration,
+             std::function<void()> setup, std::function<void()> body,
+             uint64_t itemsPerIteration = 1)    {
+        if(!isSelected(name))    return false;
+
+        for(int i = 0; i < mOptions.warmupIterations; i++)    {
+            if(setup)    setup();
+            body();
+        }
+
+        std::vector<int64_t> samplesNs;
+        samplesNs.reserve(1024);
+        int64_t totalNs = 0ll;
+        while((totalNs < mOptions.minTimeUs * 1000ll || samplesNs.size() < mOptions.minIterations) &&
+              samplesNs.size() < mOptions.maxIterations)    {
+            if(setup)    setup();
+
+            int64_t beginNs = now_in_nanosecond_MONOTONIC();
+            body();
+            int64_t elapsedNs = now_in_nanosecond_MONOTONIC() - beginNs;
+
+            samplesNs.push_back(elapsedNs);
+            totalNs += elapsedNs;
+        }
+
+        std::sort(samplesNs.begin(), samplesNs.end());
+        auto percentile = [&](double p) -> double {
+            size_t index = (size_t)(p / 100.0 * (double)(samplesNs.size() - 1) + 0.5);
+            return (double)samplesNs[index] / 1000.0;
+        };
+
+        BenchResult result;
+        result.name = name;
+        result.width = width;
+        result.height = height;
+        result.iterations = samplesNs.size();
+        result.itemsPerIteration = itemsPerIteration;
+        result.bytesPerIteration = bytesPerIteration;
+        result.minUs = (double)samplesNs.front() / 1000.0;
+        result.meanUs = (double)totalNs / 1000.0 / (double)samplesNs.size();
+        result.p50Us = percentile(50.0);
+        result.p99Us = percentile(99.0);
+        result.maxUs = (double)samplesNs.back() / 1000.0;
+        mResults.push_back(result);
+
+        return true;
+    }
+
+    // Records a benchmark that cannot run in this environment
+    void skip(const char *name, int32_t width, int32_t height, const char *reason)    {
+        if(!isSelected(name))    return;
+
+        BenchResult result = {};
+        result.name = name;
+        result.width = width;
+        result.height = height;
+        result.skipped = reason;
+        mResults.push_back(result);
+    }
+
+    const std::vector<BenchResult> &getResults() const    { return mResults; }
+
+    void printTable(FILE *out) const    {
+        fprintf(out, "%-36s %10s %9s %11s %11s %11s %11s %10s\n",
+                "benchmark", "resolution", "iters", "mean(us)", "p50(us)", "p99(us)", "min(us)", "MB/s");
+        for(const BenchResult &r : mResults)    {
+            char resolution[32] = "-";
+            if(r.width > 0)    snprintf(resolution, sizeof(resolution), "%dx%d", r.width, r.height);
+            if(!r.skipped.empty())    {
+                fprintf(out, "%-36s %10s   skipped: %s\n", r.name.c_str(), resolution, r.skipped.c_str());
+                continue;
+            }
+            fprintf(out, "%-36s %10s %9" PRIu64 " %11.2f %11.2f %11.2f %11.2f %10.1f\n",
+                    r.name.c_str(), resolution, r.iterations,
+                    r.meanUs, r.p50Us, r.p99Us, r.minUs, getMBPerSecond(r));
+        }
+    }
+
+    int toJson(std::string &json) const    {
+        char line[1024];
+        char hostname[256] = "";
+        gethostname(hostname, sizeof(hostname) - 1);
+
+        snprintf(line, sizeof(line),
+                 "{\n  \"timestamp_us\": %" PRId64 ",\n  \"host\": \"%s\",\n  \"cpus\": %ld,\n"
+                 "  \"cpu_model\": \"%s\",\n  \"results\": [\n",
+                 now_in_microsecond_high_res_time_REALTIME(), hostname,
+                 sysconf(_SC_NPROCESSORS_ONLN), getCpuModel().c_str());
+        json = line;
+
+        for(size_t i = 0; i < mResults.size(); i++)    {
+            const BenchResult &r = mResults[i];
+            if(!r.skipped.empty())    {
+                snprintf(line, sizeof(line),
+                         "    {\"name\": \"%s\", \"width\": %d, \"height\": %d, \"skipped\": \"%s\"}",
+                         r.name.c_str(), r.width, r.height, r.skipped.c_str());
+            } else    {
+                snprintf(line, sizeof(line),
+                         "    {\"name\": \"%s\", \"width\": %d, \"height\": %d, "
+                         "\"iterations\": %" PRIu64 ", \"items_per_iteration\": %" PRIu64 ", "
+                         "\"bytes_per_iteration\": %" PRIu64 ", \"min_us\": %.3f, \"mean_us\": %.3f, "
+                         "\"p50_us\": %.3f, \"p99_us\": %.3f, \"max_us\": %.3f, "
+                         "\"mb_per_s\": %.3f, \"mpix_per_s\": %.3f, \"ns_per_item\": %.3f}",
+                         r.name.c_str(), r.width, r.height, r.iterations, r.itemsPerIteration,
+                         r.bytesPerIteration, r.minUs, r.meanUs, r.p50Us, r.p99Us, r.maxUs,
+                         getMBPerSecond(r),
+                         (r.width > 0) ? (double)r.width * r.height / r.meanUs : 0.0,
+                         r.meanUs * 1000.0 / (double)r.itemsPerIteration);
+            }
+            json += line;
+            json += (i + 1 < mResults.size()) ? ",\n" : "\n";
+        }
+        json += "  ]\n}\n";
+
+        return (int)mResults.size();
+    }
+
+    // |path| "-" writes to stdout
+    int writeJson(const char *path) const    {
+        std::string json;
+        toJson(json);
+
+        FILE *file = (strcmp(path, "-") == 0) ? stdout : fopen(path, "w");
+        if(file == nullptr)    {
+            LOG_ERR_ERRNO("BenchRunner", "Unable to open %s", path);
+            return -1;
+        }
+        size_t written = fwrite(json.data(), 1, json.size(), file);
+        if(file != stdout)    fclose(file);
+        if(written != json.size())    {
+            LOG_ERR("BenchRunner", "Short write to %s", path);
+            return -1;
+        }
+
+        return (int)mResults.size();
+    }
+
+    // "model name" of /proc/cpuinfo, empty if unknown
+    static std::string getCpuModel()    {
+        std::string model;
+        FILE *file = fopen("/proc/cpuinfo", "r");
+        if(file == nullptr)    return model;
+
+        char line[512];
+        while(fgets(line, sizeof(line), file))    {
+            if(strncmp(line, "model name", 10) != 0)    continue;
+
+            const char *value = strchr(line, ':');
+            if(value == nullptr)    break;
+            for(value += 1; *value == ' '; value++);
+            model = value;
+            while(!model.empty() && (model.back() == '\n' || model.back() == '"'))    model.pop_back();
+            break;
+        }
+        fclose(file);
+
+        return model;
+    }
+
+private:
+    static double getMBPerSecond(const BenchResult &r)    {
+        if(r.meanUs <= 0.0)    return 0.0;
+        return (double)r.bytesPerIteration / r.meanUs;
+    }
+
+    Options mOptions;
+    std::vector<BenchResult> mResults;
+};
+
+}  // namespace bench
+}  // namespace libeYs3D
@@ -6,6 +6,10 @@
 
 #pragma once
 
+// Called by the producers from each of their worker threads. The library
+// versions do nothing; see stage_scheduling.h for per stage affinity,
+// priority and quota control.
+
 #define CAMERA_READER_CGROUP      "eYs3D/readers"
 #define IMU_READER_CGROUP         "eYs3D/readers"
 
@@ -86,3 +86,7 @@ void LOG_IMU_PRODUCER_TICK(const char *TAG, const char *FMT, ...);
 #else
     #define DDEBUG(...) (void)0
 #endif // DEBUG_LEVEL > 1
+
+#ifdef EYS3D_ASYNC_LOG
+    #include "async_log.h"
+#endif
@@ -0,0 +1,706 @@
+/*
+ * Copyright (C) 2021 eYs3D Corporation
+ * All rights reserved.
+ * This project is licensed under the Apache License, Version 2.0.
+ */
+
+#pragma once
+
+#include "EYS3DSystem.h"
+#include "devices/CameraDevice.h"
+#include "base/Compiler.h"
+#include "base/synchronization/Lock.h"
+#include "base/threads/Executor.h"
+#include "utils.h"
+#include "debug.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+//
+// On-disk cache of what a camera reports about itself over USB at startup:
+// the stream info lists, the rectify logs of every index, the ZD tables and
+// the focal lengths, one file per serial number and firmware version.
+//
+// CameraDevice reads all of these from the device with a few retries each,
+// on construction and again on every initStream(). Defining
+// EYS3D_CALIBRATION_CACHE_IMPLEMENTATION in exactly one source file of the
+// application before including this header replaces those reads with the
+// cached copies once a device was seen:
+//
+//      #define EYS3D_CALIBRATION_CACHE_IMPLEMENTATION
+//      #include "devices/CalibrationCache.h"
+//
+// The application then needs libdl (${CMAKE_DL_LIBS}). The first start reads
+// the device as before and records the results. Later starts map the file and
+// copy the records out of it. Once initStream() returned, the same USB reads
+// run again on the executor at low priority, so they never compete with the
+// ones of the start itself. New records are written to the file by that same
+// task. A record whose device data changed is dropped and read from the
+// device on the next initStream(). Nothing waits on that check.
+//
+// Files go to $EYS3D_CALIBRATION_CACHE_DIR, by default <SDK home>/cache.
+// EYS3D_CALIBRATION_CACHE=0 turns the cache off. A file written by another
+// build of the SDK (different record sizes) is ignored and rewritten.
+//
+
+namespace libeYs3D    {
+namespace devices    {
+
+struct CalibrationCacheStats    {
+    uint64_t hits = 0ull;           // records copied from the cache instead of the device
+    uint64_t misses = 0ull;         // records read from the device and added
+    uint64_t validated = 0ull;      // records found unchanged on the device
+    uint64_t invalidated = 0ull;    // records dropped because the device data changed
+};
+
+class CalibrationCache    {
+    DISALLOW_COPY_ASSIGN_AND_MOVE(CalibrationCache);
+
+public:
+    enum class Record : uint32_t    {
+        STREAM_INFO = 1,    // initStreamInfoList()
+        RECTIFY_LOGS,       // loadRectifyLogData(), with the focal lengths
+        RECTIFY_LOG,        // getRectifyMatLogDataTwice(), key: rectify log index
+        ZD_TABLE,           // updateZDTable(), key: ZD table index and data type
+    };
+
+    static constexpr int kMaxStreamInfo = 64;   // as initStreamInfoList() asks for
+    static constexpr int kRectifyLogCount = 5;  // as loadRectifyLogData() reads
+
+    // Never destroyed, devices may be released after static destructors ran
+    static CalibrationCache &get()    {
+        static CalibrationCache *sInstance = new CalibrationCache();
+        return *sInstance;
+    }
+
+    bool isEnabled() const    { return mEnabled; }
+    void setEnabled(bool enabled)    { mEnabled = enabled; }
+
+    // For devices first seen after the call
+    void setDirectory(const char *directory)    {
+        base::AutoLock lock(mLock);
+        mDirectory = directory;
+    }
+
+    CalibrationCacheStats getStats()    {
+        base::AutoLock lock(mLock);
+        return mStats;
+    }
+
+    // Drops the file of the device, it is read from the device from now on
+    void invalidate(const CameraDeviceInfo &info)    {
+        base::AutoLock lock(mLock);
+        Entry &entry = findEntry(info);
+        entry.records.clear();
+        unmap(entry);
+        unlink(entry.path.c_str());
+    }
+
+    /**
+     * Copies a record of the device into |data|.
+     * return
+     *     true: |data| holds the record, |length| bytes
+     *     false: nothing cached, or of another size
+     */
+    bool restore(const CameraDeviceInfo &info, Record type, uint32_t key,
+                 void *data, size_t length)    {
+        base::AutoLock lock(mLock);
+        const Data *record = findRecord(findEntry(info), type, key);
+        if(!record || record->length != length)    return false;
+
+        memcpy(data, record->bytes, length);
+        mStats.hits += 1;
+        return true;
+    }
+
+    // Variable length records, e.g. STREAM_INFO
+    bool restore(const CameraDeviceInfo &info, Record type, uint32_t key,
+                 std::vector<uint8_t> *data)    {
+        base::AutoLock lock(mLock);
+        const Data *record = findRecord(findEntry(info), type, key);
+        if(!record)    return false;
+
+        data->assign(record->bytes, record->bytes + record->length);
+        mStats.hits += 1;
+        return true;
+    }
+
+    // Adds or replaces a record just read from the device, written out in the background
+    void store(const CameraDeviceInfo &info, const DEVSELINFO &devSelInfo,
+               Record type, uint32_t key, const void *data, size_t length)    {
+        base::AutoLock lock(mLock);
+        Entry &entry = findEntry(info);
+        if(entry.serialNumber.empty())    return;     // nothing to tell the devices apart
+        entry.devSelInfo = devSelInfo;
+
+        Data &record = entry.records[makeKey(type, key)];
+        record.owned.assign((const uint8_t *)data, (const uint8_t *)data + length);
+        record.bytes = record.owned.data();
+        record.length = (uint32_t)length;
+        record.rawDigest = 0ull;    // learned by the next validation
+        record.validated = false;
+        entry.dirty = true;
+        entry.validationDeferred = true;
+        mStats.misses += 1;
+    }
+
+    // A record was handed out, it is checked by the next scheduleValidation()
+    void deferValidation(const CameraDeviceInfo &info, const DEVSELINFO &devSelInfo)    {
+        base::AutoLock lock(mLock);
+        Entry &entry = findEntry(info);
+        entry.devSelInfo = devSelInfo;
+        entry.validationDeferred = true;
+    }
+
+    /**
+     * Checks the records handed out or stored since the last call against the
+     * device, once per record and process, and writes the new ones out. Call
+     * it once the device is done with its own reads: after initStream().
+     */
+    void scheduleValidation(const CameraDeviceInfo &info)    {
+        if(!mEnabled)    return;
+
+        base::AutoLock lock(mLock);
+        Entry &entry = findEntry(info);
+        if(!entry.validationDeferred)    return;
+
+        entry.validationDeferred = false;
+        scheduleValidationLocked(entry);    // a running check picks up the new records as well
+    }
+
+    static uint32_t zdTableKey(const ZDTABLEINFO &zdTableInfo)    {
+        return ((uint32_t)(zdTableInfo.nIndex & 0xFFFF) << 16) | (uint32_t)(zdTableInfo.nDataType & 0xFFFF);
+    }
+
+    // FNV-1a, over the device data a record was made of
+    static uint64_t digest(const void *data, size_t length, uint64_t hash = 0xCBF29CE484222325ull)    {
+        const uint8_t *bytes = (const uint8_t *)data;
+        for(size_t i = 0; i < length; i++)    {
+            hash ^= bytes[i];
+            hash *= 0x100000001B3ull;
+        }
+        return hash;
+    }
+
+private:
+    static constexpr uint32_t kVersion = 1;
+
+    struct FileHeader    {
+        char magic[8];
+        uint32_t version;
+        uint32_t recordCount;
+        uint32_t rectLogSize;       // the layouts this build of the SDK reads
+        uint32_t zdTableInfoSize;
+        uint32_t streamInfoSize;
+        uint32_t focalLengthSize;
+        char serialNumber[64];
+        char firmwareVersion[64];
+        uint64_t checksum;          // digest() of everything after the header
+    };
+
+    struct RecordHeader    {
+        uint32_t type;
+        uint32_t key;
+        uint64_t rawDigest;
+        uint32_t length;
+        uint32_t reserved;
+    };
+
+    struct Data    {
+        const uint8_t *bytes = nullptr;     // into the mapping or |owned|
+        uint32_t length = 0;
+        uint64_t rawDigest = 0ull;
+        bool validated = false;
+        std::vector<uint8_t> owned;
+    };
+
+    struct Entry    {
+        std::string path;
+        std::string serialNumber;
+        std::string firmwareVersion;
+        DEVSELINFO devSelInfo;
+        void *map = nullptr;
+        size_t mapSize = 0;
+        std::map<uint64_t, Data> records;
+        bool dirty = false;
+        bool validationDeferred = false;    // records to check at the next scheduleValidation()
+        bool validating = false;
+    };
+
+    CalibrationCache()    {
+        const char *enabled = getenv("EYS3D_CALIBRATION_CACHE");
+        mEnabled = !(enabled && !strcmp(enabled, "0"));
+
+        const char *directory = getenv("EYS3D_CALIBRATION_CACHE_DIR");
+        if(directory && *directory)    {
+            mDirectory = directory;
+        } else    {
+            const char *home = EYS3DSystem::getSDKHomePath();
+            mDirectory = std::string((home && *home) ? home : ".") + "/cache";
+        }
+    }
+
+    static uint64_t makeKey(Record type, uint32_t key)    {
+        return ((uint64_t)type << 32) | key;
+    }
+
+    static std::string sanitize(const char *name)    {
+        std::string string(name);
+        for(char &c : string)    {
+            if(!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+                 c == '.' || c == '-'))
+                c = '_';
+        }
+        return string;
+    }
+
+    static FileHeader makeHeader(const Entry &entry)    {
+        FileHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "EYS3DCAL", sizeof(header.magic));
+        header.version = kVersion;
+        header.rectLogSize = sizeof(eSPCtrl_RectLogData);
+        header.zdTableInfoSize = sizeof(ZDTableInfo);
+        header.streamInfoSize = sizeof(APC_STREAM_INFO);
+        header.focalLengthSize = sizeof(CameraDevice::FocalLength);
+        snprintf(header.serialNumber, sizeof(header.serialNumber), "%s", entry.serialNumber.c_str());
+        snprintf(header.firmwareVersion, sizeof(header.firmwareVersion), "%s", entry.firmwareVersion.c_str());
+        return header;
+    }
+
+    const Data *findRecord(Entry &entry, Record type, uint32_t key)    {
+        if(!mEnabled || entry.serialNumber.empty())    return nullptr;
+
+        auto it = entry.records.find(makeKey(type, key));
+        return (it == entry.records.end()) ? nullptr : &it->second;
+    }
+
+    // guarded by mLock, maps the file of the device on first use
+    Entry &findEntry(const CameraDeviceInfo &info)    {
+        std::string name = std::string(info.serialNumber) + "/" + info.firmwareVersion;
+        std::unique_ptr<Entry> &entry = mEntries[name];
+        if(entry)    return *entry;
+
+        entry.reset(new Entry());
+        entry->serialNumber = info.serialNumber;
+        entry->firmwareVersion = info.firmwareVersion;
+        entry->path = mDirectory + "/" + sanitize(info.serialNumber) + "_" +
+                      sanitize(info.firmwareVersion) + ".cal";
+        memset(&entry->devSelInfo, 0, sizeof(entry->devSelInfo));
+        if(mEnabled)    map(*entry);
+
+        return *entry;
+    }
+
+    void map(Entry &entry)    {
+        int fd = open(entry.path.c_str(), O_RDONLY | O_CLOEXEC);
+        if(fd < 0)    return;     // first time this device is seen
+
+        struct stat st;
+        void *map = MAP_FAILED;
+        if(fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(FileHeader))
+            map = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if(map == MAP_FAILED)    return;
+
+        entry.map = map;
+        entry.mapSize = (size_t)st.st_size;
+        if(!parse(entry))    {
+            LOG_WARN("CalibrationCache", "Ignoring %s, stale or damaged", entry.path.c_str());
+            entry.records.clear();
+            unmap(entry);
+        }
+    }
+
+    void unmap(Entry &entry)    {
+        for(auto &record : entry.records)    {
+            if(record.second.owned.empty())    {    // still pointing into the mapping
+                record.second.owned.assign(record.second.bytes, record.second.bytes + record.second.length);
+                record.second.bytes = record.second.owned.data();
+            }
+        }
+        if(entry.map)    munmap(entry.map, entry.mapSize);
+        entry.map = nullptr;
+        entry.mapSize = 0;
+    }
+
+    bool parse(Entry &entry)    {
+        const uint8_t *begin = (const uint8_t *)entry.map;
+        const uint8_t *end = begin + entry.mapSize;
+        FileHeader expected = makeHeader(entry);
+        FileHeader header;
+        memcpy(&header, begin, sizeof(header));
+        expected.recordCount = header.recordCount;
+        expected.checksum = header.checksum;
+        if(memcmp(&header, &expected, sizeof(header)) != 0)    return false;
+
+        const uint8_t *p = begin + sizeof(FileHeader);
+        if(digest(p, (size_t)(end - p)) != header.checksum)    return false;
+
+        for(uint32_t i = 0; i < header.recordCount; i++)    {
+            RecordHeader recordHeader;
+            if((size_t)(end - p) < sizeof(recordHeader))    return false;
+            memcpy(&recordHeader, p, sizeof(recordHeader));
+            p += sizeof(recordHeader);
+            if((size_t)(end - p) < recordHeader.length)    return false;
+
+            Data &record = entry.records[makeKey((Record)recordHeader.type, recordHeader.key)];
+            record.bytes = p;
+            record.length = recordHeader.length;
+            record.rawDigest = recordHeader.rawDigest;
+            p += (recordHeader.length + 7u) & ~7u;
+        }
+
+        return true;
+    }
+
+    // guarded by mLock, rewrites the file and maps the new one
+    void flush(Entry &entry)    {
+        entry.dirty = false;
+        if(mkdir(mDirectory.c_str(), 0755) != 0 && errno != EEXIST)    {
+            LOG_ERR_ERRNO("CalibrationCache", "Unable to create %s", mDirectory.c_str());
+            return;
+        }
+
+        std::vector<uint8_t> body;
+        for(const auto &record : entry.records)    {
+            RecordHeader recordHeader = { (uint32_t)(record.first >> 32), (uint32_t)record.first,
+                                          record.second.rawDigest, record.second.length, 0u };
+            body.insert(body.end(), (const uint8_t *)&recordHeader,
+                        (const uint8_t *)&recordHeader + sizeof(recordHeader));
+            body.insert(body.end(), record.second.bytes, record.second.bytes + record.second.length);
+            body.resize((body.size() + 7u) & ~(size_t)7u, 0);
+        }
+
+        FileHeader header = makeHeader(entry);
+        header.recordCount = (uint32_t)entry.records.size();
+        header.checksum = digest(body.data(), body.size());
+
+        // written aside and renamed over, readers of other processes see the old or the new file
+        std::string temporary = entry.path + ".tmp." + std::to_string(getpid());
+        FILE *file = fopen(temporary.c_str(), "wb");
+        if(file == nullptr)    {
+            LOG_ERR_ERRNO("CalibrationCache", "Unable to create %s", temporary.c_str());
+            return;
+        }
+        bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                       (body.empty() || fwrite(body.data(), body.size(), 1, file) == 1);
+        written = (fclose(file) == 0) && written;
+        if(!written || rename(temporary.c_str(), entry.path.c_str()) != 0)    {
+            LOG_ERR_ERRNO("CalibrationCache", "Unable to write %s", entry.path.c_str());
+            unlink(temporary.c_str());
+            return;
+        }
+
+        std::map<uint64_t, Data> records;
+        records.swap(entry.records);
+        unmap(entry);
+        map(entry);
+        for(auto &record : records)    {   // keep what this process already checked
+            auto it = entry.records.find(record.first);
+            if(it != entry.records.end())    it->second.validated = record.second.validated;
+        }
+    }
+
+    void scheduleValidationLocked(Entry &entry)    {
+        if(!mEnabled || entry.validating || entry.serialNumber.empty())    return;
+
+        entry.validating = true;
+        base::Executor::get().post([this, &entry]() { validate(entry); }, base::TaskPriority::Low);
+    }
+
+    // The device reads behind each record, 0 if they failed
+    static uint64_t readRawDigest(const DEVSELINFO &devSelInfo, Record type, uint32_t key, const Data &record)    {
+        void *handle = EYS3DSystem::getEYS3DDIHandle();
+        DEVSELINFO devSel = devSelInfo;
+
+        switch(type)    {
+        case Record::STREAM_INFO:    {
+            std::vector<APC_STREAM_INFO> color(kMaxStreamInfo), depth(kMaxStreamInfo);
+            memset(color.data(), 0, color.size() * sizeof(APC_STREAM_INFO));
+            memset(depth.data(), 0, depth.size() * sizeof(APC_STREAM_INFO));
+            if(APC_GetDeviceResolutionList(handle, &devSel, kMaxStreamInfo, color.data(),
+                                           kMaxStreamInfo, depth.data()) != APC_OK)
+                return 0ull;
+
+            uint64_t hash = digest(color.data(), color.size() * sizeof(APC_STREAM_INFO));
+            return digest(depth.data(), depth.size() * sizeof(APC_STREAM_INFO), hash);
+        }
+        case Record::RECTIFY_LOGS:
+        case Record::RECTIFY_LOG:    {
+            int first = (type == Record::RECTIFY_LOG) ? (int)key : 0;
+            int last = (type == Record::RECTIFY_LOG) ? (int)key : kRectifyLogCount - 1;
+            std::unique_ptr<eSPCtrl_RectLogData> rectLog(new eSPCtrl_RectLogData());
+            uint64_t hash = 0xCBF29CE484222325ull;
+            for(int index = first; index <= last; index++)    {
+                memset(rectLog.get(), 0, sizeof(eSPCtrl_RectLogData));
+                if(APC_GetRectifyMatLogData(handle, &devSel, rectLog.get(), index) != APC_OK)    return 0ull;
+                hash = digest(rectLog.get(), sizeof(eSPCtrl_RectLogData), hash);
+            }
+            return hash;
+        }
+        case Record::ZD_TABLE:    {
+            if(record.length != sizeof(ZDTableInfo))    return 0ull;
+
+            ZDTableInfo cached;
+            memcpy(&cached, record.bytes, sizeof(cached));
+            ZDTABLEINFO zdTableInfo = cached.nZDTableInfo;
+            std::vector<uint8_t> table(sizeof(cached.nZDTable), 0);
+            int actualLength = 0;
+            if(APC_GetZDTable(handle, &devSel, table.data(), cached.nZDTableSize,
+                              &actualLength, &zdTableInfo) != APC_OK)
+                return 0ull;
+
+            return digest(table.data(), (size_t)actualLength);
+        }
+        }
+        return 0ull;
+    }
+
+    // Runs on the executor, the device is read with mLock released
+    void validate(Entry &entry)    {
+        base::AutoLock lock(mLock);
+        bool changed = false;
+        for(;;)    {
+            auto it = entry.records.begin();
+            while(it != entry.records.end() && it->second.validated)    ++it;
+            if(it == entry.records.end())    break;
+
+            const uint64_t key = it->first;
+            Data record;
+            record.owned.assign(it->second.bytes, it->second.bytes + it->second.length);
+            record.bytes = record.owned.data();
+            record.length = it->second.length;
+            DEVSELINFO devSelInfo = entry.devSelInfo;
+            it->second.validated = true;
+
+            lock.unlock();
+            uint64_t rawDigest = readRawDigest(devSelInfo, (Record)(key >> 32), (uint32_t)key, record);
+            lock.lock();
+
+            it = entry.records.find(key);
+            if(it == entry.records.end() || rawDigest == 0ull)    continue;  // replaced, or the read failed
+
+            if(it->second.rawDigest == 0ull)    {
+                it->second.rawDigest = rawDigest;   // first check of a new record
+                changed = true;
+            } else if(it->second.rawDigest == rawDigest)    {
+                mStats.validated += 1;
+            } else    {
+                LOG_WARN("CalibrationCache", "%s: device data changed, dropping record %u:%u",
+                         entry.serialNumber.c_str(), (uint32_t)(key >> 32), (uint32_t)key);
+                entry.records.erase(it);
+                mStats.invalidated += 1;
+                changed = true;
+            }
+        }
+
+        if(changed || entry.dirty)    flush(entry);
+        entry.validating = false;
+    }
+
+    base::Lock mLock;
+    std::atomic<bool> mEnabled{true};
+    std::string mDirectory;                                 // guarded by mLock
+    std::map<std::string, std::unique_ptr<Entry>> mEntries;
+    CalibrationCacheStats mStats;
+};
+
+}  // namespace devices
+}  // namespace libeYs3D
+
+#ifdef EYS3D_CALIBRATION_CACHE_IMPLEMENTATION
+
+#include <dlfcn.h>
+
+//
+// The CameraDevice members below take precedence over the ones of the
+// prebuilt library, which they fall back to on a cache miss.
+//
+
+namespace libeYs3D    {
+namespace devices    {
+
+using CalibrationCacheOriginal = int (*)(CameraDevice *);
+
+inline CalibrationCacheOriginal calibration_cache_original(const char *symbol)    {
+    void *original = dlsym(RTLD_NEXT, symbol);
+    if(original == nullptr)    LOG_ERR("CalibrationCache", "Unable to find %s: %s", symbol, dlerror());
+    return (CalibrationCacheOriginal)original;
+}
+
+int CameraDevice::initStreamInfoList()    {
+    static CalibrationCacheOriginal sOriginal =
+            calibration_cache_original("_ZN8libeYs3D7devices12CameraDevice18initStreamInfoListEv");
+    using Record = CalibrationCache::Record;
+    CalibrationCache &cache = CalibrationCache::get();
+
+    std::vector<uint8_t> record;
+    uint32_t counts[2];
+    if(cache.restore(mCameraDeviceInfo, Record::STREAM_INFO, 0u, &record) && record.size() >= sizeof(counts))    {
+        memcpy(counts, record.data(), sizeof(counts));
+        const APC_STREAM_INFO *streamInfo = (const APC_STREAM_INFO *)(record.data() + sizeof(counts));
+        if(record.size() == sizeof(counts) + (counts[0] + counts[1]) * sizeof(APC_STREAM_INFO))    {
+            mColorStreamInfo.assign(streamInfo, streamInfo + counts[0]);
+            mDepthStreamInfo.assign(streamInfo + counts[0], streamInfo + counts[0] + counts[1]);
+            cache.deferValidation(mCameraDeviceInfo, mDevSelInfo);
+            return APC_OK;
+        }
+    }
+
+    int ret = sOriginal ? sOriginal(this) : APC_NullPtr;
+    if(ret != APC_OK || !cache.isEnabled())    return ret;
+
+    counts[0] = (uint32_t)mColorStreamInfo.size();
+    counts[1] = (uint32_t)mDepthStreamInfo.size();
+    record.assign((const uint8_t *)counts, (const uint8_t *)counts + sizeof(counts));
+    record.insert(record.end(), (const uint8_t *)mColorStreamInfo.data(),
+                  (const uint8_t *)(mColorStreamInfo.data() + mColorStreamInfo.size()));
+    record.insert(record.end(), (const uint8_t *)mDepthStreamInfo.data(),
+                  (const uint8_t *)(mDepthStreamInfo.data() + mDepthStreamInfo.size()));
+    cache.store(mCameraDeviceInfo, mDevSelInfo, Record::STREAM_INFO, 0u, record.data(), record.size());
+
+    return ret;
+}
+
+int CameraDevice::loadRectifyLogData()    {
+    static CalibrationCacheOriginal sOriginal =
+            calibration_cache_original("_ZN8libeYs3D7devices12CameraDevice18loadRectifyLogDataEv");
+    using Record = CalibrationCache::Record;
+    CalibrationCache &cache = CalibrationCache::get();
+    const size_t logSize = sizeof(eSPCtrl_RectLogData);
+    const size_t length = CalibrationCache::kRectifyLogCount * logSize + sizeof(FocalLength);
+
+    std::vector<uint8_t> record;
+    if(cache.restore(mCameraDeviceInfo, Record::RECTIFY_LOGS, 0u, &record) && record.size() == length)    {
+        mCameraRectifyLogData.clear();
+        for(int i = 0; i < CalibrationCache::kRectifyLogCount; i++)    {
+            std::shared_ptr<eSPCtrl_RectLogData> rectLog = std::make_shared<eSPCtrl_RectLogData>();
+            memcpy(rectLog.get(), record.data() + i * logSize, logSize);
+            mCameraRectifyLogData.push_back(rectLog);
+        }
+        memcpy(&m_FocalLength, record.data() + CalibrationCache::kRectifyLogCount * logSize, sizeof(FocalLength));
+        cache.deferValidation(mCameraDeviceInfo, mDevSelInfo);
+        return APC_OK;
+    }
+
+    int ret = sOriginal ? sOriginal(this) : APC_NullPtr;
+    if(ret != APC_OK || !cache.isEnabled() ||
+       mCameraRectifyLogData.size() != (size_t)CalibrationCache::kRectifyLogCount)
+        return ret;
+
+    record.clear();
+    for(const auto &rectLog : mCameraRectifyLogData)    {
+        if(!rectLog)    return ret;
+        record.insert(record.end(), (const uint8_t *)rectLog.get(), (const uint8_t *)rectLog.get() + logSize);
+    }
+    record.insert(record.end(), (const uint8_t *)&m_FocalLength, (const uint8_t *)&m_FocalLength + sizeof(FocalLength));
+    cache.store(mCameraDeviceInfo, mDevSelInfo, Record::RECTIFY_LOGS, 0u, record.data(), record.size());
+
+    return ret;
+}
+
+int CameraDevice::getRectifyMatLogDataTwice()    {
+    static CalibrationCacheOriginal sOriginal =
+            calibration_cache_original("_ZN8libeYs3D7devices12CameraDevice25getRectifyMatLogDataTwiceEv");
+    using Record = CalibrationCache::Record;
+    CalibrationCache &cache = CalibrationCache::get();
+
+    if(cache.restore(mCameraDeviceInfo, Record::RECTIFY_LOG, (uint32_t)mRectifyLogIndex,
+                     &mRectifyLogData, sizeof(mRectifyLogData)))    {
+        cache.deferValidation(mCameraDeviceInfo, mDevSelInfo);
+        return APC_OK;
+    }
+
+    int ret = sOriginal ? sOriginal(this) : APC_NullPtr;
+    if(ret == APC_OK && cache.isEnabled())    {
+        cache.store(mCameraDeviceInfo, mDevSelInfo, Record::RECTIFY_LOG, (uint32_t)mRectifyLogIndex,
+                    &mRectifyLogData, sizeof(mRectifyLogData));
+    }
+
+    return ret;
+}
+
+int CameraDevice::updateZDTable()    {
+    static CalibrationCacheOriginal sOriginal =
+            calibration_cache_original("_ZN8libeYs3D7devices12CameraDevice13updateZDTableEv");
+    using Record = CalibrationCache::Record;
+    CalibrationCache &cache = CalibrationCache::get();
+
+    // the table to read, as the original picks it: the key of the lookup and of the store
+    ZDTABLEINFO zdTableInfo;
+    zdTableInfo.nIndex = getZDTableIndex();
+    zdTableInfo.nDataType = getZDTableDataType();
+    const uint32_t key = CalibrationCache::zdTableKey(zdTableInfo);
+
+    if(cache.restore(mCameraDeviceInfo, Record::ZD_TABLE, key, &mZDTableInfo, sizeof(mZDTableInfo)))    {
+        cache.deferValidation(mCameraDeviceInfo, mDevSelInfo);
+        return APC_OK;
+    }
+
+    int ret = sOriginal ? sOriginal(this) : APC_NullPtr;
+    if(ret != APC_OK || !cache.isEnabled())    return ret;
+
+    if(CalibrationCache::zdTableKey(mZDTableInfo.nZDTableInfo) != key)    {
+        LOG_WARN("CalibrationCache", "%s: ZD table %d:%d read for %d:%d, not cached",
+                 mCameraDeviceInfo.serialNumber, mZDTableInfo.nZDTableInfo.nIndex,
+                 mZDTableInfo.nZDTableInfo.nDataType, zdTableInfo.nIndex, zdTableInfo.nDataType);
+        return ret;
+    }
+    cache.store(mCameraDeviceInfo, mDevSelInfo, Record::ZD_TABLE, key, &mZDTableInfo, sizeof(mZDTableInfo));
+
+    return ret;
+}
+
+// The pipeline overloads and the models' initStream() all end up here
+int CameraDevice::initStream(libeYs3D::video::COLOR_RAW_DATA_TYPE colorFormat,
+                             int32_t colorWidth, int32_t colorHeight, int32_t actualFps,
+                             libeYs3D::video::DEPTH_RAW_DATA_TYPE depthFormat,
+                             int32_t depthWidth, int32_t depthHeight,
+                             DEPTH_TRANSFER_CTRL depthDataTransferCtrl,
+                             CONTROL_MODE ctrlMode,
+                             int rectifyLogIndex,
+                             libeYs3D::video::Producer::Callback colorImageCallback,
+                             libeYs3D::video::Producer::Callback depthImageCallback,
+                             libeYs3D::video::PCProducer::PCCallback pcFrameCallback,
+                             libeYs3D::sensors::SensorDataProducer::AppCallback imuDataCallback)    {
+    using Original = int (*)(CameraDevice *, libeYs3D::video::COLOR_RAW_DATA_TYPE, int32_t, int32_t, int32_t,
+                             libeYs3D::video::DEPTH_RAW_DATA_TYPE, int32_t, int32_t,
+                             DEPTH_TRANSFER_CTRL, CONTROL_MODE, int,
+                             libeYs3D::video::Producer::Callback, libeYs3D::video::Producer::Callback,
+                             libeYs3D::video::PCProducer::PCCallback,
+                             libeYs3D::sensors::SensorDataProducer::AppCallback);
+    static Original sOriginal = (Original)calibration_cache_original(
+            "_ZN8libeYs3D7devices12CameraDevice10initStreamENS_5video19COLOR_RAW_DATA_TYPEEiiiNS2_19DEPTH_RAW_DATA_TYPEEii"
+            "19DEPTH_TRANSFER_CTRL12CONTROL_MODEiSt8functionIFbPKNS2_5FrameEEESC_S7_IFbPKNS2_7PCFrameEEES7_IFbPKNS_7sensors10SensorDataEEE");
+    if(sOriginal == nullptr)    return APC_NullPtr;
+
+    int ret = sOriginal(this, colorFormat, colorWidth, colorHeight, actualFps,
+                        depthFormat, depthWidth, depthHeight, depthDataTransferCtrl, ctrlMode, rectifyLogIndex,
+                        std::move(colorImageCallback), std::move(depthImageCallback),
+                        std::move(pcFrameCallback), std::move(imuDataCallback));
+
+    // the USB reads of the start are over, check what it took from the cache
+    CalibrationCache::get().scheduleValidation(mCameraDeviceInfo);
+    return ret;
+}
+
+}  // namespace devices
+}  // namespace libeYs3D
+
+#endif  // EYS3D_CALIBRATION_CACHE_IMPLEMENTATION
@@ -9,6 +9,7 @@
 #include "EYS3DSystem.h"
 #include "devices/MemoryAllocator.h"
 #include "devices/IMUDevice.h"
+#include "devices/LatencyStats.h"
 #include "devices/controller/RegisterReadWriteController.h"
 #include "devices/model/DepthFilterOptions.h"
 #include "devices/model/PostProcessOptions.h"
@@ -279,6 +280,17 @@ public:
     int selectDataFormat(IMUDevice::IMU_DATA_FORMAT format);
     
     void dumpFrameInfo(int frameCount = 60);
+
+    // Per-stage latency histograms of this device, see devices/LatencyStats.h.
+    // The reference stays valid until releaseLatencyStats(), call it after
+    // closeStream(); the library built destructor does not.
+    LatencyStats &getLatencyStats()    { return LatencyStats::of(this); }
+    std::shared_ptr<LatencyStats> shareLatencyStats()    { return LatencyStats::share(this); }
+    void releaseLatencyStats()    { LatencyStats::release(this); }
+    int64_t getLatencyPercentileUs(LatencyStream stream, LatencyStage stage, double percentile)    {
+        return getLatencyStats().getPercentileUs(stream, stage, percentile);
+    }
+
     void doSnapshot(int StreamType);
     virtual bool isPlyFilterSupported() { return true; }
     void enablePlyFilter(bool enable);
@@ -10,6 +10,7 @@
 #include "video/FrameProducer.h"
 #include "video/PCProducer.h"
 #include "video/FrameSet.h"
+#include "drop_stats.h"
 #include "base/synchronization/Lock.h"
 #include "base/synchronization/ConditionVariable.h"
 #include "utils.h"
@@ -57,7 +58,9 @@ public:
                                 
                 break;
             } else    { // queue full, ((mRear == mFront) && (mCount == mCapacity))
-                if(timeoutMs == 0)    {
+                if(timeoutMs == 0)    { // the oldest unread frame is overwritten
+                    DropStats::get().record(kDropStreamName, DropReason::SLOW_CONSUMER,
+                                            mItems[(mFront + 1) % mCapacity].serialNumber);
                     mFront = (mFront + 1) % mCapacity;
                     mRear = (mRear + 1) % mCapacity;
                     mItems[mRear].clone(item);
@@ -146,9 +149,15 @@ public:
                 } else if(mItems[mFront].serialNumber < sn)    {
                     if(IS_SN_ROTATE(mItems[mFront].serialNumber, sn))    break;
                     
+                    DropStats::get().record(kDropStreamName, DropReason::UNMATCHED_SET,
+                                            mItems[mFront].serialNumber);
                     continue;
                 } else    { // (mItems[mFront].serialNumber > sn)
-                    if(IS_SN_ROTATE(mItems[mFront].serialNumber, sn))    continue;
+                    if(IS_SN_ROTATE(mItems[mFront].serialNumber, sn))    {
+                        DropStats::get().record(kDropStreamName, DropReason::UNMATCHED_SET,
+                                                mItems[mFront].serialNumber);
+                        continue;
+                    }
 
                     break;
                 }
@@ -184,6 +193,8 @@ public:
     ~CircularQueue()    { stop(); }
     
 private:
+    static constexpr const char *kDropStreamName = "frameset";
+
     T mItems[CAPACITY];
     libeYs3D::base::Lock mLock;
     libeYs3D::base::ConditionVariable mCond;
@@ -0,0 +1,252 @@
+/*
+ * Copyright (C) 2021 eYs3D Corporation
+ * All rights reserved.
+ * This project is licensed under the Apache License, Version 2.0.
+ */
+
+#pragma once
+
+#include "latency_histogram.h"
+#include "video/Producer.h"
+#include "video/PCProducer.h"
+#include "sensors/SensorDataProducer.h"
+#include "base/synchronization/Lock.h"
+#include "base/Compiler.h"
+#include "utils.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include <map>
+#include <memory>
+#include <string>
+
+namespace libeYs3D    {
+namespace devices    {
+
+enum class LatencyStream    {
+    COLOR = 0,
+    DEPTH,
+    PC,
+    IMU,
+    COUNT
+};
+
+// READ and POST_PROCESS happen inside the producers of the prebuilt library,
+// which do not report them: they stay empty for a CameraDevice and are only
+// filled by code that rebuilds those stages itself (e.g. eys3d.pipeline_bench)
+enum class LatencyStage    {
+    READ = 0,               // device read, e.g. around readColorFrame()
+    RGB_TRANSCODE,          // Frame::rgbTranscodingTimeUs
+    FILTER,                 // Frame::filteringTimeUs
+    POST_PROCESS,           // PostProcessHandle / ColorProcessHandle
+    CALLBACK_QUEUE_WAIT,    // frame ready -> app callback entered
+    CALLBACK_EXECUTION,     // time spent inside the app callback
+    PC_GENERATION,          // PCFrame::transcodingTimeUs
+    PIPELINE_QUEUE_WAIT,    // frame ready -> Pipeline::waitFor*() returned
+    END_TO_END,             // frame timestamp -> delivered to the app
+    COUNT
+};
+
+// One LatencyHistogram per stream and stage of a CameraDevice.
+//
+// The producers of the prebuilt library already stamp every frame with its
+// transcoding/filtering cost; recordFrame()/recordPCFrame() turn those into
+// histogram samples, and wrap() decorates the app callbacks so that queue
+// wait and callback execution are measured as well:
+//
+//      auto &stats = device->getLatencyStats();
+//      device->initStream(...,
+//                         stats.wrap(LatencyStream::COLOR, color_image_callback),
+//                         stats.wrap(LatencyStream::DEPTH, depth_image_callback),
+//                         stats.wrap(pc_frame_callback), ...);
+//      ...
+//      int64_t p99 = device->getLatencyPercentileUs(LatencyStream::DEPTH,
+//                                                   LatencyStage::END_TO_END, 99.0);
+//
+// Frame timestamps are REALTIME based, so are the ages computed here.
+//
+// of() takes a process wide lock, so callbacks should keep the reference it
+// returns rather than look it up per frame. The prebuilt CameraDevice does not
+// know about this registry: release() (CameraDevice::releaseLatencyStats())
+// must be called once the streams are closed, otherwise a device later
+// allocated at the same address inherits the old histograms.
+class LatencyStats    {
+    DISALLOW_COPY_ASSIGN_AND_MOVE(LatencyStats);
+
+public:
+    // RAII helper recording the lifetime of the scope into one stage
+    class Scope    {
+    public:
+        Scope(LatencyStats &stats, LatencyStream stream, LatencyStage stage)
+            : mHistogram(stats.histogram(stream, stage)),
+              mStartUs(now_in_microsecond_high_res_time_MONOTONIC())    {}
+        ~Scope()    {
+            mHistogram.record(now_in_microsecond_high_res_time_MONOTONIC() - mStartUs);
+        }
+
+    private:
+        LatencyHistogram &mHistogram;
+        int64_t mStartUs;
+    };
+
+    LatencyStats() = default;
+
+    // Returns the instance bound to |owner|, created on first use
+    static LatencyStats &of(const void *owner)    {
+        return *share(owner);
+    }
+
+    // Same as of(), for holders that may outlive release(), e.g. the metrics registry
+    static std::shared_ptr<LatencyStats> share(const void *owner)    {
+        base::AutoLock lock(registryLock());
+        std::shared_ptr<LatencyStats> &stats = registry()[owner];
+        if(!stats)    stats = std::make_shared<LatencyStats>();
+
+        return stats;
+    }
+
+    // Unbinds the instance from |owner|, references from of() become invalid
+    // once the last share() holder is gone
+    static void release(const void *owner)    {
+        base::AutoLock lock(registryLock());
+        registry().erase(owner);
+    }
+
+    LatencyHistogram &histogram(LatencyStream stream, LatencyStage stage)    {
+        return mHistograms[(int)stream][(int)stage];
+    }
+
+    const LatencyHistogram &histogram(LatencyStream stream, LatencyStage stage) const    {
+        return mHistograms[(int)stream][(int)stage];
+    }
+
+    void record(LatencyStream stream, LatencyStage stage, int64_t valueUs)    {
+        histogram(stream, stage).record(valueUs);
+    }
+
+    int64_t getPercentileUs(LatencyStream stream, LatencyStage stage, double percentile) const    {
+        return histogram(stream, stage).getPercentileUs(percentile);
+    }
+
+    // Records the per-frame costs stamped by the producers plus the age of
+    // |frame| at the time of the call, as |waitStage| (CALLBACK_QUEUE_WAIT or
+    // PIPELINE_QUEUE_WAIT)
+    void recordFrame(LatencyStream stream, const libeYs3D::video::Frame *frame,
+                     LatencyStage waitStage = LatencyStage::CALLBACK_QUEUE_WAIT)    {
+        int64_t ageUs = now_in_microsecond_high_res_time_REALTIME() - frame->tsUs;
+
+        record(stream, LatencyStage::RGB_TRANSCODE, frame->rgbTranscodingTimeUs);
+        record(stream, LatencyStage::FILTER, frame->filteringTimeUs);
+        record(stream, waitStage, ageUs - frame->rgbTranscodingTimeUs - frame->filteringTimeUs);
+        record(stream, LatencyStage::END_TO_END, ageUs);
+    }
+
+    void recordPCFrame(const libeYs3D::video::PCFrame *pcFrame,
+                       LatencyStage waitStage = LatencyStage::CALLBACK_QUEUE_WAIT)    {
+        int64_t ageUs = now_in_microsecond_high_res_time_REALTIME() - pcFrame->tsUs;
+
+        record(LatencyStream::PC, LatencyStage::PC_GENERATION, pcFrame->transcodingTimeUs);
+        record(LatencyStream::PC, waitStage, ageUs - pcFrame->transcodingTimeUs);
+        record(LatencyStream::PC, LatencyStage::END_TO_END, ageUs);
+    }
+
+    libeYs3D::video::Producer::Callback
+    wrap(LatencyStream stream, libeYs3D::video::Producer::Callback callback)    {
+        if(!callback)    return callback;
+
+        return [this, stream, callback](const libeYs3D::video::Frame *frame) -> bool {
+            recordFrame(stream, frame);
+            Scope scope(*this, stream, LatencyStage::CALLBACK_EXECUTION);
+            return callback(frame);
+        };
+    }
+
+    libeYs3D::video::PCProducer::PCCallback
+    wrap(libeYs3D::video::PCProducer::PCCallback callback)    {
+        if(!callback)    return callback;
+
+        return [this, callback](const libeYs3D::video::PCFrame *pcFrame) -> bool {
+            recordPCFrame(pcFrame);
+            Scope scope(*this, LatencyStream::PC, LatencyStage::CALLBACK_EXECUTION);
+            return callback(pcFrame);
+        };
+    }
+
+    libeYs3D::sensors::SensorDataProducer::AppCallback
+    wrap(libeYs3D::sensors::SensorDataProducer::AppCallback callback)    {
+        if(!callback)    return callback;
+
+        return [this, callback](const libeYs3D::sensors::SensorData *sensorData) -> bool {
+            Scope scope(*this, LatencyStream::IMU, LatencyStage::CALLBACK_EXECUTION);
+            return callback(sensorData);
+        };
+    }
+
+    void reset()    {
+        for(int s = 0; s < (int)LatencyStream::COUNT; s++)
+            for(int t = 0; t < (int)LatencyStage::COUNT; t++)    mHistograms[s][t].reset();
+    }
+
+    static const char *getStreamName(LatencyStream stream)    {
+        static const char *kStreamNames[] = { "color", "depth", "pc", "imu" };
+        return kStreamNames[(int)stream];
+    }
+
+    static const char *getStageName(LatencyStage stage)    {
+        static const char *kStageNames[] = { "read", "rgb_transcode", "filter", "post_process",
+                                             "callback_queue_wait", "callback_execution",
+                                             "pc_generation", "pipeline_queue_wait",
+                                             "end_to_end" };
+        return kStageNames[(int)stage];
+    }
+
+    // One line per non-empty stream/stage: count, min, mean, p50, p99, p999, max
+    int toString(char *buffer, int bufferLength) const    {
+        int length = 0;
+
+        if(bufferLength > 0)    buffer[0] = '\0';
+        for(int s = 0; s < (int)LatencyStream::COUNT; s++)    {
+            for(int t = 0; t < (int)LatencyStage::COUNT; t++)    {
+                const LatencyHistogram &h = mHistograms[s][t];
+                if(h.getCount() == 0 || length >= bufferLength)    continue;
+
+                length += snprintf(buffer + length, bufferLength - length,
+                                   "%s.%s: n=%" PRIu64 " min=%" PRId64 " mean=%" PRId64
+                                   " p50=%" PRId64 " p99=%" PRId64 " p999=%" PRId64
+                                   " max=%" PRId64 " us\n",
+                                   getStreamName((LatencyStream)s), getStageName((LatencyStage)t),
+                                   h.getCount(),
+                                   h.getMinUs(), h.getMeanUs(), h.getPercentileUs(50.0),
+                                   h.getPercentileUs(99.0), h.getPercentileUs(99.9),
+                                   h.getMaxUs());
+            }
+        }
+
+        return length < bufferLength ? length : bufferLength - 1;
+    }
+
+    int toString(std::string &string) const    {
+        char buffer[4096];
+        int ret = toString(buffer, sizeof(buffer));
+        string.append(buffer);
+
+        return ret;
+    }
+
+private:
+    static base::Lock &registryLock()    {
+        static base::Lock sLock;
+        return sLock;
+    }
+
+    static std::map<const void *, std::shared_ptr<LatencyStats>> &registry()    {
+        static std::map<const void *, std::shared_ptr<LatencyStats>> sRegistry;
+        return sRegistry;
+    }
+
+    LatencyHistogram mHistograms[(int)LatencyStream::COUNT][(int)LatencyStage::COUNT];
+};
+
+}  // namespace devices
+}  // namespace libeYs3D
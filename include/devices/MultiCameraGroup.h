@@ -0,0 +1,549 @@
+/*
+ * Copyright (C) 2021 eYs3D Corporation
+ * All rights reserved.
+ * This project is licensed under the Apache License, Version 2.0.
+ */
+
+#pragma once
+
+#include "EYS3DSystem.h"
+#include "devices/CameraDevice.h"
+#include "DMPreview_utility/RegisterSettings.h"
+#include "video/Frame.h"
+#include "video/video.h"
+#include "drop_stats.h"
+#include "base/Compiler.h"
+#include "base/synchronization/Lock.h"
+#include "base/threads/Executor.h"
+#include "base/threads/FunctorThread.h"
+#include "utils.h"
+#include "debug.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+//
+// Streaming from several cameras as one unit.
+//
+// A MultiCameraGroup brings its members up in parallel on the SDK executor,
+// ties them together with the register frame sync where the devices support
+// it, and hands the app one MultiFrameSet per capture instant: one key frame
+// (depth by default) of every member, matched by serial number or by
+// timestamp, plus the companion frame (color) of the same serial number of
+// each device. A complete set waits up to Options::companionWaitUs for
+// companions still on their way, then goes out without them.
+//
+//      MultiCameraGroup group("rig", [](const MultiFrameSet *set)    {
+//          ... set->depth[i], set->color[i] for each member i
+//      });
+//      for(int i = 0; i < system->getCameraDeviceCount(); i++)
+//          group.addMember(std::unique_ptr<GroupMember>(
+//                  new CameraDeviceMember(system->getCameraDevice(i), i)));
+//      group.start(config, options);
+//      ...
+//      group.stop();
+//
+// Sets are delivered one at a time on an Executor::Strand, so the callbacks
+// of all the groups share the executor threads. Key frames without a partner
+// in every other member are dropped as UNMATCHED_SET, sets the app is too
+// slow for are dropped oldest first as SLOW_CONSUMER, both under the name of
+// the group in DropStats. Frames are copied into pooled buffers: nothing is
+// allocated once the first sets went through.
+//
+// Any GroupMember implementation can join a group: eys3d.multi_camera
+// --virtual drives one with synthetic frames, so the bring-up, the matching
+// and the drop accounting can be exercised without any camera.
+//
+
+namespace libeYs3D    {
+namespace devices    {
+
+struct GroupStreamConfig    {
+    video::COLOR_RAW_DATA_TYPE colorFormat = video::COLOR_RAW_DATA_YUY2;
+    int32_t colorWidth = 640;
+    int32_t colorHeight = 480;
+    int32_t fps = 30;
+    video::DEPTH_RAW_DATA_TYPE depthFormat = video::DEPTH_RAW_DATA_11_BITS;
+    int32_t depthWidth = 640;
+    int32_t depthHeight = 480;
+    DEPTH_TRANSFER_CTRL depthDataTransferCtrl = DEPTH_IMG_COLORFUL_TRANSFER;
+    CONTROL_MODE ctrlMode = IMAGE_SN_SYNC;
+    int rectifyLogIndex = 0;
+};
+
+inline bool operator==(const GroupStreamConfig &a, const GroupStreamConfig &b)    {
+    return a.colorFormat == b.colorFormat && a.colorWidth == b.colorWidth &&
+           a.colorHeight == b.colorHeight && a.fps == b.fps &&
+           a.depthFormat == b.depthFormat && a.depthWidth == b.depthWidth &&
+           a.depthHeight == b.depthHeight && a.depthDataTransferCtrl == b.depthDataTransferCtrl &&
+           a.ctrlMode == b.ctrlMode && a.rectifyLogIndex == b.rectifyLogIndex;
+}
+
+inline bool operator!=(const GroupStreamConfig &a, const GroupStreamConfig &b)    { return !(a == b); }
+
+// One device of a MultiCameraGroup
+class GroupMember    {
+public:
+    virtual ~GroupMember() = default;
+
+    virtual const char *getName() const = 0;
+
+    // Same return values as CameraDevice::initStream()
+    virtual int initStream(const GroupStreamConfig &config,
+                           video::Producer::Callback colorCallback,
+                           video::Producer::Callback depthCallback) = 0;
+
+    /**
+     * Makes this member capture in step with |master|, called on the master
+     * itself too, after all members initialized and before any is enabled.
+     * return
+     *     0: synchronized, serial numbers of the members match
+     *     < 0: not supported, the group falls back to timestamp matching
+     */
+    virtual int configureFrameSync(GroupMember *master, const GroupStreamConfig &config) = 0;
+
+    virtual void enableStream() = 0;
+    virtual int closeStream() = 0;
+};
+
+class CameraDeviceMember : public GroupMember    {
+    DISALLOW_COPY_ASSIGN_AND_MOVE(CameraDeviceMember);
+
+public:
+    // |systemIndex|: index of the device in EYS3DSystem::getCameraDevice()
+    CameraDeviceMember(std::shared_ptr<CameraDevice> device, int systemIndex)
+        : mDevice(std::move(device)), mName("camera" + std::to_string(systemIndex))    {
+        memset(&mDevSelInfo, 0, sizeof(mDevSelInfo));
+        mDevSelInfo.index = systemIndex;
+    }
+
+    const char *getName() const override    { return mName.c_str(); }
+
+    int initStream(const GroupStreamConfig &config,
+                   video::Producer::Callback colorCallback,
+                   video::Producer::Callback depthCallback) override    {
+        return mDevice->initStream(config.colorFormat, config.colorWidth, config.colorHeight, config.fps,
+                                   config.depthFormat, config.depthWidth, config.depthHeight,
+                                   config.depthDataTransferCtrl, config.ctrlMode, config.rectifyLogIndex,
+                                   std::move(colorCallback), std::move(depthCallback), nullptr, nullptr);
+    }
+
+    int configureFrameSync(GroupMember *master, const GroupStreamConfig &config) override    {
+        CameraDeviceMember *masterDevice = dynamic_cast<CameraDeviceMember *>(master);
+        if(masterDevice == nullptr)    return -1;
+
+        bool isMJPG = (config.colorFormat == video::COLOR_RAW_DATA_MJPG);
+        void *handle = EYS3DSystem::getEYS3DDIHandle();
+        if(masterDevice == this)    {
+            return RegisterSettings::FramesyncD0(handle, &mDevSelInfo,
+                                                 config.depthWidth, config.depthHeight,
+                                                 config.colorWidth, config.colorHeight, isMJPG, config.fps);
+        }
+
+        return RegisterSettings::Framesync(handle, &masterDevice->mDevSelInfo, &mDevSelInfo,
+                                           config.depthWidth, config.depthHeight,
+                                           config.colorWidth, config.colorHeight, isMJPG, config.fps,
+                                           mDevice->getCameraDeviceInfo().devInfo.wPID);
+    }
+
+    void enableStream() override    { mDevice->enableStream(); }
+    int closeStream() override    { return mDevice->closeStream(); }
+
+    CameraDevice *getCameraDevice()    { return mDevice.get(); }
+
+private:
+    std::shared_ptr<CameraDevice> mDevice;
+    const std::string mName;
+    DEVSELINFO mDevSelInfo;
+};
+
+// One capture instant of the whole group, index i is the i-th member added
+struct MultiFrameSet    {
+    uint32_t serialNumber = 0u;     // of the first member
+    int64_t tsUs = 0ll;             // of the first member
+    int64_t skewUs = 0ll;           // spread of the key frame timestamps
+    std::vector<std::unique_ptr<video::Frame>> depth;
+    std::vector<std::unique_ptr<video::Frame>> color;
+    std::vector<bool> hasDepth;
+    std::vector<bool> hasColor;
+};
+
+struct MultiCameraGroupStats    {
+    uint64_t sets = 0ull;           // delivered to the app
+    uint64_t unmatched = 0ull;      // key frames dropped without partners
+    uint64_t slowConsumer = 0ull;   // sets dropped before the app could take them
+    uint64_t missingCompanions = 0ull;  // companions given up on after companionWaitUs
+    int64_t maxSkewUs = 0ll;
+    int64_t bringUpUs = 0ll;        // start(): parallel init, frame sync and enable
+    bool frameSynced = false;
+};
+
+class MultiCameraGroup    {
+    DISALLOW_COPY_ASSIGN_AND_MOVE(MultiCameraGroup);
+
+public:
+    using Callback = std::function<void(const MultiFrameSet *set)>;
+
+    enum class MatchBy    { SERIAL, TIMESTAMP };
+    enum class KeyStream    { DEPTH, COLOR };
+
+    struct Options    {
+        MatchBy matchBy = MatchBy::SERIAL;
+        KeyStream keyStream = KeyStream::DEPTH;
+        bool frameSync = true;          // falls back to TIMESTAMP when not supported
+        int64_t toleranceUs = 0ll;      // TIMESTAMP matching window, 0: half a frame period
+        // How long a complete set waits for late companions, 0: one frame
+        // period, < 0: never. Checked as frames of the group arrive, members
+        // which never delivered a companion are not waited for.
+        int64_t companionWaitUs = 0ll;
+    };
+
+    static constexpr int kMaxPending = 4;       // key frames waiting per member
+    static constexpr int kMaxQueuedSets = 2;    // sets waiting for the app
+    static constexpr int kCompanionHistory = 3;
+
+    MultiCameraGroup(const char *name, Callback callback)
+        : mName(name), mCallback(std::move(callback)),
+          mDrops(DropStats::get().stream(name)),
+          mStrand(base::Executor::get(), base::TaskPriority::High)    {}
+
+    ~MultiCameraGroup()    { stop(); }
+
+    // Before start() only, returns the index of the member in the sets
+    int addMember(std::unique_ptr<GroupMember> member)    {
+        if(mStarted)    return -1;
+
+        mMembers.push_back(std::move(member));
+        mPending.emplace_back();
+        mCompanions.emplace_back();
+        mCompanionSeen.push_back(false);
+        return (int)mMembers.size() - 1;
+    }
+
+    int getMemberCount() const    { return (int)mMembers.size(); }
+    GroupMember *getMember(int index)    { return mMembers[index].get(); }
+
+    /**
+     * Initializes the members in parallel, synchronizes them and enables them.
+     * return
+     *     0: streaming
+     *     < 0: the first initStream() error, members already initialized are closed
+     */
+    int start(const GroupStreamConfig &config, const Options &options)    {
+        if(mStarted || mMembers.empty())    return -1;
+
+        int64_t startUs = now_in_microsecond_high_res_time_MONOTONIC();
+        mOptions = options;
+        if(mOptions.toleranceUs <= 0ll)    mOptions.toleranceUs = 500000ll / (config.fps > 0 ? config.fps : 30);
+        if(mOptions.companionWaitUs == 0ll)    mOptions.companionWaitUs = 1000000ll / (config.fps > 0 ? config.fps : 30);
+
+        std::vector<int> results(mMembers.size(), 0);
+        runOnAllMembers([&](int i)    {
+            results[i] = mMembers[i]->initStream(config,
+                    [this, i](const video::Frame *frame) { return onFrame(i, false, frame); },
+                    [this, i](const video::Frame *frame) { return onFrame(i, true, frame); });
+            if(results[i] != 0)
+                LOG_ERR(mName.c_str(), "%s: initStream failed (%d)", mMembers[i]->getName(), results[i]);
+        });
+        for(size_t i = 0; i < results.size(); i++)    {
+            if(results[i] == 0)    continue;
+
+            runOnAllMembers([&](int j) { if(results[j] == 0)    mMembers[j]->closeStream(); });
+            return results[i];
+        }
+
+        bool synced = false;
+        if(mOptions.frameSync && mMembers.size() > 1)    {
+            synced = true;
+            for(auto &member : mMembers)    {
+                int ret = member->configureFrameSync(mMembers[0].get(), config);
+                if(ret != 0)    {
+                    LOG_WARN(mName.c_str(), "%s: frame sync not supported (%d)", member->getName(), ret);
+                    synced = false;
+                }
+            }
+        }
+        if(!synced && mOptions.matchBy == MatchBy::SERIAL && mMembers.size() > 1)    {
+            LOG_WARN(mName.c_str(), "Members not frame synced, matching by timestamp");
+            mOptions.matchBy = MatchBy::TIMESTAMP;
+        }
+
+        mStarted = true;
+        for(auto &member : mMembers)    member->enableStream();
+
+        base::AutoLock lock(mLock);
+        mStats.frameSynced = synced;
+        mStats.bringUpUs = now_in_microsecond_high_res_time_MONOTONIC() - startUs;
+        return 0;
+    }
+
+    // Closes the members in parallel and waits for the set being delivered
+    void stop()    {
+        if(!mStarted)    return;
+
+        runOnAllMembers([this](int i) { mMembers[i]->closeStream(); });
+        mStarted = false;
+        mStrand.waitForIdle();
+
+        base::AutoLock lock(mLock);
+        for(size_t i = 0; i < mMembers.size(); i++)    {
+            while(!mPending[i].empty())    recycle(popFront(mPending[i]));
+            while(!mCompanions[i].empty())    recycle(popFront(mCompanions[i]));
+            mCompanionSeen[i] = false;
+        }
+        mHoldDeadlineUs = 0ll;
+        while(!mQueuedSets.empty())    recycleSet(popFront(mQueuedSets));
+    }
+
+    MatchBy getMatchBy() const    { return mOptions.matchBy; }
+
+    MultiCameraGroupStats getStats()    {
+        base::AutoLock lock(mLock);
+        return mStats;
+    }
+
+    const std::string &getName() const    { return mName; }
+
+private:
+    using FramePtr = std::unique_ptr<video::Frame>;
+    using SetPtr = std::unique_ptr<MultiFrameSet>;
+
+    template <class T>
+    static T popFront(std::deque<T> &queue)    {
+        T item = std::move(queue.front());
+        queue.pop_front();
+        return item;
+    }
+
+    // Runs |task| for every member in parallel, see Executor::parallelFor()
+    template <class Task>
+    void runOnAllMembers(Task task)    {
+        const int count = (int)mMembers.size();
+        base::Executor::get().parallelFor(count, count, [&](int i) { task(i); });
+    }
+
+    FramePtr takeFrame()    {
+        if(mFreeFrames.empty())    return FramePtr(new video::Frame());
+
+        FramePtr frame = std::move(mFreeFrames.back());
+        mFreeFrames.pop_back();
+        return frame;
+    }
+
+    void recycle(FramePtr frame)    {
+        if(frame)    mFreeFrames.push_back(std::move(frame));
+    }
+
+    void recycleSet(SetPtr set)    {
+        for(size_t i = 0; i < set->depth.size(); i++)    {
+            recycle(std::move(set->depth[i]));
+            recycle(std::move(set->color[i]));
+        }
+        mFreeSets.push_back(std::move(set));
+    }
+
+    bool onFrame(int member, bool isDepth, const video::Frame *frame)    {
+        FramePtr copy;
+        {
+            base::AutoLock lock(mLock);
+            copy = takeFrame();
+        }
+        copy->clone(frame);     // out of the lock, the other members go on
+
+        bool isKey = (isDepth == (mOptions.keyStream == KeyStream::DEPTH));
+        base::AutoLock lock(mLock);
+        if(!mStarted)    {
+            recycle(std::move(copy));
+            return true;
+        }
+
+        if(!isKey)    {
+            std::deque<FramePtr> &companions = mCompanions[member];
+            companions.push_back(std::move(copy));
+            if(companions.size() > kCompanionHistory)    recycle(popFront(companions));
+            mCompanionSeen[member] = true;
+            if(mHoldDeadlineUs != 0ll)    match();     // a held set may be complete now
+            return true;
+        }
+
+        std::deque<FramePtr> &pending = mPending[member];
+        pending.push_back(std::move(copy));
+        if(pending.size() > kMaxPending)    dropFront(pending);
+        match();
+        return true;
+    }
+
+    void dropFront(std::deque<FramePtr> &pending)    {
+        mDrops.record(DropReason::UNMATCHED_SET, pending.front()->serialNumber);
+        mStats.unmatched += 1;
+        recycle(popFront(pending));
+        mHoldDeadlineUs = 0ll;      // the held instant, if any, changed
+    }
+
+    std::deque<FramePtr>::iterator findCompanion(size_t member, uint32_t serialNumber)    {
+        std::deque<FramePtr> &companions = mCompanions[member];
+        return std::find_if(companions.begin(), companions.end(),
+                            [serialNumber](const FramePtr &frame) { return frame->serialNumber == serialNumber; });
+    }
+
+    // Whether the set of the pending fronts can go out: every companion is
+    // there, or the wait for them is over
+    bool companionsReady()    {
+        if(mOptions.companionWaitUs < 0ll)    return true;
+
+        bool ready = true;
+        for(size_t i = 0; i < mPending.size() && ready; i++)    {
+            if(mCompanionSeen[i] && findCompanion(i, mPending[i].front()->serialNumber) == mCompanions[i].end())
+                ready = false;
+        }
+        if(ready)    return true;
+
+        int64_t nowUs = now_in_microsecond_high_res_time_MONOTONIC();
+        if(mHoldDeadlineUs == 0ll)    {
+            mHoldDeadlineUs = nowUs + mOptions.companionWaitUs;
+            return false;
+        }
+        return nowUs >= mHoldDeadlineUs;
+    }
+
+    // Whether |frame| comes before the target instant and can no longer be matched
+    bool isBehind(const video::Frame &frame, uint32_t serialNumber, int64_t tsUs) const    {
+        if(mOptions.matchBy == MatchBy::SERIAL)
+            return (int32_t)(frame.serialNumber - serialNumber) < 0;
+
+        return frame.tsUs < tsUs - mOptions.toleranceUs;
+    }
+
+    // Emits sets as long as every member has a key frame of the same instant
+    void match()    {
+        const size_t count = mPending.size();
+        for(;;)    {
+            for(size_t i = 0; i < count; i++)    {
+                if(mPending[i].empty())    return;
+            }
+
+            // the latest front is the earliest instant all members can still make
+            const video::Frame *target = mPending[0].front().get();
+            for(size_t i = 1; i < count; i++)    {
+                const video::Frame *front = mPending[i].front().get();
+                bool later = (mOptions.matchBy == MatchBy::SERIAL)
+                        ? (int32_t)(front->serialNumber - target->serialNumber) > 0
+                        : front->tsUs > target->tsUs;
+                if(later)    target = front;
+            }
+
+            bool complete = true;
+            const uint32_t serialNumber = target->serialNumber;
+            const int64_t tsUs = target->tsUs;
+            for(size_t i = 0; i < count; i++)    {
+                while(!mPending[i].empty() && isBehind(*mPending[i].front(), serialNumber, tsUs))
+                    dropFront(mPending[i]);
+                if(mPending[i].empty())    complete = false;
+            }
+            if(!complete || !companionsReady())    return;
+
+            emit();
+        }
+    }
+
+    void emit()    {
+        const size_t count = mPending.size();
+        mHoldDeadlineUs = 0ll;
+        SetPtr set;
+        if(mFreeSets.empty())    {
+            set.reset(new MultiFrameSet());
+        } else    {
+            set = popFront(mFreeSets);
+        }
+        set->depth.resize(count);
+        set->color.resize(count);
+        set->hasDepth.assign(count, false);
+        set->hasColor.assign(count, false);
+
+        bool keyIsDepth = (mOptions.keyStream == KeyStream::DEPTH);
+        int64_t minTsUs = 0ll, maxTsUs = 0ll;
+        for(size_t i = 0; i < count; i++)    {
+            FramePtr key = popFront(mPending[i]);
+            if(i == 0 || key->tsUs < minTsUs)    minTsUs = key->tsUs;
+            if(i == 0 || key->tsUs > maxTsUs)    maxTsUs = key->tsUs;
+            if(i == 0)    {
+                set->serialNumber = key->serialNumber;
+                set->tsUs = key->tsUs;
+            }
+
+            // the companion of a device carries the serial number of its key frame
+            FramePtr companion;
+            auto it = findCompanion(i, key->serialNumber);
+            if(it != mCompanions[i].end())    {
+                companion = std::move(*it);
+                mCompanions[i].erase(it);
+            } else if(mCompanionSeen[i] && mOptions.companionWaitUs >= 0ll)    {
+                mStats.missingCompanions += 1;
+            }
+
+            (keyIsDepth ? set->hasDepth : set->hasColor)[i] = true;
+            (keyIsDepth ? set->hasColor : set->hasDepth)[i] = (bool)companion;
+            (keyIsDepth ? set->depth : set->color)[i] = std::move(key);
+            (keyIsDepth ? set->color : set->depth)[i] = std::move(companion);
+        }
+        set->skewUs = maxTsUs - minTsUs;
+        if(set->skewUs > mStats.maxSkewUs)    mStats.maxSkewUs = set->skewUs;
+
+        if(mQueuedSets.size() >= kMaxQueuedSets)    {
+            SetPtr oldest = popFront(mQueuedSets);
+            mDrops.record(DropReason::SLOW_CONSUMER, oldest->serialNumber);
+            mStats.slowConsumer += 1;
+            recycleSet(std::move(oldest));
+        }
+        mQueuedSets.push_back(std::move(set));
+
+        // one task per set, a task finding nothing had its set dropped
+        mStrand.post([this]() { deliver(); });
+    }
+
+    void deliver()    {
+        SetPtr set;
+        {
+            base::AutoLock lock(mLock);
+            if(mQueuedSets.empty())    return;
+            set = popFront(mQueuedSets);
+        }
+
+        if(mCallback)    mCallback(set.get());
+
+        base::AutoLock lock(mLock);
+        mStats.sets += 1;
+        recycleSet(std::move(set));
+    }
+
+    const std::string mName;
+    const Callback mCallback;
+    DropCounters &mDrops;
+    Options mOptions;
+
+    std::vector<std::unique_ptr<GroupMember>> mMembers;
+    std::atomic<bool> mStarted{false};
+
+    base::Lock mLock;
+    std::deque<std::deque<FramePtr>> mPending;      // guarded by mLock, one per member
+    std::deque<std::deque<FramePtr>> mCompanions;
+    std::vector<bool> mCompanionSeen;
+    int64_t mHoldDeadlineUs = 0ll;                  // set while the pending fronts wait for companions
+    std::deque<SetPtr> mQueuedSets;
+    std::vector<FramePtr> mFreeFrames;
+    std::deque<SetPtr> mFreeSets;
+    MultiCameraGroupStats mStats;
+
+    base::Executor::Strand mStrand;
+};
+
+}  // namespace devices
+}  // namespace libeYs3D
@@ -10,6 +10,11 @@
 #include "video/FrameProducer.h"
 #include "video/PCProducer.h"
 #include "sensors/SensorDataProducer.h"
+#include "drop_stats.h"
+#ifndef _WIN32
+#include "ready_fd.h"
+#include "spin_wait.h"
+#endif
 #include "base/synchronization/Lock.h"
 #include "base/synchronization/ConditionVariable.h"
 #include "utils.h"
@@ -57,6 +62,8 @@ public:
             }
 
 			if (timeoutMs == 0) {
+				DropStats::get().record(mName, DropReason::SLOW_CONSUMER,
+				                        drop_serial_of(mItems[(mFront + 1) % mCapacity]));
 				mFront = (mFront + 1) % mCapacity;
 				mRear = (mRear + 1) % mCapacity;
 				mItems[mRear].clone(item);
@@ -192,6 +199,7 @@ public:
     }
 #else  // !_WIN32
     Pipeline::RESULT enQueue(const T *item, int32_t timeoutMs = DEFAULT_TIMEOUT_MS)    {
+        ReadyFd *readyFd = ReadyFdRegistry::get().find(this);   // before mLock, see ready_fd.h
         libeYs3D::base::AutoLock lock(mLock);
         
         while(true)    {
@@ -202,11 +210,16 @@ public:
                 mRear = (mRear + 1) % mCapacity;
                 mItems[mRear].clone(item);
             
-                if(mCount == 1)    mCond.signal();
+                if(mCount == 1)    {
+                    mCond.signal();
+                    updateReadyFdLocked(readyFd);
+                }
                                 
                 break;
             } else    { // queue full, ((mRear == mFront) && (mCount == mCapacity))
-                if(timeoutMs == 0)    {
+                if(timeoutMs == 0)    { // the oldest unread frame is overwritten
+                    DropStats::get().record(mName, DropReason::SLOW_CONSUMER,
+                                            drop_serial_of(mItems[(mFront + 1) % mCapacity]));
                     mFront = (mFront + 1) % mCapacity;
                     mRear = (mRear + 1) % mCapacity;
                     mItems[mRear].clone(item);
@@ -233,6 +246,9 @@ public:
     }
     
     Pipeline::RESULT deQueue(T *item, int32_t timeoutMs = DEFAULT_TIMEOUT_MS)    {
+        if(timeoutMs != 0)    spinUntilReady();
+
+        ReadyFd *readyFd = ReadyFdRegistry::get().find(this);
         libeYs3D::base::AutoLock lock(mLock);
         
         if(mStopped)    return Pipeline::RESULT::STOPPED;
@@ -264,24 +280,85 @@ public:
         mFront = (mFront + 1) % mCapacity;
         item->clone(&mItems[mFront]);
 
+        if(mCount == 0)    updateReadyFdLocked(readyFd);
+
         return Pipeline::RESULT::OK;
     }
     
     void reset()    {
+        ReadyFd *readyFd = ReadyFdRegistry::get().find(this);
         libeYs3D::base::AutoLock lock(mLock);
         
         mFront = 0;
         mRear = 0;
         mCount = 0;
+        updateReadyFdLocked(readyFd);
     }
     
     void stop()    {
+        ReadyFd *readyFd = ReadyFdRegistry::get().find(this);
         libeYs3D::base::AutoLock lock(mLock);
         
         if(mStopped)    return;
         
         mStopped = true;
         mCond.broadcast();
+        updateReadyFdLocked(readyFd);
+    }
+
+    /**
+     * Readable while the queue holds data or is stopped, see ready_fd.h.
+     * Only for queues the app builds and fills itself: the enQueue() and
+     * deQueue() inlined in the prebuilt library never update it. Call it
+     * before the producer starts.
+     * \return the descriptor, < 0 if none could be set up
+     */
+    int getReadyFd()    {
+        ReadyFd *readyFd = ReadyFdRegistry::get().acquire(this);   // before mLock, see ready_fd.h
+        if(readyFd == nullptr)    return -1;
+
+        libeYs3D::base::AutoLock lock(mLock);
+        readyFd->update(mCount > 0 || mStopped);
+        return readyFd->fd();
+    }
+
+    /**
+     * Spins per the policy of setWaitStrategy() until the queue holds data
+     * or is stopped, see spin_wait.h. Returns right away without a policy.
+     * Only reads the count under mLock, so it works on the queues filled by
+     * the prebuilt library as well.
+     */
+    void spinUntilReady()    {
+        SpinWaiter *spinWaiter = SpinWaiterTable::get().find(this);
+        if(spinWaiter)    spinWaiter->spin(mLock, [this]() { return mCount > 0 || mStopped; });
+    }
+
+    // nullptr blocks right away, the default; see spin_wait.h
+    void setWaitStrategy(const SpinWaitPolicy *policy)    {
+        if(policy == nullptr && SpinWaiterTable::get().find(this) == nullptr)    return;
+
+        SpinWaitPolicy off;
+        off.maxSpinUs = 0;
+        SpinWaiter *spinWaiter = SpinWaiterTable::get().acquire(this);
+        if(spinWaiter)    spinWaiter->setPolicy(policy ? *policy : off);
+    }
+
+    // false if no wait of this queue went through the spin path
+    bool getWaitStats(SpinWaitStats *stats)    {
+        SpinWaiter *spinWaiter = SpinWaiterTable::get().find(this);
+        if(spinWaiter == nullptr)    return false;
+
+        return spinWaiter->getStats(stats);
+    }
+
+    /**
+     * Frees the ready fd and spin state of this queue, see queue_side_table.h.
+     * The destructor is the one of the prebuilt library and does not; the
+     * owner calls this once no thread uses the queue any more.
+     */
+    void releaseSideState()    {
+        ReadyFdRegistry::get().release(this);
+        SpinWaiterTable::get().release(this);
     }
 #endif
     
@@ -292,6 +369,13 @@ public:
     ~CircularQueue()    { stop(); }
     
 private:
+#ifndef _WIN32
+    // |readyFd| is looked up before taking mLock, the registry has its own lock
+    void updateReadyFdLocked(ReadyFd *readyFd)    {
+        if(readyFd)    readyFd->update(mCount > 0 || mStopped);
+    }
+#endif
+
     char mName[128];
     T mItems[CAPACITY];
 #ifdef _WIN32
@@ -358,6 +442,85 @@ public:
                          int32_t timeoutMs = DEFAULT_TIMEOUT_MS);
     RESULT insertIMUData(const libeYs3D::sensors::SensorData *imuData,
                          int32_t timeoutMs = DEFAULT_TIMEOUT_MS);
+
+#ifndef _WIN32
+    enum STREAM    {
+        COLOR = 1 << 0,
+        DEPTH = 1 << 1,
+        PC    = 1 << 2,
+        IMU   = 1 << 3
+    };
+
+    /**
+     * Opt-in spin-then-block waiting for consumers which need the frame as
+     * soon as it lands, see spin_wait.h. The waitFor*() calls run in the
+     * prebuilt library and always block right away; the policy applies to
+     * the spinWaitFor*() calls below.
+     * \param[in] policy   nullptr: block right away (default)
+     */
+    void setWaitStrategy(STREAM stream, const SpinWaitPolicy *policy)    {
+        switch(stream)    {
+            case STREAM::COLOR: mColorFrameQueue.setWaitStrategy(policy); break;
+            case STREAM::DEPTH: mDepthFrameQueue.setWaitStrategy(policy); break;
+            case STREAM::PC:    mPCFrameQueue.setWaitStrategy(policy); break;
+            case STREAM::IMU:   mIMUDataQueue.setWaitStrategy(policy); break;
+            default:            break;
+        }
+    }
+
+    /**
+     * Same as the waitFor*() calls, but first spin on the queue as set with
+     * setWaitStrategy(), then block in the waitFor*() call if the data did
+     * not land in time. They run in the app, so they work with the prebuilt
+     * library. The spin budget comes on top of timeoutMs, timeoutMs == 0
+     * does not spin.
+     */
+    RESULT spinWaitForColorFrame(libeYs3D::video::Frame *frame,
+                                 int32_t timeoutMs = DEFAULT_TIMEOUT_MS)    {
+        if(timeoutMs != 0)    mColorFrameQueue.spinUntilReady();
+        return waitForColorFrame(frame, timeoutMs);
+    }
+    RESULT spinWaitForDepthFrame(libeYs3D::video::Frame *frame,
+                                 int32_t timeoutMs = DEFAULT_TIMEOUT_MS)    {
+        if(timeoutMs != 0)    mDepthFrameQueue.spinUntilReady();
+        return waitForDepthFrame(frame, timeoutMs);
+    }
+    RESULT spinWaitForPCFrame(libeYs3D::video::PCFrame *pcFrame,
+                              int32_t timeoutMs = DEFAULT_TIMEOUT_MS)    {
+        if(timeoutMs != 0)    mPCFrameQueue.spinUntilReady();
+        return waitForPCFrame(pcFrame, timeoutMs);
+    }
+    RESULT spinWaitForIMUData(libeYs3D::sensors::SensorData *imuData,
+                              int32_t timeoutMs = DEFAULT_TIMEOUT_MS)    {
+        if(timeoutMs != 0)    mIMUDataQueue.spinUntilReady();
+        return waitForIMUData(imuData, timeoutMs);
+    }
+
+    /**
+     * How the spinWaitFor*() calls of stream were served: immediately, by
+     * spinning or by blocking. false if none went through the spin path yet.
+     */
+    bool getWaitStats(STREAM stream, SpinWaitStats *stats)    {
+        switch(stream)    {
+            case STREAM::COLOR: return mColorFrameQueue.getWaitStats(stats);
+            case STREAM::DEPTH: return mDepthFrameQueue.getWaitStats(stats);
+            case STREAM::PC:    return mPCFrameQueue.getWaitStats(stats);
+            case STREAM::IMU:   return mIMUDataQueue.getWaitStats(stats);
+            default:            return false;
+        }
+    }
+
+    /**
+     * Frees what setWaitStrategy() set up. The prebuilt destructor does not,
+     * call it once the streams are closed and no spinWaitFor*() is in flight.
+     */
+    void releaseWaitStrategies()    {
+        mColorFrameQueue.releaseSideState();
+        mDepthFrameQueue.releaseSideState();
+        mPCFrameQueue.releaseSideState();
+        mIMUDataQueue.releaseSideState();
+    }
+#endif
     
     void reset();
     //void start();
@@ -0,0 +1,281 @@
+/*
+ * Copyright (C) 2021 eYs3D Corporation
+ * All rights reserved.
+ * This project is licensed under the Apache License, Version 2.0.
+ */
+
+#pragma once
+
+#include "devices/MultiCameraGroup.h"
+#include "base/Compiler.h"
+#include "base/synchronization/ConditionVariable.h"
+#include "base/synchronization/Lock.h"
+#include "base/threads/Thread.h"
+#include "utils.h"
+#include "debug.h"
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <string>
+
+//
+// Switching the resolution, frame rate or depth format of a running device.
+//
+// Going through closeStream() and initStream() makes the app rebuild its own
+// side as well: the callbacks, the queues and mailboxes behind them, and the
+// depth filter settings. The SDK resets the filters on every initStream().
+// initStream() also sleeps a fixed kOpenSettleMs after opening the device,
+// which is most of the blackout. A StreamReconfigurer owns the callbacks it
+// hands to the device for the lifetime of the stream, so the app side stays
+// up across a switch:
+//
+//      StreamReconfigurer stream(std::unique_ptr<GroupMember>(new CameraDeviceMember(device, 0)),
+//                                color_callback, depth_callback);
+//      stream.open(config);
+//      ...
+//      ReconfigureReport report;
+//      stream.reconfigureStream(lowResConfig, &report);   // report.gapMs
+//
+// reconfigureStream() pauses the device, reopens it in the new mode, puts the
+// depth filter and accuracy options back before the first frame, and returns
+// once every configured stream delivered again. closeStream() returns once
+// the producers stopped, so the callbacks see one mode or the other. The
+// producer threads and buffers of the SDK are still recreated.
+//
+// Without more, a reconfigure waits the same kOpenSettleMs as the library.
+// Defining EYS3D_STREAM_RECONFIGURE_IMPLEMENTATION in one source file opts
+// into shortening it: the open settle sleep of a reconfigure then becomes
+// Options::settleMs, kReconfigureSettleMs by default, since the sensor is
+// already running. The first open() keeps the library delay.
+//
+
+namespace libeYs3D    {
+namespace devices    {
+
+struct ReconfigureReport    {
+    double gapMs = 0.0;         // last frame of the old mode to the first one of each new stream
+    double closeMs = 0.0;
+    double initMs = 0.0;
+    bool reopened = false;      // false: the mode was already the requested one
+    bool resumed = false;       // every configured stream delivered before the timeout
+};
+
+namespace internal    {
+
+// Settle time for the initStream() of this thread, -1: the library default
+inline int &reconfigure_settle_override_ms()    {
+    static thread_local int sSettleMs = -1;
+    return sSettleMs;
+}
+
+}  // namespace internal
+
+class StreamReconfigurer    {
+    DISALLOW_COPY_ASSIGN_AND_MOVE(StreamReconfigurer);
+
+public:
+    static constexpr unsigned kOpenSettleMs = 1600;     // CameraDevice::initStream() after APC_OpenDevice2()
+    static constexpr int kReconfigureSettleMs = 200;
+
+    struct Options    {
+        int settleMs = kReconfigureSettleMs;    // open settle of a reconfigure, needs the implementation
+        int resumeTimeoutMs = 3000;             // for the first frame of each stream in the new mode
+    };
+
+    StreamReconfigurer(std::unique_ptr<GroupMember> member,
+                       video::Producer::Callback colorCallback,
+                       video::Producer::Callback depthCallback)
+        : StreamReconfigurer(std::move(member), std::move(colorCallback), std::move(depthCallback), Options())    {}
+
+    StreamReconfigurer(std::unique_ptr<GroupMember> member,
+                       video::Producer::Callback colorCallback,
+                       video::Producer::Callback depthCallback,
+                       const Options &options)
+        : mMember(std::move(member)), mColorCallback(std::move(colorCallback)),
+          mDepthCallback(std::move(depthCallback)), mOptions(options)    {}
+
+    ~StreamReconfigurer()    { close(); }
+
+    // Same return values as CameraDevice::initStream()
+    int open(const GroupStreamConfig &config)    {
+        if(mOpened)    return 1;
+
+        int ret = initStream(config);
+        if(ret != 0)    return ret;
+
+        mMember->enableStream();
+        mOpened = true;
+        return 0;
+    }
+
+    /**
+     * Switches the running stream to |config|.
+     * return
+     *     0: streaming in the new mode, or already in it
+     *     < 0: initStream() failed, the stream is closed
+     *     1: not opened
+     */
+    int reconfigureStream(const GroupStreamConfig &config, ReconfigureReport *report = nullptr)    {
+        ReconfigureReport result;
+        if(!mOpened)    return 1;
+        if(config == mConfig)    {
+            result.resumed = true;
+            if(report)    *report = result;
+            return 0;
+        }
+
+        CameraDevice *device = getCameraDevice();
+        std::unique_ptr<DepthFilterOptions> filterOptions;
+        std::unique_ptr<DepthAccuracyOptions> accuracyOptions;
+        if(device)    {
+            filterOptions.reset(new DepthFilterOptions(device->getDepthFilterOptions()));
+            accuracyOptions.reset(new DepthAccuracyOptions(device->getDepthAccuracyOptions()));
+        }
+
+        int64_t startUs = now_in_microsecond_high_res_time_MONOTONIC();
+        mMember->closeStream();
+        int64_t closedUs = now_in_microsecond_high_res_time_MONOTONIC();
+        int64_t lastFrameUs;
+        {
+            base::AutoLock lock(mLock);
+            lastFrameUs = mLastFrameUs ? mLastFrameUs : startUs;
+        }
+
+        int ret;
+        {
+            int &settleMs = internal::reconfigure_settle_override_ms();
+            settleMs = mOptions.settleMs;
+            ret = initStream(config);
+            settleMs = -1;
+        }
+        int64_t initializedUs = now_in_microsecond_high_res_time_MONOTONIC();
+        result.reopened = true;
+        result.closeMs = (closedUs - startUs) / 1000.0;
+        result.initMs = (initializedUs - closedUs) / 1000.0;
+        if(ret != 0)    {
+            LOG_ERR("StreamReconfigurer", "%s: initStream failed (%d)", mMember->getName(), ret);
+            mOpened = false;
+            if(report)    *report = result;
+            return ret;
+        }
+
+        if(device)    {     // before the first frame of the new mode
+            device->setDepthFilterOptions(*filterOptions);
+            device->setDepthAccuracyOptions(*accuracyOptions);
+        }
+        mMember->enableStream();
+
+        {
+            base::AutoLock lock(mLock);
+            int64_t deadlineUs = now_in_microsecond_high_res_time_REALTIME() +
+                                 (int64_t)mOptions.resumeTimeoutMs * 1000ll;
+            while(!resumedLocked() && now_in_microsecond_high_res_time_REALTIME() < deadlineUs)
+                mCond.timedWait(&mLock, deadlineUs);
+            result.resumed = resumedLocked();
+            int64_t resumeUs = std::max(mFirstColorUs, mFirstDepthUs);
+            result.gapMs = ((result.resumed ? resumeUs : now_in_microsecond_high_res_time_MONOTONIC()) -
+                            lastFrameUs) / 1000.0;
+        }
+        if(!result.resumed)
+            LOG_WARN("StreamReconfigurer", "%s: no frame within %d ms of the switch",
+                     mMember->getName(), mOptions.resumeTimeoutMs);
+
+        if(report)    *report = result;
+        return 0;
+    }
+
+    void close()    {
+        if(!mOpened)    return;
+
+        mMember->closeStream();
+        mOpened = false;
+    }
+
+    const GroupStreamConfig &getConfig() const    { return mConfig; }
+    GroupMember *getMember()    { return mMember.get(); }
+
+private:
+    CameraDevice *getCameraDevice()    {
+        CameraDeviceMember *member = dynamic_cast<CameraDeviceMember *>(mMember.get());
+        return member ? member->getCameraDevice() : nullptr;
+    }
+
+    int initStream(const GroupStreamConfig &config)    {
+        {
+            base::AutoLock lock(mLock);
+            mConfig = config;
+            mFirstColorUs = mFirstDepthUs = 0ll;
+        }
+
+        return mMember->initStream(config,
+                [this](const video::Frame *frame) -> bool { return onFrame(frame, true); },
+                [this](const video::Frame *frame) -> bool { return onFrame(frame, false); });
+    }
+
+    bool onFrame(const video::Frame *frame, bool isColor)    {
+        {
+            base::AutoLock lock(mLock);
+            int64_t nowUs = now_in_microsecond_high_res_time_MONOTONIC();
+            int64_t &firstUs = isColor ? mFirstColorUs : mFirstDepthUs;
+            if(firstUs == 0ll)    {
+                firstUs = nowUs;
+                mCond.signal();
+            }
+            mLastFrameUs = nowUs;
+        }
+
+        const video::Producer::Callback &callback = isColor ? mColorCallback : mDepthCallback;
+        return callback ? callback(frame) : true;
+    }
+
+    // guarded by mLock
+    bool resumedLocked() const    {
+        return (mConfig.colorWidth <= 0 || !mColorCallback || mFirstColorUs != 0ll) &&
+               (mConfig.depthWidth <= 0 || !mDepthCallback || mFirstDepthUs != 0ll);
+    }
+
+    const std::unique_ptr<GroupMember> mMember;
+    const video::Producer::Callback mColorCallback;
+    const video::Producer::Callback mDepthCallback;
+    const Options mOptions;
+    bool mOpened = false;
+
+    base::Lock mLock;
+    base::ConditionVariable mCond;
+    GroupStreamConfig mConfig;                  // guarded by mLock
+    int64_t mLastFrameUs = 0ll;
+    int64_t mFirstColorUs = 0ll;
+    int64_t mFirstDepthUs = 0ll;
+};
+
+}  // namespace devices
+}  // namespace libeYs3D
+
+#ifdef EYS3D_STREAM_RECONFIGURE_IMPLEMENTATION
+
+#include <dlfcn.h>
+#include <unistd.h>
+
+namespace libeYs3D    {
+namespace base    {
+
+// Takes precedence over the one of the prebuilt library, only the open
+// settle of a reconfigure is shortened
+void Thread::sleepMs(unsigned n)    {
+    using SleepMs = void (*)(unsigned);
+    static SleepMs sOriginal = (SleepMs)dlsym(RTLD_NEXT, "_ZN8libeYs3D4base6Thread7sleepMsEj");
+
+    int settleMs = devices::internal::reconfigure_settle_override_ms();
+    if(settleMs >= 0 && n == devices::StreamReconfigurer::kOpenSettleMs)    n = (unsigned)settleMs;
+
+    if(sOriginal)    sOriginal(n);
+    else    usleep((useconds_t)n * 1000u);
+}
+
+}  // namespace base
+}  // namespace libeYs3D
+
+#endif  // EYS3D_STREAM_RECONFIGURE_IMPLEMENTATION
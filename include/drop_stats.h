@@ -0,0 +1,253 @@
+/*
+ * Copyright (C) 2021 eYs3D Corporation
+ * All rights reserved.
+ * This project is licensed under the Apache License, Version 2.0.
+ */
+
+#pragma once
+
+#include "base/Compiler.h"
+#include "base/synchronization/Lock.h"
+#include "utils.h"
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+//
+// Frame drop accounting.
+//
+// Every place where a frame can be discarded reports it with a reason and
+// the serial number of the discarded frame:
+//
+//      DEVICE_SERIAL_GAP  serial numbers missing in what the device delivered
+//      STAGE_OVERFLOW     an internal stage queue was full and dropped its oldest item
+//      SLOW_CONSUMER *    a Pipeline/FrameSetPipeline queue overwrote an unread frame
+//      UNMATCHED_SET *    FrameSetPipeline skipped a frame without a partner
+//      PC_PAIRING *       a color/depth frame could not be paired for point cloud
+//      SUPERSEDED         a newer frame replaced it in a LatestFrameMailbox
+//
+// * Incomplete: only counted where the code recording them is compiled into
+// the app, i.e. queues the app builds from these headers, MultiCameraGroup
+// and the point cloud stages of the samples. The Pipeline/FrameSetPipeline
+// of a CameraDevice and the library's own point cloud pairing are built into
+// the prebuilt library and report 0 for them. isDropReasonComplete() tells
+// which is which.
+//
+// Counters are kept per stream (e.g. the Pipeline queue name) and per reason;
+// the last kEventCount drop events of each stream are kept with their serial
+// numbers. Recording a drop on a cached DropCounters is lock-free, the
+// by-name DropStats::record() takes a lock to find the stream and is meant for
+// drop paths only.
+//
+
+namespace libeYs3D    {
+
+enum class DropReason    {
+    DEVICE_SERIAL_GAP = 0,
+    STAGE_OVERFLOW,
+    SLOW_CONSUMER,
+    UNMATCHED_SET,
+    PC_PAIRING,
+    SUPERSEDED,
+    COUNT
+};
+
+inline const char *getDropReasonName(DropReason reason)    {
+    static const char *kNames[] = { "device_serial_gap", "stage_overflow", "slow_consumer",
+                                    "unmatched_set", "pc_pairing", "superseded" };
+    return kNames[(int)reason];
+}
+
+// false for the reasons the prebuilt library does not report, see above
+inline bool isDropReasonComplete(DropReason reason)    {
+    return reason != DropReason::SLOW_CONSUMER && reason != DropReason::UNMATCHED_SET &&
+           reason != DropReason::PC_PAIRING;
+}
+
+struct DropEvent    {
+    uint32_t serialNumber;
+    DropReason reason;
+    int64_t tsUs;
+};
+
+class DropCounters    {
+    DISALLOW_COPY_ASSIGN_AND_MOVE(DropCounters);
+
+public:
+    static constexpr int kEventCount = 64;
+
+    explicit DropCounters(const char *name) : mName(name)    {}
+
+    void record(DropReason reason, uint32_t serialNumber, uint64_t count = 1)    {
+        mCounts[(int)reason].fetch_add(count, std::memory_order_relaxed);
+
+        uint64_t index = mEventIndex.fetch_add(1, std::memory_order_relaxed);
+        Event &event = mEvents[index % kEventCount];
+        event.serialNumber.store(serialNumber, std::memory_order_relaxed);
+        event.reason.store((int)reason, std::memory_order_relaxed);
+        event.tsUs.store(now_in_microsecond_high_res_time_REALTIME(), std::memory_order_relaxed);
+    }
+
+    uint64_t getCount(DropReason reason) const    {
+        return mCounts[(int)reason].load(std::memory_order_relaxed);
+    }
+
+    uint64_t getTotal() const    {
+        uint64_t total = 0;
+        for(int i = 0; i < (int)DropReason::COUNT; i++)
+            total += mCounts[i].load(std::memory_order_relaxed);
+
+        return total;
+    }
+
+    // Oldest first
+    std::vector<DropEvent> getRecentEvents() const    {
+        std::vector<DropEvent> events;
+        uint64_t end = mEventIndex.load(std::memory_order_relaxed);
+        uint64_t begin = (end > kEventCount) ? end - kEventCount : 0;
+        for(uint64_t i = begin; i < end; i++)    {
+            const Event &event = mEvents[i % kEventCount];
+            events.push_back({ event.serialNumber.load(std::memory_order_relaxed),
+                               (DropReason)event.reason.load(std::memory_order_relaxed),
+                               event.tsUs.load(std::memory_order_relaxed) });
+        }
+
+        return events;
+    }
+
+    const std::string &getName() const    { return mName; }
+
+private:
+    struct Event    {
+        std::atomic<uint32_t> serialNumber{0};
+        std::atomic<int> reason{0};
+        std::atomic<int64_t> tsUs{0};
+    };
+
+    std::string mName;
+    std::atomic<uint64_t> mCounts[(int)DropReason::COUNT] = {};
+    std::atomic<uint64_t> mEventIndex{0};
+    Event mEvents[kEventCount];
+};
+
+class DropStats    {
+    DISALLOW_COPY_ASSIGN_AND_MOVE(DropStats);
+
+public:
+    // Never destroyed, queues may report drops while being torn down
+    static DropStats &get()    {
+        static DropStats *sInstance = new DropStats();
+        return *sInstance;
+    }
+
+    // Find-or-create, the reference stays valid for the process lifetime
+    DropCounters &stream(const char *name)    {
+        base::AutoLock lock(mLock);
+        std::unique_ptr<DropCounters> &counters = mStreams[name];
+        if(!counters)    counters.reset(new DropCounters(name));
+
+        return *counters;
+    }
+
+    void record(const char *streamName, DropReason reason, uint32_t serialNumber)    {
+        stream(streamName).record(reason, serialNumber);
+    }
+
+    void forEach(std::function<void(const DropCounters &)> visitor)    {
+        base::AutoLock lock(mLock);
+        for(auto &entry : mStreams)    visitor(*entry.second);
+    }
+
+    int toString(std::string &string)    {
+        char line[256];
+        forEach([&](const DropCounters &counters)    {
+            for(int r = 0; r < (int)DropReason::COUNT; r++)    {
+                uint64_t count = counters.getCount((DropReason)r);
+                if(count == 0)    continue;
+
+                snprintf(line, sizeof(line), "%s.%s: %" PRIu64 "\n", counters.getName().c_str(),
+                         getDropReasonName((DropReason)r), count);
+                string.append(line);
+            }
+        });
+
+        return (int)string.size();
+    }
+
+private:
+    DropStats() = default;
+
+    base::Lock mLock;
+    std::map<std::string, std::unique_ptr<DropCounters>> mStreams; // guarded by mLock
+};
+
+// Counts the serial numbers skipped between consecutive deliveries of one
+// stream. A jump larger than IS_SN_ROTATE's window is taken as a counter
+// wrap/reset and not counted. Not thread safe, feed it from one thread.
+class SerialGapTracker    {
+public:
+    // Returns how many serial numbers were skipped right before |serialNumber|
+    uint32_t advance(uint32_t serialNumber)    {
+        uint32_t missing = 0;
+        if(mHasLast && serialNumber > mLastSerial + 1 &&
+           serialNumber - mLastSerial <= kMaxGap)    {
+            missing = serialNumber - mLastSerial - 1;
+        }
+        mLastSerial = serialNumber;
+        mHasLast = true;
+
+        return missing;
+    }
+
+    uint32_t getLastSerial() const    { return mLastSerial; }
+
+private:
+    static constexpr uint32_t kMaxGap = 0X00FF00;
+
+    uint32_t mLastSerial = 0;
+    bool mHasLast = false;
+};
+
+// Reports DEVICE_SERIAL_GAP for the gaps found by SerialGapTracker
+class SerialGapDetector    {
+public:
+    explicit SerialGapDetector(DropCounters &counters) : mCounters(counters)    {}
+
+    void onSerial(uint32_t serialNumber)    {
+        uint32_t lastSerial = mTracker.getLastSerial();
+        uint32_t missing = mTracker.advance(serialNumber);
+        if(missing)    mCounters.record(DropReason::DEVICE_SERIAL_GAP, lastSerial + 1, missing);
+    }
+
+private:
+    DropCounters &mCounters;
+    SerialGapTracker mTracker;
+};
+
+// Serial number of a queued item, if it has one
+template <class T>
+inline auto drop_serial_of(const T &item, int) -> decltype((uint32_t)item.serialNumber)    {
+    return item.serialNumber;
+}
+
+template <class T>
+inline auto drop_serial_of(const T &item, int) -> decltype((uint32_t)item->serialNumber)    {
+    return item ? item->serialNumber : 0;
+}
+
+template <class T>
+inline uint32_t drop_serial_of(const T &, long)    { return 0; }
+
+template <class T>
+inline uint32_t drop_serial_of(const T &item)    { return drop_serial_of(item, 0); }
+
+}  // namespace libeYs3D
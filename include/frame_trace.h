@@ -0,0 +1,393 @@
+/*
+ * Copyright (C) 2021 eYs3D Corporation
+ * All rights reserved.
+ * This project is licensed under the Apache License, Version 2.0.
+ */
+
+#pragma once
+
+#include "video/Producer.h"
+#include "video/PCProducer.h"
+#include "base/Compiler.h"
+#include "base/synchronization/Lock.h"
+#include "base/threads/Thread.h"
+#include "utils.h"
+#include "debug.h"
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+//
+// Per-frame tracing exported as Chrome trace / Perfetto JSON.
+//
+// Spans are recorded into a fixed ring owned by the recording thread (the
+// oldest spans are overwritten), so recording never locks or allocates once a
+// thread has logged its first span. The ring of an exited thread keeps its
+// spans for export; once Tracer::kMaxBuffers rings exist, a new thread takes
+// over the one retired first, so memory is bounded by the number of threads
+// tracing at the same time, not by the thread churn. A span may carry the serialNumber of the
+// frame it handles; at export time all spans of the same category and serial
+// number are linked by a flow, so the path of one frame across the reader,
+// callback and pipeline threads shows up as connected arrows.
+//
+//      libeYs3D::trace::enableTracing(true);
+//      ...
+//      {
+//          libeYs3D::trace::TraceScope scope("pipeline_wait", "color");
+//          ret = pipeline->waitForColorFrame(&frame);
+//          scope.setSerial(frame.serialNumber);
+//      }
+//      ...
+//      libeYs3D::trace::Tracer::get().dumpJson("/tmp/eys3d_trace.json");
+//
+// Load the file in chrome://tracing or https://ui.perfetto.dev. Setting
+// EYS3D_TRACE_FILE=<path> and calling enableTracingFromEnv() enables tracing
+// and dumps the file at exit.
+//
+// When tracing is disabled a span costs one relaxed load and one branch.
+// Timestamps use the REALTIME clock, like Frame::tsUs.
+//
+
+namespace libeYs3D    {
+namespace trace    {
+
+// Constant-initialized so the check needs no guard
+template <class T = void>
+struct TraceEnabled    {
+    static std::atomic<bool> value;
+};
+
+template <class T>
+std::atomic<bool> TraceEnabled<T>::value{false};
+
+inline bool isTracingEnabled()    {
+    return TraceEnabled<>::value.load(std::memory_order_relaxed);
+}
+
+inline void enableTracing(bool enable)    {
+    TraceEnabled<>::value.store(enable, std::memory_order_relaxed);
+}
+
+static constexpr int64_t kNoSerial = -1ll;
+
+struct TraceEvent    {
+    const char *name;       // string literal
+    const char *category;   // string literal, e.g. "color", "depth", "pc"
+    int64_t beginUs;
+    int64_t endUs;
+    int64_t serial;         // kNoSerial if the span is not bound to a frame
+};
+
+struct TraceBuffer    {
+    static constexpr size_t kCapacity = 16 * 1024;
+
+    unsigned long tid;
+    uint64_t retiredAt = 0;     // its thread exited if non 0, guarded by the lock of the Tracer
+    std::atomic<uint64_t> count{0};
+    TraceEvent events[kCapacity];
+
+    void append(const TraceEvent &event)    {
+        uint64_t index = count.load(std::memory_order_relaxed);
+        events[index & (kCapacity - 1)] = event;
+        count.store(index + 1, std::memory_order_release);
+    }
+};
+
+class Tracer    {
+    DISALLOW_COPY_ASSIGN_AND_MOVE(Tracer);
+
+public:
+    static constexpr size_t kMaxBuffers = 16;  // before those of exited threads are reused
+
+    // Never destroyed, so spans recorded during static destruction stay valid
+    static Tracer &get()    {
+        static Tracer *sInstance = new Tracer();
+        return *sInstance;
+    }
+
+    void record(const char *name, const char *category,
+                int64_t beginUs, int64_t endUs, int64_t serial = kNoSerial)    {
+        threadBuffer()->append({ name, category, beginUs, endUs, serial });
+    }
+
+    // Names the calling thread in the exported trace, |name| is copied
+    void setThreadName(const char *name)    {
+        unsigned long tid = threadBuffer()->tid;
+        base::AutoLock lock(mLock);
+        mThreadNames[tid] = name;
+    }
+
+    void clear()    {
+        base::AutoLock lock(mLock);
+        for(TraceBuffer *buffer : mBuffers)    buffer->count.store(0, std::memory_order_relaxed);
+    }
+
+    // Spans being recorded while exporting may be missing or torn, disable
+    // tracing first for an exact snapshot
+    int toJson(std::string &json)    {
+        struct Span    {
+            TraceEvent event;
+            unsigned long tid;
+        };
+        std::vector<Span> spans;
+        std::map<unsigned long, std::string> threadNames;
+        {
+            base::AutoLock lock(mLock);
+            for(TraceBuffer *buffer : mBuffers)    {
+                uint64_t count = buffer->count.load(std::memory_order_acquire);
+                uint64_t first = (count > TraceBuffer::kCapacity) ? count - TraceBuffer::kCapacity : 0;
+                for(uint64_t i = first; i < count; i++)    {
+                    spans.push_back({ buffer->events[i & (TraceBuffer::kCapacity - 1)], buffer->tid });
+                }
+            }
+            threadNames = mThreadNames;
+        }
+
+        std::sort(spans.begin(), spans.end(), [](const Span &a, const Span &b) {
+            return a.event.beginUs < b.event.beginUs;
+        });
+
+        char line[512];
+        json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+        bool first = true;
+        auto append = [&](int length)    {
+            if(length <= 0)    return;
+            if(!first)    json += ",\n";
+            json.append(line, MIN((size_t)length, sizeof(line) - 1));
+            first = false;
+        };
+
+        for(const auto &entry : threadNames)    {
+            if(!first)    json += ",\n";
+            snprintf(line, sizeof(line), "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%lu,"
+                                         "\"args\":{\"name\":\"", entry.first);
+            json += line;
+            appendJsonEscaped(json, entry.second);
+            json += "\"}}";
+            first = false;
+        }
+
+        // (category, serial) -> number of spans, to tell the last flow step
+        std::map<std::pair<std::string, int64_t>, int> flowTotal, flowSeen;
+        for(const Span &span : spans)    {
+            if(span.event.serial != kNoSerial)
+                flowTotal[std::make_pair(std::string(span.event.category), span.event.serial)] += 1;
+        }
+
+        for(const Span &span : spans)    {
+            const TraceEvent &e = span.event;
+            if(e.serial == kNoSerial)    {
+                append(snprintf(line, sizeof(line),
+                                "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%lu,"
+                                "\"ts\":%" PRId64 ",\"dur\":%" PRId64 "}",
+                                e.name, e.category, span.tid, e.beginUs, e.endUs - e.beginUs));
+                continue;
+            }
+
+            append(snprintf(line, sizeof(line),
+                            "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%lu,"
+                            "\"ts\":%" PRId64 ",\"dur\":%" PRId64 ",\"args\":{\"serial\":%" PRId64 "}}",
+                            e.name, e.category, span.tid, e.beginUs, e.endUs - e.beginUs, e.serial));
+
+            auto key = std::make_pair(std::string(e.category), e.serial);
+            int total = flowTotal[key];
+            if(total < 2)    continue;
+
+            int seen = ++flowSeen[key];
+            const char *phase = (seen == 1) ? "s" : (seen == total) ? "f" : "t";
+            append(snprintf(line, sizeof(line),
+                            "{\"name\":\"frame\",\"cat\":\"%s\",\"ph\":\"%s\",\"bp\":\"e\",\"pid\":1,"
+                            "\"tid\":%lu,\"ts\":%" PRId64 ",\"id\":\"%s:%" PRId64 "\"}",
+                            e.category, phase, span.tid, e.beginUs, e.category, e.serial));
+        }
+        json += "\n]}\n";
+
+        return (int)spans.size();
+    }
+
+    // Returns the number of exported spans or a negative value on failure
+    int dumpJson(const char *path)    {
+        std::string json;
+        int count = toJson(json);
+
+        FILE *file = fopen(path, "w");
+        if(file == nullptr)    {
+            LOG_ERR_ERRNO("Tracer", "Unable to open %s", path);
+            return -1;
+        }
+        size_t written = fwrite(json.data(), 1, json.size(), file);
+        fclose(file);
+        if(written != json.size())    {
+            LOG_ERR("Tracer", "Short write to %s", path);
+            return -1;
+        }
+        LOG_INFO("Tracer", "%d spans written to %s", count, path);
+
+        return count;
+    }
+
+private:
+    // Hands the buffer of a thread back to the Tracer when the thread exits
+    struct ThreadBuffer    {
+        TraceBuffer *buffer = nullptr;
+
+        ~ThreadBuffer()    {
+            if(buffer)    Tracer::get().retire(buffer);
+        }
+    };
+
+    Tracer() = default;
+
+    static void appendJsonEscaped(std::string &json, const std::string &value)    {
+        for(char c : value)    {
+            if(c == '"' || c == '\\')    {
+                json += '\\';
+                json += c;
+            } else if((unsigned char)c < 0x20)    {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned)(unsigned char)c);
+                json += escaped;
+            } else    {
+                json += c;
+            }
+        }
+    }
+
+    TraceBuffer *threadBuffer()    {
+        static thread_local ThreadBuffer sThreadBuffer;
+        if(sThreadBuffer.buffer == nullptr)    sThreadBuffer.buffer = acquireBuffer();
+
+        return sThreadBuffer.buffer;
+    }
+
+    // Past kMaxBuffers, takes over the buffer of the thread which exited
+    // first, dropping its spans
+    TraceBuffer *acquireBuffer()    {
+        const unsigned long tid = base::getCurrentThreadId();
+        base::AutoLock lock(mLock);
+        TraceBuffer *oldest = nullptr;
+        if(mBuffers.size() >= kMaxBuffers)    {
+            for(TraceBuffer *buffer : mBuffers)    {
+                if(buffer->retiredAt && (!oldest || buffer->retiredAt < oldest->retiredAt))    oldest = buffer;
+            }
+        }
+        if(oldest)    {
+            // thread ids are reused, another buffer may still stand for the name
+            const unsigned long oldTid = oldest->tid;
+            oldest->tid = tid;
+            if(std::none_of(mBuffers.begin(), mBuffers.end(),
+                            [oldTid](const TraceBuffer *buffer) { return buffer->tid == oldTid; }))
+                mThreadNames.erase(oldTid);
+            oldest->retiredAt = 0;
+            oldest->count.store(0, std::memory_order_relaxed);
+            return oldest;
+        }
+
+        TraceBuffer *buffer = new TraceBuffer();
+        buffer->tid = tid;
+        mBuffers.push_back(buffer);
+        return buffer;
+    }
+
+    void retire(TraceBuffer *buffer)    {
+        base::AutoLock lock(mLock);
+        buffer->retiredAt = ++mRetiredCount;
+    }
+
+    base::Lock mLock;
+    std::vector<TraceBuffer *> mBuffers;                // guarded by mLock
+    uint64_t mRetiredCount = 0;                         // guarded by mLock
+    std::map<unsigned long, std::string> mThreadNames;  // guarded by mLock
+};
+
+// Records the lifetime of the scope as one span
+class TraceScope    {
+    DISALLOW_COPY_ASSIGN_AND_MOVE(TraceScope);
+
+public:
+    TraceScope(const char *name, const char *category, int64_t serial = kNoSerial)
+        : mName(name), mCategory(category), mSerial(serial)    {
+        if(isTracingEnabled())    mBeginUs = now_in_microsecond_high_res_time_REALTIME();
+    }
+
+    ~TraceScope()    {
+        if(mBeginUs)    {
+            Tracer::get().record(mName, mCategory, mBeginUs,
+                                 now_in_microsecond_high_res_time_REALTIME(), mSerial);
+        }
+    }
+
+    // For spans whose frame is only known at the end, e.g. a pipeline wait
+    void setSerial(int64_t serial)    { mSerial = serial; }
+
+private:
+    const char *mName;
+    const char *mCategory;
+    int64_t mSerial;
+    int64_t mBeginUs = 0ll;
+};
+
+// Span from the frame timestamp (taken by the reader thread of the prebuilt
+// producers) to now, i.e. read, transcoding, filtering and queueing
+inline void traceFrameInFlight(const char *category, const libeYs3D::video::Frame *frame)    {
+    if(isTracingEnabled())    {
+        Tracer::get().record("in_flight", category, frame->tsUs,
+                             now_in_microsecond_high_res_time_REALTIME(), frame->serialNumber);
+    }
+}
+
+inline void traceFrameInFlight(const char *category, const libeYs3D::video::PCFrame *pcFrame)    {
+    if(isTracingEnabled())    {
+        Tracer::get().record("in_flight", category, pcFrame->tsUs,
+                             now_in_microsecond_high_res_time_REALTIME(), pcFrame->serialNumber);
+    }
+}
+
+// Decorates an app callback with "in_flight" and "callback" spans
+inline libeYs3D::video::Producer::Callback
+wrap(const char *category, libeYs3D::video::Producer::Callback callback)    {
+    if(!callback)    return callback;
+
+    return [category, callback](const libeYs3D::video::Frame *frame) -> bool {
+        traceFrameInFlight(category, frame);
+        TraceScope scope("callback", category, frame->serialNumber);
+        return callback(frame);
+    };
+}
+
+inline libeYs3D::video::PCProducer::PCCallback
+wrap(const char *category, libeYs3D::video::PCProducer::PCCallback callback)    {
+    if(!callback)    return callback;
+
+    return [category, callback](const libeYs3D::video::PCFrame *pcFrame) -> bool {
+        traceFrameInFlight(category, pcFrame);
+        TraceScope scope("callback", category, pcFrame->serialNumber);
+        return callback(pcFrame);
+    };
+}
+
+// Enables tracing and dumps at exit if EYS3D_TRACE_FILE is set
+inline void enableTracingFromEnv()    {
+    static std::string sPath;
+    const char *path = getenv("EYS3D_TRACE_FILE");
+    if(path == nullptr || path[0] == '\0' || !sPath.empty())    return;
+
+    sPath = path;
+    enableTracing(true);
+    atexit([]() {
+        enableTracing(false);
+        Tracer::get().dumpJson(sPath.c_str());
+    });
+}
+
+}  // namespace trace
+}  // namespace libeYs3D
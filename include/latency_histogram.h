@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2021 eYs3D Corporation
+ * All rights reserved.
+ * This project is licensed under the Apache License, Version 2.0.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+
+namespace libeYs3D    {
+
+// Fixed-memory log-linear latency histogram (HDR histogram style).
+//
+// Values 0 ~ 31 us have exact buckets. Above that every power of two is split
+// into 32 linear sub-buckets, so any recorded value is reported with less than
+// 1/32 (~3%) relative error. Values above kMaxValueUs are clamped.
+//
+// record() is lock-free (relaxed atomics only) and may be called concurrently
+// from any number of producer threads; queries may run at the same time and
+// observe a slightly stale but consistent-enough view.
+class LatencyHistogram    {
+public:
+    static constexpr int kSubBucketBits = 5;
+    static constexpr int kSubBucketCount = 1 << kSubBucketBits;
+    static constexpr int kMaxExponent = 31; // 2^31 us, ~35 minutes
+    static constexpr int64_t kMaxValueUs = (1ll << (kMaxExponent + 1)) - 1;
+    static constexpr int kBucketCount = (kMaxExponent - kSubBucketBits + 2) * kSubBucketCount;
+
+    LatencyHistogram()    { reset(); }
+
+    void record(int64_t valueUs)    {
+        if(valueUs < 0)    valueUs = 0;
+        if(valueUs > kMaxValueUs)    valueUs = kMaxValueUs;
+
+        mCounts[bucketIndex(valueUs)].fetch_add(1, std::memory_order_relaxed);
+        mTotalCount.fetch_add(1, std::memory_order_relaxed);
+        mSumUs.fetch_add(valueUs, std::memory_order_relaxed);
+
+        updateMin(valueUs);
+        updateMax(valueUs);
+    }
+
+    void reset()    {
+        for(int i = 0; i < kBucketCount; i++)    mCounts[i].store(0, std::memory_order_relaxed);
+        mTotalCount.store(0, std::memory_order_relaxed);
+        mSumUs.store(0, std::memory_order_relaxed);
+        mMinUs.store(INT64_MAX, std::memory_order_relaxed);
+        mMaxUs.store(0, std::memory_order_relaxed);
+    }
+
+    // Adds every sample of |other| into this histogram
+    void merge(const LatencyHistogram &other)    {
+        for(int i = 0; i < kBucketCount; i++)    {
+            uint64_t count = other.mCounts[i].load(std::memory_order_relaxed);
+            if(count)    mCounts[i].fetch_add(count, std::memory_order_relaxed);
+        }
+        mTotalCount.fetch_add(other.getCount(), std::memory_order_relaxed);
+        mSumUs.fetch_add(other.mSumUs.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        if(other.getCount())    {
+            updateMin(other.getMinUs());
+            updateMax(other.getMaxUs());
+        }
+    }
+
+    uint64_t getCount() const    { return mTotalCount.load(std::memory_order_relaxed); }
+
+    int64_t getMinUs() const    {
+        return getCount() ? mMinUs.load(std::memory_order_relaxed) : 0ll;
+    }
+
+    int64_t getMaxUs() const    { return mMaxUs.load(std::memory_order_relaxed); }
+
+    int64_t getMeanUs() const    {
+        uint64_t count = getCount();
+        return count ? (int64_t)(mSumUs.load(std::memory_order_relaxed) / count) : 0ll;
+    }
+
+    // |percentile| in 0.0 ~ 100.0, e.g. 99.9 for p999. Returns the highest
+    // value equivalent to the bucket holding that rank, 0 if empty.
+    int64_t getPercentileUs(double percentile) const    {
+        uint64_t total = getCount();
+        if(total == 0)    return 0ll;
+
+        if(percentile < 0.0)    percentile = 0.0;
+        if(percentile > 100.0)    percentile = 100.0;
+
+        uint64_t rank = (uint64_t)(percentile / 100.0 * total + 0.5);
+        if(rank == 0)    rank = 1;
+
+        uint64_t seen = 0;
+        for(int i = 0; i < kBucketCount; i++)    {
+            seen += mCounts[i].load(std::memory_order_relaxed);
+            if(seen >= rank)    {
+                int64_t value = bucketUpperBound(i);
+                int64_t max = getMaxUs();
+                return value < max ? value : max;
+            }
+        }
+
+        return getMaxUs();
+    }
+
+    static int bucketIndex(int64_t valueUs)    {
+        if(valueUs < kSubBucketCount)    return (int)valueUs;
+
+        int exponent = 63 - __builtin_clzll((uint64_t)valueUs);
+        int group = exponent - kSubBucketBits + 1;
+        int sub = (int)(valueUs >> (exponent - kSubBucketBits)) - kSubBucketCount;
+
+        return group * kSubBucketCount + sub;
+    }
+
+    static int64_t bucketUpperBound(int index)    {
+        if(index < kSubBucketCount)    return index;
+
+        int group = index / kSubBucketCount;
+        int64_t sub = index % kSubBucketCount;
+        int64_t lower = (kSubBucketCount + sub) << (group - 1);
+
+        return lower + (1ll << (group - 1)) - 1;
+    }
+
+private:
+    void updateMin(int64_t valueUs)    {
+        int64_t current = mMinUs.load(std::memory_order_relaxed);
+        while(valueUs < current &&
+              !mMinUs.compare_exchange_weak(current, valueUs, std::memory_order_relaxed))    {}
+    }
+
+    void updateMax(int64_t valueUs)    {
+        int64_t current = mMaxUs.load(std::memory_order_relaxed);
+        while(valueUs > current &&
+              !mMaxUs.compare_exchange_weak(current, valueUs, std::memory_order_relaxed))    {}
+    }
+
+    std::atomic<uint64_t> mCounts[kBucketCount];
+    std::atomic<uint64_t> mTotalCount;
+    std::atomic<int64_t> mSumUs;
+    std::atomic<int64_t> mMinUs;
+    std::atomic<int64_t> mMaxUs;
+};
+
+}  // namespace libeYs3D
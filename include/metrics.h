@@ -0,0 +1,458 @@
+/*
+ * Copyright (C) 2021 eYs3D Corporation
+ * All rights reserved.
+ * This project is licensed under the Apache License, Version 2.0.
+ */
+
+#pragma once
+
+#include "devices/LatencyStats.h"
+#include "drop_stats.h"
+#include "base/Compiler.h"
+#include "base/synchronization/Lock.h"
+#include "base/threads/FunctorThread.h"
+#include "utils.h"
+#include "debug.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+//
+// In-process metrics registry with a Prometheus text exporter.
+//
+// Metrics are created once (under a lock) and then updated through the
+// returned references with relaxed atomics only:
+//
+//      auto &metrics = libeYs3D::metrics::MetricsRegistry::get();
+//      auto &color = metrics.stream("8062-0", libeYs3D::devices::LatencyStream::COLOR);
+//      ...
+//      color.onFrame(frame->serialNumber, frame->actualDataBufferSize); // in the callback
+//
+//      libeYs3D::metrics::MetricsServer server(&metrics, "/tmp/eys3d_metrics.sock");
+//      server.start();
+//
+// and scraped with e.g.
+//
+//      curl --unix-socket /tmp/eys3d_metrics.sock http://localhost/metrics
+//
+// snapshot() returns the same samples as name/labels/value triples for
+// in-process consumers. Only counters and gauges are exported, a scrape never
+// changes the registry: derive rates on the consumer side, e.g.
+// rate(eys3d_stream_frames_total[10s]), so several scrapers do not disturb
+// each other.
+//
+
+namespace libeYs3D    {
+namespace metrics    {
+
+class Counter    {
+public:
+    void add(uint64_t n = 1)    { mValue.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t get() const    { return mValue.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> mValue{0};
+};
+
+class Gauge    {
+public:
+    void set(int64_t value)    { mValue.store(value, std::memory_order_relaxed); }
+    void add(int64_t delta)    { mValue.fetch_add(delta, std::memory_order_relaxed); }
+    int64_t get() const    { return mValue.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<int64_t> mValue{0};
+};
+
+// Throughput and continuity of one stream of one device
+class StreamMetrics    {
+public:
+    StreamMetrics(Counter &frames, Counter &bytes, Counter &serialGaps,
+                  Counter &lostFrames, Gauge &queueDepth)
+        : mFrames(frames), mBytes(bytes), mSerialGaps(serialGaps),
+          mLostFrames(lostFrames), mQueueDepth(queueDepth)    {}
+
+    // Call once per delivered frame/sample, from a single thread per stream
+    void onFrame(uint32_t serialNumber, uint64_t bytes)    {
+        mFrames.add(1);
+        mBytes.add(bytes);
+
+        uint32_t missing = mSerials.advance(serialNumber);
+        if(missing)    {
+            mSerialGaps.add(1);
+            mLostFrames.add(missing);
+        }
+    }
+
+    void setQueueDepth(int64_t depth)    { mQueueDepth.set(depth); }
+
+    Counter &frames()    { return mFrames; }
+    Counter &bytes()    { return mBytes; }
+
+private:
+    Counter &mFrames;
+    Counter &mBytes;
+    Counter &mSerialGaps;
+    Counter &mLostFrames;
+    Gauge &mQueueDepth;
+    SerialGapTracker mSerials;
+};
+
+struct MetricSample    {
+    std::string name;
+    std::string labels;     // e.g. device="8062-0",stream="color"
+    double value;
+};
+
+class MetricsRegistry    {
+    DISALLOW_COPY_ASSIGN_AND_MOVE(MetricsRegistry);
+
+public:
+    MetricsRegistry() = default;
+
+    static MetricsRegistry &get()    {
+        static MetricsRegistry *sInstance = new MetricsRegistry();
+        return *sInstance;
+    }
+
+    // Find-or-create; cache the reference, it stays valid for the registry lifetime.
+    // |labels| is a Prometheus label list without braces, e.g. reason="queue_full"
+    Counter &counter(const char *name, const char *labels = "", const char *help = nullptr)    {
+        base::AutoLock lock(mLock);
+        Family &family = findFamily(name, "counter", help);
+        std::unique_ptr<Counter> &counter = family.counters[labels];
+        if(!counter)    counter.reset(new Counter());
+
+        return *counter;
+    }
+
+    Gauge &gauge(const char *name, const char *labels = "", const char *help = nullptr)    {
+        base::AutoLock lock(mLock);
+        Family &family = findFamily(name, "gauge", help);
+        std::unique_ptr<Gauge> &gauge = family.gauges[labels];
+        if(!gauge)    gauge.reset(new Gauge());
+
+        return *gauge;
+    }
+
+    StreamMetrics &stream(const char *device, libeYs3D::devices::LatencyStream stream)    {
+        std::string labels = streamLabels(device, stream);
+        {
+            base::AutoLock lock(mLock);
+            auto it = mStreams.find(labels);
+            if(it != mStreams.end())    return *it->second;
+        }
+
+        const char *l = labels.c_str();
+        StreamMetrics *metrics = new StreamMetrics(
+            counter("eys3d_stream_frames_total", l, "Frames or samples delivered"),
+            counter("eys3d_stream_bytes_total", l, "Payload bytes delivered"),
+            counter("eys3d_stream_serial_gaps_total", l, "Discontinuities in serial numbers"),
+            counter("eys3d_stream_lost_frames_total", l, "Serial numbers skipped"),
+            gauge("eys3d_stream_queue_depth", l, "Frames waiting to be consumed"));
+
+        base::AutoLock lock(mLock);
+        std::unique_ptr<StreamMetrics> &entry = mStreams[labels];
+        if(!entry)    entry.reset(metrics);
+        else    delete metrics;
+
+        return *entry;
+    }
+
+    // Exports p50/p99/p999 of every non-empty stage of |stats|, e.g.
+    // CameraDevice::shareLatencyStats(). The registry keeps |stats| alive
+    // until detachLatencyStats(), also past CameraDevice::releaseLatencyStats().
+    void attachLatencyStats(const char *device,
+                            std::shared_ptr<const libeYs3D::devices::LatencyStats> stats)    {
+        base::AutoLock lock(mLock);
+        mLatencyStats[device] = stats;
+    }
+
+    void detachLatencyStats(const char *device)    {
+        base::AutoLock lock(mLock);
+        mLatencyStats.erase(device);
+    }
+
+    std::vector<MetricSample> snapshot()    {
+        std::vector<MetricSample> samples;
+        base::AutoLock lock(mLock);
+        collect(&samples, nullptr);
+
+        return samples;
+    }
+
+    int toPrometheus(std::string &text)    {
+        base::AutoLock lock(mLock);
+        collect(nullptr, &text);
+
+        return (int)text.size();
+    }
+
+private:
+    struct Family    {
+        std::string type;
+        std::string help;
+        std::map<std::string, std::unique_ptr<Counter>> counters;
+        std::map<std::string, std::unique_ptr<Gauge>> gauges;
+    };
+
+    static std::string streamLabels(const char *device, libeYs3D::devices::LatencyStream stream)    {
+        char labels[256];
+        snprintf(labels, sizeof(labels), "device=\"%s\",stream=\"%s\"",
+                 device, libeYs3D::devices::LatencyStats::getStreamName(stream));
+
+        return labels;
+    }
+
+    Family &findFamily(const char *name, const char *type, const char *help)    {
+        Family &family = mFamilies[name];
+        if(family.type.empty())    family.type = type;
+        if(help != nullptr && family.help.empty())    family.help = help;
+
+        return family;
+    }
+
+    // Exactly one of |samples| and |text| is set, mLock is held
+    void collect(std::vector<MetricSample> *samples, std::string *text)    {
+        char line[512];
+        auto emit = [&](const char *name, const std::string &labels, double value)    {
+            if(samples)    {
+                samples->push_back({ name, labels, value });
+                return;
+            }
+            if(labels.empty())    snprintf(line, sizeof(line), "%s %.17g\n", name, value);
+            else    snprintf(line, sizeof(line), "%s{%s} %.17g\n", name, labels.c_str(), value);
+            text->append(line);
+        };
+        auto header = [&](const char *name, const char *type, const char *help)    {
+            if(text == nullptr)    return;
+            if(help && help[0])    {
+                snprintf(line, sizeof(line), "# HELP %s %s\n", name, help);
+                text->append(line);
+            }
+            snprintf(line, sizeof(line), "# TYPE %s %s\n", name, type);
+            text->append(line);
+        };
+
+        for(auto &f : mFamilies)    {
+            header(f.first.c_str(), f.second.type.c_str(), f.second.help.c_str());
+            for(auto &c : f.second.counters)    emit(f.first.c_str(), c.first, (double)c.second->get());
+            for(auto &g : f.second.gauges)    emit(f.first.c_str(), g.first, (double)g.second->get());
+        }
+
+        header("eys3d_frame_drops_total", "counter",
+               "Dropped frames by pipeline stream and reason, complete=\"false\" reasons "
+               "are not counted by the queues of the prebuilt library");
+        DropStats::get().forEach([&](const DropCounters &counters)    {
+            char labels[256];
+            for(int r = 0; r < (int)DropReason::COUNT; r++)    {
+                snprintf(labels, sizeof(labels), "stream=\"%s\",reason=\"%s\",complete=\"%s\"",
+                         counters.getName().c_str(), getDropReasonName((DropReason)r),
+                         isDropReasonComplete((DropReason)r) ? "true" : "false");
+                emit("eys3d_frame_drops_total", labels, (double)counters.getCount((DropReason)r));
+            }
+        });
+
+        if(mLatencyStats.empty())    return;
+
+        using libeYs3D::devices::LatencyStats;
+        using libeYs3D::devices::LatencyStream;
+        using libeYs3D::devices::LatencyStage;
+        static const double kQuantiles[] = { 0.5, 0.99, 0.999 };
+        header("eys3d_stage_latency_us", "summary", "Per-stage latency in microseconds");
+        for(auto &d : mLatencyStats)    {
+            for(int s = 0; s < (int)LatencyStream::COUNT; s++)    {
+                for(int t = 0; t < (int)LatencyStage::COUNT; t++)    {
+                    const char *streamName = LatencyStats::getStreamName((LatencyStream)s);
+                    const char *stageName = LatencyStats::getStageName((LatencyStage)t);
+                    const LatencyHistogram &h =
+                        d.second->histogram((LatencyStream)s, (LatencyStage)t);
+                    if(h.getCount() == 0)    continue;
+
+                    char labels[256];
+                    for(double q : kQuantiles)    {
+                        snprintf(labels, sizeof(labels),
+                                 "device=\"%s\",stream=\"%s\",stage=\"%s\",quantile=\"%g\"",
+                                 d.first.c_str(), streamName, stageName, q);
+                        emit("eys3d_stage_latency_us", labels,
+                             (double)h.getPercentileUs(q * 100.0));
+                    }
+                    snprintf(labels, sizeof(labels), "device=\"%s\",stream=\"%s\",stage=\"%s\"",
+                             d.first.c_str(), streamName, stageName);
+                    emit("eys3d_stage_latency_us_count", labels, (double)h.getCount());
+                    emit("eys3d_stage_latency_us_sum", labels,
+                         (double)h.getMeanUs() * (double)h.getCount());
+                }
+            }
+        }
+    }
+
+    base::Lock mLock;
+    std::map<std::string, Family> mFamilies;                                    // guarded by mLock
+    std::map<std::string, std::unique_ptr<StreamMetrics>> mStreams;             // guarded by mLock
+    std::map<std::string, std::shared_ptr<const libeYs3D::devices::LatencyStats>>
+        mLatencyStats;                                                          // guarded by mLock
+};
+
+// Serves MetricsRegistry::toPrometheus() on a unix-domain stream socket.
+// Each connection gets one HTTP/1.0 response and is closed, so both
+// "curl --unix-socket" and a plain "nc -U" work. Accepted sockets are
+// non-blocking and a response must be sent within kServeTimeoutMs: a client
+// that never reads is dropped instead of stalling the loop or stop().
+class MetricsServer    {
+    DISALLOW_COPY_ASSIGN_AND_MOVE(MetricsServer);
+
+public:
+    static constexpr int kServeTimeoutMs = 1000;
+
+    MetricsServer(MetricsRegistry *registry, const char *socketPath)
+        : mRegistry(registry), mSocketPath(socketPath),
+          mThread([this]() { loop(); })    {}
+
+    ~MetricsServer()    { stop(); }
+
+    int start()    {
+        struct sockaddr_un address;
+        if(mSocketPath.size() >= sizeof(address.sun_path))    return -ENAMETOOLONG;
+
+        mListenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        mWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(mListenFd < 0 || mWakeFd < 0)    {
+            int err = errno;
+            LOG_ERR_ERRNO("MetricsServer", "Unable to create socket/eventfd");
+            closeFds();
+            return -err;
+        }
+
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, mSocketPath.c_str(), sizeof(address.sun_path) - 1);
+        unlink(mSocketPath.c_str());
+        if(bind(mListenFd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+           listen(mListenFd, 8) < 0)    {
+            int err = errno;
+            LOG_ERR_ERRNO("MetricsServer", "Unable to listen on %s", mSocketPath.c_str());
+            closeFds();
+            return -err;
+        }
+
+        if(!mThread.start())    {
+            closeFds();
+            return -EAGAIN;
+        }
+        mStarted = true;
+        LOG_INFO("MetricsServer", "Serving metrics on %s", mSocketPath.c_str());
+
+        return 0;
+    }
+
+    void stop()    {
+        if(!mStarted)    return;
+
+        uint64_t one = 1;
+        write_fully(mWakeFd, &one, sizeof(one), "MetricsServer");
+        mThread.wait();
+        mStarted = false;
+        closeFds();
+        unlink(mSocketPath.c_str());
+    }
+
+private:
+    void loop()    {
+        while(true)    {
+            struct pollfd fds[2] = { { mListenFd, POLLIN, 0 }, { mWakeFd, POLLIN, 0 } };
+            if(poll(fds, 2, -1) < 0)    {
+                if(errno == EINTR)    continue;
+                LOG_ERR_ERRNO("MetricsServer", "poll failed");
+                return;
+            }
+            if(fds[1].revents)    return;
+            if(!(fds[0].revents & POLLIN))    continue;
+
+            int fd = accept4(mListenFd, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+            if(fd < 0)    continue;
+            serve(fd);
+            ::close(fd);
+        }
+    }
+
+    void serve(int fd)    {
+        const int64_t deadlineUs = now_in_microsecond_high_res_time_MONOTONIC() +
+                                   kServeTimeoutMs * 1000ll;
+
+        // drain the request if one arrives quickly, its content does not matter
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if(poll(&pfd, 1, 100) > 0)    {
+            char request[1024];
+            (void)::recv(fd, request, sizeof(request), MSG_DONTWAIT);
+        }
+
+        std::string body;
+        mRegistry->toPrometheus(body);
+
+        char header[160];
+        int length = snprintf(header, sizeof(header),
+                              "HTTP/1.0 200 OK\r\n"
+                              "Content-Type: text/plain; version=0.0.4\r\n"
+                              "Content-Length: %zu\r\n\r\n", body.size());
+        if(sendAll(fd, header, length, deadlineUs))    sendAll(fd, body.data(), body.size(), deadlineUs);
+    }
+
+    // send() never raises SIGPIPE here; gives up at |deadlineUs| or on stop()
+    bool sendAll(int fd, const char *data, size_t size, int64_t deadlineUs)    {
+        while(size > 0)    {
+            ssize_t sent = ::send(fd, data, size, MSG_NOSIGNAL);
+            if(sent > 0)    {
+                data += sent;
+                size -= (size_t)sent;
+                continue;
+            }
+            if(sent < 0 && errno == EINTR)    continue;
+            if(sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK)    return false;
+
+            int64_t remainingUs = deadlineUs - now_in_microsecond_high_res_time_MONOTONIC();
+            if(remainingUs <= 0)    {
+                LOG_WARN("MetricsServer", "Client not reading, dropping the connection");
+                return false;
+            }
+
+            struct pollfd fds[2] = { { fd, POLLOUT, 0 }, { mWakeFd, POLLIN, 0 } };
+            if(poll(fds, 2, (int)((remainingUs + 999) / 1000)) < 0 && errno != EINTR)    return false;
+            if(fds[1].revents)    return false;
+        }
+
+        return true;
+    }
+
+    void closeFds()    {
+        if(mListenFd >= 0)    ::close(mListenFd);
+        if(mWakeFd >= 0)    ::close(mWakeFd);
+        mListenFd = -1;
+        mWakeFd = -1;
+    }
+
+    MetricsRegistry *mRegistry;
+    std::string mSocketPath;
+    int mListenFd = -1;
+    int mWakeFd = -1;
+    bool mStarted = false;
+    base::FunctorThread mThread;
+};
+
+}  // namespace metrics
+}  // namespace libeYs3D
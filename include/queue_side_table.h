@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2021 eYs3D Corporation
+ * All rights reserved.
+ * This project is licensed under the Apache License, Version 2.0.
+ */
+
+#pragma once
+
+#include "base/Compiler.h"
+#include "base/synchronization/Lock.h"
+#include "debug.h"
+
+#include <stdint.h>
+
+#include <atomic>
+
+//
+// Per queue state kept outside of the queues of Pipeline and
+// FrameSetPipeline. Those are laid out as the prebuilt library expects them,
+// so optional features (ready fds, spin waiting, drop streams) hang their
+// state here, keyed by queue, created on first use:
+//
+//      T *state = QueueSideTable<T>::get().find(this);     // hot path
+//      if(state)    state->...;
+//
+// find() is lock-free: one relaxed load as long as no queue has a T, then a
+// short linear probe over a fixed array of kCapacity slots. acquire() and
+// release() serialize on a lock. The destructors of the queues are those of
+// the prebuilt library, so they do not release anything: the owner of a
+// queue calls release() (through the queue's release helper) once no thread
+// uses the queue any more, otherwise a queue later allocated at the same
+// address inherits the state.
+//
+
+namespace libeYs3D    {
+
+template <class T>
+class QueueSideTable    {
+    DISALLOW_COPY_ASSIGN_AND_MOVE(QueueSideTable);
+
+public:
+    static constexpr size_t kCapacity = 256;
+
+    // Never destroyed, queues may be torn down after static destructors ran
+    static QueueSideTable &get()    {
+        static QueueSideTable *sInstance = new QueueSideTable();
+        return *sInstance;
+    }
+
+    // nullptr if all kCapacity slots are taken
+    T *acquire(const void *queue)    {
+        base::AutoLock lock(mLock);
+        T *state = find(queue);
+        if(state)    return state;
+
+        for(size_t i = 0, slot = hash(queue); i < kCapacity; i++, slot = (slot + 1) % kCapacity)    {
+            const void *key = mSlots[slot].key.load(std::memory_order_relaxed);
+            if(key != nullptr && key != tombstone())    continue;
+
+            state = new T();
+            mSlots[slot].state.store(state, std::memory_order_relaxed);
+            mSlots[slot].key.store(queue, std::memory_order_release);
+            mCount.store(mCount.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+            return state;
+        }
+
+        LOG_ERR("QueueSideTable", "No room left for queue %p", queue);
+        return nullptr;
+    }
+
+    // nullptr if |queue| has none
+    T *find(const void *queue)    {
+        if(mCount.load(std::memory_order_relaxed) == 0)    return nullptr;
+
+        for(size_t i = 0, slot = hash(queue); i < kCapacity; i++, slot = (slot + 1) % kCapacity)    {
+            const void *key = mSlots[slot].key.load(std::memory_order_acquire);
+            if(key == queue)    return mSlots[slot].state.load(std::memory_order_relaxed);
+            if(key == nullptr)    return nullptr;
+        }
+
+        return nullptr;
+    }
+
+    // The state of |queue| must not be in use any more
+    void release(const void *queue)    {
+        if(mCount.load(std::memory_order_relaxed) == 0)    return;
+
+        base::AutoLock lock(mLock);
+        for(size_t i = 0, slot = hash(queue); i < kCapacity; i++, slot = (slot + 1) % kCapacity)    {
+            const void *key = mSlots[slot].key.load(std::memory_order_relaxed);
+            if(key == nullptr)    return;
+            if(key != queue)    continue;
+
+            mSlots[slot].key.store(tombstone(), std::memory_order_relaxed);
+            delete mSlots[slot].state.exchange(nullptr, std::memory_order_relaxed);
+            size_t count = mCount.load(std::memory_order_relaxed) - 1;
+            mCount.store(count, std::memory_order_relaxed);
+
+            // tombstones only lengthen the probes of misses, drop them with the last state
+            if(count == 0)    {
+                for(Slot &s : mSlots)    s.key.store(nullptr, std::memory_order_relaxed);
+            }
+            return;
+        }
+    }
+
+private:
+    struct Slot    {
+        std::atomic<const void *> key{nullptr};
+        std::atomic<T *> state{nullptr};
+    };
+
+    QueueSideTable() = default;
+
+    static const void *tombstone()    { return reinterpret_cast<const void *>(uintptr_t(1)); }
+
+    static size_t hash(const void *queue)    {
+        uintptr_t value = reinterpret_cast<uintptr_t>(queue);
+        return (size_t)((value >> 4) * 0x9E3779B97F4A7C15ull >> 32) % kCapacity;
+    }
+
+    base::Lock mLock;               // serializes acquire() and release()
+    Slot mSlots[kCapacity];
+    std::atomic<size_t> mCount{0};
+};
+
+}  // namespace libeYs3D
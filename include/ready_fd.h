@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2021 eYs3D Corporation
+ * All rights reserved.
+ * This project is licensed under the Apache License, Version 2.0.
+ */
+
+#pragma once
+
+#include "queue_side_table.h"
+#include "base/Compiler.h"
+#include "utils.h"
+#include "debug.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include <vector>
+
+//
+// Readiness file descriptors for Pipeline::CircularQueue, so one poll/epoll
+// loop can serve many queues instead of one blocking thread per queue:
+//
+//      Pipeline::CircularQueue<Frame, 2> queue("app.depth");
+//      int fd = queue.getReadyFd();
+//      ... epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);   // EPOLLIN, level triggered
+//      ... queue.deQueue(&frame, 0);                        // once readable
+//
+// A ReadyFd is an eventfd that is readable while its queue holds data or is
+// stopped. It is kept in a QueueSideTable, created on the first
+// getReadyFd() and closed by CircularQueue::releaseSideState(). Queues nobody
+// asked a descriptor for only pay one relaxed load per enQueue()/deQueue().
+// The table is always looked up, and the descriptor created, before the
+// queue lock is taken.
+//
+// Only queues built and filled by the app get one. The queues of a Pipeline
+// or FrameSetPipeline owned by a CameraDevice are filled by the enQueue()
+// inlined in the prebuilt library, which neither knows about descriptors nor
+// calls back into the app, so they cannot be watched from a poll/epoll loop
+// until the library is rebuilt from these headers; their consumers keep one
+// waitFor*() thread per stream.
+//
+
+namespace libeYs3D    {
+
+class ReadyFd    {
+    DISALLOW_COPY_ASSIGN_AND_MOVE(ReadyFd);
+
+public:
+    ReadyFd() : mFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))    {
+        if(mFd < 0)    LOG_ERR_ERRNO("ReadyFd", "Unable to create eventfd");
+    }
+
+    ~ReadyFd()    {
+        if(mFd >= 0)    close(mFd);
+    }
+
+    int fd() const    { return mFd; }
+
+    void set()    {
+        if(mReady)    return;
+
+        uint64_t one = 1;
+        if(write(mFd, &one, sizeof(one)) == sizeof(one))    mReady = true;
+    }
+
+    void clear()    {
+        if(!mReady)    return;
+
+        uint64_t value;
+        while(read(mFd, &value, sizeof(value)) < 0 && errno == EINTR);
+        mReady = false;
+    }
+
+    void update(bool ready)    {
+        if(ready)    set();
+        else    clear();
+    }
+
+private:
+    const int mFd;
+    bool mReady = false;    // guarded by the lock of the queue
+};
+
+using ReadyFdRegistry = QueueSideTable<ReadyFd>;
+
+// poll() over a few readiness descriptors, each standing for a bit of the
+// returned mask
+class ReadySet    {
+public:
+    void add(int fd, uint32_t bit)    {
+        mFds.push_back({ fd, POLLIN, 0 });
+        mBits.push_back(bit);
+    }
+
+    size_t size() const    { return mFds.size(); }
+
+    /**
+     * \param[in] timeoutMs   < 0 waits without waking up until one is ready
+     * \return the bits of the ready descriptors, 0 on timeout or error
+     */
+    uint32_t wait(int32_t timeoutMs)    {
+        int64_t deadlineUs = now_in_microsecond_high_res_time_MONOTONIC() + (int64_t)timeoutMs * 1000ll;
+        int32_t remainingMs = timeoutMs;
+
+        for(;;)    {
+            int ret = poll(mFds.data(), mFds.size(), remainingMs);
+            if(ret > 0)    break;
+            if(ret == 0)    return 0u;
+            if(errno != EINTR)    {
+                LOG_ERR_ERRNO("ReadySet", "poll failed");
+                return 0u;
+            }
+            if(timeoutMs >= 0)    {
+                remainingMs = (int32_t)((deadlineUs - now_in_microsecond_high_res_time_MONOTONIC()) / 1000ll);
+                if(remainingMs < 0)    remainingMs = 0;
+            }
+        }
+
+        uint32_t ready = 0u;
+        for(size_t i = 0; i < mFds.size(); i++)    {
+            if(mFds[i].revents & (POLLIN | POLLERR | POLLHUP))    ready |= mBits[i];
+        }
+        return ready;
+    }
+
+private:
+    std::vector<struct pollfd> mFds;
+    std::vector<uint32_t> mBits;
+};
+
+}  // namespace libeYs3D
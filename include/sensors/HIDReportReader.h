@@ -0,0 +1,319 @@
+/*
+ * Copyright (C) 2021 eYs3D Corporation
+ * All rights reserved.
+ * This project is licensed under the Apache License, Version 2.0.
+ */
+
+#pragma once
+
+#include "base/Compiler.h"
+#include "base/synchronization/ConditionVariable.h"
+#include "base/synchronization/Lock.h"
+#include "base/threads/FunctorThread.h"
+#include "base/threads/Thread.h"
+#include "utils.h"
+#include "debug.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <string>
+
+//
+// Event driven HID report reading for IMU devices.
+//
+// HIDEventLoop owns one epoll instance and one thread. Any number of
+// HIDReportReader objects (one per hidraw node) can be attached to the same
+// loop, so several IMUs are served by a single thread instead of one blocking
+// hid_read() thread per device.
+//
+// Each reader opens its node non-blocking. On every wakeup it drains all
+// pending reports until read() returns EAGAIN, and stamps each report with the
+// MONOTONIC time taken right after the read() syscall returns.
+//
+//      libeYs3D::sensors::HIDEventLoop loop;
+//      loop.start();
+//
+//      libeYs3D::sensors::HIDReportReader reader(&loop,
+//          [](const uint8_t *report, int length, int64_t tsUs) {
+//              IMUData imuData;
+//              imuData.parsePacket((unsigned char *)report, true);
+//          });
+//      reader.open("/dev/hidraw3");
+//      ...
+//      reader.close();
+//      loop.stop();
+//
+// attach() accepts any readable fd, e.g. one end of a socketpair() or a pty
+// master replaying recorded reports, which makes the reader testable without
+// an IMU.
+//
+// Handlers run without the loop lock held, so a report callback may close()
+// its own reader or any other one.
+//
+
+namespace libeYs3D    {
+namespace sensors    {
+
+class HIDEventLoop    {
+    DISALLOW_COPY_ASSIGN_AND_MOVE(HIDEventLoop);
+
+public:
+    // Invoked on the loop thread when |fd| becomes readable or hangs up
+    using Handler = std::function<void(uint32_t events)>;
+
+    HIDEventLoop()
+        : mThread([this]() { loop(); })    {
+        mEpollFd = epoll_create1(EPOLL_CLOEXEC);
+        mWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(mEpollFd < 0 || mWakeFd < 0)    {
+            LOG_ERR_ERRNO("HIDEventLoop", "Unable to create epoll/eventfd");
+            return;
+        }
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = mWakeFd;
+        epoll_ctl(mEpollFd, EPOLL_CTL_ADD, mWakeFd, &ev);
+    }
+
+    ~HIDEventLoop()    {
+        stop();
+        if(mWakeFd >= 0)    ::close(mWakeFd);
+        if(mEpollFd >= 0)    ::close(mEpollFd);
+    }
+
+    bool start()    {
+        if(mEpollFd < 0 || mWakeFd < 0)    return false;
+
+        base::AutoLock lock(mLock);
+        if(mStarted)    return true;
+        mStarted = mThread.start();
+
+        return mStarted;
+    }
+
+    void stop()    {
+        {
+            base::AutoLock lock(mLock);
+            if(!mStarted || mStopping)    return;
+            mStopping = true;
+        }
+
+        uint64_t one = 1;
+        write_fully(mWakeFd, &one, sizeof(one), "HIDEventLoop");
+        mThread.wait();
+    }
+
+    // returns 0 on success and negative errno on failure
+    int add(int fd, Handler handler)    {
+        {
+            base::AutoLock lock(mLock);
+            mHandlers[fd] = std::move(handler);
+        }
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.fd = fd;
+        if(epoll_ctl(mEpollFd, EPOLL_CTL_ADD, fd, &ev) < 0)    {
+            int err = errno;
+            LOG_ERR_ERRNO("HIDEventLoop", "EPOLL_CTL_ADD failed, fd: %d", fd);
+
+            base::AutoLock lock(mLock);
+            mHandlers.erase(fd);
+            return -err;
+        }
+
+        return 0;
+    }
+
+    // Stops polling |fd| without dropping its handler, safe to call from the
+    // handler itself (e.g. on EOF); remove() must still be called later
+    void mute(int fd)    {
+        epoll_ctl(mEpollFd, EPOLL_CTL_DEL, fd, nullptr);
+    }
+
+    // After remove() returns the handler of |fd| is no longer pending, and no
+    // longer running unless remove() was called from the loop thread itself,
+    // i.e. from a handler
+    void remove(int fd)    {
+        epoll_ctl(mEpollFd, EPOLL_CTL_DEL, fd, nullptr);
+
+        base::AutoLock lock(mLock);
+        mHandlers.erase(fd);
+        if(base::getCurrentThreadId() == mLoopThreadId.load(std::memory_order_relaxed))    return;
+        while(mDispatchingFd == fd)    mDispatchDone.wait(&lock);
+    }
+
+private:
+    void loop()    {
+        static constexpr int kMaxEvents = 16;
+        struct epoll_event events[kMaxEvents];
+        Handler handler;
+
+        mLoopThreadId.store(base::getCurrentThreadId(), std::memory_order_relaxed);
+        while(true)    {
+            int count = epoll_wait(mEpollFd, events, kMaxEvents, -1);
+            if(count < 0)    {
+                if(errno == EINTR)    continue;
+
+                LOG_ERR_ERRNO("HIDEventLoop", "epoll_wait failed");
+                break;
+            }
+
+            for(int i = 0; i < count; i++)    {
+                if(events[i].data.fd == mWakeFd)    {
+                    uint64_t value;
+                    while(::read(mWakeFd, &value, sizeof(value)) > 0)    {}
+
+                    base::AutoLock lock(mLock);
+                    if(mStopping)    return;
+                    continue;
+                }
+
+                // a copy runs outside mLock, mDispatchingFd lets remove() wait for it
+                const int fd = events[i].data.fd;
+                {
+                    base::AutoLock lock(mLock);
+                    auto it = mHandlers.find(fd);
+                    if(it == mHandlers.end())    continue;    // removed by an earlier handler
+                    handler = it->second;
+                    mDispatchingFd = fd;
+                }
+
+                handler(events[i].events);
+
+                base::AutoLock lock(mLock);
+                mDispatchingFd = -1;
+                mDispatchDone.broadcast();
+            }
+        }
+    }
+
+    int mEpollFd = -1;
+    int mWakeFd = -1;
+    base::Lock mLock;
+    std::map<int, Handler> mHandlers; // guarded by mLock
+    base::ConditionVariable mDispatchDone;
+    int mDispatchingFd = -1;          // guarded by mLock, the fd whose handler runs
+    std::atomic<unsigned long> mLoopThreadId{0ul};
+    bool mStarted = false;
+    bool mStopping = false;
+    base::FunctorThread mThread;
+};
+
+class HIDReportReader    {
+    DISALLOW_COPY_ASSIGN_AND_MOVE(HIDReportReader);
+
+public:
+    // |report| is valid only during the call, |tsUs| is MONOTONIC microseconds
+    using ReportCallback = std::function<void(const uint8_t *report, int length, int64_t tsUs)>;
+
+    static constexpr int kMaxReportSize = 256;
+
+    HIDReportReader(HIDEventLoop *eventLoop, ReportCallback callback)
+        : mEventLoop(eventLoop), mCallback(std::move(callback))    {}
+
+    ~HIDReportReader()    { close(); }
+
+    // Opens a hidraw node, e.g. one entry of EYS3DSystem::getHIDDeviceList()
+    int open(const char *hidrawPath)    {
+        int fd = ::open(hidrawPath, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if(fd < 0)    {
+            int err = errno;
+            LOG_ERR_ERRNO("HIDReportReader", "Unable to open %s", hidrawPath);
+            return -err;
+        }
+
+        int ret = attach(fd, true);
+        if(ret < 0)    ::close(fd);
+
+        return ret;
+    }
+
+    // Reads from an already opened fd; the fd is switched to non-blocking.
+    // If |ownFd| is true, close() also closes the fd.
+    int attach(int fd, bool ownFd = false)    {
+        if(mFd >= 0)    return -EBUSY;
+
+        int flags = fcntl(fd, F_GETFL, 0);
+        if(flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)    {
+            int err = errno;
+            LOG_ERR_ERRNO("HIDReportReader", "Unable to set O_NONBLOCK, fd: %d", fd);
+            return -err;
+        }
+
+        mFd = fd;
+        mOwnFd = ownFd;
+        int ret = mEventLoop->add(fd, [this](uint32_t events) { onEvents(events); });
+        if(ret < 0)    mFd = -1;
+
+        return ret;
+    }
+
+    void close()    {
+        if(mFd < 0)    return;
+
+        mEventLoop->remove(mFd);
+        if(mOwnFd)    ::close(mFd);
+        mFd = -1;
+    }
+
+    bool isOpened() const    { return mFd >= 0; }
+
+    // statistics, updated on the loop thread only
+    uint64_t getReportCount() const    { return mReportCount.load(std::memory_order_relaxed); }
+    uint64_t getWakeupCount() const    { return mWakeupCount.load(std::memory_order_relaxed); }
+
+private:
+    void onEvents(uint32_t events)    {
+        uint8_t report[kMaxReportSize];
+
+        mWakeupCount.fetch_add(1, std::memory_order_relaxed);
+        while(true)    { // drain every pending report
+            ssize_t length = ::read(mFd, report, sizeof(report));
+            if(length > 0)    {
+                int64_t tsUs = now_in_microsecond_high_res_time_MONOTONIC();
+                mReportCount.fetch_add(1, std::memory_order_relaxed);
+                if(mCallback)    mCallback(report, (int)length, tsUs);
+                if(mFd < 0)    return;     // closed by the callback
+                continue;
+            }
+
+            if(length < 0 && errno == EINTR)    continue;
+            if(length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))    break;
+
+            // length == 0 or a real error: the device is gone
+            if(length < 0)    LOG_ERR_ERRNO("HIDReportReader", "read failed, fd: %d", mFd);
+            events |= EPOLLHUP;
+            break;
+        }
+
+        if(events & (EPOLLHUP | EPOLLRDHUP | EPOLLERR))    {
+            // level triggered epoll would report the hang up forever
+            LOG_INFO("HIDReportReader", "fd %d hung up", mFd);
+            mEventLoop->mute(mFd);
+        }
+    }
+
+    HIDEventLoop *mEventLoop;
+    ReportCallback mCallback;
+    int mFd = -1;
+    bool mOwnFd = false;
+
+    std::atomic<uint64_t> mReportCount{0llu};
+    std::atomic<uint64_t> mWakeupCount{0llu};
+};
+
+}  // namespace sensors
+}  // namespace libeYs3D
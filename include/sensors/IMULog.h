@@ -0,0 +1,573 @@
+/*
+ * Copyright (C) 2021 eYs3D Corporation
+ * All rights reserved.
+ * This project is licensed under the Apache License, Version 2.0.
+ */
+
+#pragma once
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "sensors/SensorDataProducer.h"
+#include "devices/IMUDevice.h"
+#include "base/Compiler.h"
+#include "base/threads/WorkerThread.h"
+#include "cgroup.h"
+#include "utils.h"
+#include "debug.h"
+
+//
+// Binary IMU log made of preallocated, memory-mapped segment files.
+//
+// Every segment is "imu_<index>.bin" inside the log directory (typically
+// EYS3DSystem::getIMULogPath()) and holds a fixed header followed by
+// |capacity| fixed-size IMULogRecord slots:
+//
+//     +---------------------+----------+----------+-----+
+//     | IMULogSegmentHeader | record 0 | record 1 | ... |
+//     +---------------------+----------+----------+-----+
+//
+// IMULogWriter::append() is meant for the IMU reader thread. It copies the
+// report into the next mapped slot and publishes it by a release store of
+// the header's |committed| counter: no lock, no syscall and no formatting.
+// Segment creation (ftruncate + MAP_POPULATE) and retirement (msync + munmap)
+// run on a maintenance thread; the next segment is prepared once the current
+// one is half full. If it is not ready in time the record is dropped and
+// counted instead of stalling the reader. A segment that cannot be created
+// (full disk, directory gone) is retried with a backoff of 10 ms doubling up
+// to 1 s; records appended meanwhile are dropped and counted the same way.
+//
+// Records are in sequence and timestamp order, so the slot position is the
+// sequence index and timestamps are found by binary search over the slots.
+// IMULogReader exposes both lookups and IMULogReplayProducer feeds a log back
+// through SensorDataProducer at the original or an accelerated rate.
+//
+
+namespace libeYs3D    {
+namespace sensors    {
+
+static constexpr uint32_t kIMULogMagic = 0x4C4D4945; // "EIML"
+static constexpr uint16_t kIMULogVersion = 1;
+static constexpr int kIMULogPayloadSize = 112;
+static constexpr uint32_t kIMULogDefaultRecordsPerSegment = 65536; // 8 MB
+
+struct IMULogRecord    {
+    uint32_t sequence;
+    uint16_t length;  // valid bytes in data
+    uint16_t format;  // IMUDevice::IMU_DATA_FORMAT
+    int64_t tsUs;     // host timestamp of the report
+    uint8_t data[kIMULogPayloadSize];
+};
+
+struct IMULogSegmentHeader    {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t recordSize;
+    uint32_t capacity;
+    uint32_t segmentIndex;
+    std::atomic<uint32_t> committed; // published record count
+    uint8_t reserved[108];
+};
+
+static_assert(sizeof(IMULogRecord) == 128, "IMULogRecord layout changed");
+static_assert(sizeof(IMULogSegmentHeader) == 128, "IMULogSegmentHeader layout changed");
+
+class IMULogSegment    {
+    DISALLOW_COPY_ASSIGN_AND_MOVE(IMULogSegment);
+
+public:
+    IMULogSegment() = default;
+    ~IMULogSegment()    { close(); }
+
+    // Creates and maps a writable segment, all pages are faulted in here
+    int create(const char *path, uint32_t segmentIndex, uint32_t capacity)    {
+        mSize = sizeof(IMULogSegmentHeader) + (size_t)capacity * sizeof(IMULogRecord);
+        mFd = ::open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(mFd < 0)    {
+            int err = errno;
+            LOG_ERR_ERRNO("IMULogSegment", "Unable to create %s", path);
+            return -err;
+        }
+
+        if(ftruncate(mFd, mSize) < 0)    {
+            int err = errno;
+            LOG_ERR_ERRNO("IMULogSegment", "Unable to preallocate %s", path);
+            close();
+            return -err;
+        }
+
+        int ret = map(PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE);
+        if(ret < 0)    return ret;
+
+        IMULogSegmentHeader *h = header();
+        h->magic = kIMULogMagic;
+        h->version = kIMULogVersion;
+        h->recordSize = sizeof(IMULogRecord);
+        h->capacity = capacity;
+        h->segmentIndex = segmentIndex;
+        h->committed.store(0, std::memory_order_release);
+        mPath = path;
+
+        return 0;
+    }
+
+    // Maps an existing segment read-only
+    int open(const char *path)    {
+        struct stat st;
+        mFd = ::open(path, O_RDONLY | O_CLOEXEC);
+        if(mFd < 0 || fstat(mFd, &st) < 0)    {
+            int err = errno;
+            LOG_ERR_ERRNO("IMULogSegment", "Unable to open %s", path);
+            close();
+            return -err;
+        }
+
+        mSize = st.st_size;
+        if(mSize < sizeof(IMULogSegmentHeader))    {
+            close();
+            return -EINVAL;
+        }
+
+        int ret = map(PROT_READ, MAP_SHARED);
+        if(ret < 0)    return ret;
+
+        const IMULogSegmentHeader *h = header();
+        if(h->magic != kIMULogMagic || h->version != kIMULogVersion ||
+           h->recordSize != sizeof(IMULogRecord) ||
+           mSize < sizeof(IMULogSegmentHeader) + (size_t)h->capacity * sizeof(IMULogRecord))    {
+            LOG_ERR("IMULogSegment", "%s is not a valid IMU log segment", path);
+            close();
+            return -EINVAL;
+        }
+        mPath = path;
+
+        return 0;
+    }
+
+    void close()    {
+        if(mBase != nullptr)    {
+            munmap(mBase, mSize);
+            mBase = nullptr;
+        }
+        if(mFd >= 0)    {
+            ::close(mFd);
+            mFd = -1;
+        }
+    }
+
+    void flush()    {
+        if(mBase != nullptr)    msync(mBase, mSize, MS_ASYNC);
+    }
+
+    IMULogSegmentHeader *header() const    {
+        return reinterpret_cast<IMULogSegmentHeader *>(mBase);
+    }
+
+    IMULogRecord *record(uint32_t index) const    {
+        return reinterpret_cast<IMULogRecord *>(
+                   reinterpret_cast<uint8_t *>(mBase) + sizeof(IMULogSegmentHeader)) + index;
+    }
+
+    uint32_t capacity() const    { return header()->capacity; }
+    uint32_t count() const    { return header()->committed.load(std::memory_order_acquire); }
+    const std::string &path() const    { return mPath; }
+
+private:
+    int map(int prot, int flags)    {
+        mBase = mmap(nullptr, mSize, prot, flags, mFd, 0);
+        if(mBase == MAP_FAILED)    {
+            int err = errno;
+            mBase = nullptr;
+            LOG_ERR_ERRNO("IMULogSegment", "mmap failed, size: %zu", mSize);
+            close();
+            return -err;
+        }
+
+        return 0;
+    }
+
+    int mFd = -1;
+    void *mBase = nullptr;
+    size_t mSize = 0;
+    std::string mPath;
+};
+
+static inline std::string imu_log_segment_path(const std::string &dirPath, uint32_t segmentIndex)    {
+    char name[32];
+    snprintf(name, sizeof(name), "/imu_%08u.bin", segmentIndex);
+    return dirPath + name;
+}
+
+class IMULogWriter    {
+    DISALLOW_COPY_ASSIGN_AND_MOVE(IMULogWriter);
+
+public:
+    IMULogWriter(const char *dirPath,
+                 uint32_t recordsPerSegment = kIMULogDefaultRecordsPerSegment)
+        : mDirPath(dirPath), mRecordsPerSegment(recordsPerSegment),
+          mMaintenance([this](MaintenanceItem &&item) { return maintain(std::move(item)); })    {}
+
+    ~IMULogWriter()    { close(); }
+
+    // Prepares the first segment synchronously; call before the reader starts
+    int open()    {
+        if(create_directory(mDirPath.c_str(), "IMULogWriter") < 0)    return -EIO;
+
+        IMULogSegment *segment = new IMULogSegment();
+        int ret = segment->create(imu_log_segment_path(mDirPath, 0).c_str(), 0,
+                                  mRecordsPerSegment);
+        if(ret < 0)    {
+            delete segment;
+            return ret;
+        }
+
+        mCurrent = segment;
+        mNextSegmentIndex = 1;
+        mRetryBackoffMs = 0;
+        mRetryAtUs.store(0, std::memory_order_relaxed);
+        mSparePending.store(false, std::memory_order_relaxed);
+        mMaintenance.start();
+
+        return 0;
+    }
+
+    // Hot path, single producer. Returns 0, or -EAGAIN if the record had to be
+    // dropped because the next segment was not ready yet.
+    int append(const uint8_t *data, int length, int64_t tsUs,
+               uint16_t format = libeYs3D::devices::IMUDevice::RAW_DATA_WITH_OFFSET)    {
+        if(mCurrent == nullptr)    return -EBADF;
+
+        IMULogSegmentHeader *h = mCurrent->header();
+        uint32_t index = h->committed.load(std::memory_order_relaxed);
+        if(index == h->capacity)    {
+            if(rotate() < 0)    {
+                mDroppedCount.fetch_add(1, std::memory_order_relaxed);
+                mSequence += 1;
+                return -EAGAIN;
+            }
+            h = mCurrent->header();
+            index = 0;
+        }
+
+        IMULogRecord *record = mCurrent->record(index);
+        record->sequence = mSequence++;
+        record->format = format;
+        record->tsUs = tsUs;
+        record->length = (uint16_t)MIN(length, kIMULogPayloadSize);
+        memcpy(record->data, data, record->length);
+        h->committed.store(index + 1, std::memory_order_release);
+
+        if(index + 1 == (h->capacity >> 1))    requestSpareSegment();
+
+        return 0;
+    }
+
+    void close()    {
+        if(mCurrent == nullptr)    return;
+
+        MaintenanceItem item;
+        item.retired = mCurrent;
+        mMaintenance.enqueue(std::move(item));
+        mCurrent = nullptr;
+
+        MaintenanceItem stop;
+        stop.stop = true;
+        mMaintenance.enqueue(std::move(stop));
+        mMaintenance.join();
+
+        delete mSpare.exchange(nullptr);
+    }
+
+    // records lost because no segment was ready, including while creation failed
+    uint64_t getDroppedCount() const    {
+        return mDroppedCount.load(std::memory_order_relaxed);
+    }
+
+    uint64_t getSegmentFailureCount() const    {
+        return mSegmentFailureCount.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct MaintenanceItem    {
+        IMULogSegment *retired = nullptr;
+        bool allocate = false;
+        bool stop = false;
+    };
+
+    int rotate()    {
+        IMULogSegment *spare = mSpare.exchange(nullptr, std::memory_order_acquire);
+        if(spare == nullptr)    {
+            requestSpareSegment();
+            return -EAGAIN;
+        }
+
+        MaintenanceItem item;
+        item.retired = mCurrent;
+        mMaintenance.enqueue(std::move(item));
+        mCurrent = spare;
+        mSparePending.store(false, std::memory_order_relaxed);
+
+        return 0;
+    }
+
+    void requestSpareSegment()    {
+        if(mSparePending.load(std::memory_order_acquire))    return;
+
+        int64_t retryAtUs = mRetryAtUs.load(std::memory_order_relaxed);
+        if(retryAtUs != 0 && now_in_microsecond_high_res_time_MONOTONIC() < retryAtUs)    return;
+
+        mSparePending.store(true, std::memory_order_relaxed);
+        MaintenanceItem item;
+        item.allocate = true;
+        mMaintenance.enqueue(std::move(item));
+    }
+
+    base::WorkerProcessingResult maintain(MaintenanceItem &&item)    {
+        if(item.stop)    return base::WorkerProcessingResult::Stop;
+
+        if(item.retired != nullptr)    {
+            item.retired->flush();
+            delete item.retired;
+        }
+
+        if(item.allocate)    {
+            IMULogSegment *segment = new IMULogSegment();
+            std::string path = imu_log_segment_path(mDirPath, mNextSegmentIndex);
+            if(segment->create(path.c_str(), mNextSegmentIndex, mRecordsPerSegment) < 0)    {
+                delete segment;
+                mSegmentFailureCount.fetch_add(1, std::memory_order_relaxed);
+                mRetryBackoffMs = std::min(std::max(mRetryBackoffMs * 2, (int)kRetryMinBackoffMs),
+                                           (int)kRetryMaxBackoffMs);
+                mRetryAtUs.store(now_in_microsecond_high_res_time_MONOTONIC() + mRetryBackoffMs * 1000ll,
+                                 std::memory_order_relaxed);
+                // lets the appending thread request the segment again
+                mSparePending.store(false, std::memory_order_release);
+                return base::WorkerProcessingResult::Continue;
+            }
+
+            mNextSegmentIndex += 1;
+            mRetryBackoffMs = 0;
+            mRetryAtUs.store(0, std::memory_order_relaxed);
+            delete mSpare.exchange(segment, std::memory_order_release);
+        }
+
+        return base::WorkerProcessingResult::Continue;
+    }
+
+    std::string mDirPath;
+    uint32_t mRecordsPerSegment;
+
+    static constexpr int kRetryMinBackoffMs = 10;
+    static constexpr int kRetryMaxBackoffMs = 1000;
+
+    // owned by the appending thread
+    IMULogSegment *mCurrent = nullptr;
+    uint32_t mSequence = 0;
+
+    // owned by the maintenance thread once open() returns
+    uint32_t mNextSegmentIndex = 0;
+    int mRetryBackoffMs = 0;
+
+    // set by the appending thread, cleared by either thread
+    std::atomic<bool> mSparePending{false};
+    std::atomic<int64_t> mRetryAtUs{0};
+
+    std::atomic<IMULogSegment *> mSpare{nullptr};
+    std::atomic<uint64_t> mDroppedCount{0};
+    std::atomic<uint64_t> mSegmentFailureCount{0};
+    base::WorkerThread<MaintenanceItem> mMaintenance;
+};
+
+class IMULogReader    {
+    DISALLOW_COPY_ASSIGN_AND_MOVE(IMULogReader);
+
+public:
+    IMULogReader() = default;
+    ~IMULogReader()    { close(); }
+
+    // Maps every segment found in |dirPath| in segment order
+    int open(const char *dirPath)    {
+        DIR *dir = opendir(dirPath);
+        if(dir == nullptr)    {
+            LOG_ERR_ERRNO("IMULogReader", "Unable to open %s", dirPath);
+            return -ENOENT;
+        }
+
+        std::vector<std::string> names;
+        struct dirent *entry;
+        while((entry = readdir(dir)) != nullptr)    {
+            unsigned int index;
+            if(sscanf(entry->d_name, "imu_%08u.bin", &index) == 1)    names.push_back(entry->d_name);
+        }
+        closedir(dir);
+        std::sort(names.begin(), names.end());
+
+        for(const std::string &name : names)    {
+            IMULogSegment *segment = new IMULogSegment();
+            std::string path = std::string(dirPath) + "/" + name;
+            if(segment->open(path.c_str()) < 0 || segment->count() == 0)    {
+                delete segment;
+                continue;
+            }
+            mSegments.push_back(segment);
+            mTotalCount += segment->count();
+        }
+
+        return mSegments.empty() ? -ENODATA : 0;
+    }
+
+    void close()    {
+        for(IMULogSegment *segment : mSegments)    delete segment;
+        mSegments.clear();
+        mTotalCount = 0;
+    }
+
+    size_t count() const    { return mTotalCount; }
+
+    // |index| is the position in the whole log, 0 ~ count() - 1
+    const IMULogRecord *record(size_t index) const    {
+        for(IMULogSegment *segment : mSegments)    {
+            if(index < segment->count())    return segment->record(index);
+            index -= segment->count();
+        }
+
+        return nullptr;
+    }
+
+    // Position of the record carrying |sequence|, or count() if absent
+    size_t findSequence(uint32_t sequence) const    {
+        return lowerBound([sequence](const IMULogRecord *r) { return r->sequence < sequence; },
+                          [sequence](const IMULogRecord *r) { return r->sequence == sequence; });
+    }
+
+    // Position of the first record with tsUs >= |tsUs|, or count()
+    size_t findTimestamp(int64_t tsUs) const    {
+        return lowerBound([tsUs](const IMULogRecord *r) { return r->tsUs < tsUs; },
+                          [](const IMULogRecord *) { return true; });
+    }
+
+private:
+    template <class Less, class Match>
+    size_t lowerBound(Less less, Match match) const    {
+        size_t base = 0;
+        for(IMULogSegment *segment : mSegments)    {
+            uint32_t count = segment->count();
+            if(less(segment->record(count - 1)))    {
+                base += count;
+                continue;
+            }
+
+            uint32_t low = 0, high = count;
+            while(low < high)    {
+                uint32_t mid = low + ((high - low) >> 1);
+                if(less(segment->record(mid)))    low = mid + 1;
+                else    high = mid;
+            }
+
+            return match(segment->record(low)) ? base + low : mTotalCount;
+        }
+
+        return mTotalCount;
+    }
+
+    std::vector<IMULogSegment *> mSegments;
+    size_t mTotalCount = 0;
+};
+
+// Replays an IMU log through the regular SensorDataProducer path.
+// |rate| 1.0 keeps the original timing, 2.0 is twice as fast, 0 means no pacing.
+class IMULogReplayProducer : public SensorDataProducer    {
+public:
+    IMULogReplayProducer(const IMULogReader *reader, float rate = 1.0f,
+                         size_t startIndex = 0)
+        : SensorDataProducer(SensorData::SensorDataType::IMU_DATA),
+          mReader(reader), mRate(rate), mNextIndex(startIndex)    {}
+
+    virtual ~IMULogReplayProducer()    {}
+
+    virtual const char* getName() override    { return "IMULogReplayProducer"; }
+
+    bool isFinished() const    { return mNextIndex >= mReader->count(); }
+
+    virtual int readSensorData(SensorData *sensorData) override    {
+        if(isFinished())    {
+            libeYs3D::base::Thread::sleepMs(10);
+            return -ENODATA;
+        }
+
+        const IMULogRecord *record = mReader->record(mNextIndex++);
+        if(mRate > 0.0f)    pace(record->tsUs);
+
+        IMUData *imuData = new (sensorData->data) IMUData();
+        switch(record->format)    {
+            case libeYs3D::devices::IMUDevice::DMP_DATA_WITHOT_OFFSET:
+            case libeYs3D::devices::IMUDevice::DMP_DATA_WITH_OFFSET:
+                imuData->parsePacket_DMP((unsigned char *)record->data);
+                break;
+            case libeYs3D::devices::IMUDevice::QUATERNION_DATA:
+                imuData->parsePacket_Quaternion((unsigned char *)record->data);
+                break;
+            default:
+                imuData->parsePacket((unsigned char *)record->data, true);
+                break;
+        }
+        sensorData->type = SensorData::SensorDataType::IMU_DATA;
+        sensorData->serialNumber = record->sequence;
+
+        return record->length;
+    }
+
+    virtual void logProducerTick(const char *FMT, ...) override    {
+        char buffer[512];
+        va_list args;
+        va_start(args, FMT);
+        vsnprintf(buffer, sizeof(buffer), FMT, args);
+        va_end(args);
+        LOG_IMU_PRODUCER_TICK(getName(), "%s", buffer);
+    }
+
+protected:
+    void virtual attachReaderWorkerCGgroup() override    {
+        attach_to_cgroup(IMU_READER_CGROUP, getName());
+    }
+
+    void virtual attachCallbackWorkerCGgroup() override    {
+        attach_to_cgroup(IMU_CALLBACK_CGROUP, getName());
+    }
+
+private:
+    void pace(int64_t recordTsUs)    {
+        int64_t now = now_in_microsecond_high_res_time_MONOTONIC();
+        if(mFirstRecordTsUs < 0)    {
+            mFirstRecordTsUs = recordTsUs;
+            mReplayStartUs = now;
+            return;
+        }
+
+        int64_t due = mReplayStartUs + (int64_t)((recordTsUs - mFirstRecordTsUs) / mRate);
+        if(due > now)    libeYs3D::base::Thread::sleepUs((unsigned)(due - now));
+    }
+
+    const IMULogReader *mReader;
+    float mRate;
+    size_t mNextIndex;
+    int64_t mFirstRecordTsUs = -1ll;
+    int64_t mReplayStartUs = 0ll;
+};
+
+}  // namespace sensors
+}  // namespace libeYs3D
@@ -12,10 +12,21 @@
 #include <functional>
 #include <sstream>
 
+#include "drop_stats.h"
+#include "queue_side_table.h"
+
 #ifndef EYS3D_UNITY_WRAPPER_SINGLE_CONSUMER_QUEUE_H
 #define EYS3D_UNITY_WRAPPER_SINGLE_CONSUMER_QUEUE_H
 
 const int QUEUE_MAX_SIZE = 10;
+
+// Drop stream of a queue renamed by set_drop_stream(), kept in a
+// QueueSideTable so the queue layout stays that of the original class
+struct single_consumer_queue_drops
+{
+    libeYs3D::DropCounters *counters = nullptr;
+};
+
 // Simplest implementation of a blocking concurrent queue for thread messaging
 template<class T>
 class single_consumer_queue
@@ -32,10 +43,39 @@ class single_consumer_queue
     // when need to stop
     std::atomic<bool> _need_to_flush;
     std::atomic<bool> _was_flushed;
+
+    // items popped by enqueue() on overflow are counted as STAGE_OVERFLOW
+    // drops, called with _mutex held on the overflow path only
+    void record_overflow(const T& item)
+    {
+        using drops_table = libeYs3D::QueueSideTable<single_consumer_queue_drops>;
+        single_consumer_queue_drops *drops = drops_table::get().find(this);
+        if (drops)
+            drops->counters->record(libeYs3D::DropReason::STAGE_OVERFLOW, libeYs3D::drop_serial_of(item));
+        else
+            libeYs3D::DropStats::get().record("single_consumer_queue", libeYs3D::DropReason::STAGE_OVERFLOW,
+                                              libeYs3D::drop_serial_of(item));
+    }
 public:
     explicit single_consumer_queue<T>(unsigned int cap = QUEUE_MAX_SIZE)
             : _queue(), _mutex(), _deq_cv(), _enq_cv(), _cap(cap), _accepting(true), _need_to_flush(false), _was_flushed(false)
     {}
+
+    // Only for queues the app owns: the destructor stays the implicit one the
+    // prebuilt library was built with, so the owner calls release_drop_stream()
+    // before destroying a queue it called this on
+    void set_drop_stream(const char *name)
+    {
+        single_consumer_queue_drops *drops =
+            libeYs3D::QueueSideTable<single_consumer_queue_drops>::get().acquire(this);
+        if (drops)
+            drops->counters = &libeYs3D::DropStats::get().stream(name);
+    }
+
+    void release_drop_stream()
+    {
+        libeYs3D::QueueSideTable<single_consumer_queue_drops>::get().release(this);
+    }
     T enqueue_pop_wasted(T&& item) {
         std::unique_lock<std::mutex> lock(_mutex);
         if (_accepting)
@@ -45,6 +85,7 @@ public:
             {
                 T wasted = _queue.front();
                 _queue.pop_front();
+                record_overflow(wasted);
                 if (wasted) {
                     return wasted;
                 }
@@ -62,6 +103,7 @@ public:
             _queue.push_back(std::move(item));
             if (_queue.size() > _cap)
             {
+                record_overflow(_queue.front());
                 _queue.pop_front();
             }
         }
@@ -0,0 +1,182 @@
+/*
+ * Copyright (C) 2021 eYs3D Corporation
+ * All rights reserved.
+ * This project is licensed under the Apache License, Version 2.0.
+ */
+
+#pragma once
+
+#include "queue_side_table.h"
+#include "base/Compiler.h"
+#include "base/synchronization/Lock.h"
+#include "utils.h"
+
+#include <sched.h>
+#include <stdint.h>
+
+#include <atomic>
+
+//
+// Spin-then-block waiting for the consumers of the Pipeline queues. A
+// consumer parked on the condition variable of a queue pays a futex wake-up
+// plus the scheduler latency when the frame lands, hundreds of microseconds
+// on a loaded ARM board. With a SpinWaitPolicy set on the queue, the wait
+// first polls the queue for up to maxSpinUs, with pause/yield instructions
+// for pauseUs then with sched_yield(), and only then blocks:
+//
+//      libeYs3D::SpinWaitPolicy policy;
+//      policy.maxSpinUs = 300;
+//      pipeline->setWaitStrategy(Pipeline::STREAM::DEPTH, &policy);
+//      ...
+//      pipeline->spinWaitForDepthFrame(&frame);
+//      ...
+//      libeYs3D::SpinWaitStats stats;
+//      pipeline->getWaitStats(Pipeline::STREAM::DEPTH, &stats);
+//
+// With |adaptive| the budget halves after each wait that ended up blocking
+// (down to minSpinUs) and doubles after each one served by spinning, so a
+// consumer polling long before the next frame stops burning its core.
+// Spinning holds the queue lock only for tryLock() checks of the count.
+//
+// The waitFor*() calls of a Pipeline owned by a CameraDevice run in the
+// prebuilt library and block right away whatever the policy. The
+// spinWaitFor*() calls are inline: they spin in the app, reading the count
+// of the library-filled queue under its lock, then call waitFor*(). The
+// queues an app builds itself spin in their own deQueue().
+//
+
+namespace libeYs3D    {
+
+struct SpinWaitPolicy    {
+    int32_t maxSpinUs = 200;    // spin budget before blocking
+    int32_t pauseUs = 50;       // pause instructions first, sched_yield() after
+    int32_t minSpinUs = 10;     // floor of the adaptive budget
+    bool adaptive = true;
+};
+
+struct SpinWaitStats    {
+    uint64_t immediate = 0ull;  // data was already there
+    uint64_t pauseHits = 0ull;  // served while spinning on pause
+    uint64_t yieldHits = 0ull;  // served while spinning on sched_yield()
+    uint64_t blocked = 0ull;    // spin budget ran out, parked on the queue
+    uint64_t spinUs = 0ull;     // total time spent spinning
+    int32_t budgetUs = 0;       // current adaptive budget
+};
+
+inline void cpu_relax()    {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    asm volatile("yield" ::: "memory");
+#else
+    asm volatile("" ::: "memory");
+#endif
+}
+
+class SpinWaiter    {
+    DISALLOW_COPY_ASSIGN_AND_MOVE(SpinWaiter);
+
+public:
+    static constexpr int kPausesPerCheck = 32;
+
+    SpinWaiter() = default;
+
+    void setPolicy(const SpinWaitPolicy &policy)    {
+        mMaxSpinUs.store(policy.maxSpinUs, std::memory_order_relaxed);
+        mPauseUs.store(policy.pauseUs, std::memory_order_relaxed);
+        mMinSpinUs.store(policy.minSpinUs, std::memory_order_relaxed);
+        mAdaptive.store(policy.adaptive, std::memory_order_relaxed);
+        mBudgetUs.store(policy.maxSpinUs, std::memory_order_relaxed);
+    }
+
+    /**
+     * Spins until |ready| returns true, checked under |lock|, or the budget
+     * ran out. Returns with |lock| released either way, the caller then
+     * takes it and blocks as usual if there is still nothing to consume.
+     */
+    template <class Ready>
+    void spin(base::Lock &lock, Ready ready)    {
+        if(mMaxSpinUs.load(std::memory_order_relaxed) <= 0)    return;    // turned off
+
+        if(checkReady(lock, ready))    {
+            mImmediate.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        const int32_t budgetUs = mBudgetUs.load(std::memory_order_relaxed);
+        const int32_t pauseUs = mPauseUs.load(std::memory_order_relaxed);
+        const int64_t startUs = now_in_microsecond_high_res_time_MONOTONIC();
+        int64_t elapsedUs = 0ll;
+
+        while(elapsedUs < budgetUs)    {
+            if(elapsedUs < pauseUs)    {
+                for(int i = 0; i < kPausesPerCheck; i++)    cpu_relax();
+            } else    {
+                sched_yield();
+            }
+
+            if(checkReady(lock, ready))    {
+                elapsedUs = now_in_microsecond_high_res_time_MONOTONIC() - startUs;
+                (elapsedUs < pauseUs ? mPauseHits : mYieldHits).fetch_add(1, std::memory_order_relaxed);
+                mSpinUs.fetch_add((uint64_t)elapsedUs, std::memory_order_relaxed);
+                adapt(true);
+                return;
+            }
+            elapsedUs = now_in_microsecond_high_res_time_MONOTONIC() - startUs;
+        }
+
+        mBlocked.fetch_add(1, std::memory_order_relaxed);
+        mSpinUs.fetch_add((uint64_t)elapsedUs, std::memory_order_relaxed);
+        adapt(false);
+    }
+
+    // false if no wait went through spin() yet
+    bool getStats(SpinWaitStats *stats) const    {
+        stats->immediate = mImmediate.load(std::memory_order_relaxed);
+        stats->pauseHits = mPauseHits.load(std::memory_order_relaxed);
+        stats->yieldHits = mYieldHits.load(std::memory_order_relaxed);
+        stats->blocked = mBlocked.load(std::memory_order_relaxed);
+        stats->spinUs = mSpinUs.load(std::memory_order_relaxed);
+        stats->budgetUs = mBudgetUs.load(std::memory_order_relaxed);
+
+        return (stats->immediate + stats->pauseHits + stats->yieldHits + stats->blocked) > 0ull;
+    }
+
+private:
+    template <class Ready>
+    static bool checkReady(base::Lock &lock, Ready &ready)    {
+        if(!lock.tryLock())    return false;    // the producer is in there
+
+        bool isReady = ready();
+        lock.unlock();
+        return isReady;
+    }
+
+    void adapt(bool spinHit)    {
+        if(!mAdaptive.load(std::memory_order_relaxed))    return;
+
+        int32_t budgetUs = mBudgetUs.load(std::memory_order_relaxed);
+        int32_t maxSpinUs = mMaxSpinUs.load(std::memory_order_relaxed);
+        int32_t minSpinUs = mMinSpinUs.load(std::memory_order_relaxed);
+        budgetUs = spinHit ? budgetUs * 2 : budgetUs / 2;
+        if(budgetUs > maxSpinUs)    budgetUs = maxSpinUs;
+        if(budgetUs < minSpinUs)    budgetUs = minSpinUs;
+        mBudgetUs.store(budgetUs, std::memory_order_relaxed);
+    }
+
+    std::atomic<int32_t> mMaxSpinUs{0};
+    std::atomic<int32_t> mPauseUs{0};
+    std::atomic<int32_t> mMinSpinUs{0};
+    std::atomic<bool> mAdaptive{false};
+    std::atomic<int32_t> mBudgetUs{0};
+
+    std::atomic<uint64_t> mImmediate{0};
+    std::atomic<uint64_t> mPauseHits{0};
+    std::atomic<uint64_t> mYieldHits{0};
+    std::atomic<uint64_t> mBlocked{0};
+    std::atomic<uint64_t> mSpinUs{0};
+};
+
+using SpinWaiterTable = QueueSideTable<SpinWaiter>;
+
+}  // namespace libeYs3D
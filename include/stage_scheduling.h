@@ -0,0 +1,489 @@
+/*
+ * Copyright (C) 2021 eYs3D Corporation
+ * All rights reserved.
+ * This project is licensed under the Apache License, Version 2.0.
+ */
+
+#pragma once
+
+#include "cgroup.h"
+#include "base/Compiler.h"
+#include "base/synchronization/Lock.h"
+#include "debug.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+//
+// Per stage CPU affinity, scheduling policy, niceness and cgroup v2 cpu.max
+// quota for the worker threads of the producers.
+//
+// The producers call attach_to_cgroup(<cgroup name>, <producer name>) from
+// each of their threads when it starts (see cgroup.h). Defining
+// EYS3D_STAGE_SCHEDULING_IMPLEMENTATION in exactly one source file of the
+// application before including this header provides attach_to_cgroup() and
+// initialize_cgroup(), which then apply the policies set here instead of
+// requiring a pre-configured cgroup hierarchy:
+//
+//      #define EYS3D_STAGE_SCHEDULING_IMPLEMENTATION
+//      #include "stage_scheduling.h"
+//
+//      using libeYs3D::scheduling::Stage;
+//      auto &scheduler = libeYs3D::scheduling::StageScheduler::get();
+//
+//      libeYs3D::scheduling::StagePolicy reader;
+//      reader.cpus = { 2, 3 };
+//      reader.schedPolicy = SCHED_FIFO;
+//      reader.rtPriority = 50;
+//      scheduler.setPolicy(nullptr, Stage::READER, reader);    // all devices
+//
+//      scheduler.bindDevice("8062-0");
+//      device0->openStream(...);
+//      scheduler.bindDevice("8062-1");
+//      device1->openStream(...);
+//
+// The hooks do not tell which device a thread belongs to: threads attaching
+// after bindDevice() are attributed to that device, so open the devices one
+// after the other. Policies can be changed at any time, they are re-applied
+// to the live threads of the stage.
+//
+// Nothing here requires privileges: SCHED_FIFO falls back to SCHED_OTHER,
+// negative niceness and cpu.max quotas are skipped, each with a single log
+// line, and getThreads() reports what was applied to which thread.
+//
+
+namespace libeYs3D    {
+namespace scheduling    {
+
+enum class Stage    {
+    READER = 0,     // USB frame readers
+    RGB,            // color decoding, depth to RGB
+    FILTER,         // depth filtering
+    CALLBACK,       // delivery to the application
+    PC,             // point cloud generation
+    IMU,            // IMU reader
+    COUNT
+};
+
+inline const char *stage_name(Stage stage)    {
+    switch(stage)    {
+        case Stage::READER:   return "reader";
+        case Stage::RGB:      return "rgb";
+        case Stage::FILTER:   return "filter";
+        case Stage::CALLBACK: return "callback";
+        case Stage::PC:       return "pc";
+        case Stage::IMU:      return "imu";
+        default:              return "unknown";
+    }
+}
+
+// Maps the arguments of attach_to_cgroup() to a stage, false if unknown
+inline bool stage_from_cgroup(const char *cgroupName, const char *producerName, Stage &stage)    {
+    if(cgroupName == nullptr)    return false;
+    if(producerName == nullptr)    producerName = "";
+
+    if(strcmp(cgroupName, CAMERA_READER_CGROUP) == 0)    {    // IMU_READER_CGROUP too
+        stage = strstr(producerName, "IMU") ? Stage::IMU : Stage::READER;
+    } else if(strcmp(cgroupName, COLOR_CODER_CGROUP) == 0)    {    // PC_CODER_CGROUP too
+        stage = (strncmp(producerName, "PC", 2) == 0) ? Stage::PC : Stage::RGB;
+    } else if(strcmp(cgroupName, DEPTH_RGB_CODER_CGROUP) == 0)    {
+        stage = Stage::RGB;
+    } else if(strcmp(cgroupName, DEPTH_FILTER_CODER_CGROUP) == 0)    {
+        stage = Stage::FILTER;
+    } else if(strcmp(cgroupName, COLOR_CALLBACK_CGROUP) == 0)    {
+        stage = Stage::CALLBACK;
+    } else    {
+        return false;
+    }
+
+    return true;
+}
+
+inline pid_t current_tid()    {
+    return (pid_t)syscall(SYS_gettid);
+}
+
+struct StagePolicy    {
+    static constexpr int kUnchanged = INT_MIN;
+
+    std::vector<int> cpus;          // affinity, empty leaves it unchanged
+    int schedPolicy = kUnchanged;   // SCHED_OTHER or SCHED_FIFO
+    int rtPriority = 0;             // 1..99 with SCHED_FIFO
+    int nice = kUnchanged;          // -20..19 with SCHED_OTHER
+    int64_t cpuQuotaUs = 0ll;       // cgroup v2 cpu.max quota, 0 for none
+    int64_t cpuPeriodUs = 100000ll;
+
+    // "2-3,6" -> { 2, 3, 6 }, false on a malformed list
+    static bool parseCpuList(const char *list, std::vector<int> &cpus)    {
+        cpus.clear();
+        const char *p = list;
+        while(p && *p)    {
+            char *end = nullptr;
+            long first = strtol(p, &end, 10);
+            if(end == p || first < 0)    return false;
+            long last = first;
+            p = end;
+            if(*p == '-')    {
+                last = strtol(p + 1, &end, 10);
+                if(end == p + 1 || last < first)    return false;
+                p = end;
+            }
+            for(long cpu = first; cpu <= last; cpu++)    cpus.push_back((int)cpu);
+            if(*p == ',')    p++;
+            else if(*p != '\0')    return false;
+        }
+        return !cpus.empty();
+    }
+};
+
+// Bits of StageThread::applied and StageThread::failed
+enum : uint32_t    {
+    STAGE_APPLIED_AFFINITY  = 1u << 0,
+    STAGE_APPLIED_SCHEDULER = 1u << 1,
+    STAGE_APPLIED_NICE      = 1u << 2,
+    STAGE_APPLIED_QUOTA     = 1u << 3,
+};
+
+struct StageThread    {
+    pid_t tid;
+    Stage stage;
+    std::string producer;   // e.g. "ColorFrameProducer"
+    std::string device;     // bound device, empty if none
+    uint32_t applied;       // STAGE_APPLIED_* of the last application
+    uint32_t failed;
+};
+
+class StageScheduler    {
+    DISALLOW_COPY_ASSIGN_AND_MOVE(StageScheduler);
+
+public:
+    // Never destroyed, producer threads may attach while the process exits
+    static StageScheduler &get()    {
+        static StageScheduler *sInstance = new StageScheduler();
+        return *sInstance;
+    }
+
+    // |device| nullptr or "" sets the default of the stage for all devices
+    void setPolicy(const char *device, Stage stage, const StagePolicy &policy)    {
+        base::AutoLock lock(mLock);
+        mPolicies[PolicyKey(device ? device : "", stage)] = policy;
+        reapplyLocked(stage);
+    }
+
+    // Threads already running keep what was applied to them
+    void clearPolicy(const char *device, Stage stage)    {
+        base::AutoLock lock(mLock);
+        mPolicies.erase(PolicyKey(device ? device : "", stage));
+    }
+
+    // Threads attaching from now on belong to |device|, nullptr unbinds
+    void bindDevice(const char *device)    {
+        base::AutoLock lock(mLock);
+        mBoundDevice = device ? device : "";
+    }
+
+    // Parent of the cgroups created for quotas, defaults to the cgroup of
+    // the process, e.g. "/sys/fs/cgroup/robot.slice/camera.service"
+    void setCgroupRoot(const char *path)    {
+        base::AutoLock lock(mLock);
+        mCgroupRoot = path ? path : "";
+        mCgroupRootResolved = !mCgroupRoot.empty();
+    }
+
+    // Called on the producer threads through attach_to_cgroup()
+    void onAttach(const char *cgroupName, const char *producerName)    {
+        Stage stage;
+        if(!stage_from_cgroup(cgroupName, producerName, stage))    return;
+
+        base::AutoLock lock(mLock);
+        attachLocked(current_tid(), stage, producerName ? producerName : "", mBoundDevice);
+    }
+
+    // For the threads of the application, e.g. a frame consumer that must
+    // share the cores of the callbacks. Returns the STAGE_APPLIED_* bits.
+    uint32_t attachCurrentThread(Stage stage, const char *device = nullptr)    {
+        base::AutoLock lock(mLock);
+        return attachLocked(current_tid(), stage, "application",
+                            device ? std::string(device) : mBoundDevice).applied;
+    }
+
+    // Live threads only
+    std::vector<StageThread> getThreads()    {
+        base::AutoLock lock(mLock);
+        pruneLocked();
+        return mThreads;
+    }
+
+    // The SCHED_FIFO range this process can use without CAP_SYS_NICE, 0 if none
+    static int getMaxUnprivilegedRtPriority()    {
+        struct rlimit limit;
+        if(getrlimit(RLIMIT_RTPRIO, &limit) != 0)    return 0;
+        return (limit.rlim_cur == RLIM_INFINITY) ? sched_get_priority_max(SCHED_FIFO)
+                                                 : (int)limit.rlim_cur;
+    }
+
+private:
+    using PolicyKey = std::pair<std::string, Stage>;
+
+    enum WarnedFlag : uint32_t    {
+        WARNED_AFFINITY = 1u << 0,
+        WARNED_FIFO     = 1u << 1,
+        WARNED_NICE     = 1u << 2,
+        WARNED_CGROUP   = 1u << 3,
+    };
+
+    StageScheduler() = default;
+
+    StageThread &attachLocked(pid_t tid, Stage stage, const std::string &producer,
+                              const std::string &device)    {
+        pruneLocked();
+
+        StageThread *thread = nullptr;
+        for(StageThread &t : mThreads)    {
+            if(t.tid == tid)    thread = &t;
+        }
+        if(thread == nullptr)    {
+            mThreads.push_back(StageThread());
+            thread = &mThreads.back();
+        }
+        thread->tid = tid;
+        thread->stage = stage;
+        thread->producer = producer;
+        thread->device = device;
+        thread->applied = 0u;
+        thread->failed = 0u;
+
+        const StagePolicy *policy = findPolicyLocked(device, stage);
+        if(policy)    applyLocked(*thread, *policy);
+
+        return *thread;
+    }
+
+    // The policy of the device, the default of the stage otherwise
+    const StagePolicy *findPolicyLocked(const std::string &device, Stage stage) const    {
+        auto it = mPolicies.find(PolicyKey(device, stage));
+        if(it == mPolicies.end() && !device.empty())    it = mPolicies.find(PolicyKey("", stage));
+        return (it == mPolicies.end()) ? nullptr : &it->second;
+    }
+
+    void reapplyLocked(Stage stage)    {
+        pruneLocked();
+        for(StageThread &thread : mThreads)    {
+            if(thread.stage != stage)    continue;
+
+            const StagePolicy *policy = findPolicyLocked(thread.device, stage);
+            if(policy)    applyLocked(thread, *policy);
+        }
+    }
+
+    // Drops the threads which exited, the hooks do not tell
+    void pruneLocked()    {
+        char path[64];
+        for(size_t i = 0; i < mThreads.size();)    {
+            snprintf(path, sizeof(path), "/proc/self/task/%d", (int)mThreads[i].tid);
+            if(access(path, F_OK) == 0)    {
+                i++;
+                continue;
+            }
+            mThreads[i] = std::move(mThreads.back());
+            mThreads.pop_back();
+        }
+    }
+
+    void applyLocked(StageThread &thread, const StagePolicy &policy)    {
+        thread.applied = 0u;
+        thread.failed = 0u;
+
+        if(!policy.cpus.empty())    {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for(int cpu : policy.cpus)    {
+                if(cpu >= 0 && cpu < CPU_SETSIZE)    CPU_SET(cpu, &set);
+            }
+            if(sched_setaffinity(thread.tid, sizeof(set), &set) == 0)    {
+                thread.applied |= STAGE_APPLIED_AFFINITY;
+            } else    {
+                thread.failed |= STAGE_APPLIED_AFFINITY;
+                warnOnceLocked(WARNED_AFFINITY, "CPU affinity of %s %s not applied",
+                               thread.producer.c_str(), stage_name(thread.stage));
+            }
+        }
+
+        bool realtime = false;
+        if(policy.schedPolicy == SCHED_FIFO)    {
+            struct sched_param param;
+            memset(&param, 0, sizeof(param));
+            param.sched_priority = policy.rtPriority;
+            if(sched_setscheduler(thread.tid, SCHED_FIFO, &param) == 0)    {
+                thread.applied |= STAGE_APPLIED_SCHEDULER;
+                realtime = true;
+            } else    {
+                thread.failed |= STAGE_APPLIED_SCHEDULER;
+                warnOnceLocked(WARNED_FIFO, "SCHED_FIFO %d of %s %s not permitted (rlimit %d), "
+                               "keeping SCHED_OTHER", policy.rtPriority, thread.producer.c_str(),
+                               stage_name(thread.stage), getMaxUnprivilegedRtPriority());
+            }
+        }
+        if(!realtime && policy.schedPolicy != StagePolicy::kUnchanged)    {
+            // also where SCHED_FIFO was refused, or set by an earlier policy
+            struct sched_param param;
+            memset(&param, 0, sizeof(param));
+            if(sched_setscheduler(thread.tid, SCHED_OTHER, &param) == 0 &&
+               policy.schedPolicy == SCHED_OTHER)    {
+                thread.applied |= STAGE_APPLIED_SCHEDULER;
+            }
+        }
+
+        if(!realtime && policy.nice != StagePolicy::kUnchanged)    {
+            if(setpriority(PRIO_PROCESS, (id_t)thread.tid, policy.nice) == 0)    {
+                thread.applied |= STAGE_APPLIED_NICE;
+            } else    {
+                thread.failed |= STAGE_APPLIED_NICE;
+                warnOnceLocked(WARNED_NICE, "nice %d of %s %s not permitted",
+                               policy.nice, thread.producer.c_str(), stage_name(thread.stage));
+            }
+        }
+
+        if(policy.cpuQuotaUs > 0ll)    {
+            if(attachToQuotaGroupLocked(thread, policy))    {
+                thread.applied |= STAGE_APPLIED_QUOTA;
+            } else    {
+                thread.failed |= STAGE_APPLIED_QUOTA;
+            }
+        }
+    }
+
+    // A threaded cgroup per device and stage under the cgroup root, with
+    // |policy.cpuQuotaUs| of every |policy.cpuPeriodUs|
+    bool attachToQuotaGroupLocked(const StageThread &thread, const StagePolicy &policy)    {
+        if(!resolveCgroupRootLocked())    return false;
+
+        std::string name = std::string("eys3d-") + stage_name(thread.stage);
+        if(!thread.device.empty())    {
+            name += '-';
+            for(char c : thread.device)    name += (isalnum((unsigned char)c) ? c : '_');
+        }
+        std::string group = mCgroupRoot + "/" + name;
+
+        if(mkdir(group.c_str(), 0755) != 0 && errno != EEXIST)    {
+            warnOnceLocked(WARNED_CGROUP, "Unable to create %s (%s), cpu.max quotas disabled",
+                           group.c_str(), strerror(errno));
+            return false;
+        }
+        // the controllers of threaded cgroups apply per thread; the root
+        // becomes "domain threaded" and keeps the process
+        writeFile(group + "/cgroup.type", "threaded");
+        writeFile(mCgroupRoot + "/cgroup.subtree_control", "+cpu");
+
+        char value[64];
+        snprintf(value, sizeof(value), "%lld %lld",
+                 (long long)policy.cpuQuotaUs, (long long)policy.cpuPeriodUs);
+        if(!writeFile(group + "/cpu.max", value))    {
+            warnOnceLocked(WARNED_CGROUP, "Unable to set %s/cpu.max (%s), cpu.max quotas disabled",
+                           group.c_str(), strerror(errno));
+            return false;
+        }
+
+        snprintf(value, sizeof(value), "%d", (int)thread.tid);
+        if(!writeFile(group + "/cgroup.threads", value))    {
+            warnOnceLocked(WARNED_CGROUP, "Unable to move thread %s into %s (%s)",
+                           value, group.c_str(), strerror(errno));
+            return false;
+        }
+
+        return true;
+    }
+
+    // The cgroup v2 directory of the process from /proc/self/cgroup
+    bool resolveCgroupRootLocked()    {
+        if(mCgroupRootResolved)    return !mCgroupRoot.empty();
+        mCgroupRootResolved = true;
+
+        if(access("/sys/fs/cgroup/cgroup.controllers", F_OK) != 0)    {
+            warnOnceLocked(WARNED_CGROUP, "No cgroup v2 hierarchy, cpu.max quotas disabled");
+            return false;
+        }
+
+        FILE *file = fopen("/proc/self/cgroup", "r");
+        if(file == nullptr)    return false;
+
+        char line[PATH_MAX];
+        while(fgets(line, sizeof(line), file))    {
+            if(strncmp(line, "0::", 3) != 0)    continue;
+
+            std::string path = line + 3;
+            while(!path.empty() && path.back() == '\n')    path.pop_back();
+            if(path == "/")    path.clear();
+            mCgroupRoot = "/sys/fs/cgroup" + path;
+            break;
+        }
+        fclose(file);
+
+        return !mCgroupRoot.empty();
+    }
+
+    static bool writeFile(const std::string &path, const char *value)    {
+        int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+        if(fd < 0)    return false;
+
+        size_t length = strlen(value);
+        ssize_t written = write(fd, value, length);
+        int error = errno;
+        close(fd);
+        errno = error;
+
+        return written == (ssize_t)length;
+    }
+
+    void warnOnceLocked(uint32_t flag, const char *FMT, ...)    {
+        if(mWarned & flag)    return;
+        mWarned |= flag;
+
+        char buffer[512];
+        va_list args;
+        va_start(args, FMT);
+        vsnprintf(buffer, sizeof(buffer), FMT, args);
+        va_end(args);
+        LOG_WARN("StageScheduler", "%s", buffer);
+    }
+
+    base::Lock mLock;
+    std::map<PolicyKey, StagePolicy> mPolicies;     // guarded by mLock
+    std::vector<StageThread> mThreads;
+    std::string mBoundDevice;
+    std::string mCgroupRoot;
+    bool mCgroupRootResolved = false;
+    uint32_t mWarned = 0u;
+};
+
+}  // namespace scheduling
+}  // namespace libeYs3D
+
+#ifdef EYS3D_STAGE_SCHEDULING_IMPLEMENTATION
+// Take the place of the hooks of the library, see cgroup.h
+void initialize_cgroup()    {
+    libeYs3D::scheduling::StageScheduler::get();
+}
+
+void attach_to_cgroup(const char *cgroupName, const char *log_tag)    {
+    libeYs3D::scheduling::StageScheduler::get().onAttach(cgroupName, log_tag);
+}
+#endif
@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2021 eYs3D Corporation
+ * All rights reserved.
+ * This project is licensed under the Apache License, Version 2.0.
+ */
+
+#pragma once
+
+#ifdef WIN32
+#  include <eSPDI_DM.h>
+#else
+#  include <eSPDI.h>
+#endif
+#include "ColorPaletteGenerator.h"
+#include "debug.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+//
+// Synthetic camera frames for the benchmarks: deterministic so runs are
+// comparable, shaped like what the devices deliver (noise, holes, a few
+// objects in front of a plane) so data dependent kernels take their usual
+// paths.
+//
+
+namespace libeYs3D    {
+namespace bench    {
+
+static constexpr int kD11MaxDisparity = 2047;
+static constexpr int kZ14MaxDepth = 16383;
+
+inline uint32_t next_random(uint32_t &state)    {
+    state = state * 1664525u + 1013904223u;
+    return state >> 8;
+}
+
+// Loads a raw frame dump, fails if the file is not exactly |expectedSize|
+// bytes long (0 accepts any size)
+inline bool load_raw(const char *path, std::vector<uint8_t> &buffer, size_t expectedSize)    {
+    if(path == nullptr)    return false;
+
+    FILE *file = fopen(path, "rb");
+    if(file == nullptr)    {
+        LOG_ERR_ERRNO("bench", "Unable to open %s", path);
+        return false;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if(size <= 0 || (expectedSize != 0 && size != (long)expectedSize))    {
+        fclose(file);
+        return false;
+    }
+
+    buffer.resize((size_t)size);
+    size_t length = fread(buffer.data(), 1, (size_t)size, file);
+    fclose(file);
+
+    return length == (size_t)size;
+}
+
+// Gradient with noise, YUY2 (Y0 U Y1 V)
+inline void make_yuy2(std::vector<uint8_t> &yuy2, int32_t width, int32_t height)    {
+    uint32_t state = 1;
+
+    yuy2.resize((size_t)width * height * 2);
+    for(int32_t y = 0; y < height; y++)    {
+        uint8_t *row = &yuy2[(size_t)y * width * 2];
+        for(int32_t x = 0; x < width; x += 2)    {
+            row[x * 2 + 0] = (uint8_t)((x * 255 / width + (next_random(state) & 0x0F)) & 0xFF);
+            row[x * 2 + 1] = (uint8_t)(128 + (y * 64 / height) - 32);
+            row[x * 2 + 2] = (uint8_t)((x * 255 / width + (next_random(state) & 0x0F)) & 0xFF);
+            row[x * 2 + 3] = (uint8_t)(128 - (x * 64 / width) + 32);
+        }
+    }
+}
+
+// A tilted plane with a few boxes in front of it and ~5% holes, 16 bits per
+// pixel with values in [1, maxValue]; |nearIsLarge| for disparity
+inline void make_depth(std::vector<uint8_t> &depth, int32_t width, int32_t height,
+                       int maxValue, bool nearIsLarge)    {
+    uint32_t state = 7;
+
+    depth.resize((size_t)width * height * 2);
+    uint16_t *pixels = (uint16_t *)depth.data();
+    for(int32_t y = 0; y < height; y++)    {
+        for(int32_t x = 0; x < width; x++)    {
+            // distance in [0.25, 1.0] of the range, nearer at the bottom
+            float distance = 1.0f - 0.75f * (float)y / (float)height;
+            if(((x / (width / 8)) & 1) && ((y / (height / 4)) & 1))    distance *= 0.5f;
+            distance += (float)(next_random(state) & 0xFF) / 255.0f * 0.01f;
+
+            uint16_t value = nearIsLarge ? (uint16_t)(maxValue * 0.25f / distance)
+                                         : (uint16_t)(maxValue * distance);
+            if(value > maxValue)    value = maxValue;
+            if(value == 0)    value = 1;
+            if((next_random(state) % 100) < 5)    value = 0;
+
+            pixels[(size_t)y * width + x] = value;
+        }
+    }
+}
+
+// Reprojection matrix of a 60 degree HFOV camera with a 5 cm baseline
+inline void make_rect_log(eSPCtrl_RectLogData &rectLog, int32_t width, int32_t height)    {
+    memset(&rectLog, 0, sizeof(rectLog));
+
+    float focal = (float)width * 0.866f;
+    rectLog.InImgWidth = width;
+    rectLog.InImgHeight = height;
+    rectLog.OutImgWidth = width;
+    rectLog.OutImgHeight = height;
+    rectLog.CamMat1[0] = focal;
+    rectLog.CamMat1[2] = width / 2.0f;
+    rectLog.CamMat1[4] = focal;
+    rectLog.CamMat1[5] = height / 2.0f;
+    rectLog.CamMat1[8] = 1.0f;
+
+    rectLog.ReProjectMat[0] = 1.0f;
+    rectLog.ReProjectMat[3] = -width / 2.0f;
+    rectLog.ReProjectMat[5] = 1.0f;
+    rectLog.ReProjectMat[7] = -height / 2.0f;
+    rectLog.ReProjectMat[11] = focal;
+    rectLog.ReProjectMat[14] = 1.0f / 50.0f;
+}
+
+// The depth to RGB24 mapping done by the depth producer: one palette lookup
+// per pixel, 14 bits depth or 11 bits disparity
+inline void colorize_depth(const RGBQUAD *palette, int paletteSize,
+                           const uint16_t *depth, uint8_t *rgb, int32_t pixelCount)    {
+    for(int32_t i = 0; i < pixelCount; i++)    {
+        uint16_t value = depth[i];
+        if(value >= paletteSize)    value = paletteSize - 1;
+
+        const RGBQUAD &color = palette[value];
+        rgb[i * 3 + 0] = color.rgbRed;
+        rgb[i * 3 + 1] = color.rgbGreen;
+        rgb[i * 3 + 2] = color.rgbBlue;
+    }
+}
+
+// Organized cloud of a 14 bits depth frame from make_depth(), in mm through
+// the pinhole of make_rect_log(), the layout of PCFrame::xyzDataVec: holes
+// are (0, 0, 0)
+inline void make_xyz(std::vector<float> &xyz, const std::vector<uint8_t> &z14,
+                     int32_t width, int32_t height)    {
+    const uint16_t *depth = (const uint16_t *)z14.data();
+    const float focal = (float)width * 0.866f;
+
+    xyz.assign((size_t)width * height * 3, 0.0f);
+    for(int32_t y = 0; y < height; y++)    {
+        for(int32_t x = 0; x < width; x++)    {
+            size_t i = (size_t)y * width + x;
+            float z = (float)depth[i];
+            if(depth[i] == 0)    continue;
+
+            xyz[i * 3 + 0] = ((float)x - width / 2.0f) * z / focal;
+            xyz[i * 3 + 1] = ((float)y - height / 2.0f) * z / focal;
+            xyz[i * 3 + 2] = z;
+        }
+    }
+}
+
+}  // namespace bench
+}  // namespace libeYs3D
@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2021 eYs3D Corporation
+ * All rights reserved.
+ * This project is licensed under the Apache License, Version 2.0.
+ */
+
+#pragma once
+
+#include "video/Producer.h"
+#include "video/PCProducer.h"
+#include "drop_stats.h"
+#include "base/Compiler.h"
+#include "base/synchronization/ConditionVariable.h"
+#include "base/synchronization/Lock.h"
+#include "base/threads/FunctorThread.h"
+
+#include <stdint.h>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+//
+// Latest-frame-wins callback delivery.
+//
+// The producers wait for the app callback of a frame to return before they
+// hand out the next one (mCBFinishSignal), so a slow callback throttles the
+// whole producer down to the USB reader. A LatestFrameMailbox sits between
+// the producer and such a callback: the producer only copies the frame into
+// the mailbox and goes on, the callback runs on the mailbox thread with the
+// newest frame, and a frame replaced before the callback could take it is
+// counted as SUPERSEDED and its buffer goes back to the pool.
+//
+//      libeYs3D::video::FrameMailbox colorMailbox("viewer.color", render_color);
+//      libeYs3D::video::PCFrameMailbox pcMailbox("viewer.pc", render_cloud);
+//      cameraDevice->openStream(colorMailbox.callback(), depth_callback,
+//                               pcMailbox.callback(), imu_callback);
+//      ...
+//      cameraDevice->closeStream();    // before the mailboxes go away
+//
+// The mailbox holds three frames at most: the one in the callback, the newest
+// waiting one and the one being filled; none is allocated after the first
+// frames. The callback result is returned to the producer with the next frame.
+//
+
+namespace libeYs3D    {
+namespace video    {
+
+template <class T>
+class LatestFrameMailbox    {
+    DISALLOW_COPY_ASSIGN_AND_MOVE(LatestFrameMailbox);
+
+public:
+    using Callback = std::function<bool(const T *frame)>;
+
+    static constexpr int kPoolSize = 3;
+
+    LatestFrameMailbox(const char *name, Callback callback)
+        : mName(name), mCallback(std::move(callback)),
+          mDrops(DropStats::get().stream(name)),
+          mThread([this]() { deliveryMain(); })    {
+        for(int i = 0; i < kPoolSize; i++)    mFree.emplace_back(new T());
+        mThread.start();
+    }
+
+    // Pending frames are discarded, the running callback is waited for
+    ~LatestFrameMailbox()    {
+        {
+            base::AutoLock lock(mLock);
+            mStopped = true;
+            mCond.signal();
+        }
+        mThread.wait();
+    }
+
+    // To hand to the producer, e.g. CameraDevice::openStream()
+    Callback callback()    {
+        return [this](const T *frame) -> bool { return post(frame); };
+    }
+
+    // Copies |frame| in, never waits for the callback
+    bool post(const T *frame)    {
+        std::unique_ptr<T> slot;
+        {
+            base::AutoLock lock(mLock);
+            if(mStopped)    return false;
+            if(!mFree.empty())    {
+                slot = std::move(mFree.back());
+                mFree.pop_back();
+            }
+        }
+        if(!slot)    slot.reset(new T());    // more than one producer thread
+        slot->clone(frame);
+
+        base::AutoLock lock(mLock);
+        mPosted += 1;
+        if(mPending)    {
+            mDrops.record(DropReason::SUPERSEDED, mPending->serialNumber);
+            mSuperseded += 1;
+            mFree.push_back(std::move(mPending));
+        }
+        mPending = std::move(slot);
+        mCond.signal();
+
+        return mLastResult;
+    }
+
+    uint64_t getPostedCount()    {
+        base::AutoLock lock(mLock);
+        return mPosted;
+    }
+
+    uint64_t getDeliveredCount()    {
+        base::AutoLock lock(mLock);
+        return mDelivered;
+    }
+
+    uint64_t getSupersededCount()    {
+        base::AutoLock lock(mLock);
+        return mSuperseded;
+    }
+
+    const std::string &getName() const    { return mName; }
+
+private:
+    void deliveryMain()    {
+        std::unique_ptr<T> frame;
+        base::AutoLock lock(mLock);
+        while(true)    {
+            while(!mPending && !mStopped)    mCond.wait(&lock);
+            if(mStopped)    break;
+
+            frame = std::move(mPending);
+            lock.unlock();
+
+            bool result = mCallback(frame.get());
+
+            lock.lock();
+            mLastResult = result;
+            mDelivered += 1;
+            mFree.push_back(std::move(frame));
+        }
+    }
+
+    const std::string mName;
+    const Callback mCallback;
+    DropCounters &mDrops;
+
+    base::Lock mLock;
+    base::ConditionVariable mCond;
+    std::unique_ptr<T> mPending;                // guarded by mLock
+    std::vector<std::unique_ptr<T>> mFree;
+    bool mLastResult = true;
+    bool mStopped = false;
+    uint64_t mPosted = 0ull;
+    uint64_t mDelivered = 0ull;
+    uint64_t mSuperseded = 0ull;
+
+    base::FunctorThread mThread;
+};
+
+using FrameMailbox = LatestFrameMailbox<Frame>;
+using PCFrameMailbox = LatestFrameMailbox<PCFrame>;
+
+}  // namespace video
+}  // namespace libeYs3D
@@ -0,0 +1,256 @@
+/*
+ * Copyright (C) 2021 eYs3D Corporation
+ * All rights reserved.
+ * This project is licensed under the Apache License, Version 2.0.
+ */
+
+#pragma once
+
+#include "video/PCFrame.h"
+#include "base/Compiler.h"
+#include "base/synchronization/Lock.h"
+#include "DMPreview_utility/PlyWriter.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <vector>
+
+//
+// Triangle mesh of an organized point cloud.
+//
+// The points of a PCFrame are laid out row by row like the depth pixels, so
+// each 2x2 block of neighbouring points is a quad of the surface. The quad
+// becomes two triangles where its corners are valid and their depths stay
+// within maxDepthChangeFactor * z of each other. Across a depth jump, the
+// triangles that do not straddle it are kept (one or none). No search is
+// needed, and a frame costs one pass over its points:
+//
+//      OrganizedMeshBuilder builder;
+//      PCMesh mesh;
+//      builder.build(pcFrame, &mesh);
+//      PlyWriter::writePlyMesh(mesh.vertices, mesh.indices, "mesh.ply");
+//
+// Only the points used by a triangle become vertices, as CloudPoint (the
+// vertex layout of PlyWriter). Triangles are counter-clockwise as seen from
+// the camera.
+//
+// With the producer hooks of video/PCProducerHooks.h, PCMeshStage builds
+// the mesh of each point cloud frame inside PCFrameProducer, into meshes
+// pooled from one frame to the next. The point cloud callback picks it up
+// with its frame:
+//
+//      PCMeshStage::get().configure(true);
+//      ...
+//      bool pc_callback(const PCFrame *frame)    {
+//          std::shared_ptr<const PCMesh> mesh = PCMeshStage::get().meshFor(frame);
+//          if(mesh)    ... mesh->vertices, mesh->indices
+//      }
+//
+// A mesh held by the application is not reused until it is released. The
+// stage starts from $EYS3D_PC_MESH (1: on).
+//
+
+namespace libeYs3D    {
+namespace video    {
+
+struct PCMesh    {
+    int64_t tsUs = 0ll;                 // of the point cloud frame
+    uint32_t serialNumber = 0u;
+    int32_t width = 0;                  // of the organized cloud
+    int32_t height = 0;
+    std::vector<CloudPoint> vertices;
+    std::vector<uint32_t> indices;      // 3 per triangle
+
+    size_t triangleCount() const    { return indices.size() / 3; }
+};
+
+class OrganizedMeshBuilder    {
+    DISALLOW_COPY_ASSIGN_AND_MOVE(OrganizedMeshBuilder);
+
+public:
+    OrganizedMeshBuilder() = default;
+
+    // Corners further apart than |factor| * z in depth are on different surfaces
+    void setMaxDepthChangeFactor(float factor)    { mMaxDepthChange = (factor > 0.0f) ? factor : 0.0f; }
+    float getMaxDepthChangeFactor() const    { return mMaxDepthChange; }
+
+    /**
+     * Meshes the |width| x |height| points of |xyz| and |rgb| (3 values
+     * each) into |mesh|, reusing its buffers.
+     * return
+     *     number of triangles
+     */
+    size_t build(const float *xyz, const uint8_t *rgb, int32_t width, int32_t height, PCMesh *mesh)    {
+        mesh->width = width;
+        mesh->height = height;
+        mesh->vertices.clear();
+        mesh->indices.clear();
+        if(width < 2 || height < 2)    return 0;
+
+        mRemap.assign((size_t)width * height, (uint32_t)kNoVertex);
+        for(int32_t y = 0; y + 1 < height; y++)    {
+            for(int32_t x = 0; x + 1 < width; x++)    {
+                const size_t a = (size_t)y * width + x, b = a + 1, c = a + width, d = c + 1;
+                meshQuad(xyz, rgb, a, b, c, d, mesh);
+            }
+        }
+        return mesh->triangleCount();
+    }
+
+    // The organized cloud of |frame|, 0 triangles if it is not organized
+    size_t build(const PCFrame *frame, PCMesh *mesh)    {
+        mesh->tsUs = frame->tsUs;
+        mesh->serialNumber = frame->serialNumber;
+
+        const size_t count = (size_t)std::max(frame->width, 0) * (size_t)std::max(frame->height, 0);
+        if(frame->xyzDataVec.size() != count * 3 || frame->rgbDataVec.size() != count * 3)    {
+            mesh->width = mesh->height = 0;
+            mesh->vertices.clear();
+            mesh->indices.clear();
+            return 0;
+        }
+        return build(frame->xyzDataVec.data(), frame->rgbDataVec.data(), frame->width, frame->height, mesh);
+    }
+
+private:
+    static constexpr uint32_t kNoVertex = 0xFFFFFFFFu;
+
+    static bool isValid(const float *p)    {
+        return p[2] > 0.0f && isfinite(p[0]) && isfinite(p[1]) && isfinite(p[2]);
+    }
+
+    bool isSurface(const float *xyz, size_t i, size_t j, size_t k) const    {
+        const float zi = xyz[i * 3 + 2], zj = xyz[j * 3 + 2], zk = xyz[k * 3 + 2];
+        const float nearest = std::min(zi, std::min(zj, zk));
+        return std::max(zi, std::max(zj, zk)) - nearest <= mMaxDepthChange * nearest;
+    }
+
+    uint32_t vertexOf(const float *xyz, const uint8_t *rgb, size_t i, PCMesh *mesh)    {
+        uint32_t &vertex = mRemap[i];
+        if(vertex != kNoVertex)    return vertex;
+
+        const float *p = xyz + i * 3;
+        const uint8_t *c = rgb + i * 3;
+        vertex = (uint32_t)mesh->vertices.size();
+        mesh->vertices.push_back(CloudPoint{ p[0], p[1], p[2], c[0], c[1], c[2] });
+        return vertex;
+    }
+
+    void addTriangle(const float *xyz, const uint8_t *rgb, size_t i, size_t j, size_t k, PCMesh *mesh)    {
+        const uint32_t vi = vertexOf(xyz, rgb, i, mesh);
+        const uint32_t vj = vertexOf(xyz, rgb, j, mesh);
+        const uint32_t vk = vertexOf(xyz, rgb, k, mesh);
+        mesh->indices.push_back(vi);
+        mesh->indices.push_back(vj);
+        mesh->indices.push_back(vk);
+    }
+
+    // a b
+    // c d, split along b-c, or along a-d when that keeps more triangles
+    void meshQuad(const float *xyz, const uint8_t *rgb, size_t a, size_t b, size_t c, size_t d, PCMesh *mesh)    {
+        const bool va = isValid(xyz + a * 3), vb = isValid(xyz + b * 3);
+        const bool vc = isValid(xyz + c * 3), vd = isValid(xyz + d * 3);
+        if((int)va + (int)vb + (int)vc + (int)vd < 3)    return;
+
+        const bool acb = va && vb && vc && isSurface(xyz, a, c, b);
+        const bool bcd = vb && vc && vd && isSurface(xyz, b, c, d);
+        if(acb && bcd)    {
+            addTriangle(xyz, rgb, a, c, b, mesh);
+            addTriangle(xyz, rgb, b, c, d, mesh);
+            return;
+        }
+
+        const bool acd = va && vc && vd && isSurface(xyz, a, c, d);
+        const bool adb = va && vd && vb && isSurface(xyz, a, d, b);
+        if((int)acd + (int)adb > (int)acb + (int)bcd)    {
+            if(acd)    addTriangle(xyz, rgb, a, c, d, mesh);
+            if(adb)    addTriangle(xyz, rgb, a, d, b, mesh);
+            return;
+        }
+        if(acb)    addTriangle(xyz, rgb, a, c, b, mesh);
+        if(bcd)    addTriangle(xyz, rgb, b, c, d, mesh);
+    }
+
+    float mMaxDepthChange = 0.05f;
+    std::vector<uint32_t> mRemap;       // vertex of each point, kNoVertex: not used yet
+};
+
+// Meshes of the latest point cloud frames, built inside PCFrameProducer
+class PCMeshStage    {
+    DISALLOW_COPY_ASSIGN_AND_MOVE(PCMeshStage);
+
+public:
+    // Meshes kept for the callbacks: the frames in flight of a few producers
+    static constexpr size_t kPoolSize = 8;
+
+    // Never destroyed, producers may still run while static destructors do
+    static PCMeshStage &get()    {
+        static PCMeshStage *sInstance = new PCMeshStage();
+        return *sInstance;
+    }
+
+    void configure(bool enabled, float maxDepthChangeFactor = 0.05f)    {
+        mMaxDepthChange = maxDepthChangeFactor;
+        mEnabled = enabled;
+    }
+
+    bool isEnabled() const    { return mEnabled; }
+    float getMaxDepthChangeFactor() const    { return mMaxDepthChange; }
+
+    /**
+     * The mesh of |frame|, nullptr if it has none or it already left the
+     * pool.
+     */
+    std::shared_ptr<const PCMesh> meshFor(const PCFrame *frame)    {
+        base::AutoLock lock(mLock);
+        for(auto iter = mMeshes.rbegin(); iter != mMeshes.rend(); ++iter)    {
+            const PCMesh &mesh = **iter;
+            if(mesh.serialNumber == frame->serialNumber && mesh.tsUs == frame->tsUs)    return *iter;
+        }
+        return nullptr;
+    }
+
+    // A mesh to build into: the oldest one nobody holds once the pool is full
+    std::shared_ptr<PCMesh> acquire()    {
+        base::AutoLock lock(mLock);
+        if(mMeshes.size() >= kPoolSize)    {
+            for(auto iter = mMeshes.begin(); iter != mMeshes.end(); ++iter)    {
+                if(iter->use_count() != 1)    continue;
+
+                std::shared_ptr<PCMesh> mesh = std::move(*iter);
+                mMeshes.erase(iter);
+                return mesh;
+            }
+        }
+        return std::make_shared<PCMesh>();
+    }
+
+    // Hands |mesh| to meshFor(), the oldest mesh leaves the pool past kPoolSize
+    void publish(std::shared_ptr<PCMesh> mesh)    {
+        base::AutoLock lock(mLock);
+        mMeshes.push_back(std::move(mesh));
+        if(mMeshes.size() > kPoolSize)    mMeshes.pop_front();
+    }
+
+private:
+    PCMeshStage()    {
+        const char *mesh = getenv("EYS3D_PC_MESH");
+        configure(mesh && atoi(mesh) != 0);
+    }
+
+    std::atomic<bool> mEnabled{false};
+    std::atomic<float> mMaxDepthChange{0.05f};
+
+    base::Lock mLock;
+    std::deque<std::shared_ptr<PCMesh>> mMeshes;    // oldest first
+};
+
+}  // namespace video
+}  // namespace libeYs3D
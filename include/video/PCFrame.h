@@ -25,6 +25,7 @@ public:
     int32_t width;
     int32_t height;
 
+    // drgbDataVec: normals of PCNormalStage when set, see video/PointCloudNormals.h
 #ifdef DEVICE_MEMORY_ALLOCATOR
     std::vector<uint8_t, libeYs3D::devices::MemoryAllocator<uint8_t>> drgbDataVec;
     std::vector<uint8_t, libeYs3D::devices::MemoryAllocator<uint8_t>> rgbDataVec;
@@ -0,0 +1,310 @@
+/*
+ * Copyright (C) 2021 eYs3D Corporation
+ * All rights reserved.
+ * This project is licensed under the Apache License, Version 2.0.
+ */
+
+#pragma once
+
+#include "video/OrganizedMesh.h"
+#include "video/PointCloudCrop.h"
+#include "video/PointCloudDownsampler.h"
+#include "video/PointCloudGenerator.h"
+#include "video/PointCloudNormals.h"
+
+//
+// Point cloud stages run by PCFrameProducer on its own thread, before a frame
+// is queued for the point cloud callback:
+//
+//  - PCStrideStage: the cloud of a device is generated on every k-th row and
+//    column of the depth frame instead of every pixel (PointCloudGenerator).
+//    The frame then holds width x height points of the strided grid.
+//  - PCProjectionStage: the cloud of a device is deprojected through a
+//    cylinder for wide FOV modules, its rows split over several threads.
+//  - PCCropStage: only a rectangle and depth range of the depth frame are
+//    deprojected, and the points outside a box are dropped once the stages
+//    on the organized cloud ran (PointCloudCrop.h).
+//  - PCNormalStage: normals of the organized cloud, in drgbDataVec
+//    (PointCloudNormalEstimator).
+//  - PCMeshStage: triangle mesh of the organized cloud, for meshFor()
+//    (OrganizedMeshBuilder).
+//  - PCDownsampleStage: one point per voxel (PointCloudDownsampler).
+//
+// PCFrameProducer and CameraDevice::readPCFrame() live in the prebuilt
+// library. Defining EYS3D_PC_PRODUCER_HOOKS_IMPLEMENTATION in exactly one
+// source file of the application before including this header replaces them
+// with versions that run the stages. The application then needs libdl
+// (${CMAKE_DL_LIBS}):
+//
+//      #define EYS3D_PC_PRODUCER_HOOKS_IMPLEMENTATION
+//      #include "video/PCProducerHooks.h"
+//      ...
+//      PCStrideStage::Options options;
+//      options.targetPointCount = 160 * 90;
+//      PCStrideStage::get().setOptions(device.get(), options);
+//
+// The test programs do this only when configured with -DEYS3D_PC_PRODUCER_HOOKS=ON.
+// Stages left unconfigured cost one lookup per frame.
+//
+// The generator reproduces APC_GetPointCloud() for the default point cloud
+// configuration of a device only: PLY filter off, full resolution depth,
+// and mPointCloudInfo decoding the depth format of the stream. Otherwise
+// the stride, crop and projection stages are skipped with a warning and the
+// library deprojects the frame. check_pc_generator() compares the two on a
+// frame of the device, callback.test runs it on its first depth frame.
+//
+
+#ifdef EYS3D_PC_PRODUCER_HOOKS_IMPLEMENTATION
+
+#include "video/PCFrameProducer.h"
+#include "devices/CameraDevice.h"
+
+#include <dlfcn.h>
+#include <math.h>
+
+#include <atomic>
+#include <vector>
+
+namespace libeYs3D    {
+namespace video    {
+namespace internal    {
+
+// What the hooks of one producer thread share across its frames
+struct PCProducerState    {
+    PointCloudGenerator generator;
+    PointCloudNormalEstimator normals;
+    OrganizedMeshBuilder meshBuilder;
+    PointCloudDownsampler compactor{0.0f};     // keeps the valid points of cropped frames
+    PointCloudDownsampler downsampler;
+    size_t fullSize = 0;            // values of a full resolution cloud, 3 per point
+    bool strided = false;           // readPCFrame() of the current frame used the generator
+    bool cropped = false;           // and cropped it
+    int32_t width = 0;              // its grid
+    int32_t height = 0;
+};
+
+inline PCProducerState &pc_producer_state()    {
+    static thread_local PCProducerState sState;     // one producer per thread
+    return sState;
+}
+
+// How the readPCFrame() of this thread deprojects, for check_pc_generator()
+enum class PCReadMode    {
+    STAGES,         // as configured in the stages
+    LIBRARY,        // APC_GetPointCloud()
+    GENERATOR       // the generator at stride 1, no crop, pinhole
+};
+
+inline PCReadMode &pc_read_mode()    {
+    static thread_local PCReadMode sMode = PCReadMode::STAGES;
+    return sMode;
+}
+
+inline void *pc_producer_original(const char *symbol)    {
+    void *original = dlsym(RTLD_NEXT, symbol);
+    if(original == nullptr)    LOG_ERR("PCProducerHooks", "Unable to find %s: %s", symbol, dlerror());
+    return original;
+}
+
+using PCProduceOriginal = int (*)(PCFrameProducer *, PCFrame *);
+
+// Frames come back from the callback with the size the stages left them at,
+// the library fills them at the full size again
+inline int pc_producer_produce(PCProduceOriginal original, PCFrameProducer *producer, PCFrame *frame)    {
+    PCProducerState &state = pc_producer_state();
+    if(original == nullptr)    return 0;
+
+    if(frame->xyzDataVec.size() < state.fullSize)    frame->xyzDataVec.resize(state.fullSize);
+    if(frame->rgbDataVec.size() < state.fullSize)    frame->rgbDataVec.resize(state.fullSize);
+
+    state.strided = false;
+    state.cropped = false;
+    int ret = original(producer, frame);
+    if(ret == 0)    return ret;     // no frame this time
+
+    state.fullSize = std::max(state.fullSize, frame->xyzDataVec.size());
+    if(state.strided)    {
+        const size_t points = (size_t)state.width * state.height;
+        frame->xyzDataVec.resize(points * 3);
+        frame->rgbDataVec.resize(points * 3);
+        frame->width = state.width;
+        frame->height = state.height;
+    }
+
+    // drgbDataVec holds normals only if this stage wrote them
+    bool hasNormals = false;
+    PCNormalStage &normals = PCNormalStage::get();
+    if(normals.isEnabled())    {
+        state.normals.setMethod(normals.getMethod());
+        state.normals.setMaxDepthChangeFactor(normals.getMaxDepthChangeFactor());
+        state.normals.setSmoothingRadius(normals.getSmoothingRadius());
+        state.normals.compute(frame);
+        hasNormals = true;
+    }
+
+    PCMeshStage &mesh = PCMeshStage::get();
+    if(mesh.isEnabled())    {
+        std::shared_ptr<PCMesh> built = mesh.acquire();
+        state.meshBuilder.setMaxDepthChangeFactor(mesh.getMaxDepthChangeFactor());
+        state.meshBuilder.build(frame, built.get());
+        mesh.publish(std::move(built));
+    }
+
+    if(state.cropped)    {
+        frame->width = (int32_t)state.compactor.downsample(frame, hasNormals);
+        frame->height = 1;
+    }
+
+    const PCDownsampleStage::Settings downsample = PCDownsampleStage::get().getSettings();
+    if(downsample.leafSize > 0.0f)    {
+        state.downsampler.setLeafSize(downsample.leafSize);
+        state.downsampler.setPolicy(downsample.policy);
+        state.downsampler.downsample(frame, hasNormals);
+    }
+
+    return ret;
+}
+
+}  // namespace internal
+
+int PCFrameProducer::producePCFrame(PCFrame *pcFrame)    {
+    static internal::PCProduceOriginal sOriginal = (internal::PCProduceOriginal)
+            internal::pc_producer_original("_ZN8libeYs3D5video15PCFrameProducer14producePCFrameEPNS0_7PCFrameE");
+    return internal::pc_producer_produce(sOriginal, this, pcFrame);
+}
+
+int PCFrameProducer::produceDepthOnlyPCFrame(PCFrame *pcFrame)    {
+    static internal::PCProduceOriginal sOriginal = (internal::PCProduceOriginal)
+            internal::pc_producer_original("_ZN8libeYs3D5video15PCFrameProducer23produceDepthOnlyPCFrameEPNS0_7PCFrameE");
+    return internal::pc_producer_produce(sOriginal, this, pcFrame);
+}
+
+}  // namespace video
+
+namespace devices    {
+
+// Called by both producer paths, |colorBuffer| is nullptr for depth only.
+// Virtual, the vtables of the library resolve to this one.
+int CameraDevice::readPCFrame(const uint8_t *colorBuffer, const uint8_t *depthBuffer,
+                              uint8_t *rgbDataBuffer, float *xyzDataBuffer)    {
+    using ReadPCFrame = int (*)(CameraDevice *, const uint8_t *, const uint8_t *, uint8_t *, float *);
+    static ReadPCFrame sOriginal = (ReadPCFrame)video::internal::pc_producer_original(
+            "_ZN8libeYs3D7devices12CameraDevice11readPCFrameEPKhS3_PhPf");
+    static std::atomic<bool> sWarned{false};
+
+    const video::internal::PCReadMode mode = video::internal::pc_read_mode();
+    video::PCCropStage::Crop crop;
+    video::PCProjectionStage::Options projection;
+    bool cropped = false, projected = false;
+    int stride = 1;
+    if(mode == video::internal::PCReadMode::STAGES)    {
+        cropped = video::PCCropStage::get().cropFor(this, &crop);
+        projected = video::PCProjectionStage::get().optionsFor(this, &projection);
+        stride = video::PCStrideStage::get().strideFor(this, mDepthWidth, mDepthHeight);
+    }
+    bool generate = (mode == video::internal::PCReadMode::GENERATOR) || stride > 1 || cropped || projected;
+
+    // what the generator does not model is left to the library
+    const bool supported = !mPlyFilterEnabled && !video::PointCloudGenerator::isScaledDown(mDepthFormat) &&
+                           mPointCloudInfo.wDepthType == (decltype(mPointCloudInfo.wDepthType))mDepthFormat &&
+                           video::PointCloudGenerator::encodingOf(mDepthFormat) != video::PointCloudGenerator::DepthEncoding::NONE;
+    if(generate && !supported)    {
+        if(!sWarned.exchange(true))
+            LOG_WARN("PCProducerHooks", "Point cloud stages skipped: PLY filter %s, depth format %d, "
+                     "point cloud depth type %d", mPlyFilterEnabled ? "on" : "off", (int)mDepthFormat,
+                     (int)mPointCloudInfo.wDepthType);
+        generate = false;
+    }
+    if(!generate || depthBuffer == nullptr)
+        return sOriginal ? sOriginal(this, colorBuffer, depthBuffer, rgbDataBuffer, xyzDataBuffer) : APC_NullPtr;
+
+    video::internal::PCProducerState &state = video::internal::pc_producer_state();
+    video::PointCloudGenerator &generator = state.generator;
+    generator.setIntrinsics(video::PinholeIntrinsics::fromRectifyLog(mRectifyLogData, mDepthWidth, mDepthHeight));
+    generator.setDepthFormat(mDepthFormat, mZDTableInfo.nZDTable,
+                             std::min((size_t)mZDTableInfo.nZDTableSize, sizeof(mZDTableInfo.nZDTable)));
+    generator.setDepthPalette(mColorPaletteZ14, COLOR_PALETTE_MAX_COUNT);
+    generator.setProjection(projection.projection);
+    generator.setThreadCount(projection.threadCount);
+    generator.setStride(stride);
+    generator.setRegion(cropped ? crop.rect : video::PixelRect());
+    generator.setDepthRange(cropped ? crop.zNear : 0.0f, cropped ? crop.zFar : 0.0f);
+    const size_t count = generator.generate(depthBuffer, mDepthWidth, mDepthHeight, colorBuffer,
+                                            mColorWidth, mColorHeight, xyzDataBuffer, rgbDataBuffer);
+    if(cropped && crop.useBox)    video::crop_points_to_box(crop.box, xyzDataBuffer, rgbDataBuffer, count);
+
+    state.strided = true;
+    state.cropped = cropped;
+    state.width = generator.outputWidth(mDepthWidth);
+    state.height = generator.outputHeight(mDepthHeight);
+    return APC_OK;
+}
+
+}  // namespace devices
+
+namespace video    {
+
+struct PCGeneratorCheck    {
+    size_t points = 0;              // pixels of the depth frame
+    size_t bothValid = 0;
+    size_t onlyLibrary = 0;         // a hole in the generator cloud only
+    size_t onlyGenerator = 0;       // a hole in the library cloud only
+    float maxErrorMm = 0.0f;        // largest distance between the points of a pixel
+    double meanErrorMm = 0.0;
+    bool generated = false;         // false: the device is not in a configuration the generator models
+};
+
+/**
+ * Deprojects one depth frame of |device| with APC_GetPointCloud() and with
+ * the generator at stride 1, on the calling thread, and compares the two
+ * clouds pixel by pixel. |depthBuffer| is a raw depth frame of the running
+ * stream, |colorBuffer| may be nullptr.
+ * \return false if either deprojection failed
+ */
+inline bool check_pc_generator(devices::CameraDevice *device, const uint8_t *colorBuffer,
+                               const uint8_t *depthBuffer, int32_t depthWidth, int32_t depthHeight,
+                               PCGeneratorCheck *check)    {
+    *check = PCGeneratorCheck();
+    check->points = (size_t)depthWidth * depthHeight;
+    std::vector<float> libraryXYZ(check->points * 3), generatorXYZ(check->points * 3);
+    std::vector<uint8_t> libraryRGB(check->points * 3), generatorRGB(check->points * 3);
+
+    internal::PCReadMode &mode = internal::pc_read_mode();
+    internal::PCProducerState &state = internal::pc_producer_state();
+    const bool strided = state.strided;
+    mode = internal::PCReadMode::LIBRARY;
+    int libraryRet = device->readPCFrame(colorBuffer, depthBuffer, libraryRGB.data(), libraryXYZ.data());
+    state.strided = false;
+    mode = internal::PCReadMode::GENERATOR;
+    int generatorRet = device->readPCFrame(colorBuffer, depthBuffer, generatorRGB.data(), generatorXYZ.data());
+    check->generated = state.strided;
+    state.strided = strided;
+    mode = internal::PCReadMode::STAGES;
+    if(libraryRet != APC_OK || generatorRet != APC_OK)    return false;
+
+    double sumMm = 0.0;
+    for(size_t i = 0; i < check->points; i++)    {
+        const float *a = &libraryXYZ[i * 3];
+        const float *b = &generatorXYZ[i * 3];
+        const bool aValid = (a[0] != 0.0f || a[1] != 0.0f || a[2] != 0.0f);
+        const bool bValid = (b[0] != 0.0f || b[1] != 0.0f || b[2] != 0.0f);
+        if(aValid && bValid)    {
+            const float dx = a[0] - b[0], dy = a[1] - b[1], dz = a[2] - b[2];
+            const float errorMm = sqrtf(dx * dx + dy * dy + dz * dz);
+            check->maxErrorMm = std::max(check->maxErrorMm, errorMm);
+            sumMm += errorMm;
+            check->bothValid++;
+        } else if(aValid)    {
+            check->onlyLibrary++;
+        } else if(bValid)    {
+            check->onlyGenerator++;
+        }
+    }
+    check->meanErrorMm = check->bothValid ? sumMm / check->bothValid : 0.0;
+    return true;
+}
+
+}  // namespace video
+}  // namespace libeYs3D
+
+#endif  // EYS3D_PC_PRODUCER_HOOKS_IMPLEMENTATION
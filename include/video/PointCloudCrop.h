@@ -0,0 +1,235 @@
+/*
+ * Copyright (C) 2021 eYs3D Corporation
+ * All rights reserved.
+ * This project is licensed under the Apache License, Version 2.0.
+ */
+
+#pragma once
+
+#include "video/PointCloudGenerator.h"
+#include "base/Compiler.h"
+#include "base/synchronization/Lock.h"
+
+#if defined(__SSE2__) || defined(__x86_64__)
+#  include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+#  include <arm_neon.h>
+#endif
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <map>
+
+//
+// Cropping of the point cloud of a stream to a working volume.
+//
+// A crop combines a rectangle of the depth frame, a depth range, and a box
+// in camera space, either axis aligned or oriented. The rectangle and the
+// range are applied by PointCloudGenerator before deprojection: pixels
+// outside the rectangle are never read, and depths outside the range are
+// never deprojected. The box is tested afterwards, 4 points at a time:
+//
+//      PCCropStage::Crop crop;
+//      crop.rect = { 320, 180, 640, 360 };                 // depth pixels
+//      crop.zNear = 300.0f;                                // mm
+//      crop.zFar = 1200.0f;
+//      crop.useBox = true;
+//      const float boxMin[3] = { -200.0f, -150.0f, 400.0f }, boxMax[3] = { 200.0f, 150.0f, 1000.0f };
+//      crop.box = OrientedBox::fromAxisAligned(boxMin, boxMax);
+//      PCCropStage::get().setCrop(device.get(), crop);
+//
+// With the producer hooks of video/PCProducerHooks.h, the producer of a
+// cropped stream generates only the rectangle, runs the organized stages
+// (normals, mesh) on it, and then keeps only the surviving points. Such a
+// frame holds count points with width = count and height = 1. The default
+// crop of every device comes from $EYS3D_PC_CROP_RECT (x,y,width,height),
+// $EYS3D_PC_CROP_RANGE_MM (near,far) and $EYS3D_PC_CROP_BOX_MM
+// (minX,minY,minZ,maxX,maxY,maxZ).
+//
+
+namespace libeYs3D    {
+namespace video    {
+
+// Box of camera space, mm for PCFrame
+struct OrientedBox    {
+    float center[3] = { 0.0f, 0.0f, 0.0f };
+    float axes[9] = { 1.0f, 0.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 1.0f };    // unit axis k in row k
+    float halfExtents[3] = { 0.0f, 0.0f, 0.0f };
+
+    static OrientedBox fromAxisAligned(const float boxMin[3], const float boxMax[3])    {
+        OrientedBox box;
+        for(int k = 0; k < 3; k++)    {
+            box.center[k] = (boxMin[k] + boxMax[k]) * 0.5f;
+            box.halfExtents[k] = fabsf(boxMax[k] - boxMin[k]) * 0.5f;
+        }
+        return box;
+    }
+
+    // |axes|: 3x3 rotation of the box, row k its axis k in camera space
+    static OrientedBox fromCenterAxes(const float center[3], const float axes[9], const float halfExtents[3])    {
+        OrientedBox box;
+        memcpy(box.center, center, sizeof(box.center));
+        memcpy(box.axes, axes, sizeof(box.axes));
+        for(int k = 0; k < 3; k++)    box.halfExtents[k] = fabsf(halfExtents[k]);
+        return box;
+    }
+
+    bool contains(const float *p) const    {
+        const float d[3] = { p[0] - center[0], p[1] - center[1], p[2] - center[2] };
+        for(int k = 0; k < 3; k++)    {
+            const float *axis = axes + k * 3;
+            if(!(fabsf(axis[0] * d[0] + axis[1] * d[1] + axis[2] * d[2]) <= halfExtents[k]))    return false;
+        }
+        return true;
+    }
+};
+
+/**
+ * Turns the points of |xyz| outside |box|, and the holes, into holes
+ * (0, 0, 0) of |xyz| and |rgb| (3 values each).
+ * return
+ *     number of points left
+ */
+inline size_t crop_points_to_box(const OrientedBox &box, float *xyz, uint8_t *rgb, size_t count)    {
+    size_t kept = 0;
+    size_t i = 0;
+
+#if defined(__SSE2__) || defined(__x86_64__)
+    const __m128 signBit = _mm_set1_ps(-0.0f);
+    const __m128 cx = _mm_set1_ps(box.center[0]), cy = _mm_set1_ps(box.center[1]), cz = _mm_set1_ps(box.center[2]);
+    for(; i + 4 <= count; i += 4)    {
+        const float *p = xyz + i * 3;
+        const __m128 px = _mm_setr_ps(p[0], p[3], p[6], p[9]);
+        const __m128 py = _mm_setr_ps(p[1], p[4], p[7], p[10]);
+        const __m128 pz = _mm_setr_ps(p[2], p[5], p[8], p[11]);
+        const __m128 dx = _mm_sub_ps(px, cx), dy = _mm_sub_ps(py, cy), dz = _mm_sub_ps(pz, cz);
+
+        __m128 inside = _mm_cmpgt_ps(pz, _mm_setzero_ps());
+        for(int k = 0; k < 3; k++)    {
+            const float *axis = box.axes + k * 3;
+            const __m128 local = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, _mm_set1_ps(axis[0])),
+                                                       _mm_mul_ps(dy, _mm_set1_ps(axis[1]))),
+                                            _mm_mul_ps(dz, _mm_set1_ps(axis[2])));
+            inside = _mm_and_ps(inside, _mm_cmple_ps(_mm_andnot_ps(signBit, local), _mm_set1_ps(box.halfExtents[k])));
+        }
+
+        const int mask = _mm_movemask_ps(inside);
+        for(int lane = 0; lane < 4; lane++)    {
+            if(mask & (1 << lane))    {
+                kept++;
+                continue;
+            }
+            memset(xyz + (i + lane) * 3, 0, 3 * sizeof(float));
+            memset(rgb + (i + lane) * 3, 0, 3);
+        }
+    }
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+    const float32x4_t cx = vdupq_n_f32(box.center[0]), cy = vdupq_n_f32(box.center[1]), cz = vdupq_n_f32(box.center[2]);
+    for(; i + 4 <= count; i += 4)    {
+        const float32x4x3_t p = vld3q_f32(xyz + i * 3);     // deinterleaves x, y, z
+        const float32x4_t dx = vsubq_f32(p.val[0], cx), dy = vsubq_f32(p.val[1], cy), dz = vsubq_f32(p.val[2], cz);
+
+        uint32x4_t inside = vcgtq_f32(p.val[2], vdupq_n_f32(0.0f));
+        for(int k = 0; k < 3; k++)    {
+            const float *axis = box.axes + k * 3;
+            const float32x4_t local = vmlaq_n_f32(vmlaq_n_f32(vmulq_n_f32(dx, axis[0]), dy, axis[1]), dz, axis[2]);
+            inside = vandq_u32(inside, vcleq_f32(vabsq_f32(local), vdupq_n_f32(box.halfExtents[k])));
+        }
+
+        uint32_t lanes[4];
+        vst1q_u32(lanes, inside);
+        for(int lane = 0; lane < 4; lane++)    {
+            if(lanes[lane])    {
+                kept++;
+                continue;
+            }
+            memset(xyz + (i + lane) * 3, 0, 3 * sizeof(float));
+            memset(rgb + (i + lane) * 3, 0, 3);
+        }
+    }
+#endif
+
+    for(; i < count; i++)    {
+        float *p = xyz + i * 3;
+        if(p[2] > 0.0f && box.contains(p))    {
+            kept++;
+            continue;
+        }
+        memset(p, 0, 3 * sizeof(float));
+        memset(rgb + i * 3, 0, 3);
+    }
+    return kept;
+}
+
+// Crop of the point cloud of each device, for the producer hooks
+class PCCropStage    {
+    DISALLOW_COPY_ASSIGN_AND_MOVE(PCCropStage);
+
+public:
+    struct Crop    {
+        PixelRect rect;                 // empty: the whole depth frame
+        float zNear = 0.0f;             // mm, 0: no limit
+        float zFar = 0.0f;
+        bool useBox = false;
+        OrientedBox box;
+    };
+
+    // Never destroyed, producers may still run while static destructors do
+    static PCCropStage &get()    {
+        static PCCropStage *sInstance = new PCCropStage();
+        return *sInstance;
+    }
+
+    // |device|: the CameraDevice of the stream, nullptr for the default of every device
+    void setCrop(const void *device, const Crop &crop)    {
+        base::AutoLock lock(mLock);
+        mCrops[device] = crop;
+    }
+
+    void clearCrop(const void *device)    {
+        base::AutoLock lock(mLock);
+        mCrops.erase(device);
+    }
+
+    // false if the stream of |device| is not cropped
+    bool cropFor(const void *device, Crop *crop)    {
+        base::AutoLock lock(mLock);
+        if(mCrops.empty())    return false;
+
+        auto iter = mCrops.find(device);
+        if(iter == mCrops.end())    iter = mCrops.find(nullptr);
+        if(iter == mCrops.end())    return false;
+
+        *crop = iter->second;
+        return true;
+    }
+
+private:
+    PCCropStage()    {
+        const char *rect = getenv("EYS3D_PC_CROP_RECT");
+        const char *range = getenv("EYS3D_PC_CROP_RANGE_MM");
+        const char *box = getenv("EYS3D_PC_CROP_BOX_MM");
+        if(!rect && !range && !box)    return;
+
+        Crop crop;
+        if(rect)    sscanf(rect, "%d,%d,%d,%d", &crop.rect.x, &crop.rect.y, &crop.rect.width, &crop.rect.height);
+        if(range)    sscanf(range, "%f,%f", &crop.zNear, &crop.zFar);
+        float boxMin[3], boxMax[3];
+        if(box && sscanf(box, "%f,%f,%f,%f,%f,%f", &boxMin[0], &boxMin[1], &boxMin[2],
+                         &boxMax[0], &boxMax[1], &boxMax[2]) == 6)    {
+            crop.useBox = true;
+            crop.box = OrientedBox::fromAxisAligned(boxMin, boxMax);
+        }
+        mCrops[nullptr] = crop;
+    }
+
+    base::Lock mLock;
+    std::map<const void *, Crop> mCrops;
+};
+
+}  // namespace video
+}  // namespace libeYs3D
@@ -0,0 +1,268 @@
+/*
+ * Copyright (C) 2021 eYs3D Corporation
+ * All rights reserved.
+ * This project is licensed under the Apache License, Version 2.0.
+ */
+
+#pragma once
+
+#include "video/PCFrame.h"
+#include "video/PointCloudNormals.h"
+#include "video/VoxelGrid.h"
+#include "base/Compiler.h"
+#include "base/synchronization/Lock.h"
+#include "debug.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+//
+// Voxel grid downsampling of point clouds.
+//
+// A PCFrame holds one point per depth pixel, holes included. A
+// PointCloudDownsampler keeps one point per occupied voxel of the leaf size.
+// That point is either the centroid of the voxel's points and colors, or the
+// first point that fell in the voxel. The voxels go through a VoxelGrid hash
+// table. Every buffer is kept from one frame to the next:
+//
+//      PointCloudDownsampler downsampler(50.0f);       // 5 cm, PCFrame is in mm
+//      downsampler.downsample(pcFrame);                // in place
+//
+// After downsample(frame), xyzDataVec and rgbDataVec hold 3 values per kept
+// point in the order their voxels were first seen. width and height still
+// describe the depth frame. Holes (z <= 0 or not finite) are dropped. When
+// the caller says drgbDataVec holds the normals of PCNormalStage, they
+// follow their points, averaged and renormalized for CENTROID.
+//
+// The same stage can run inside PCFrameProducer, before the point cloud
+// callback and anything downstream of it, with the producer hooks of
+// video/PCProducerHooks.h. Configure it at any time:
+//
+//      PCDownsampleStage::get().configure(50.0f, PointCloudDownsampler::Policy::CENTROID);
+//
+// The stage starts from $EYS3D_PC_VOXEL_SIZE_MM (unset or 0: off) and
+// $EYS3D_PC_VOXEL_POLICY (centroid, the default, or first).
+//
+
+namespace libeYs3D    {
+namespace video    {
+
+class PointCloudDownsampler    {
+    DISALLOW_COPY_ASSIGN_AND_MOVE(PointCloudDownsampler);
+
+public:
+    enum class Policy    {
+        CENTROID,       // mean position and color of the points of the voxel
+        FIRST_HIT       // first point of the voxel in scan order, no arithmetic
+    };
+
+    explicit PointCloudDownsampler(float leafSize = 50.0f, Policy policy = Policy::CENTROID)
+        : mPolicy(policy)    { setLeafSize(leafSize); }
+
+    // Same unit as the points; 0 keeps every valid point
+    void setLeafSize(float leafSize)    { mGrid.setVoxelSize(leafSize > 0.0f ? leafSize : 0.0f); }
+    float getLeafSize() const    { return mGrid.getVoxelSize(); }
+
+    void setPolicy(Policy policy)    { mPolicy = policy; }
+    Policy getPolicy() const    { return mPolicy; }
+
+    /**
+     * Downsamples the |count| points of |xyz| and |rgb| (3 values each) into
+     * |outXYZ| and |outRGB|, which may be |xyz| and |rgb| themselves.
+     * |normals|, encoded as by encode_normal(), go to |outNormals| alike.
+     * return
+     *     number of points written
+     */
+    size_t downsample(const float *xyz, const uint8_t *rgb, size_t count, float *outXYZ, uint8_t *outRGB,
+                      const int8_t *normals = nullptr, int8_t *outNormals = nullptr)    {
+        if(outNormals == nullptr)    normals = nullptr;
+        if(mGrid.getVoxelSize() <= 0.0f)    return compactValid(xyz, rgb, normals, count, outXYZ, outRGB, outNormals);
+
+        mGrid.reset(mGrid.size());      // voxels of the last cloud
+        return (mPolicy == Policy::FIRST_HIT) ? firstHit(xyz, rgb, normals, count, outXYZ, outRGB, outNormals)
+                                              : centroid(xyz, rgb, normals, count, outXYZ, outRGB, outNormals);
+    }
+
+    /**
+     * In place on the point cloud of |frame|. |withNormals|: drgbDataVec holds
+     * the normals of PointCloudNormalEstimator::compute(PCFrame *), which then
+     * follow their points. Otherwise drgbDataVec is left alone: the library
+     * allocates it with 3 bytes per point too, so its size tells nothing.
+     */
+    size_t downsample(PCFrame *frame, bool withNormals = false)    {
+        size_t count = std::min(frame->xyzDataVec.size(), frame->rgbDataVec.size()) / 3;
+        if(frame->drgbDataVec.size() < count * 3)    withNormals = false;
+        int8_t *normals = withNormals ? (int8_t *)frame->drgbDataVec.data() : nullptr;
+        size_t kept = downsample(frame->xyzDataVec.data(), frame->rgbDataVec.data(), count,
+                                 frame->xyzDataVec.data(), frame->rgbDataVec.data(), normals, normals);
+        frame->xyzDataVec.resize(kept * 3);
+        frame->rgbDataVec.resize(kept * 3);
+        if(normals)    frame->drgbDataVec.resize(kept * 3);
+        return kept;
+    }
+
+private:
+    struct Accumulator    {
+        float x, y, z;
+        uint32_t count;
+        uint32_t r, g, b;
+        int32_t nx, ny, nz;     // encoded normals
+    };
+
+    static bool isValid(const float *p)    {
+        return p[2] > 0.0f && isfinite(p[0]) && isfinite(p[1]) && isfinite(p[2]);
+    }
+
+    static size_t compactValid(const float *xyz, const uint8_t *rgb, const int8_t *normals, size_t count,
+                               float *outXYZ, uint8_t *outRGB, int8_t *outNormals)    {
+        size_t kept = 0;
+        for(size_t i = 0; i < count; i++)    {
+            if(!isValid(xyz + i * 3))    continue;
+
+            memmove(outXYZ + kept * 3, xyz + i * 3, 3 * sizeof(float));
+            memmove(outRGB + kept * 3, rgb + i * 3, 3);
+            if(normals)    memmove(outNormals + kept * 3, normals + i * 3, 3);
+            kept++;
+        }
+        return kept;
+    }
+
+    // Never writes ahead of the point being read, so it also works in place
+    size_t firstHit(const float *xyz, const uint8_t *rgb, const int8_t *normals, size_t count,
+                    float *outXYZ, uint8_t *outRGB, int8_t *outNormals)    {
+        size_t kept = 0;
+        uint64_t lastKey = ~0ull;       // neighbouring pixels mostly share their voxel
+        for(size_t i = 0; i < count; i++)    {
+            const float *p = xyz + i * 3;
+            if(!isValid(p))    continue;
+
+            uint64_t key = mGrid.keyOf(p[0], p[1], p[2]);
+            if(key == lastKey)    continue;
+
+            lastKey = key;
+            if(mGrid.findOrInsert(key, (uint32_t)kept) != (uint32_t)kept)    continue;
+
+            memmove(outXYZ + kept * 3, p, 3 * sizeof(float));
+            memmove(outRGB + kept * 3, rgb + i * 3, 3);
+            if(normals)    memmove(outNormals + kept * 3, normals + i * 3, 3);
+            kept++;
+        }
+        return kept;
+    }
+
+    size_t centroid(const float *xyz, const uint8_t *rgb, const int8_t *normals, size_t count,
+                    float *outXYZ, uint8_t *outRGB, int8_t *outNormals)    {
+        mAccumulators.clear();
+        uint64_t lastKey = ~0ull;
+        uint32_t voxel = 0u;
+        for(size_t i = 0; i < count; i++)    {
+            const float *p = xyz + i * 3;
+            if(!isValid(p))    continue;
+
+            uint64_t key = mGrid.keyOf(p[0], p[1], p[2]);
+            if(key != lastKey)    {
+                lastKey = key;
+                voxel = mGrid.findOrInsert(key, (uint32_t)mAccumulators.size());
+                if(voxel == mAccumulators.size())
+                    mAccumulators.push_back(Accumulator{ 0.0f, 0.0f, 0.0f, 0u, 0u, 0u, 0u, 0, 0, 0 });
+            }
+
+            Accumulator &sum = mAccumulators[voxel];
+            const uint8_t *c = rgb + i * 3;
+            sum.x += p[0];
+            sum.y += p[1];
+            sum.z += p[2];
+            sum.r += c[0];
+            sum.g += c[1];
+            sum.b += c[2];
+            sum.count++;
+            if(normals)    {
+                sum.nx += normals[i * 3 + 0];
+                sum.ny += normals[i * 3 + 1];
+                sum.nz += normals[i * 3 + 2];
+            }
+        }
+
+        // the sums are apart from the input, the output may overwrite it now
+        for(size_t v = 0; v < mAccumulators.size(); v++)    {
+            const Accumulator &sum = mAccumulators[v];
+            const float inverse = 1.0f / (float)sum.count;
+            const uint32_t half = sum.count / 2;
+            outXYZ[v * 3 + 0] = sum.x * inverse;
+            outXYZ[v * 3 + 1] = sum.y * inverse;
+            outXYZ[v * 3 + 2] = sum.z * inverse;
+            outRGB[v * 3 + 0] = (uint8_t)((sum.r + half) / sum.count);
+            outRGB[v * 3 + 1] = (uint8_t)((sum.g + half) / sum.count);
+            outRGB[v * 3 + 2] = (uint8_t)((sum.b + half) / sum.count);
+            if(normals)    {
+                float n[3] = { (float)sum.nx, (float)sum.ny, (float)sum.nz };
+                const float length = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+                const float scale = (length > 0.0f) ? 1.0f / length : 0.0f;
+                n[0] *= scale;
+                n[1] *= scale;
+                n[2] *= scale;
+                encode_normal(n, outNormals + v * 3);
+            }
+        }
+        return mAccumulators.size();
+    }
+
+    VoxelGrid mGrid;
+    Policy mPolicy;
+    std::vector<Accumulator> mAccumulators;     // one per voxel, CENTROID
+};
+
+// Settings of the downsampling inside PCFrameProducer, for every device
+class PCDownsampleStage    {
+    DISALLOW_COPY_ASSIGN_AND_MOVE(PCDownsampleStage);
+
+public:
+    using Policy = PointCloudDownsampler::Policy;
+
+    // Never destroyed, producers may still run while static destructors do
+    static PCDownsampleStage &get()    {
+        static PCDownsampleStage *sInstance = new PCDownsampleStage();
+        return *sInstance;
+    }
+
+    struct Settings    {
+        float leafSize = 0.0f;          // mm, 0: off
+        Policy policy = Policy::CENTROID;
+    };
+
+    // |leafSize| in mm, 0 turns the stage off
+    void configure(float leafSize, Policy policy = Policy::CENTROID)    {
+        base::AutoLock lock(mLock);
+        mSettings.leafSize = (leafSize > 0.0f) ? leafSize : 0.0f;
+        mSettings.policy = policy;
+    }
+
+    // Both values of the same configure() call, for the producer thread
+    Settings getSettings() const    {
+        base::AutoLock lock(mLock);
+        return mSettings;
+    }
+
+    float getLeafSize() const    { return getSettings().leafSize; }
+    Policy getPolicy() const    { return getSettings().policy; }
+    bool isEnabled() const    { return getLeafSize() > 0.0f; }
+
+private:
+    PCDownsampleStage()    {
+        const char *leafSize = getenv("EYS3D_PC_VOXEL_SIZE_MM");
+        const char *policy = getenv("EYS3D_PC_VOXEL_POLICY");
+        configure(leafSize ? (float)atof(leafSize) : 0.0f,
+                  (policy && !strcmp(policy, "first")) ? Policy::FIRST_HIT : Policy::CENTROID);
+    }
+
+    mutable base::Lock mLock;
+    Settings mSettings;     // guarded by mLock
+};
+
+}  // namespace video
+}  // namespace libeYs3D
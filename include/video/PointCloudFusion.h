@@ -0,0 +1,306 @@
+/*
+ * Copyright (C) 2021 eYs3D Corporation
+ * All rights reserved.
+ * This project is licensed under the Apache License, Version 2.0.
+ */
+
+#pragma once
+
+#include "video/PCFrame.h"
+#include "video/VoxelGrid.h"
+#include "base/Compiler.h"
+#include "base/threads/Executor.h"
+
+#if defined(__SSE2__) || defined(__x86_64__)
+#  include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+#  include <arm_neon.h>
+#endif
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+//
+// Fusion of the point clouds of several cameras into one cloud.
+//
+// Each source has extrinsics, a 4x4 rigid transform from its camera frame
+// to the common frame, in the unit of the clouds (mm for PCFrame). fuse()
+// takes one PCFrame per source. It transforms and compacts them in parallel
+// on the SDK executor, one task per source, then merges the results
+// through a VoxelGrid. When two sources see the same voxel, the point of
+// the lower source index is kept:
+//
+//      PointCloudFusion fusion(2);
+//      fusion.setExtrinsics(1, PointTransform::fromRotationTranslation(R, t));
+//      fusion.setVoxelSize(5.0f);
+//      const PCFrame *frames[] = { left, right };
+//      fusion.fuse(frames, 2, &fused);     // fused.sourceId[i]: 0 or 1
+//
+// Points with z <= 0 or not finite (no depth) are dropped. A voxel size of 0
+// concatenates the clouds without merging. Buffers are reused from one call
+// to the next. fuse() may run on an executor worker: the sources are then
+// transformed inline, one after the other.
+//
+// Only the transforms and the voxel keys are computed in parallel. The merge
+// through the VoxelGrid is single threaded, in source order, so its cost
+// grows with the total point count. Voxel coordinates are clamped to 21 bits
+// per axis (VoxelGrid::kAxisLimit): points farther than 2^20 voxels from the
+// origin along an axis, about 5 km at 5 mm, all fall into the border voxels
+// and are merged with each other.
+//
+
+namespace libeYs3D    {
+namespace video    {
+
+// Row major, p' = M * [x y z 1]
+struct PointTransform    {
+    float m[16];
+
+    static PointTransform identity()    {
+        PointTransform transform;
+        memset(transform.m, 0, sizeof(transform.m));
+        transform.m[0] = transform.m[5] = transform.m[10] = transform.m[15] = 1.0f;
+        return transform;
+    }
+
+    // |rotation|: 3x3 row major
+    static PointTransform fromRotationTranslation(const float rotation[9], const float translation[3])    {
+        PointTransform transform = identity();
+        for(int row = 0; row < 3; row++)    {
+            for(int col = 0; col < 3; col++)    transform.m[row * 4 + col] = rotation[row * 3 + col];
+            transform.m[row * 4 + 3] = translation[row];
+        }
+        return transform;
+    }
+};
+
+struct FusedPointCloud    {
+    int64_t tsUs = 0ll;                 // newest of the source frames
+    std::vector<float> xyz;             // 3 per point
+    std::vector<uint8_t> rgb;           // 3 per point
+    std::vector<uint8_t> sourceId;      // index of the source of each point
+
+    size_t size() const    { return sourceId.size(); }
+};
+
+/**
+ * Scalar transform_valid_points() of the points [|begin|, |count|) of
+ * |xyz|, appended at |written| to |outXYZ| and |outRGB|: the tail of the
+ * vector loops, and the reference they are checked against.
+ * return
+ *     number of points of |outXYZ| after the call
+ */
+inline size_t transform_valid_points_scalar(const float *xyz, const uint8_t *rgb, size_t begin, size_t count,
+                                            const PointTransform &transform,
+                                            float *outXYZ, uint8_t *outRGB, size_t written)    {
+    const float *m = transform.m;
+    for(size_t i = begin; i < count; i++)    {
+        const float *p = xyz + i * 3;
+        if(!(p[2] > 0.0f) || !isfinite(p[0]) || !isfinite(p[1]) || !isfinite(p[2]))    continue;
+
+        float *q = outXYZ + written * 3;
+        q[0] = m[0] * p[0] + m[1] * p[1] + m[2] * p[2] + m[3];
+        q[1] = m[4] * p[0] + m[5] * p[1] + m[6] * p[2] + m[7];
+        q[2] = m[8] * p[0] + m[9] * p[1] + m[10] * p[2] + m[11];
+        memcpy(outRGB + written * 3, rgb + i * 3, 3);
+        written++;
+    }
+    return written;
+}
+
+/**
+ * Transforms the valid points of |xyz| (z > 0 and finite) by |transform|,
+ * and copies them with their colors to |outXYZ| and |outRGB| back to back.
+ * The vector paths take 4 points at a time, deinterleaved as in
+ * crop_points_to_box(), and only compact the valid lanes.
+ * return
+ *     number of points written
+ */
+inline size_t transform_valid_points(const float *xyz, const uint8_t *rgb, size_t count,
+                                     const PointTransform &transform,
+                                     float *outXYZ, uint8_t *outRGB)    {
+    size_t written = 0;
+    size_t i = 0;
+
+#if defined(__SSE2__) || defined(__x86_64__)
+    const float *m = transform.m;
+    __m128 rows[12];
+    for(int k = 0; k < 12; k++)    rows[k] = _mm_set1_ps(m[k]);
+    const __m128 zero = _mm_setzero_ps();
+    for(; i + 4 <= count; i += 4)    {
+        const float *p = xyz + i * 3;
+        const __m128 px = _mm_setr_ps(p[0], p[3], p[6], p[9]);
+        const __m128 py = _mm_setr_ps(p[1], p[4], p[7], p[10]);
+        const __m128 pz = _mm_setr_ps(p[2], p[5], p[8], p[11]);
+
+        // v * 0 is 0 for finite v only, NaN for infinities and NaN
+        const __m128 finite = _mm_cmpeq_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(px, zero), _mm_mul_ps(py, zero)),
+                                                      _mm_mul_ps(pz, zero)), zero);
+        const int mask = _mm_movemask_ps(_mm_and_ps(_mm_cmpgt_ps(pz, zero), finite));
+        if(mask == 0)    continue;
+
+        // same order of operations as the scalar path
+        float q[3][4];
+        for(int row = 0; row < 3; row++)    {
+            const __m128 *r = rows + row * 4;
+            _mm_storeu_ps(q[row], _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(r[0], px), _mm_mul_ps(r[1], py)),
+                                                        _mm_mul_ps(r[2], pz)), r[3]));
+        }
+        for(int lane = 0; lane < 4; lane++)    {
+            if(!(mask & (1 << lane)))    continue;
+
+            float *out = outXYZ + written * 3;
+            out[0] = q[0][lane];
+            out[1] = q[1][lane];
+            out[2] = q[2][lane];
+            memcpy(outRGB + written * 3, rgb + (i + lane) * 3, 3);
+            written++;
+        }
+    }
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+    const float *m = transform.m;
+    const float32x4_t zero = vdupq_n_f32(0.0f);
+    for(; i + 4 <= count; i += 4)    {
+        const float32x4x3_t p = vld3q_f32(xyz + i * 3);     // deinterleaves x, y, z
+        const float32x4_t px = p.val[0], py = p.val[1], pz = p.val[2];
+
+        // v * 0 is 0 for finite v only, NaN for infinities and NaN
+        const uint32x4_t finite = vceqq_f32(vaddq_f32(vaddq_f32(vmulq_f32(px, zero), vmulq_f32(py, zero)),
+                                                      vmulq_f32(pz, zero)), zero);
+        uint32_t lanes[4];
+        vst1q_u32(lanes, vandq_u32(vcgtq_f32(pz, zero), finite));
+        if((lanes[0] | lanes[1] | lanes[2] | lanes[3]) == 0u)    continue;
+
+        // same order of operations as the scalar path, no fused multiply-add
+        float q[3][4];
+        for(int row = 0; row < 3; row++)    {
+            const float *r = m + row * 4;
+            vst1q_f32(q[row], vaddq_f32(vaddq_f32(vaddq_f32(vmulq_n_f32(px, r[0]), vmulq_n_f32(py, r[1])),
+                                                  vmulq_n_f32(pz, r[2])), vdupq_n_f32(r[3])));
+        }
+        for(int lane = 0; lane < 4; lane++)    {
+            if(!lanes[lane])    continue;
+
+            float *out = outXYZ + written * 3;
+            out[0] = q[0][lane];
+            out[1] = q[1][lane];
+            out[2] = q[2][lane];
+            memcpy(outRGB + written * 3, rgb + (i + lane) * 3, 3);
+            written++;
+        }
+    }
+#endif
+
+    return transform_valid_points_scalar(xyz, rgb, i, count, transform, outXYZ, outRGB, written);
+}
+
+class PointCloudFusion    {
+    DISALLOW_COPY_ASSIGN_AND_MOVE(PointCloudFusion);
+
+public:
+    static constexpr int kMaxSources = 256;     // sourceId is 8 bits
+
+    explicit PointCloudFusion(int sourceCount)
+        : mSources((size_t)std::min(std::max(sourceCount, 1), kMaxSources))    {}
+
+    int getSourceCount() const    { return (int)mSources.size(); }
+
+    void setExtrinsics(int source, const PointTransform &transform)    {
+        if(source >= 0 && source < (int)mSources.size())    mSources[source].transform = transform;
+    }
+
+    // 0: no merging, the clouds are concatenated
+    void setVoxelSize(float voxelSize)    { mGrid.setVoxelSize(voxelSize); }
+
+    /**
+     * Fuses |frames|, frames[i] from source i, nullptr for a source without
+     * a frame this time, into |fused|.
+     * return
+     *     number of points of |fused|
+     */
+    size_t fuse(const PCFrame *const *frames, int frameCount, FusedPointCloud *fused)    {
+        const int count = std::min(frameCount, (int)mSources.size());
+
+        runOnAllSources(count, [&](int i)    {
+            Source &source = mSources[i];
+            source.count = 0;
+            if(frames[i] == nullptr)    return;
+
+            const PCFrame *frame = frames[i];
+            size_t points = std::min(frame->xyzDataVec.size(), frame->rgbDataVec.size()) / 3;
+            if(source.xyz.size() < points * 3)    source.xyz.resize(points * 3);
+            if(source.rgb.size() < points * 3)    source.rgb.resize(points * 3);
+            source.count = transform_valid_points(frame->xyzDataVec.data(), frame->rgbDataVec.data(), points,
+                                                  source.transform, source.xyz.data(), source.rgb.data());
+
+            if(mGrid.getVoxelSize() <= 0.0f)    return;
+            if(source.keys.size() < source.count)    source.keys.resize(source.count);
+            for(size_t p = 0; p < source.count; p++)    {
+                const float *q = &source.xyz[p * 3];
+                source.keys[p] = mGrid.keyOf(q[0], q[1], q[2]);
+            }
+        });
+
+        size_t total = 0;
+        fused->tsUs = 0ll;
+        for(int i = 0; i < count; i++)    {
+            total += mSources[i].count;
+            if(frames[i])    fused->tsUs = std::max(fused->tsUs, frames[i]->tsUs);
+        }
+        fused->xyz.resize(total * 3);
+        fused->rgb.resize(total * 3);
+        fused->sourceId.resize(total);
+
+        size_t written = 0;
+        const bool merge = mGrid.getVoxelSize() > 0.0f;
+        if(merge)    mGrid.reset(mGrid.size());     // voxels of the last fusion
+        for(int i = 0; i < count; i++)    {
+            const Source &source = mSources[i];
+            uint64_t lastKey = ~0ull;   // neighbouring pixels mostly share their voxel
+            for(size_t p = 0; p < source.count; p++)    {
+                if(merge)    {
+                    const uint64_t key = source.keys[p];
+                    if(key == lastKey)    continue;
+
+                    lastKey = key;
+                    if(mGrid.findOrInsert(key, (uint32_t)written) != (uint32_t)written)
+                        continue;   // voxel taken by an earlier point
+                }
+
+                memcpy(&fused->xyz[written * 3], &source.xyz[p * 3], 3 * sizeof(float));
+                memcpy(&fused->rgb[written * 3], &source.rgb[p * 3], 3);
+                fused->sourceId[written] = (uint8_t)i;
+                written++;
+            }
+        }
+        fused->xyz.resize(written * 3);
+        fused->rgb.resize(written * 3);
+        fused->sourceId.resize(written);
+
+        return written;
+    }
+
+private:
+    struct Source    {
+        PointTransform transform = PointTransform::identity();
+        std::vector<float> xyz;         // transformed valid points
+        std::vector<uint8_t> rgb;
+        std::vector<uint64_t> keys;     // voxel of each point
+        size_t count = 0;
+    };
+
+    template <class Task>
+    static void runOnAllSources(int count, Task task)    {
+        base::Executor::get().parallelFor(count, count, [&](int i) { task(i); });
+    }
+
+    std::vector<Source> mSources;
+    VoxelGrid mGrid{0.0f};
+};
+
+}  // namespace video
+}  // namespace libeYs3D
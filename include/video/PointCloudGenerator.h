@@ -0,0 +1,727 @@
+/*
+ * Copyright (C) 2021 eYs3D Corporation
+ * All rights reserved.
+ * This project is licensed under the Apache License, Version 2.0.
+ */
+
+#pragma once
+
+#include "video/video.h"
+#include "base/Compiler.h"
+#include "base/synchronization/Lock.h"
+#include "base/threads/Executor.h"
+#include "DMPreview_utility/ColorPaletteGenerator.h"
+
+#ifdef WIN32
+#  include <eSPDI_DM.h>
+#else
+#  include "eSPDI_def.h"
+#endif
+
+#if defined(__SSE2__) || defined(__x86_64__)
+#  include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+#  include <arm_neon.h>
+#endif
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
+
+//
+// Organized point cloud generation from a depth frame, at full resolution or
+// on a grid of every k-th row and column.
+//
+// The depth of each kept pixel is turned into millimeters, from the 14 bits
+// Z values directly or from the disparities through the ZD table of the
+// device. It is then deprojected through the pinhole of the rectify log:
+//
+//      PointCloudGenerator generator;
+//      generator.setIntrinsics(PinholeIntrinsics::fromRectifyLog(rectLog, depthWidth, depthHeight));
+//      generator.setDepthFormat(DEPTH_RAW_DATA_14_BITS, nullptr, 0);
+//      generator.setStride(8);                                 // 1280x720 -> 160x90
+//      generator.generate(depth, 1280, 720, rgb, 1280, 720, xyz, colors);
+//
+// The color of a point comes from the color pixel at the same place in the
+// image, scaled when the color and depth resolutions differ. Without a color
+// image, from the depth palette if one is set. Holes are (0, 0, 0), as in
+// PCFrame. The cost is one pass over the kept pixels: the per-column and
+// per-row factors and the disparity lookup are computed once per
+// configuration, and the points are deprojected 4 at a time.
+//
+// Wide FOV modules deproject through a cylinder instead, the model of
+// PlyWriter::apcFrameTo3DCylinder(): the longer side of the frame spans pi
+// radians around the principal point, the other side stays a pinhole. The
+// sine and cosine of each column (or row) and the elevation of each row (or
+// column) are tables of the configuration too, so no trigonometry runs per
+// frame:
+//
+//      generator.setProjection(PointCloudGenerator::Projection::CYLINDER);
+//      generator.setThreadCount(4);        // bands of rows on the SDK executor
+//
+// A region of the depth frame and a depth range restrict the generation to
+// the pixels that can matter: pixels outside the region are not visited, and
+// pixels outside the range become holes before being deprojected.
+//
+// With EYS3D_PC_PRODUCER_HOOKS_IMPLEMENTATION (video/PCProducerHooks.h), a
+// stride or target point count set for a device in PCStrideStage replaces
+// the full resolution deprojection of its point cloud producer, as does a
+// crop of PCCropStage (video/PointCloudCrop.h) and a projection of
+// PCProjectionStage. The depth stream itself is unchanged. $EYS3D_PC_STRIDE
+// or $EYS3D_PC_TARGET_POINTS, and $EYS3D_PC_PROJECTION (pinhole or cylinder)
+// and $EYS3D_PC_GENERATE_THREADS set the default of every device.
+//
+
+namespace libeYs3D    {
+namespace video    {
+
+struct PinholeIntrinsics    {
+    float fx = 0.0f;
+    float fy = 0.0f;
+    float cx = 0.0f;
+    float cy = 0.0f;
+
+    bool isValid() const    { return fx > 0.0f && fy > 0.0f; }
+
+    bool operator==(const PinholeIntrinsics &other) const    {
+        return fx == other.fx && fy == other.fy && cx == other.cx && cy == other.cy;
+    }
+    bool operator!=(const PinholeIntrinsics &other) const    { return !(*this == other); }
+
+    /**
+     * The pinhole of the reprojection matrix Q of |rectLog|, given at the
+     * rectified output size, scaled to a depth frame of |depthWidth| x
+     * |depthHeight|.
+     */
+    static PinholeIntrinsics fromRectifyLog(const eSPCtrl_RectLogData &rectLog,
+                                            int32_t depthWidth, int32_t depthHeight)    {
+        const float *q = rectLog.ReProjectMat;
+        const float scaleX = (rectLog.OutImgWidth > 0) ? (float)depthWidth / rectLog.OutImgWidth : 1.0f;
+        const float scaleY = (rectLog.OutImgHeight > 0) ? (float)depthHeight / rectLog.OutImgHeight : 1.0f;
+
+        PinholeIntrinsics intrinsics;
+        intrinsics.fx = q[11] * scaleX;
+        intrinsics.fy = q[11] * scaleY;
+        intrinsics.cx = -q[3] * scaleX;
+        intrinsics.cy = -q[7] * scaleY;
+        return intrinsics;
+    }
+};
+
+// Smallest stride giving at most |targetPoints| points on a |width| x |height| frame
+inline int stride_for_point_count(int32_t width, int32_t height, uint32_t targetPoints)    {
+    if(targetPoints == 0u || width <= 0 || height <= 0)    return 1;
+
+    int stride = std::max(1, (int)sqrtf((float)width * height / targetPoints));
+    while((uint64_t)(width / stride) * (uint64_t)(height / stride) > targetPoints)    stride++;
+    return stride;
+}
+
+// Pixels of a depth frame, empty: the whole frame
+struct PixelRect    {
+    int32_t x = 0;
+    int32_t y = 0;
+    int32_t width = 0;
+    int32_t height = 0;
+
+    bool isEmpty() const    { return width <= 0 || height <= 0; }
+
+    bool operator==(const PixelRect &other) const    {
+        return x == other.x && y == other.y && width == other.width && height == other.height;
+    }
+    bool operator!=(const PixelRect &other) const    { return !(*this == other); }
+};
+
+class PointCloudGenerator    {
+    DISALLOW_COPY_ASSIGN_AND_MOVE(PointCloudGenerator);
+
+public:
+    enum class DepthEncoding    {
+        Z14,                // 2 bytes per pixel, millimeters in the low 14 bits
+        DISPARITY_11,       // 2 bytes per pixel, 11 bits disparity
+        DISPARITY_8,        // 1 byte per pixel
+        DISPARITY_8_x80,    // 2 bytes per pixel, 8 bits used
+        NONE                // no depth (depth off modes)
+    };
+
+    enum class Projection    {
+        PINHOLE,            // rays through the image plane of the rectify log
+        CYLINDER            // pi radians across the longer side, as PlyWriter::apcFrameTo3DCylinder()
+    };
+
+    static DepthEncoding encodingOf(DEPTH_RAW_DATA_TYPE format)    {
+        switch(format)    {
+            case DEPTH_RAW_DATA_14_BITS:
+            case DEPTH_RAW_DATA_14_BITS_RAW:
+            case DEPTH_RAW_DATA_14_BITS_COMBINED_RECTIFY:
+            case DEPTH_RAW_DATA_ILM_14_BITS:
+            case DEPTH_RAW_DATA_ILM_14_BITS_RAW:
+            case DEPTH_RAW_DATA_ILM_14_BITS_COMBINED_RECTIFY:
+            case DEPTH_RAW_DATA_SCALE_DOWN_14_BITS:
+            case DEPTH_RAW_DATA_SCALE_DOWN_14_BITS_RAW:
+            case DEPTH_RAW_DATA_SCALE_DOWN_14_BITS_COMBINED_RECTIFY:
+            case DEPTH_RAW_DATA_SCALE_DOWN_ILM_14_BITS:
+            case DEPTH_RAW_DATA_SCALE_DOWN_ILM_14_BITS_RAW:
+            case DEPTH_RAW_DATA_SCALE_DOWN_ILM_14_BITS_COMBINED_RECTIFY:
+                return DepthEncoding::Z14;
+            case DEPTH_RAW_DATA_11_BITS:
+            case DEPTH_RAW_DATA_11_BITS_RAW:
+            case DEPTH_RAW_DATA_11_BITS_COMBINED_RECTIFY:
+            case DEPTH_RAW_DATA_ILM_11_BITS:
+            case DEPTH_RAW_DATA_ILM_11_BITS_RAW:
+            case DEPTH_RAW_DATA_ILM_11_BITS_COMBINED_RECTIFY:
+            case DEPTH_RAW_DATA_SCALE_DOWN_11_BITS:
+            case DEPTH_RAW_DATA_SCALE_DOWN_11_BITS_RAW:
+            case DEPTH_RAW_DATA_SCALE_DOWN_11_BITS_COMBINED_RECTIFY:
+            case DEPTH_RAW_DATA_SCALE_DOWN_ILM_11_BITS:
+            case DEPTH_RAW_DATA_SCALE_DOWN_ILM_11_BITS_RAW:
+            case DEPTH_RAW_DATA_SCALE_DOWN_ILM_11_BITS_COMBINED_RECTIFY:
+                return DepthEncoding::DISPARITY_11;
+            case DEPTH_RAW_DATA_8_BITS:
+            case DEPTH_RAW_DATA_8_BITS_RAW:
+            case DEPTH_RAW_DATA_ILM_8_BITS:
+            case DEPTH_RAW_DATA_ILM_8_BITS_RAW:
+            case DEPTH_RAW_DATA_SCALE_DOWN_8_BITS:
+            case DEPTH_RAW_DATA_SCALE_DOWN_8_BITS_RAW:
+            case DEPTH_RAW_DATA_SCALE_DOWN_ILM_8_BITS:
+            case DEPTH_RAW_DATA_SCALE_DOWN_ILM_8_BITS_RAW:
+                return DepthEncoding::DISPARITY_8;
+            case DEPTH_RAW_DATA_8_BITS_x80:
+            case DEPTH_RAW_DATA_8_BITS_x80_RAW:
+            case DEPTH_RAW_DATA_ILM_8_BITS_x80:
+            case DEPTH_RAW_DATA_ILM_8_BITS_x80_RAW:
+            case DEPTH_RAW_DATA_SCALE_DOWN_8_BITS_x80:
+            case DEPTH_RAW_DATA_SCALE_DOWN_8_BITS_x80_RAW:
+            case DEPTH_RAW_DATA_SCALE_DOWN_ILM_8_BITS_x80:
+            case DEPTH_RAW_DATA_SCALE_DOWN_ILM_8_BITS_x80_RAW:
+                return DepthEncoding::DISPARITY_8_x80;
+            default:
+                return DepthEncoding::NONE;
+        }
+    }
+
+    // Depth delivered at a reduced resolution, the library scales it back
+    static bool isScaledDown(DEPTH_RAW_DATA_TYPE format)    {
+        switch(format)    {
+            case DEPTH_RAW_DATA_SCALE_DOWN_8_BITS:
+            case DEPTH_RAW_DATA_SCALE_DOWN_14_BITS:
+            case DEPTH_RAW_DATA_SCALE_DOWN_8_BITS_x80:
+            case DEPTH_RAW_DATA_SCALE_DOWN_11_BITS:
+            case DEPTH_RAW_DATA_SCALE_DOWN_8_BITS_RAW:
+            case DEPTH_RAW_DATA_SCALE_DOWN_14_BITS_RAW:
+            case DEPTH_RAW_DATA_SCALE_DOWN_8_BITS_x80_RAW:
+            case DEPTH_RAW_DATA_SCALE_DOWN_11_BITS_RAW:
+            case DEPTH_RAW_DATA_SCALE_DOWN_14_BITS_COMBINED_RECTIFY:
+            case DEPTH_RAW_DATA_SCALE_DOWN_11_BITS_COMBINED_RECTIFY:
+            case DEPTH_RAW_DATA_SCALE_DOWN_ILM_8_BITS:
+            case DEPTH_RAW_DATA_SCALE_DOWN_ILM_14_BITS:
+            case DEPTH_RAW_DATA_SCALE_DOWN_ILM_8_BITS_x80:
+            case DEPTH_RAW_DATA_SCALE_DOWN_ILM_11_BITS:
+            case DEPTH_RAW_DATA_SCALE_DOWN_ILM_8_BITS_RAW:
+            case DEPTH_RAW_DATA_SCALE_DOWN_ILM_14_BITS_RAW:
+            case DEPTH_RAW_DATA_SCALE_DOWN_ILM_8_BITS_x80_RAW:
+            case DEPTH_RAW_DATA_SCALE_DOWN_ILM_11_BITS_RAW:
+            case DEPTH_RAW_DATA_SCALE_DOWN_ILM_14_BITS_COMBINED_RECTIFY:
+            case DEPTH_RAW_DATA_SCALE_DOWN_ILM_11_BITS_COMBINED_RECTIFY:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    PointCloudGenerator() = default;
+
+    void setIntrinsics(const PinholeIntrinsics &intrinsics)    {
+        if(intrinsics != mIntrinsics)    mLayoutValid = false;
+        mIntrinsics = intrinsics;
+    }
+    const PinholeIntrinsics &getIntrinsics() const    { return mIntrinsics; }
+
+    void setProjection(Projection projection)    {
+        if(projection != mProjection)    mLayoutValid = false;
+        mProjection = projection;
+    }
+    Projection getProjection() const    { return mProjection; }
+
+    // Rows are generated in bands by the caller and up to |threadCount| - 1 tasks of the SDK executor
+    void setThreadCount(int threadCount)    { mThreadCount = std::max(threadCount, 1); }
+    int getThreadCount() const    { return mThreadCount; }
+
+    /**
+     * |zdTable|: the ZD table of the device, big endian millimeters per 11
+     * bits disparity, |zdTableSize| bytes. Not needed for the 14 bits formats.
+     */
+    void setDepthFormat(DEPTH_RAW_DATA_TYPE format, const uint8_t *zdTable, size_t zdTableSize)    {
+        mEncoding = encodingOf(format);
+        if(mEncoding == DepthEncoding::Z14 || mEncoding == DepthEncoding::NONE)    return;
+
+        const size_t entries = zdTableSize / 2;
+        if(zdTable == nullptr || entries == 0)    {
+            mDisparityToZ.assign(1, 0);
+            return;
+        }
+        if(mDisparityToZ.size() == entries && !memcmp(mZDTable.data(), zdTable, zdTableSize))    return;
+
+        mZDTable.assign(zdTable, zdTable + zdTableSize);
+        mDisparityToZ.resize(entries);
+        for(size_t i = 0; i < entries; i++)
+            mDisparityToZ[i] = (uint16_t)((zdTable[i * 2] << 8) | zdTable[i * 2 + 1]);
+    }
+    DepthEncoding getDepthEncoding() const    { return mEncoding; }
+
+    // RGB of the points without a color image, indexed by Z in mm
+    void setDepthPalette(const RGBQUAD *palette, int count)    {
+        mPalette = palette;
+        mPaletteCount = count;
+    }
+
+    void setStride(int stride)    {
+        stride = std::max(stride, 1);
+        if(stride != mStride)    mLayoutValid = false;
+        mStride = stride;
+    }
+    int getStride() const    { return mStride; }
+
+    // Only the pixels of |region|, clipped to the frame, are generated
+    void setRegion(const PixelRect &region)    {
+        if(region != mRegion)    mLayoutValid = false;
+        mRegion = region;
+    }
+    const PixelRect &getRegion() const    { return mRegion; }
+
+    // Z outside [zNear, zFar] mm gives a hole, 0: no limit
+    void setDepthRange(float zNear, float zFar)    {
+        const uint32_t nearest = (zNear > 1.0f) ? (uint32_t)ceilf(std::min(zNear, 65535.0f)) : 1u;
+        const uint32_t farthest = (zFar > 0.0f) ? (uint32_t)std::min(zFar, 65535.0f) : 0xFFFFFFFFu;
+        mZNear = (farthest >= nearest) ? nearest : 0xFFFFFFFFu;     // empty range: no z passes
+        mZSpan = (farthest >= nearest) ? farthest - nearest : 0u;
+    }
+
+    // Points per side of the output for a depth frame of |width| x |height|
+    int outputWidth(int32_t width) const    {
+        int32_t start, length;
+        clip(mRegion.x, mRegion.width, width, &start, &length);
+        return std::max(length / mStride, 0);
+    }
+    int outputHeight(int32_t height) const    {
+        int32_t start, length;
+        clip(mRegion.y, mRegion.height, height, &start, &length);
+        return std::max(length / mStride, 0);
+    }
+
+    /**
+     * Writes outputWidth(depthWidth) x outputHeight(depthHeight) points to
+     * |xyz| and |rgb| (3 values each), row by row over the region. |color|
+     * is RGB24 or nullptr. Each kept pixel is at the center of its stride x
+     * stride cell.
+     * return
+     *     number of points written
+     */
+    size_t generate(const uint8_t *depth, int32_t depthWidth, int32_t depthHeight,
+                    const uint8_t *color, int32_t colorWidth, int32_t colorHeight,
+                    float *xyz, uint8_t *rgb)    {
+        const int outWidth = outputWidth(depthWidth), outHeight = outputHeight(depthHeight);
+        if(outWidth == 0 || outHeight == 0)    return 0;
+
+        prepareLayout(depthWidth, depthHeight, color ? colorWidth : 0);
+        const Frame frame{ depth, depthWidth, depthHeight, color, colorWidth, colorHeight, xyz, rgb, outWidth };
+        const int threads = (mThreadCount > 1) ? std::min(mThreadCount, base::Executor::get().numWorkers() + 1) : 1;
+        if(threads <= 1 || outHeight < 2 * (int)kMinBandRows)    {
+            generateRows(frame, 0, outHeight);
+        } else    {
+            runRowBands(outHeight, threads, [this, &frame](int begin, int end)    { generateRows(frame, begin, end); });
+        }
+
+        return (size_t)outWidth * outHeight;
+    }
+
+private:
+    static constexpr float kPi = 3.14159265f;
+    static constexpr int kChunkColumns = 256;       // depths decoded at once, on the stack
+    static constexpr int kMinBandRows = 16;         // fewer rows are not worth a task
+    static constexpr int kBandsPerThread = 4;       // so that a late thread still finds work
+
+    struct Frame    {
+        const uint8_t *depth;
+        int32_t depthWidth;
+        int32_t depthHeight;
+        const uint8_t *color;
+        int32_t colorWidth;
+        int32_t colorHeight;
+        float *xyz;
+        uint8_t *rgb;
+        int outWidth;
+    };
+
+    // |start| and |length| of [start, start + length) within [0, limit), all of it for length <= 0
+    static void clip(int32_t start, int32_t length, int32_t limit, int32_t *clippedStart, int32_t *clippedLength)    {
+        if(length <= 0)    {
+            *clippedStart = 0;
+            *clippedLength = std::max(limit, 0);
+            return;
+        }
+
+        const int64_t end = std::min((int64_t)start + length, (int64_t)limit);
+        *clippedStart = std::min(std::max(start, 0), std::max(limit, 0));
+        *clippedLength = (int32_t)std::max(end - *clippedStart, (int64_t)0);
+    }
+
+    // Runs |rows| over [0, rowCount) in bands, see Executor::parallelFor()
+    static void runRowBands(int rowCount, int threads, const std::function<void(int, int)> &rows)    {
+        const int rowsPerBand = std::max((rowCount + threads * kBandsPerThread - 1) / (threads * kBandsPerThread),
+                                         (int)kMinBandRows);
+        const int bandCount = (rowCount + rowsPerBand - 1) / rowsPerBand;
+        base::Executor::get().parallelFor(bandCount, threads, [&](int band)    {
+            const int begin = band * rowsPerBand;
+            rows(begin, std::min(begin + rowsPerBand, rowCount));
+        });
+    }
+
+    void generateRows(const Frame &frame, int rowBegin, int rowEnd) const    {
+        const int offset = mRowStart + mStride / 2;
+        const size_t bytesPerPixel = (mEncoding == DepthEncoding::DISPARITY_8) ? 1 : 2;
+        uint32_t z[kChunkColumns];
+
+        for(int row = rowBegin; row < rowEnd; row++)    {
+            const int y = row * mStride + offset;
+            const uint8_t *depthRow = frame.depth + (size_t)y * frame.depthWidth * bytesPerPixel;
+            const uint8_t *colorRow = frame.color ? frame.color + (size_t)std::min(y * frame.colorHeight / frame.depthHeight,
+                                                                                   frame.colorHeight - 1) *
+                                                                  frame.colorWidth * 3
+                                                  : nullptr;
+            float *outXYZ = frame.xyz + (size_t)row * frame.outWidth * 3;
+            uint8_t *outRGB = frame.rgb + (size_t)row * frame.outWidth * 3;
+
+            for(int first = 0; first < frame.outWidth; first += kChunkColumns)    {
+                const int count = std::min((int)kChunkColumns, frame.outWidth - first);
+                decodeDepth(depthRow, first, count, z);
+                colorPoints(z, colorRow, first, count, outRGB + (size_t)first * 3);
+                deproject(z, count, mColumnFactors.data() + first, mColumnZ.data() + first,
+                          mRowFactors[row], mRowZ[row], outXYZ + (size_t)first * 3);
+            }
+        }
+    }
+
+    // Z in mm of the |count| output columns from |first|, 0 for holes and depths out of range
+    void decodeDepth(const uint8_t *depthRow, int first, int count, uint32_t *z) const    {
+        const int column = mColumns[first];
+        const uint16_t *wideRow = (const uint16_t *)depthRow + column;
+        const uint8_t *narrowRow = depthRow + column;
+        const uint16_t *lut = mDisparityToZ.empty() ? nullptr : mDisparityToZ.data();
+        const uint32_t lutLast = mDisparityToZ.empty() ? 0u : (uint32_t)mDisparityToZ.size() - 1u;
+
+        switch(mEncoding)    {
+            case DepthEncoding::Z14:
+                decodeColumns(count, z, [wideRow](int x)    { return wideRow[x] & 0x3FFFu; });
+                break;
+            case DepthEncoding::DISPARITY_11:
+                decodeColumns(count, z, [wideRow, lut, lutLast](int x)    {
+                    return (uint32_t)lut[std::min((uint32_t)wideRow[x], lutLast)];
+                });
+                break;
+            case DepthEncoding::DISPARITY_8:
+                decodeColumns(count, z, [narrowRow, lut, lutLast](int x)    {
+                    return (uint32_t)lut[std::min((uint32_t)narrowRow[x] << 3, lutLast)];
+                });
+                break;
+            case DepthEncoding::DISPARITY_8_x80:
+                decodeColumns(count, z, [wideRow, lut, lutLast](int x)    {
+                    return (uint32_t)lut[std::min((uint32_t)(wideRow[x] & 0xFFu) << 3, lutLast)];
+                });
+                break;
+            default:
+                memset(z, 0, (size_t)count * sizeof(uint32_t));
+                break;
+        }
+    }
+
+    // |depthAt| of every stride-th pixel from the first column of the chunk, contiguous reads at stride 1
+    template <class DepthAt>
+    void decodeColumns(int count, uint32_t *z, DepthAt depthAt) const    {
+        const uint32_t zNear = mZNear, zSpan = mZSpan;
+        if(mStride == 1)    {
+            for(int k = 0; k < count; k++)    {
+                const uint32_t value = depthAt(k);
+                z[k] = (value - zNear > zSpan) ? 0u : value;        // out of range, 0 (no depth) included
+            }
+            return;
+        }
+
+        const int stride = mStride;
+        for(int k = 0; k < count; k++)    {
+            const uint32_t value = depthAt(k * stride);
+            z[k] = (value - zNear > zSpan) ? 0u : value;
+        }
+    }
+
+    void colorPoints(const uint32_t *z, const uint8_t *colorRow, int first, int count, uint8_t *rgb) const    {
+        if(!colorRow && !mPalette)    {
+            memset(rgb, 0, (size_t)count * 3);
+            return;
+        }
+
+        const int *colorColumns = mColorColumns.data() + first;
+        for(int k = 0; k < count; k++)    {
+            uint8_t *c = rgb + k * 3;
+            if(z[k] == 0u)    {
+                c[0] = c[1] = c[2] = 0;
+            } else if(colorRow)    {
+                memcpy(c, colorRow + (size_t)colorColumns[k] * 3, 3);
+            } else if(mPalette)    {
+                const RGBQUAD &entry = mPalette[std::min((int)z[k], mPaletteCount - 1)];
+                c[0] = entry.rgbRed;
+                c[1] = entry.rgbGreen;
+                c[2] = entry.rgbBlue;
+            } else    {
+                c[0] = c[1] = c[2] = 0;
+            }
+        }
+    }
+
+    // x = z * columnX, y = z * rowY, z = z * columnZ * rowZ, (0, 0, 0) where z is 0
+    static void deproject(const uint32_t *z, int count, const float *columnX, const float *columnZ,
+                          float rowY, float rowZ, float *xyz)    {
+        int k = 0;
+
+#if defined(__SSE2__) || defined(__x86_64__)
+        const __m128 y4 = _mm_set1_ps(rowY), rowZ4 = _mm_set1_ps(rowZ), zero = _mm_setzero_ps();
+        for(; k + 4 <= count; k += 4)    {
+            const __m128 zf = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(z + k)));
+            const __m128 valid = _mm_cmpgt_ps(zf, zero);        // no -0.0f in the holes
+            const __m128 px = _mm_and_ps(_mm_mul_ps(zf, _mm_loadu_ps(columnX + k)), valid);
+            const __m128 py = _mm_and_ps(_mm_mul_ps(zf, y4), valid);
+            const __m128 pz = _mm_and_ps(_mm_mul_ps(_mm_mul_ps(zf, _mm_loadu_ps(columnZ + k)), rowZ4), valid);
+
+            // x0 y0 x1 y1, x2 y2 x3 y3 -> x0 y0 z0 x1 | y1 z1 x2 y2 | z2 x3 y3 z3
+            const __m128 xy01 = _mm_unpacklo_ps(px, py), xy23 = _mm_unpackhi_ps(px, py);
+            const __m128 z0x1 = _mm_shuffle_ps(pz, xy01, _MM_SHUFFLE(2, 2, 0, 0));
+            const __m128 y1z1 = _mm_shuffle_ps(xy01, pz, _MM_SHUFFLE(1, 1, 3, 3));
+            const __m128 z23xy3 = _mm_shuffle_ps(pz, xy23, _MM_SHUFFLE(3, 2, 3, 2));
+            float *out = xyz + (size_t)k * 3;
+            _mm_storeu_ps(out, _mm_shuffle_ps(xy01, z0x1, _MM_SHUFFLE(2, 0, 1, 0)));
+            _mm_storeu_ps(out + 4, _mm_shuffle_ps(y1z1, xy23, _MM_SHUFFLE(1, 0, 2, 0)));
+            _mm_storeu_ps(out + 8, _mm_shuffle_ps(z23xy3, z23xy3, _MM_SHUFFLE(1, 3, 2, 0)));
+        }
+#elif defined(__ARM_NEON) || defined(__aarch64__)
+        const float32x4_t zero = vdupq_n_f32(0.0f);
+        for(; k + 4 <= count; k += 4)    {
+            const float32x4_t zf = vcvtq_f32_u32(vld1q_u32(z + k));
+            const uint32x4_t valid = vcgtq_f32(zf, zero);
+            float32x4x3_t p;
+            p.val[0] = vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(vmulq_f32(zf, vld1q_f32(columnX + k))), valid));
+            p.val[1] = vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(vmulq_n_f32(zf, rowY)), valid));
+            p.val[2] = vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(
+                    vmulq_n_f32(vmulq_f32(zf, vld1q_f32(columnZ + k)), rowZ)), valid));
+            vst3q_f32(xyz + (size_t)k * 3, p);       // interleaves x, y, z
+        }
+#endif
+
+        for(; k < count; k++)    {
+            float *p = xyz + (size_t)k * 3;
+            if(z[k] == 0u)    {
+                p[0] = p[1] = p[2] = 0.0f;
+                continue;
+            }
+
+            const float zf = (float)z[k];
+            p[0] = zf * columnX[k];
+            p[1] = zf * rowY;
+            p[2] = zf * columnZ[k] * rowZ;
+        }
+    }
+
+    // Pinhole: x and y through the image plane, z as is. Cylinder: the
+    // angle of the longer side gives sin and cos, the other side is an
+    // elevation (y - cy) / fy, the ray length being the depth.
+    void prepareLayout(int32_t depthWidth, int32_t depthHeight, int32_t colorWidth)    {
+        if(mLayoutValid && depthWidth == mDepthWidth && depthHeight == mDepthHeight &&
+           (colorWidth == 0 || colorWidth == mColorWidth))
+            return;
+
+        const int outWidth = outputWidth(depthWidth), outHeight = outputHeight(depthHeight);
+        int32_t columnStart, length;
+        clip(mRegion.x, mRegion.width, depthWidth, &columnStart, &length);
+        clip(mRegion.y, mRegion.height, depthHeight, &mRowStart, &length);
+        const int offset = mStride / 2;
+        const float fx = mIntrinsics.isValid() ? mIntrinsics.fx : 1.0f;
+        const float fy = mIntrinsics.isValid() ? mIntrinsics.fy : 1.0f;
+        const bool cylinder = (mProjection == Projection::CYLINDER);
+        const bool horizontal = (depthWidth > depthHeight);     // the side spanning pi radians
+        const float radiansPerPixel = kPi / (float)std::max(horizontal ? depthWidth : depthHeight, 1);
+
+        mColumns.resize(outWidth);
+        mColorColumns.resize(outWidth);
+        mColumnFactors.resize(outWidth);
+        mColumnZ.resize(outWidth);
+        for(int col = 0; col < outWidth; col++)    {
+            mColumns[col] = columnStart + col * mStride + offset;
+            mColorColumns[col] = std::min(mColumns[col] * colorWidth / depthWidth, std::max(colorWidth - 1, 0));
+
+            const float dx = (float)mColumns[col] - mIntrinsics.cx;
+            mColumnFactors[col] = (cylinder && horizontal) ? sinf(dx * radiansPerPixel) : dx / fx;
+            mColumnZ[col] = (cylinder && horizontal) ? cosf(dx * radiansPerPixel) : 1.0f;
+        }
+        mRowFactors.resize(outHeight);
+        mRowZ.resize(outHeight);
+        for(int row = 0; row < outHeight; row++)    {
+            const float dy = (float)(mRowStart + row * mStride + offset) - mIntrinsics.cy;
+            mRowFactors[row] = (cylinder && !horizontal) ? sinf(dy * radiansPerPixel) : dy / fy;
+            mRowZ[row] = (cylinder && !horizontal) ? cosf(dy * radiansPerPixel) : 1.0f;
+        }
+
+        mDepthWidth = depthWidth;
+        mDepthHeight = depthHeight;
+        mColorWidth = colorWidth;
+        mLayoutValid = true;
+    }
+
+private:
+    PinholeIntrinsics mIntrinsics;
+    Projection mProjection = Projection::PINHOLE;
+    DepthEncoding mEncoding = DepthEncoding::Z14;
+    std::vector<uint8_t> mZDTable;
+    std::vector<uint16_t> mDisparityToZ;        // millimeters per disparity, 0: hole
+    const RGBQUAD *mPalette = nullptr;
+    int mPaletteCount = 0;
+    int mStride = 1;
+    int mThreadCount = 1;
+    PixelRect mRegion;
+    uint32_t mZNear = 1u;                       // kept: z - mZNear <= mZSpan
+    uint32_t mZSpan = 0xFFFFFFFEu;
+
+    bool mLayoutValid = false;
+    int32_t mDepthWidth = 0;
+    int32_t mDepthHeight = 0;
+    int32_t mColorWidth = 0;
+    int32_t mRowStart = 0;                      // first depth row of the region
+    std::vector<int> mColumns;                  // depth column of each output column
+    std::vector<int> mColorColumns;             // color column of each output column
+    std::vector<float> mColumnFactors;          // x / z: (x - cx) / fx, or the sine of the column angle
+    std::vector<float> mColumnZ;                // 1, or the cosine of the column angle
+    std::vector<float> mRowFactors;             // y / z: (y - cy) / fy, or the sine of the row angle
+    std::vector<float> mRowZ;                   // 1, or the cosine of the row angle
+};
+
+// Point cloud stride of each device, for the producer hooks
+class PCStrideStage    {
+    DISALLOW_COPY_ASSIGN_AND_MOVE(PCStrideStage);
+
+public:
+    struct Options    {
+        int stride = 1;                 // every stride-th row and column
+        uint32_t targetPointCount = 0u; // overrides stride when not 0: at most that many points
+    };
+
+    // Never destroyed, producers may still run while static destructors do
+    static PCStrideStage &get()    {
+        static PCStrideStage *sInstance = new PCStrideStage();
+        return *sInstance;
+    }
+
+    // |device|: the CameraDevice of the stream, nullptr for the default of every device
+    void setOptions(const void *device, const Options &options)    {
+        base::AutoLock lock(mLock);
+        mOptions[device] = options;
+    }
+
+    void clearOptions(const void *device)    {
+        base::AutoLock lock(mLock);
+        mOptions.erase(device);
+    }
+
+    // Stride for a |width| x |height| depth frame of |device|, 1: full resolution
+    int strideFor(const void *device, int32_t width, int32_t height)    {
+        base::AutoLock lock(mLock);
+        auto iter = mOptions.find(device);
+        if(iter == mOptions.end())    iter = mOptions.find(nullptr);
+        if(iter == mOptions.end())    return 1;
+
+        const Options &options = iter->second;
+        return options.targetPointCount ? stride_for_point_count(width, height, options.targetPointCount)
+                                        : std::max(options.stride, 1);
+    }
+
+private:
+    PCStrideStage()    {
+        const char *stride = getenv("EYS3D_PC_STRIDE");
+        const char *targetPoints = getenv("EYS3D_PC_TARGET_POINTS");
+        if(!stride && !targetPoints)    return;
+
+        Options options;
+        options.stride = stride ? atoi(stride) : 1;
+        options.targetPointCount = targetPoints ? (uint32_t)strtoul(targetPoints, nullptr, 10) : 0u;
+        mOptions[nullptr] = options;
+    }
+
+    base::Lock mLock;
+    std::map<const void *, Options> mOptions;
+};
+
+// Projection and generation threads of each device, for the producer hooks
+class PCProjectionStage    {
+    DISALLOW_COPY_ASSIGN_AND_MOVE(PCProjectionStage);
+
+public:
+    using Projection = PointCloudGenerator::Projection;
+
+    struct Options    {
+        Projection projection = Projection::PINHOLE;   // CYLINDER for wide FOV modules
+        int threadCount = 1;            // threads generating the rows of a frame
+    };
+
+    // Never destroyed, producers may still run while static destructors do
+    static PCProjectionStage &get()    {
+        static PCProjectionStage *sInstance = new PCProjectionStage();
+        return *sInstance;
+    }
+
+    // |device|: the CameraDevice of the stream, nullptr for the default of every device
+    void setOptions(const void *device, const Options &options)    {
+        base::AutoLock lock(mLock);
+        mOptions[device] = options;
+    }
+
+    void clearOptions(const void *device)    {
+        base::AutoLock lock(mLock);
+        mOptions.erase(device);
+    }
+
+    // false if the point cloud of |device| keeps the deprojection of the library
+    bool optionsFor(const void *device, Options *options)    {
+        base::AutoLock lock(mLock);
+        if(mOptions.empty())    return false;
+
+        auto iter = mOptions.find(device);
+        if(iter == mOptions.end())    iter = mOptions.find(nullptr);
+        if(iter == mOptions.end())    return false;
+
+        *options = iter->second;
+        return true;
+    }
+
+private:
+    PCProjectionStage()    {
+        const char *projection = getenv("EYS3D_PC_PROJECTION");
+        const char *threads = getenv("EYS3D_PC_GENERATE_THREADS");
+        if(!projection && !threads)    return;
+
+        Options options;
+        options.projection = (projection && !strcmp(projection, "cylinder")) ? Projection::CYLINDER
+                                                                             : Projection::PINHOLE;
+        options.threadCount = threads ? std::max(atoi(threads), 1) : 1;
+        mOptions[nullptr] = options;
+    }
+
+    base::Lock mLock;
+    std::map<const void *, Options> mOptions;
+};
+
+}  // namespace video
+}  // namespace libeYs3D
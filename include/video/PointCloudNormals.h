@@ -0,0 +1,554 @@
+/*
+ * Copyright (C) 2021 eYs3D Corporation
+ * All rights reserved.
+ * This project is licensed under the Apache License, Version 2.0.
+ */
+
+#pragma once
+
+#include "video/PCFrame.h"
+#include "base/Compiler.h"
+
+#if defined(__SSE2__) || defined(__x86_64__)
+#  include <emmintrin.h>
+#elif defined(__aarch64__)
+#  include <arm_neon.h>
+#endif
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+//
+// Surface normals of an organized point cloud.
+//
+// A PCFrame holds its points row by row, width x height. The neighbours of
+// a point are therefore the points next to it in the image, so no search
+// tree is needed and each normal costs O(1):
+//
+//  - CROSS_PRODUCT: the cross product of the horizontal and vertical
+//    central differences, 4 points at a time with SSE2 or NEON.
+//  - COVARIANCE: the direction of least variance of the points in a square
+//    window around the point. The covariance sums come from integral
+//    images, so the cost does not depend on the window size. Smoother, and
+//    several times the cost of CROSS_PRODUCT.
+//
+// A neighbour whose depth differs from the point's by more than
+// maxDepthChangeFactor * z is on another surface. The differences then
+// become one sided, and a covariance window shrinks until it no longer
+// reaches a discontinuity. Normals have unit length and face the camera at
+// the origin. They are (0, 0, 0) where none can be estimated (holes,
+// isolated points):
+//
+//      PointCloudNormalEstimator estimator;
+//      estimator.compute(xyz, frame->width, frame->height, normals);   // 3 floats per point
+//
+// The layout of PCFrame is the prebuilt library's, so it has no room for a
+// normals buffer. drgbDataVec is allocated by the library with 3 bytes per
+// point and never filled, and compute(PCFrame *) stores the normals there
+// as 3 signed bytes per point (n * 127): see decode_normal(). Nothing in the
+// frame tells whether drgbDataVec holds normals: the caller of
+// compute(PCFrame *) says so to the next stages, as with
+// PointCloudDownsampler::downsample(frame, true). The same stage runs inside
+// PCFrameProducer, before the voxel downsampling, with the producer hooks of
+// video/PCProducerHooks.h:
+//
+//      PCNormalStage::get().configure(true, PointCloudNormalEstimator::Method::CROSS_PRODUCT);
+//
+// The stage starts from $EYS3D_PC_NORMALS (cross or covariance, unset: off).
+//
+
+namespace libeYs3D    {
+namespace video    {
+
+inline void encode_normal(const float *normal, int8_t *packed)    {
+    for(int i = 0; i < 3; i++)    packed[i] = (int8_t)(normal[i] * 127.0f + (normal[i] < 0.0f ? -0.5f : 0.5f));
+}
+
+// Unit length to within 1%, (0, 0, 0) for no normal
+inline void decode_normal(const int8_t *packed, float *normal)    {
+    for(int i = 0; i < 3; i++)    normal[i] = (float)packed[i] * (1.0f / 127.0f);
+}
+
+class PointCloudNormalEstimator    {
+    DISALLOW_COPY_ASSIGN_AND_MOVE(PointCloudNormalEstimator);
+
+public:
+    enum class Method    {
+        CROSS_PRODUCT,  // central differences of the 4 neighbours
+        COVARIANCE      // least variance in the smoothing window, integral images
+    };
+
+    static constexpr int kMaxSmoothingRadius = 64;
+
+    explicit PointCloudNormalEstimator(Method method = Method::CROSS_PRODUCT)
+        : mMethod(method)    {}
+
+    void setMethod(Method method)    { mMethod = method; }
+    Method getMethod() const    { return mMethod; }
+
+    // Neighbours further than |factor| * z in depth are on another surface
+    void setMaxDepthChangeFactor(float factor)    { mMaxDepthChange = (factor > 0.0f) ? factor : 0.0f; }
+    float getMaxDepthChangeFactor() const    { return mMaxDepthChange; }
+
+    // Half size of the COVARIANCE window, in points
+    void setSmoothingRadius(int radius)    {
+        mSmoothingRadius = (radius < 1) ? 1 : (radius > kMaxSmoothingRadius) ? kMaxSmoothingRadius : radius;
+    }
+    int getSmoothingRadius() const    { return mSmoothingRadius; }
+
+    /**
+     * Writes the normal of each of the |width| x |height| points of |xyz| to
+     * |normals|, 3 floats each.
+     * return
+     *     number of points with a normal
+     */
+    size_t compute(const float *xyz, int32_t width, int32_t height, float *normals)    {
+        if(width <= 0 || height <= 0)    return 0;
+
+        splitPlanes(xyz, (size_t)width * height);
+        if(mMethod == Method::COVARIANCE)    return covariance(width, height, normals);
+
+        size_t found = 0;
+        for(int32_t y = 0; y < height; y++)    found += crossProductRow(y, width, height, normals);
+        return found;
+    }
+
+    // Into drgbDataVec of |frame|, encoded, 0 if the cloud is not organized
+    size_t compute(PCFrame *frame)    {
+        const size_t count = (size_t)std::max(frame->width, 0) * (size_t)std::max(frame->height, 0);
+        if(count == 0 || frame->xyzDataVec.size() != count * 3)    {
+            frame->drgbDataVec.assign(frame->xyzDataVec.size(), 0);
+            return 0;
+        }
+
+        mNormals.resize(count * 3);
+        size_t found = compute(frame->xyzDataVec.data(), frame->width, frame->height, mNormals.data());
+        frame->drgbDataVec.resize(count * 3);
+        int8_t *packed = (int8_t *)frame->drgbDataVec.data();
+        for(size_t i = 0; i < count; i++)    encode_normal(&mNormals[i * 3], packed + i * 3);
+        return found;
+    }
+
+private:
+    // Sums over the valid points of a rectangle, from the integral images
+    enum Moment    { N, SX, SY, SZ, SXX, SXY, SXZ, SYY, SYZ, SZZ, kMoments };
+    struct Moments    {
+        double v[kMoments];
+    };
+
+    static constexpr size_t kNone = ~(size_t)0;
+
+    // Holes become z = 0, so z > 0 alone tells a valid point from here on
+    void splitPlanes(const float *xyz, size_t count)    {
+        mX.resize(count);
+        mY.resize(count);
+        mZ.resize(count);
+        for(size_t i = 0; i < count; i++)    {
+            const float *p = xyz + i * 3;
+            const bool valid = p[2] > 0.0f && isfinite(p[0]) && isfinite(p[1]) && isfinite(p[2]);
+            mX[i] = valid ? p[0] : 0.0f;
+            mY[i] = valid ? p[1] : 0.0f;
+            mZ[i] = valid ? p[2] : 0.0f;
+        }
+    }
+
+    bool isNeighbour(size_t i, size_t j, float limit) const    {
+        return j != kNone && mZ[j] > 0.0f && fabsf(mZ[j] - mZ[i]) <= limit;
+    }
+
+    // Central difference from |before| to |after|, one sided when one of them is on another surface
+    bool difference(size_t i, size_t before, size_t after, float limit, float *d) const    {
+        const bool hasBefore = isNeighbour(i, before, limit), hasAfter = isNeighbour(i, after, limit);
+        if(!hasBefore && !hasAfter)    return false;
+
+        const size_t a = hasAfter ? after : i, b = hasBefore ? before : i;
+        d[0] = mX[a] - mX[b];
+        d[1] = mY[a] - mY[b];
+        d[2] = mZ[a] - mZ[b];
+        return true;
+    }
+
+    // n = dv x dh, unit length, facing the camera at the origin
+    static bool orient(const float *dh, const float *dv, const float *p, float *n)    {
+        const float nx = dv[1] * dh[2] - dv[2] * dh[1];
+        const float ny = dv[2] * dh[0] - dv[0] * dh[2];
+        const float nz = dv[0] * dh[1] - dv[1] * dh[0];
+        const float length2 = nx * nx + ny * ny + nz * nz;
+        if(!(length2 > 1e-12f) || !isfinite(length2))    return false;
+
+        float scale = 1.0f / sqrtf(length2);
+        if(nx * p[0] + ny * p[1] + nz * p[2] > 0.0f)    scale = -scale;
+        n[0] = nx * scale;
+        n[1] = ny * scale;
+        n[2] = nz * scale;
+        return true;
+    }
+
+    bool crossProductAt(int32_t x, int32_t y, int32_t width, int32_t height, float *n) const    {
+        const size_t i = (size_t)y * width + x;
+        if(!(mZ[i] > 0.0f))    return false;
+
+        const float limit = mMaxDepthChange * mZ[i];
+        float dh[3], dv[3];
+        if(!difference(i, x > 0 ? i - 1 : kNone, x < width - 1 ? i + 1 : kNone, limit, dh))    return false;
+        if(!difference(i, y > 0 ? i - width : kNone, y < height - 1 ? i + width : kNone, limit, dv))    return false;
+
+        const float p[3] = { mX[i], mY[i], mZ[i] };
+        return orient(dh, dv, p, n);
+    }
+
+    size_t crossProductScalar(int32_t x, int32_t y, int32_t width, int32_t height, float *normals) const    {
+        float *n = normals + ((size_t)y * width + x) * 3;
+        if(crossProductAt(x, y, width, height, n))    return 1;
+
+        n[0] = n[1] = n[2] = 0.0f;
+        return 0;
+    }
+
+    size_t crossProductRow(int32_t y, int32_t width, int32_t height, float *normals) const    {
+        size_t found = 0;
+        int32_t x = 0;
+
+#if defined(__SSE2__) || defined(__x86_64__) || defined(__aarch64__)
+        // interior points with the 4 central differences, the others fall back to the scalar path
+        if(y > 0 && y < height - 1 && width > 0)    {
+            found += crossProductScalar(0, y, width, height, normals);
+            for(x = 1; x + 4 <= width - 1; x += 4)    {
+                const size_t i = (size_t)y * width + x;
+                float n[3][4];
+                if(!crossProduct4(i, (size_t)width, n))    {
+                    for(int k = 0; k < 4; k++)    found += crossProductScalar(x + k, y, width, height, normals);
+                    continue;
+                }
+
+                float *out = normals + i * 3;
+                for(int k = 0; k < 4; k++)    {
+                    out[k * 3 + 0] = n[0][k];
+                    out[k * 3 + 1] = n[1][k];
+                    out[k * 3 + 2] = n[2][k];
+                }
+                found += 4;
+            }
+        }
+#endif
+
+        for(; x < width; x++)    found += crossProductScalar(x, y, width, height, normals);
+        return found;
+    }
+
+#if defined(__SSE2__) || defined(__x86_64__)
+    // Points i .. i + 3, false unless all 4 have their 4 neighbours on their surface
+    bool crossProduct4(size_t i, size_t width, float n[3][4]) const    {
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 signBit = _mm_set1_ps(-0.0f);
+        const __m128 z = _mm_loadu_ps(&mZ[i]);
+        const __m128 limit = _mm_mul_ps(z, _mm_set1_ps(mMaxDepthChange));
+        const size_t neighbours[4] = { i - 1, i + 1, i - width, i + width };
+
+        __m128 ok = _mm_cmpgt_ps(z, zero);
+        for(size_t j : neighbours)    {
+            const __m128 zj = _mm_loadu_ps(&mZ[j]);
+            const __m128 change = _mm_andnot_ps(signBit, _mm_sub_ps(zj, z));
+            ok = _mm_and_ps(ok, _mm_and_ps(_mm_cmpgt_ps(zj, zero), _mm_cmple_ps(change, limit)));
+        }
+        if(_mm_movemask_ps(ok) != 0xF)    return false;
+
+        const __m128 dhx = _mm_sub_ps(_mm_loadu_ps(&mX[i + 1]), _mm_loadu_ps(&mX[i - 1]));
+        const __m128 dhy = _mm_sub_ps(_mm_loadu_ps(&mY[i + 1]), _mm_loadu_ps(&mY[i - 1]));
+        const __m128 dhz = _mm_sub_ps(_mm_loadu_ps(&mZ[i + 1]), _mm_loadu_ps(&mZ[i - 1]));
+        const __m128 dvx = _mm_sub_ps(_mm_loadu_ps(&mX[i + width]), _mm_loadu_ps(&mX[i - width]));
+        const __m128 dvy = _mm_sub_ps(_mm_loadu_ps(&mY[i + width]), _mm_loadu_ps(&mY[i - width]));
+        const __m128 dvz = _mm_sub_ps(_mm_loadu_ps(&mZ[i + width]), _mm_loadu_ps(&mZ[i - width]));
+
+        const __m128 nx = _mm_sub_ps(_mm_mul_ps(dvy, dhz), _mm_mul_ps(dvz, dhy));
+        const __m128 ny = _mm_sub_ps(_mm_mul_ps(dvz, dhx), _mm_mul_ps(dvx, dhz));
+        const __m128 nz = _mm_sub_ps(_mm_mul_ps(dvx, dhy), _mm_mul_ps(dvy, dhx));
+        const __m128 length2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(ny, ny)), _mm_mul_ps(nz, nz));
+        const __m128 usable = _mm_and_ps(_mm_cmpgt_ps(length2, _mm_set1_ps(1e-12f)),
+                                         _mm_cmplt_ps(length2, _mm_set1_ps(INFINITY)));
+        if(_mm_movemask_ps(usable) != 0xF)    return false;
+
+        const __m128 dot = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, _mm_loadu_ps(&mX[i])), _mm_mul_ps(ny, _mm_loadu_ps(&mY[i]))),
+                                      _mm_mul_ps(nz, z));
+        __m128 scale = _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(length2));
+        scale = _mm_xor_ps(scale, _mm_and_ps(_mm_cmpgt_ps(dot, zero), signBit));     // face the camera
+        _mm_storeu_ps(n[0], _mm_mul_ps(nx, scale));
+        _mm_storeu_ps(n[1], _mm_mul_ps(ny, scale));
+        _mm_storeu_ps(n[2], _mm_mul_ps(nz, scale));
+        return true;
+    }
+#elif defined(__aarch64__)
+    // Points i .. i + 3, false unless all 4 have their 4 neighbours on their surface
+    bool crossProduct4(size_t i, size_t width, float n[3][4]) const    {
+        const float32x4_t zero = vdupq_n_f32(0.0f);
+        const float32x4_t z = vld1q_f32(&mZ[i]);
+        const float32x4_t limit = vmulq_n_f32(z, mMaxDepthChange);
+        const size_t neighbours[4] = { i - 1, i + 1, i - width, i + width };
+
+        uint32x4_t ok = vcgtq_f32(z, zero);
+        for(size_t j : neighbours)    {
+            const float32x4_t zj = vld1q_f32(&mZ[j]);
+            ok = vandq_u32(ok, vandq_u32(vcgtq_f32(zj, zero), vcleq_f32(vabdq_f32(zj, z), limit)));
+        }
+        if(vminvq_u32(ok) == 0u)    return false;
+
+        const float32x4_t dhx = vsubq_f32(vld1q_f32(&mX[i + 1]), vld1q_f32(&mX[i - 1]));
+        const float32x4_t dhy = vsubq_f32(vld1q_f32(&mY[i + 1]), vld1q_f32(&mY[i - 1]));
+        const float32x4_t dhz = vsubq_f32(vld1q_f32(&mZ[i + 1]), vld1q_f32(&mZ[i - 1]));
+        const float32x4_t dvx = vsubq_f32(vld1q_f32(&mX[i + width]), vld1q_f32(&mX[i - width]));
+        const float32x4_t dvy = vsubq_f32(vld1q_f32(&mY[i + width]), vld1q_f32(&mY[i - width]));
+        const float32x4_t dvz = vsubq_f32(vld1q_f32(&mZ[i + width]), vld1q_f32(&mZ[i - width]));
+
+        const float32x4_t nx = vmlsq_f32(vmulq_f32(dvy, dhz), dvz, dhy);
+        const float32x4_t ny = vmlsq_f32(vmulq_f32(dvz, dhx), dvx, dhz);
+        const float32x4_t nz = vmlsq_f32(vmulq_f32(dvx, dhy), dvy, dhx);
+        const float32x4_t length2 = vmlaq_f32(vmlaq_f32(vmulq_f32(nx, nx), ny, ny), nz, nz);
+        const uint32x4_t usable = vandq_u32(vcgtq_f32(length2, vdupq_n_f32(1e-12f)),
+                                            vcltq_f32(length2, vdupq_n_f32(INFINITY)));
+        if(vminvq_u32(usable) == 0u)    return false;
+
+        const float32x4_t dot = vmlaq_f32(vmlaq_f32(vmulq_f32(nx, vld1q_f32(&mX[i])), ny, vld1q_f32(&mY[i])), nz, z);
+        float32x4_t scale = vdivq_f32(vdupq_n_f32(1.0f), vsqrtq_f32(length2));
+        scale = vbslq_f32(vcgtq_f32(dot, zero), vnegq_f32(scale), scale);      // face the camera
+        vst1q_f32(n[0], vmulq_f32(nx, scale));
+        vst1q_f32(n[1], vmulq_f32(ny, scale));
+        vst1q_f32(n[2], vmulq_f32(nz, scale));
+        return true;
+    }
+#endif
+
+    /**
+     * Eigenvector of the smallest eigenvalue of the symmetric matrix
+     * |c| = { xx, xy, xz, yy, yz, zz }, false when that eigenvalue is not
+     * a single one (isotropic points, points on a line).
+     */
+    static bool leastVarianceDirection(const double c[6], double *v)    {
+        const double a00 = c[0], a01 = c[1], a02 = c[2], a11 = c[3], a12 = c[4], a22 = c[5];
+        const double q = (a00 + a11 + a22) / 3.0;
+        const double p1 = a01 * a01 + a02 * a02 + a12 * a12;
+        const double p2 = (a00 - q) * (a00 - q) + (a11 - q) * (a11 - q) + (a22 - q) * (a22 - q) + 2.0 * p1;
+        if(!(p2 > 0.0))    return false;
+
+        // closed form of the eigenvalues, from the determinant of (A - qI) / p
+        const double p = sqrt(p2 / 6.0);
+        const double b00 = (a00 - q) / p, b11 = (a11 - q) / p, b22 = (a22 - q) / p;
+        const double b01 = a01 / p, b02 = a02 / p, b12 = a12 / p;
+        const double det = b00 * (b11 * b22 - b12 * b12) - b01 * (b01 * b22 - b12 * b02) + b02 * (b01 * b12 - b11 * b02);
+        const double r = std::min(std::max(det / 2.0, -1.0), 1.0);
+        const double lambda = q + 2.0 * p * cos(acos(r) / 3.0 + 2.0943951023931957);
+
+        // the eigenvector is orthogonal to the rows of A - lambda I
+        const double rows[3][3] = {
+            { a00 - lambda, a01, a02 }, { a01, a11 - lambda, a12 }, { a02, a12, a22 - lambda }
+        };
+        double best = 0.0;
+        for(int k = 0; k < 3; k++)    {
+            const double *r0 = rows[k], *r1 = rows[(k + 1) % 3];
+            const double w[3] = { r0[1] * r1[2] - r0[2] * r1[1], r0[2] * r1[0] - r0[0] * r1[2], r0[0] * r1[1] - r0[1] * r1[0] };
+            const double length2 = w[0] * w[0] + w[1] * w[1] + w[2] * w[2];
+            if(length2 <= best)    continue;
+
+            best = length2;
+            v[0] = w[0];
+            v[1] = w[1];
+            v[2] = w[2];
+        }
+        if(!(best > 0.0) || !isfinite(best))    return false;
+
+        const double scale = 1.0 / sqrt(best);
+        v[0] *= scale;
+        v[1] *= scale;
+        v[2] *= scale;
+        return true;
+    }
+
+    // Points on a discontinuity: a 4 neighbour on another surface
+    bool isEdge(size_t i, int32_t x, int32_t y, int32_t width, int32_t height) const    {
+        const float z = mZ[i], limit = mMaxDepthChange * z;
+        const size_t neighbours[4] = { x > 0 ? i - 1 : kNone, x < width - 1 ? i + 1 : kNone,
+                                       y > 0 ? i - width : kNone, y < height - 1 ? i + width : kNone };
+        for(size_t j : neighbours)    {
+            if(j != kNone && mZ[j] > 0.0f && fabsf(mZ[j] - z) > limit)    return true;
+        }
+        return false;
+    }
+
+    // Chessboard distance of each point to the nearest edge, capped
+    void buildEdgeDistances(int32_t width, int32_t height)    {
+        const uint8_t cap = (uint8_t)(mSmoothingRadius + 1);
+        mDistance.resize((size_t)width * height);
+        for(int32_t y = 0; y < height; y++)    {
+            for(int32_t x = 0; x < width; x++)    {
+                const size_t i = (size_t)y * width + x;
+                mDistance[i] = (mZ[i] > 0.0f && isEdge(i, x, y, width, height)) ? 0 : cap;
+            }
+        }
+
+        for(int32_t y = 0; y < height; y++)    {
+            for(int32_t x = 0; x < width; x++)    {
+                uint8_t &d = mDistance[(size_t)y * width + x];
+                if(x > 0)    d = std::min(d, (uint8_t)(mDistance[(size_t)y * width + x - 1] + 1));
+                if(y == 0)    continue;
+
+                const uint8_t *above = &mDistance[(size_t)(y - 1) * width];
+                for(int32_t k = std::max(x - 1, 0); k <= std::min(x + 1, width - 1); k++)
+                    d = std::min(d, (uint8_t)(above[k] + 1));
+            }
+        }
+        for(int32_t y = height - 1; y >= 0; y--)    {
+            for(int32_t x = width - 1; x >= 0; x--)    {
+                uint8_t &d = mDistance[(size_t)y * width + x];
+                if(x < width - 1)    d = std::min(d, (uint8_t)(mDistance[(size_t)y * width + x + 1] + 1));
+                if(y == height - 1)    continue;
+
+                const uint8_t *below = &mDistance[(size_t)(y + 1) * width];
+                for(int32_t k = std::max(x - 1, 0); k <= std::min(x + 1, width - 1); k++)
+                    d = std::min(d, (uint8_t)(below[k] + 1));
+            }
+        }
+    }
+
+    // Sums up to each point, one row and one column of zeros in front
+    void buildIntegralImages(int32_t width, int32_t height)    {
+        const size_t stride = (size_t)width + 1;
+        mIntegral.resize(stride * (height + 1));
+        memset(mIntegral.data(), 0, stride * sizeof(Moments));
+
+        for(int32_t y = 0; y < height; y++)    {
+            Moments row;
+            memset(&row, 0, sizeof(row));
+            const Moments *above = &mIntegral[(size_t)y * stride];
+            Moments *out = &mIntegral[(size_t)(y + 1) * stride];
+            memset(out, 0, sizeof(Moments));
+
+            for(int32_t x = 0; x < width; x++)    {
+                const size_t i = (size_t)y * width + x;
+                if(mZ[i] > 0.0f)    {
+                    const double px = mX[i], py = mY[i], pz = mZ[i];
+                    row.v[N] += 1.0;
+                    row.v[SX] += px;
+                    row.v[SY] += py;
+                    row.v[SZ] += pz;
+                    row.v[SXX] += px * px;
+                    row.v[SXY] += px * py;
+                    row.v[SXZ] += px * pz;
+                    row.v[SYY] += py * py;
+                    row.v[SYZ] += py * pz;
+                    row.v[SZZ] += pz * pz;
+                }
+                for(int m = 0; m < kMoments; m++)    out[x + 1].v[m] = above[x + 1].v[m] + row.v[m];
+            }
+        }
+    }
+
+    bool covarianceAt(int32_t x, int32_t y, int32_t width, int32_t height, int radius, float *n) const    {
+        const size_t stride = (size_t)width + 1;
+        const int32_t x0 = std::max(x - radius, 0), x1 = std::min(x + radius + 1, width);
+        const int32_t y0 = std::max(y - radius, 0), y1 = std::min(y + radius + 1, height);
+        const Moments &a = mIntegral[(size_t)y0 * stride + x0], &b = mIntegral[(size_t)y0 * stride + x1];
+        const Moments &c = mIntegral[(size_t)y1 * stride + x0], &d = mIntegral[(size_t)y1 * stride + x1];
+
+        double s[kMoments];
+        for(int m = 0; m < kMoments; m++)    s[m] = d.v[m] - b.v[m] - c.v[m] + a.v[m];
+        if(s[N] < 3.0)    return false;
+
+        const double inverse = 1.0 / s[N];
+        const double mx = s[SX] * inverse, my = s[SY] * inverse, mz = s[SZ] * inverse;
+        const double covariance[6] = {
+            s[SXX] * inverse - mx * mx, s[SXY] * inverse - mx * my, s[SXZ] * inverse - mx * mz,
+            s[SYY] * inverse - my * my, s[SYZ] * inverse - my * mz, s[SZZ] * inverse - mz * mz
+        };
+        double v[3];
+        if(!leastVarianceDirection(covariance, v))    return false;
+
+        const size_t i = (size_t)y * width + x;
+        const double sign = (v[0] * mX[i] + v[1] * mY[i] + v[2] * mZ[i] > 0.0) ? -1.0 : 1.0;
+        n[0] = (float)(v[0] * sign);
+        n[1] = (float)(v[1] * sign);
+        n[2] = (float)(v[2] * sign);
+        return true;
+    }
+
+    // Windows stop short of the nearest edge, points too close to one use the cross product
+    size_t covariance(int32_t width, int32_t height, float *normals)    {
+        buildEdgeDistances(width, height);
+        buildIntegralImages(width, height);
+
+        size_t found = 0;
+        for(int32_t y = 0; y < height; y++)    {
+            for(int32_t x = 0; x < width; x++)    {
+                const size_t i = (size_t)y * width + x;
+                float *n = normals + i * 3;
+                const int radius = std::min((int)mDistance[i] - 1, mSmoothingRadius);
+                if(mZ[i] > 0.0f && ((radius >= 1 && covarianceAt(x, y, width, height, radius, n)) ||
+                                    crossProductAt(x, y, width, height, n)))    {
+                    found++;
+                    continue;
+                }
+
+                n[0] = n[1] = n[2] = 0.0f;
+            }
+        }
+        return found;
+    }
+
+    Method mMethod;
+    float mMaxDepthChange = 0.02f;
+    int mSmoothingRadius = 3;
+
+    std::vector<float> mX;                  // planes of the cloud
+    std::vector<float> mY;
+    std::vector<float> mZ;                  // 0: hole
+    std::vector<float> mNormals;            // for compute(PCFrame *)
+    std::vector<uint8_t> mDistance;         // COVARIANCE: to the nearest edge
+    std::vector<Moments> mIntegral;         // COVARIANCE: (width + 1) x (height + 1)
+};
+
+// Settings of the normal estimation inside PCFrameProducer, for every device
+class PCNormalStage    {
+    DISALLOW_COPY_ASSIGN_AND_MOVE(PCNormalStage);
+
+public:
+    using Method = PointCloudNormalEstimator::Method;
+
+    // Never destroyed, producers may still run while static destructors do
+    static PCNormalStage &get()    {
+        static PCNormalStage *sInstance = new PCNormalStage();
+        return *sInstance;
+    }
+
+    void configure(bool enabled, Method method = Method::CROSS_PRODUCT,
+                   float maxDepthChangeFactor = 0.02f, int smoothingRadius = 3)    {
+        mMethod = method;
+        mMaxDepthChange = maxDepthChangeFactor;
+        mSmoothingRadius = smoothingRadius;
+        mEnabled = enabled;
+    }
+
+    bool isEnabled() const    { return mEnabled; }
+    Method getMethod() const    { return mMethod; }
+    float getMaxDepthChangeFactor() const    { return mMaxDepthChange; }
+    int getSmoothingRadius() const    { return mSmoothingRadius; }
+
+private:
+    PCNormalStage()    {
+        const char *method = getenv("EYS3D_PC_NORMALS");
+        if(!method)    return;
+
+        configure(true, strcmp(method, "covariance") ? Method::CROSS_PRODUCT : Method::COVARIANCE);
+    }
+
+    std::atomic<bool> mEnabled{false};
+    std::atomic<Method> mMethod{Method::CROSS_PRODUCT};
+    std::atomic<float> mMaxDepthChange{0.02f};
+    std::atomic<int> mSmoothingRadius{3};
+};
+
+}  // namespace video
+}  // namespace libeYs3D
@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2021 eYs3D Corporation
+ * All rights reserved.
+ * This project is licensed under the Apache License, Version 2.0.
+ */
+
+#pragma once
+
+#include "base/Compiler.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+//
+// Sparse voxel grid over a point cloud: one slot per occupied voxel in an
+// open addressing hash table (linear probing), keyed by the voxel
+// coordinates packed in 63 bits.
+//
+// reset() takes a new generation of the table instead of clearing it. The
+// table grows with the occupied voxels, not with the points, so it stays
+// cache sized for coarse voxels. After the first frames, a grid used once
+// per frame no longer allocates. The grid is not thread-safe.
+//
+// keyOf() clamps each coordinate to [-kAxisLimit, kAxisLimit] voxels: the
+// points beyond, and NaN, share the voxels of the border of the grid.
+//
+//      grid.setVoxelSize(10.0f);           // same unit as the points, mm for PCFrame
+//      grid.reset(grid.size());            // last frame's voxel count as the size hint
+//      for(each point i)    {
+//          uint32_t first = grid.findOrInsert(grid.keyOf(x, y, z), i);
+//          if(first == i)    ... first point of its voxel
+//      }
+//
+
+namespace libeYs3D    {
+namespace video    {
+
+class VoxelGrid    {
+    DISALLOW_COPY_ASSIGN_AND_MOVE(VoxelGrid);
+
+public:
+    static constexpr int kAxisBits = 21;                        // voxel coordinates in [-2^20, 2^20)
+    static constexpr int32_t kAxisLimit = (1 << (kAxisBits - 1)) - 1;
+    static constexpr uint32_t kEmpty = 0xFFFFFFFFu;
+
+    explicit VoxelGrid(float voxelSize = 1.0f)    {
+        setVoxelSize(voxelSize);
+        allocate(tableSizeFor(0));
+    }
+
+    void setVoxelSize(float voxelSize)    {
+        mVoxelSize = voxelSize;
+        mInverseSize = (voxelSize > 0.0f) ? 1.0f / voxelSize : 0.0f;
+    }
+    float getVoxelSize() const    { return mVoxelSize; }
+
+    /**
+     * Empties the grid. |expectedVoxels| sizes the table, it grows past that
+     * as needed: the voxel count of the previous frame is a good guess.
+     */
+    void reset(size_t expectedVoxels)    {
+        mCount = 0;
+        size_t capacity = tableSizeFor(expectedVoxels);
+        if(capacity > mSlots.size())    {
+            allocate(capacity);
+            return;
+        }
+
+        if(++mStamp == 0u)    {     // wrapped, the stale stamps could match again
+            for(Slot &slot : mSlots)    slot.stamp = 0u;
+            mStamp = 1u;
+        }
+    }
+
+    uint64_t keyOf(float x, float y, float z) const    {
+        return (uint64_t)axis(x) | ((uint64_t)axis(y) << kAxisBits) | ((uint64_t)axis(z) << (kAxisBits * 2));
+    }
+
+    /**
+     * Value of the voxel |key|, or |value| after storing it there if the
+     * voxel was empty.
+     */
+    uint32_t findOrInsert(uint64_t key, uint32_t value)    {
+        Slot &slot = probe(key);
+        if(slot.stamp == mStamp)    return slot.value;
+
+        slot.key = key;
+        slot.stamp = mStamp;
+        slot.value = value;
+        if(++mCount * 2 > mSlots.size())    grow();     // load factor <= 0.5
+        return value;
+    }
+
+    // Occupied voxels since the last reset()
+    size_t size() const    { return mCount; }
+
+private:
+    struct Slot    {
+        uint64_t key = 0ull;
+        uint32_t stamp = 0u;        // occupied in the generation mStamp
+        uint32_t value = kEmpty;
+    };
+
+    static size_t tableSizeFor(size_t voxels)    {
+        size_t capacity = 1024;
+        while(capacity < voxels * 2)    capacity <<= 1;
+        return capacity;
+    }
+
+    void allocate(size_t capacity)    {
+        int bits = 0;
+        while(((size_t)1 << bits) < capacity)    bits++;
+        mSlots.assign(capacity, Slot());
+        mShift = 64 - bits;
+        mStamp = 1u;
+    }
+
+    // The slot of |key|, or the empty one where it goes
+    Slot &probe(uint64_t key)    {
+        const size_t mask = mSlots.size() - 1;
+        size_t index = (size_t)((key * 0x9E3779B97F4A7C15ull) >> mShift);
+        while(true)    {
+            Slot &slot = mSlots[index];
+            if(slot.stamp != mStamp || slot.key == key)    return slot;
+
+            index = (index + 1) & mask;
+        }
+    }
+
+    void grow()    {
+        std::vector<Slot> slots;
+        slots.swap(mSlots);
+        const uint32_t stamp = mStamp;
+        allocate(slots.size() * 2);
+        for(const Slot &slot : slots)    {
+            if(slot.stamp != stamp)    continue;
+
+            Slot &moved = probe(slot.key);
+            moved = slot;
+            moved.stamp = mStamp;
+        }
+    }
+
+    // floor() without the libm call: truncate, then step down for negatives
+    uint32_t axis(float value) const    {
+        float scaled = value * mInverseSize;
+        if(!(scaled < (float)kAxisLimit))    scaled = (float)kAxisLimit;     // NaN as well
+        if(scaled < (float)-kAxisLimit)    scaled = (float)-kAxisLimit;
+        int32_t coordinate = (int32_t)scaled;
+        coordinate -= (scaled < (float)coordinate) ? 1 : 0;
+        return (uint32_t)(coordinate + kAxisLimit + 1) & ((1u << kAxisBits) - 1);
+    }
+
+    float mVoxelSize = 1.0f;
+    float mInverseSize = 1.0f;
+    std::vector<Slot> mSlots;           // power of 2 size
+    int mShift = 54;
+    uint32_t mStamp = 1u;
+    size_t mCount = 0;
+};
+
+}  // namespace video
+}  // namespace libeYs3D
@@ -0,0 +1,4 @@
+export EYS3D_HOME="./eYs3D"
+cd out
+./eys3d.bench --json bench.json "$@"
+cd ..
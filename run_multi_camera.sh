@@ -0,0 +1,4 @@
+export EYS3D_HOME="./eYs3D"
+cd out
+./eys3d.multi_camera "$@"
+cd ..
@@ -0,0 +1,4 @@
+export EYS3D_HOME="./eYs3D"
+cd out
+./eys3d.pipeline_bench --json pipeline_bench.json "$@"
+cd ..
@@ -0,0 +1,696 @@
+/*
+ * Copyright (C) 2021 eYs3D Corporation
+ * All rights reserved.
+ * This project is licensed under the Apache License, Version 2.0.
+ *
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "benchmark.h"
+#include "synthetic_frames.h"
+#include "video/coders.h"
+#include "video/Frame.h"
+#include "video/OrganizedMesh.h"
+#include "video/PointCloudCrop.h"
+#include "video/PointCloudDownsampler.h"
+#include "video/PointCloudFusion.h"
+#include "video/PointCloudGenerator.h"
+#include "video/PointCloudNormals.h"
+#include "video/PostProcessHandle.h"
+#include "video/ColorProcessHandle.h"
+#include "devices/model/DepthFilterOptions.h"
+#include "ColorPaletteGenerator.h"
+#include "PlyFilter.h"
+#include "PlyWriter.h"
+#include "IMUData.h"
+#include "debug.h"
+
+#define LOG_TAG "eys3d.bench"
+
+//
+// Runs the image and point cloud kernels of the SDK on synthetic frames (or
+// raw frames recorded with --color-file / --depth-file) at 640x360 and
+// 1280x720, no camera is needed:
+//
+//      eys3d.bench [--json <file|->] [--filter <substring>] [--min-time-ms <ms>]
+//                  [--color-file <yuy2 dump>] [--depth-file <16-bit depth dump>]
+//
+// A recorded file is used for the resolution whose frame size matches the
+// file size.
+//
+// --cylinder-check compares the cylinder projection of PointCloudGenerator
+// with PlyWriter::apcFrameTo3DCylinder() instead of benchmarking.
+// --fusion-check compares the vector transform of PointCloudFusion with its
+// scalar path.
+//
+
+using namespace libeYs3D;
+using namespace libeYs3D::bench;
+
+struct Resolution    {
+    int32_t width;
+    int32_t height;
+};
+
+static const Resolution kResolutions[] = { { 640, 360 }, { 1280, 720 } };
+
+static constexpr int kIMUPacketsPerIteration = 1000;
+
+// DepthFilterOptions defaults, the constructor is reserved to CameraDevice
+class BenchDepthFilterOptions : public libeYs3D::devices::DepthFilterOptions    {
+public:
+    BenchDepthFilterOptions()    {
+        resetDefault();
+        setBytesPerPixel(2);
+    }
+};
+
+struct Inputs    {
+    Resolution resolution;
+    std::vector<uint8_t> yuy2;
+    std::vector<uint8_t> rgb;
+    std::vector<uint8_t> d11;
+    std::vector<uint8_t> z14;
+    std::vector<uint8_t> d11Half;   // depth at half the color resolution
+    eSPCtrl_RectLogData rectLog;
+};
+
+static void bench_color(BenchRunner &runner, Inputs &in)    {
+    const int32_t w = in.resolution.width, h = in.resolution.height;
+    std::vector<uint8_t> rgb((size_t)w * h * 3);
+
+    runner.run("yuy2_to_rgb", w, h, in.yuy2.size(), nullptr, [&]() {
+        uint64_t size = 0;
+        libeYs3D::video::convert_yuv_to_rgb_buffer(in.yuy2.data(), rgb.data(), w, h, &size);
+        do_not_optimize(size);
+    });
+
+    std::vector<uint8_t> half((size_t)(w / 2) * (h / 2) * 3);
+    runner.run("resample_rgb_half", w, h, in.rgb.size(), nullptr, [&]() {
+        PlyWriter::resampleImage(w, h, in.rgb.data(), w / 2, h / 2, half.data(), 3);
+        do_not_optimize(half[0]);
+    });
+
+    std::vector<uint8_t> depthFull((size_t)w * h * 2);
+    runner.run("resample_depth_to_color", w, h, in.d11Half.size(), nullptr, [&]() {
+        PlyWriter::resampleImage(w / 2, h / 2, in.d11Half.data(), w, h, depthFull.data(), 2);
+        do_not_optimize(depthFull[0]);
+    });
+
+    if(!runner.isSelected("color_process_resize_half"))    return;
+
+    PostProcessOptions options;
+    options.enableColorPostProcess(true);
+    options.setColorResizeFactor(0.5f);
+    PostProcessHandleCallback callback = [](bool) -> int { return 0; };
+    libeYs3D::video::ColorProcessHandle handle(w, h, APCImageType::COLOR_RGB24, options, callback);
+    libeYs3D::video::IImageProcess *process = &handle;  // process() is only exported as a virtual
+    libeYs3D::video::Frame frame(0, 0, 0, 0, in.rgb.size(), 0);
+    frame.width = w;
+    frame.height = h;
+    runner.run("color_process_resize_half", w, h, in.rgb.size(), [&]() {
+        frame.rgbVec.assign(in.rgb.begin(), in.rgb.end());
+        frame.actualRGBBufferSize = in.rgb.size();
+    }, [&]() {
+        process->process(&frame);
+    });
+}
+
+static void bench_palette(BenchRunner &runner, Inputs &in)    {
+    const int32_t w = in.resolution.width, h = in.resolution.height;
+    std::vector<RGBQUAD> paletteZ14(COLOR_PALETTE_MAX_COUNT);
+    std::vector<RGBQUAD> paletteD11(kD11MaxDisparity + 1);
+    ColorPaletteGenerator::DmColorMode14(paletteZ14.data(), kZ14MaxDepth, 0.0f, false);
+    ColorPaletteGenerator::generatePaletteColor(paletteD11.data(), kD11MaxDisparity + 1, 0, 1, 2000, false);
+
+    std::vector<uint8_t> rgb((size_t)w * h * 3);
+    runner.run("colorize_z14", w, h, in.z14.size(), nullptr, [&]() {
+        colorize_depth(paletteZ14.data(), (int)paletteZ14.size(),
+                       (const uint16_t *)in.z14.data(), rgb.data(), w * h);
+        do_not_optimize(rgb[0]);
+    });
+    runner.run("colorize_d11", w, h, in.d11.size(), nullptr, [&]() {
+        colorize_depth(paletteD11.data(), (int)paletteD11.size(),
+                       (const uint16_t *)in.d11.data(), rgb.data(), w * h);
+        do_not_optimize(rgb[0]);
+    });
+}
+
+static void bench_post_process(BenchRunner &runner, Inputs &in)    {
+    const int32_t w = in.resolution.width, h = in.resolution.height;
+    const struct    {
+        const char *name;
+        std::vector<uint8_t> *depth;
+        APCImageType::Value type;
+        int decimationFactor;
+    } cases[] = {
+        { "post_process_d11", &in.d11, APCImageType::DEPTH_11BITS, 1 },
+        { "post_process_z14", &in.z14, APCImageType::DEPTH_14BITS, 1 },
+        { "post_process_z14_decimate2", &in.z14, APCImageType::DEPTH_14BITS, 2 },
+    };
+
+    for(const auto &c : cases)    {
+        if(!runner.isSelected(c.name))    continue;
+
+        PostProcessOptions options(5, 16.0f, c.decimationFactor);
+        options.enable(true);
+        PostProcessHandleCallback callback = [](bool) -> int { return 0; };
+        libeYs3D::video::PostProcessHandle handle(w, h, c.type, options, callback);
+        libeYs3D::video::IImageProcess *process = &handle;
+        libeYs3D::video::Frame frame(c.depth->size(), 0, 0, 0, 0, 0);
+        frame.width = w;
+        frame.height = h;
+        runner.run(c.name, w, h, c.depth->size(), [&]() {
+            frame.dataVec.assign(c.depth->begin(), c.depth->end());
+            frame.actualDataBufferSize = c.depth->size();
+        }, [&]() {
+            process->process(&frame);
+        });
+    }
+}
+
+// The DepthFilterOptions filters, in the order the depth producer applies them
+static void bench_depth_filters(BenchRunner &runner, Inputs &in, void *handle)    {
+    const int32_t w = in.resolution.width, h = in.resolution.height;
+    const char *names[] = { "depth_filter_subsample", "depth_filter_edge_preserving", "depth_filter_hole_fill",
+                            "depth_filter_temporal", "depth_filter_apply", "depth_filter_flying_depth_d11" };
+    if(handle == nullptr)    {
+        for(const char *name : names)    runner.skip(name, w, h, "APC_Init failed");
+        return;
+    }
+
+    BenchDepthFilterOptions options;
+    DEVSELINFO devSelInfo;
+    devSelInfo.index = 0;
+    const int bpp = options.getBytesPerPixel();
+    std::vector<uint8_t> depth(in.d11.size());
+    auto restore = [&]() { memcpy(depth.data(), in.d11.data(), in.d11.size()); };
+
+    unsigned char *subDisparity = nullptr;
+    int subWidth = 0, subHeight = 0;
+    restore();
+    APC_SubSample(handle, &devSelInfo, &subDisparity, depth.data(), bpp, w, h,
+                  subWidth, subHeight, options.getSubSampleMode(), options.getSubSampleFactor());
+
+    runner.run("depth_filter_subsample", w, h, depth.size(), restore, [&]() {
+        APC_SubSample(handle, &devSelInfo, &subDisparity, depth.data(), bpp, w, h,
+                      subWidth, subHeight, options.getSubSampleMode(), options.getSubSampleFactor());
+    });
+    runner.run("depth_filter_edge_preserving", w, h, depth.size(), restore, [&]() {
+        APC_EdgePreServingFilter(handle, &devSelInfo, depth.data(), options.getType(), w, h,
+                                 options.getEdgeLevel(), options.getSigma(), options.getLumda());
+    });
+    runner.run("depth_filter_hole_fill", w, h, depth.size(), restore, [&]() {
+        APC_HoleFill(handle, &devSelInfo, depth.data(), bpp, options.getKernelSize(), w, h,
+                     options.getLevel(), options.isHorizontal());
+    });
+    APC_ResetFilters(handle, &devSelInfo);
+    runner.run("depth_filter_temporal", w, h, depth.size(), restore, [&]() {
+        APC_TemporalFilter(handle, &devSelInfo, depth.data(), bpp, w, h,
+                           options.getAlpha(), options.getHistory());
+    });
+    runner.run("depth_filter_apply", w, h, depth.size(), restore, [&]() {
+        APC_ApplyFilters(handle, &devSelInfo, depth.data(), subDisparity, bpp, w, h,
+                         subWidth, subHeight);
+    });
+    runner.run("depth_filter_flying_depth_d11", w, h, depth.size(), restore, [&]() {
+        APC_FlyingDepthCancellation_D11(handle, &devSelInfo, depth.data(), w, h);
+    });
+    APC_ResetFilters(handle, &devSelInfo);
+}
+
+static void bench_point_cloud(BenchRunner &runner, Inputs &in)    {
+    const int32_t w = in.resolution.width, h = in.resolution.height;
+    std::vector<CloudPoint> cloud;
+    cloud.reserve((size_t)w * h);
+
+    // the filters work in place on the depth buffer
+    std::vector<uint8_t> depth;
+    std::vector<float> filtered;
+    runner.run("ply_filter_d11", w, h, in.d11.size(), [&]() { depth = in.d11; }, [&]() {
+        PlyFilter::CF_FILTER(depth, in.rgb, w, h, w, h, filtered, &in.rectLog);
+    });
+    runner.run("ply_filter_z14", w, h, in.z14.size(), [&]() { depth = in.z14; }, [&]() {
+        PlyFilter::CF_FILTER_Z14(depth, in.rgb, w, h, w, h, filtered, &in.rectLog);
+    });
+    runner.run("ply_unavailable_disparity", w, h, in.d11.size(), [&]() { depth = in.d11; }, [&]() {
+        PlyFilter::UnavailableDisparityCancellation(depth, w, h, kD11MaxDisparity);
+    });
+
+    const struct    {
+        const char *name;
+        std::vector<uint8_t> *depth;
+        APCImageType::Value type;
+    } cases[] = {
+        { "pc_apc_frame_to_3d_d11", &in.d11, APCImageType::DEPTH_11BITS },
+        { "pc_apc_frame_to_3d_z14", &in.z14, APCImageType::DEPTH_14BITS },
+    };
+    for(const auto &c : cases)    {
+        runner.run(c.name, w, h, c.depth->size(), [&]() { cloud.clear(); }, [&]() {
+            PlyWriter::apcFrameTo3D(w, h, *c.depth, w, h, in.rgb, &in.rectLog, c.type, cloud,
+                                    false, 0.0f, (float)kZ14MaxDepth, true, true, 1.0f);
+        });
+    }
+    runner.run("pc_apc_frame_to_3d_8029", w, h, in.d11.size(), [&]() { cloud.clear(); }, [&]() {
+        PlyWriter::apcFrameTo3D_8029(w, h, in.d11, w, h, in.rgb, &in.rectLog,
+                                     APCImageType::DEPTH_11BITS, cloud,
+                                     false, 0.0f, (float)kZ14MaxDepth, true, true, 1.0f);
+    });
+    runner.run("pc_apc_frame_to_3d_color_resolution", w, h, in.d11Half.size(),
+               [&]() { cloud.clear(); }, [&]() {
+        PlyWriter::apcFrameTo3D(w / 2, h / 2, in.d11Half, w, h, in.rgb, &in.rectLog,
+                                APCImageType::DEPTH_11BITS, cloud,
+                                false, 0.0f, (float)kZ14MaxDepth, true, false, 1.0f);
+    });
+
+    if(runner.isSelected("pc_apc_frame_to_3d_ply_filter_float"))    {
+        depth = in.z14;
+        PlyFilter::CF_FILTER_Z14(depth, in.rgb, w, h, w, h, filtered, &in.rectLog);
+        runner.run("pc_apc_frame_to_3d_ply_filter_float", w, h, filtered.size() * sizeof(float),
+                   [&]() { cloud.clear(); }, [&]() {
+            PlyWriter::apcFrameTo3D_PlyFilterFloat(w, h, filtered, w, h, in.rgb, &in.rectLog,
+                                                   APCImageType::DEPTH_14BITS, cloud,
+                                                   false, 0.0f, (float)kZ14MaxDepth,
+                                                   true, true, 1.0f);
+        });
+    }
+
+    runner.run("pc_apc_frame_to_3d_cylinder", w, h, in.d11.size(), [&]() { cloud.clear(); }, [&]() {
+        PlyWriter::apcFrameTo3DCylinder(w, h, in.d11, w, h, in.rgb, &in.rectLog,
+                                        APCImageType::DEPTH_11BITS, cloud,
+                                        false, 0.0f, (float)kZ14MaxDepth, true, 1.0f);
+    });
+}
+
+static void bench_fusion(BenchRunner &runner, Inputs &in)    {
+    const int32_t w = in.resolution.width, h = in.resolution.height;
+    const size_t points = (size_t)w * h;
+
+    libeYs3D::video::PCFrame frame;
+    frame.width = w;
+    frame.height = h;
+    make_xyz(frame.xyzDataVec, in.z14, w, h);
+    frame.rgbDataVec = in.rgb;
+
+    // 4 cameras on a circle, 90 degrees apart, looking at the same spot 1 m ahead
+    constexpr int kSources = 4;
+    libeYs3D::video::PointCloudFusion fusion(kSources);
+    for(int i = 0; i < kSources; i++)    {
+        float angle = (float)i * 1.5707963f;
+        float c = cosf(angle), s = sinf(angle);
+        const float rotation[9] = { c, 0.0f, s, 0.0f, 1.0f, 0.0f, -s, 0.0f, c };
+        const float translation[3] = { -1000.0f * s, 0.0f, 1000.0f - 1000.0f * c };
+        fusion.setExtrinsics(i, libeYs3D::video::PointTransform::fromRotationTranslation(rotation, translation));
+    }
+    const libeYs3D::video::PCFrame *frames[kSources] = { &frame, &frame, &frame, &frame };
+
+    std::vector<float> xyz(points * 3);
+    std::vector<uint8_t> rgb(points * 3);
+    runner.run("pc_fusion_transform", w, h, points * 3 * sizeof(float), nullptr, [&]() {
+        size_t count = libeYs3D::video::transform_valid_points(frame.xyzDataVec.data(), frame.rgbDataVec.data(),
+                                                               points, libeYs3D::video::PointTransform::identity(),
+                                                               xyz.data(), rgb.data());
+        do_not_optimize(count);
+    }, points);
+    runner.run("pc_fusion_transform_scalar", w, h, points * 3 * sizeof(float), nullptr, [&]() {
+        size_t count = libeYs3D::video::transform_valid_points_scalar(frame.xyzDataVec.data(),
+                                                                      frame.rgbDataVec.data(), 0, points,
+                                                                      libeYs3D::video::PointTransform::identity(),
+                                                                      xyz.data(), rgb.data(), 0);
+        do_not_optimize(count);
+    }, points);
+
+    libeYs3D::video::FusedPointCloud fused;
+    runner.run("pc_fusion_4_sources_concat", w, h, kSources * points * 3 * sizeof(float), [&]() {
+        fusion.setVoxelSize(0.0f);
+    }, [&]() {
+        do_not_optimize(fusion.fuse(frames, kSources, &fused));
+    }, kSources * points);
+    // the depth noise of make_depth() leaves about one point per 10 mm voxel
+    const float voxelSizes[] = { 10.0f, 50.0f };
+    for(float voxelSize : voxelSizes)    {
+        char name[64];
+        snprintf(name, sizeof(name), "pc_fusion_4_sources_voxel_%dmm", (int)voxelSize);
+        runner.run(name, w, h, kSources * points * 3 * sizeof(float), [&]() {
+            fusion.setVoxelSize(voxelSize);
+        }, [&]() {
+            do_not_optimize(fusion.fuse(frames, kSources, &fused));
+        }, kSources * points);
+    }
+}
+
+static void bench_downsample(BenchRunner &runner, Inputs &in)    {
+    const int32_t w = in.resolution.width, h = in.resolution.height;
+    const size_t points = (size_t)w * h;
+
+    std::vector<float> cloud;
+    make_xyz(cloud, in.z14, w, h);
+    std::vector<float> xyz(points * 3);
+    std::vector<uint8_t> rgb(points * 3);
+
+    using Policy = libeYs3D::video::PointCloudDownsampler::Policy;
+    libeYs3D::video::PointCloudDownsampler downsampler;
+    const struct { const char *name; float leafSize; Policy policy; } cases[] = {
+        { "pc_voxel_downsample_50mm_centroid", 50.0f, Policy::CENTROID },
+        { "pc_voxel_downsample_50mm_first_hit", 50.0f, Policy::FIRST_HIT },
+        { "pc_voxel_downsample_10mm_centroid", 10.0f, Policy::CENTROID },
+    };
+    for(const auto &c : cases)    {
+        runner.run(c.name, w, h, points * 3 * sizeof(float), [&]() {
+            downsampler.setLeafSize(c.leafSize);
+            downsampler.setPolicy(c.policy);
+        }, [&]() {
+            do_not_optimize(downsampler.downsample(cloud.data(), in.rgb.data(), points, xyz.data(), rgb.data()));
+        }, points);
+    }
+}
+
+static void bench_generate(BenchRunner &runner, Inputs &in)    {
+    const int32_t w = in.resolution.width, h = in.resolution.height;
+    const size_t points = (size_t)w * h;
+
+    std::vector<float> xyz(points * 3);
+    std::vector<uint8_t> rgb(points * 3);
+    libeYs3D::video::PointCloudGenerator generator;
+    generator.setIntrinsics(libeYs3D::video::PinholeIntrinsics::fromRectifyLog(in.rectLog, w, h));
+    generator.setDepthFormat(libeYs3D::video::DEPTH_RAW_DATA_14_BITS, nullptr, 0);
+
+    const int strides[] = { 1, 2, 4, 8 };
+    for(int stride : strides)    {
+        char name[64];
+        snprintf(name, sizeof(name), "pc_generate_stride_%d", stride);
+        const size_t kept = (size_t)(w / stride) * (h / stride);
+        runner.run(name, w, h, kept * 2, [&]() { generator.setStride(stride); }, [&]() {
+            do_not_optimize(generator.generate(in.z14.data(), w, h, in.rgb.data(), w, h, xyz.data(), rgb.data()));
+        }, kept);
+    }
+
+    // the center quarter of the frame, the nearest third of the depths
+    libeYs3D::video::PixelRect rect;
+    rect.x = w / 4;
+    rect.y = h / 4;
+    rect.width = w / 2;
+    rect.height = h / 2;
+    const size_t cropped = (size_t)rect.width * rect.height;
+    runner.run("pc_generate_crop_rect_range", w, h, cropped * 2, [&]() {
+        generator.setStride(1);
+        generator.setRegion(rect);
+        generator.setDepthRange(0.0f, kZ14MaxDepth / 3.0f);
+    }, [&]() {
+        do_not_optimize(generator.generate(in.z14.data(), w, h, in.rgb.data(), w, h, xyz.data(), rgb.data()));
+    }, cropped);
+
+    // the model of pc_apc_frame_to_3d_cylinder, sin/cos tables instead of sincosf() per pixel
+    using Projection = libeYs3D::video::PointCloudGenerator::Projection;
+    const int threadCounts[] = { 1, 4 };
+    for(int threads : threadCounts)    {
+        char name[64];
+        snprintf(name, sizeof(name), "pc_generate_cylinder_%d_thread%s", threads, (threads > 1) ? "s" : "");
+        runner.run(name, w, h, points * 2, [&]() {
+            generator.setRegion(libeYs3D::video::PixelRect());
+            generator.setDepthRange(0.0f, 0.0f);
+            generator.setProjection(Projection::CYLINDER);
+            generator.setThreadCount(threads);
+        }, [&]() {
+            do_not_optimize(generator.generate(in.z14.data(), w, h, in.rgb.data(), w, h, xyz.data(), rgb.data()));
+        }, points);
+    }
+
+    std::vector<float> cloud;
+    make_xyz(cloud, in.z14, w, h);
+    const float boxMin[3] = { -1000.0f, -1000.0f, 4000.0f }, boxMax[3] = { 1000.0f, 1000.0f, 8000.0f };
+    const libeYs3D::video::OrientedBox box = libeYs3D::video::OrientedBox::fromAxisAligned(boxMin, boxMax);
+    runner.run("pc_crop_box", w, h, points * 3 * sizeof(float), [&]() {
+        memcpy(xyz.data(), cloud.data(), points * 3 * sizeof(float));
+    }, [&]() {
+        do_not_optimize(libeYs3D::video::crop_points_to_box(box, xyz.data(), rgb.data(), points));
+    }, points);
+}
+
+static void bench_normals(BenchRunner &runner, Inputs &in)    {
+    const int32_t w = in.resolution.width, h = in.resolution.height;
+    const size_t points = (size_t)w * h;
+
+    std::vector<float> cloud;
+    make_xyz(cloud, in.z14, w, h);
+    std::vector<float> normals(points * 3);
+
+    using Method = libeYs3D::video::PointCloudNormalEstimator::Method;
+    libeYs3D::video::PointCloudNormalEstimator estimator;
+    const struct { const char *name; Method method; } cases[] = {
+        { "pc_normals_cross_product", Method::CROSS_PRODUCT },
+        { "pc_normals_covariance", Method::COVARIANCE },
+    };
+    for(const auto &c : cases)    {
+        runner.run(c.name, w, h, points * 3 * sizeof(float), [&]() { estimator.setMethod(c.method); }, [&]() {
+            do_not_optimize(estimator.compute(cloud.data(), w, h, normals.data()));
+        }, points);
+    }
+}
+
+static void bench_mesh(BenchRunner &runner, Inputs &in)    {
+    const int32_t w = in.resolution.width, h = in.resolution.height;
+    const size_t points = (size_t)w * h;
+
+    libeYs3D::video::PCFrame frame;
+    frame.width = w;
+    frame.height = h;
+    make_xyz(frame.xyzDataVec, in.z14, w, h);
+    frame.rgbDataVec = in.rgb;
+
+    libeYs3D::video::OrganizedMeshBuilder builder;
+    libeYs3D::video::PCMesh mesh;
+    runner.run("pc_organized_mesh", w, h, points * 3 * sizeof(float), nullptr, [&]() {
+        do_not_optimize(builder.build(&frame, &mesh));
+    }, points);
+}
+
+static void bench_imu(BenchRunner &runner)    {
+    std::vector<uint8_t> packets((size_t)kIMUPacketsPerIteration * 64);
+    uint32_t state = 3;
+    for(auto &b : packets)    b = (uint8_t)next_random(state);
+
+    IMUData data;
+    runner.run("imu_parse_packet", 0, 0, packets.size(), nullptr, [&]() {
+        for(int i = 0; i < kIMUPacketsPerIteration; i++)    data.parsePacket(&packets[(size_t)i * 64], true);
+        do_not_optimize(data._accelX);
+    }, kIMUPacketsPerIteration);
+    runner.run("imu_parse_packet_dmp", 0, 0, packets.size(), nullptr, [&]() {
+        for(int i = 0; i < kIMUPacketsPerIteration; i++)    data.parsePacket_DMP(&packets[(size_t)i * 64]);
+        do_not_optimize(data._accelX);
+    }, kIMUPacketsPerIteration);
+}
+
+// Largest distance between the points of a pixel the generator may leave
+static constexpr float kCylinderToleranceMm = 0.01f;
+
+// PointCloudGenerator::Projection::CYLINDER against the library's
+// apcFrameTo3DCylinder(), in landscape and portrait, single threaded and
+// banded: same holes, points within kCylinderToleranceMm
+static int run_cylinder_check()    {
+    using Projection = libeYs3D::video::PointCloudGenerator::Projection;
+    const Resolution resolutions[] = { { 1280, 720 }, { 720, 1280 } };
+    int failures = 0;
+
+    for(const Resolution &resolution : resolutions)    {
+        const int32_t w = resolution.width, h = resolution.height;
+        const size_t points = (size_t)w * h;
+        std::vector<uint8_t> z14, yuy2, rgb(points * 3);
+        eSPCtrl_RectLogData rectLog;
+        make_depth(z14, w, h, kZ14MaxDepth, false);
+        make_yuy2(yuy2, w, h);
+        uint64_t rgbSize = 0;
+        libeYs3D::video::convert_yuv_to_rgb_buffer(yuy2.data(), rgb.data(), w, h, &rgbSize);
+        make_rect_log(rectLog, w, h);
+
+        std::vector<CloudPoint> reference;
+        PlyWriter::apcFrameTo3DCylinder(w, h, z14, w, h, rgb, &rectLog, APCImageType::DEPTH_14BITS, reference,
+                                        false, 0.0f, (float)kZ14MaxDepth, false, 1.0f);
+        if(reference.size() != points)    {
+            fprintf(stdout, "   %dx%d: apcFrameTo3DCylinder returned %zu points for %zu pixels  FAILED\n",
+                    w, h, reference.size(), points);
+            failures++;
+            continue;
+        }
+
+        libeYs3D::video::PointCloudGenerator generator;
+        generator.setIntrinsics(libeYs3D::video::PinholeIntrinsics::fromRectifyLog(rectLog, w, h));
+        generator.setDepthFormat(libeYs3D::video::DEPTH_RAW_DATA_14_BITS, nullptr, 0);
+        generator.setProjection(Projection::CYLINDER);
+
+        const int threadCounts[] = { 1, 4 };
+        for(int threads : threadCounts)    {
+            std::vector<float> xyz(points * 3);
+            std::vector<uint8_t> colors(points * 3);
+            generator.setThreadCount(threads);
+            generator.generate(z14.data(), w, h, rgb.data(), w, h, xyz.data(), colors.data());
+
+            size_t holeMismatches = 0;
+            float maxErrorMm = 0.0f;
+            for(size_t i = 0; i < points; i++)    {
+                const CloudPoint &r = reference[i];
+                const float *g = &xyz[i * 3];
+                const bool referenceValid = isfinite(r.x) && isfinite(r.y) && isfinite(r.z) && r.z != 0.0f;
+                const bool generatorValid = (g[2] != 0.0f);
+                if(referenceValid != generatorValid)    {
+                    holeMismatches++;
+                    continue;
+                }
+                if(!referenceValid)    continue;
+
+                const float dx = r.x - g[0], dy = r.y - g[1], dz = r.z - g[2];
+                maxErrorMm = std::max(maxErrorMm, sqrtf(dx * dx + dy * dy + dz * dz));
+            }
+
+            const bool ok = (holeMismatches == 0 && maxErrorMm <= kCylinderToleranceMm);
+            fprintf(stdout, "   %dx%d, %d thread%s: %zu hole mismatches, max error %.4f mm  %s\n",
+                    w, h, threads, (threads > 1) ? "s" : "", holeMismatches, maxErrorMm, ok ? "ok" : "FAILED");
+            if(!ok)    failures++;
+        }
+    }
+
+    fprintf(stdout, "cylinder check: %s\n", failures ? "FAILED" : "passed");
+    return failures ? -1 : 0;
+}
+
+// Largest relative difference between the vector and the scalar transform
+static constexpr float kFusionTolerance = 1e-6f;
+
+// transform_valid_points() against transform_valid_points_scalar(), on a
+// frame with holes, negative depths, NaN and infinities in every lane, and
+// a point count that is not a multiple of 4: same points in the same order,
+// same colors, coordinates within kFusionTolerance
+static int run_fusion_check()    {
+    const int32_t w = 1280, h = 720;
+    std::vector<uint8_t> z14;
+    make_depth(z14, w, h, kZ14MaxDepth, false);
+    std::vector<float> xyz;
+    make_xyz(xyz, z14, w, h);
+    const size_t points = (size_t)w * h - 3;
+    std::vector<uint8_t> rgb(points * 3);
+    for(size_t i = 0; i < rgb.size(); i++)    rgb[i] = (uint8_t)(i * 7);
+
+    const float specials[] = { 0.0f, -1.0f, NAN, INFINITY, -INFINITY };
+    for(size_t i = 0; i < points; i += 13)    {
+        const float special = specials[(i / 13) % 5];
+        xyz[i * 3 + (i / 65) % 3] = special;
+    }
+
+    const float rotation[9] = { 0.0f, -1.0f, 0.0f, 0.6f, 0.0f, -0.8f, 0.8f, 0.0f, 0.6f };
+    const float translation[3] = { 120.5f, -3000.0f, 17.25f };
+    const libeYs3D::video::PointTransform transforms[] = {
+        libeYs3D::video::PointTransform::identity(),
+        libeYs3D::video::PointTransform::fromRotationTranslation(rotation, translation),
+    };
+    const char *names[] = { "identity", "rigid" };
+
+    int failures = 0;
+    for(int t = 0; t < 2; t++)    {
+        std::vector<float> vectorXYZ(points * 3), scalarXYZ(points * 3);
+        std::vector<uint8_t> vectorRGB(points * 3), scalarRGB(points * 3);
+        const size_t vectorCount = libeYs3D::video::transform_valid_points(xyz.data(), rgb.data(), points,
+                                                                           transforms[t], vectorXYZ.data(),
+                                                                           vectorRGB.data());
+        const size_t scalarCount = libeYs3D::video::transform_valid_points_scalar(xyz.data(), rgb.data(), 0, points,
+                                                                                  transforms[t], scalarXYZ.data(),
+                                                                                  scalarRGB.data(), 0);
+
+        size_t colorMismatches = 0;
+        float maxError = 0.0f;
+        const size_t common = std::min(vectorCount, scalarCount);
+        for(size_t i = 0; i < common * 3; i++)    {
+            if(vectorRGB[i] != scalarRGB[i])    colorMismatches++;
+            const float scale = std::max(fabsf(scalarXYZ[i]), 1.0f);
+            const float error = fabsf(vectorXYZ[i] - scalarXYZ[i]) / scale;
+            if(!(error <= maxError))    maxError = error;     // NaN as well
+        }
+
+        const bool ok = (vectorCount == scalarCount && colorMismatches == 0 && maxError <= kFusionTolerance);
+        fprintf(stdout, "   %s: %zu / %zu points, %zu color mismatches, max relative error %g  %s\n",
+                names[t], vectorCount, scalarCount, colorMismatches, maxError, ok ? "ok" : "FAILED");
+        if(!ok)    failures++;
+    }
+
+    fprintf(stdout, "fusion check: %s\n", failures ? "FAILED" : "passed");
+    return failures ? -1 : 0;
+}
+
+static void usage(const char *program)    {
+    fprintf(stderr,
+            "usage: %s [--json <file|->] [--filter <substring>] [--min-time-ms <ms>]\n"
+            "          [--color-file <yuy2 dump>] [--depth-file <16-bit depth dump>]\n"
+            "          [--cylinder-check] [--fusion-check]\n",
+            program);
+}
+
+int main(int argc, char** argv)    {
+    BenchRunner::Options options;
+    const char *jsonPath = nullptr;
+    const char *colorFile = nullptr;
+    const char *depthFile = nullptr;
+
+    for(int i = 1; i < argc; i++)    {
+        bool hasValue = (i + 1 < argc);
+        if(!strcmp(argv[i], "--json") && hasValue)    jsonPath = argv[++i];
+        else if(!strcmp(argv[i], "--filter") && hasValue)    options.filter = argv[++i];
+        else if(!strcmp(argv[i], "--min-time-ms") && hasValue)    options.minTimeUs = atoll(argv[++i]) * 1000ll;
+        else if(!strcmp(argv[i], "--color-file") && hasValue)    colorFile = argv[++i];
+        else if(!strcmp(argv[i], "--depth-file") && hasValue)    depthFile = argv[++i];
+        else if(!strcmp(argv[i], "--cylinder-check"))    return run_cylinder_check();
+        else if(!strcmp(argv[i], "--fusion-check"))    return run_fusion_check();
+        else    {
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    BenchRunner runner(options);
+
+    void *handle = nullptr;
+    if(APC_Init(&handle, false) < 0)    handle = nullptr;
+
+    for(const Resolution &resolution : kResolutions)    {
+        const int32_t w = resolution.width, h = resolution.height;
+        Inputs in;
+        in.resolution = resolution;
+
+        if(!load_raw(colorFile, in.yuy2, (size_t)w * h * 2))    make_yuy2(in.yuy2, w, h);
+        in.rgb.resize((size_t)w * h * 3);
+        uint64_t rgbSize = 0;
+        libeYs3D::video::convert_yuv_to_rgb_buffer(in.yuy2.data(), in.rgb.data(), w, h, &rgbSize);
+
+        if(!load_raw(depthFile, in.d11, (size_t)w * h * 2))    make_depth(in.d11, w, h, kD11MaxDisparity, true);
+        if(!load_raw(depthFile, in.z14, (size_t)w * h * 2))    make_depth(in.z14, w, h, kZ14MaxDepth, false);
+        make_depth(in.d11Half, w / 2, h / 2, kD11MaxDisparity, true);
+        make_rect_log(in.rectLog, w, h);
+
+        bench_color(runner, in);
+        bench_palette(runner, in);
+        bench_post_process(runner, in);
+        bench_depth_filters(runner, in, handle);
+        bench_point_cloud(runner, in);
+        bench_fusion(runner, in);
+        bench_downsample(runner, in);
+        bench_generate(runner, in);
+        bench_normals(runner, in);
+        bench_mesh(runner, in);
+    }
+    bench_imu(runner);
+
+    if(handle)    APC_Release(&handle);
+
+    runner.printTable(stdout);
+    if(jsonPath && runner.writeJson(jsonPath) < 0)    return -1;
+
+    return 0;
+}
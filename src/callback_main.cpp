@@ -6,8 +6,11 @@
 
 #include "EYS3DSystem.h"
 #include "devices/CameraDevice.h"
+#include "DMPreview_utility/ModeConfigTable.h"
+#include "video/PCProducerHooks.h"
 #include "video/Frame.h"
 #include "sensors/SensorData.h"
+#include "drop_stats.h"
 #include "debug.h"
 
 #ifdef _WIN32
@@ -35,14 +38,13 @@ typedef struct {
 using namespace libeYs3D;
 
 std::shared_ptr<libeYs3D::devices::CameraDevice> dDevice;
+static libeYs3D::devices::LatencyStats *sLatencyStats = nullptr;
 
 // using Callback = std::function<bool(const Frame* frame)>;
 static bool color_image_callback(const libeYs3D::video::Frame* frame)    {
     char buffer[512];
     static int64_t count = 0ll;
     static int64_t time = 0ll;
-    static int64_t transcodingTime = 0ll;
-    static int64_t filteringTime = 0ll;
     //static int64_t lastSerialNumber = 0, c = -1;
 
 #if 1
@@ -59,11 +61,18 @@ static bool color_image_callback(const libeYs3D::video::Frame* frame)    {
 #endif
 
 #if 1
+    static libeYs3D::SerialGapDetector serialGaps(libeYs3D::DropStats::get().stream("color"));
+    serialGaps.onSerial(frame->serialNumber);
+
+    auto &latencyStats = *sLatencyStats;
+    latencyStats.recordFrame(libeYs3D::devices::LatencyStream::COLOR, frame);
     if((count++ % DURATION) == 0)    {
         if(count != 1)    {
             int64_t temp = 0ll;
-            LOG_INFO(LOG_TAG, "Color image trancoding cost average: %" PRId64 " ms...",
-                     (transcodingTime / 1000 / DURATION));
+            const auto &h = latencyStats.histogram(libeYs3D::devices::LatencyStream::COLOR,
+                                                   libeYs3D::devices::LatencyStage::RGB_TRANSCODE);
+            LOG_INFO(LOG_TAG, "Color image trancoding cost p50/p99/p999: %" PRId64 "/%" PRId64 "/%" PRId64 " us...",
+                     h.getPercentileUs(50.0), h.getPercentileUs(99.0), h.getPercentileUs(99.9));
 
             temp = (frame->tsUs - time) / 1000 / DURATION;
             LOG_INFO(LOG_TAG, "Color image cost average: %" PRId64 " ms, %" PRId64 " fps...",
@@ -71,9 +80,6 @@ static bool color_image_callback(const libeYs3D::video::Frame* frame)    {
         }
 
         time = frame->tsUs;
-        transcodingTime = frame->rgbTranscodingTimeUs;
-    } else    {
-        transcodingTime += frame->rgbTranscodingTimeUs;
     }
 #endif
 
@@ -84,8 +90,6 @@ static bool depth_image_callback(const libeYs3D::video::Frame* frame)    {
     char buffer[1024];
     static int64_t count = 0ll;
     static int64_t time = 0ll;
-    static int64_t transcodingTime = 0ll;
-    static int64_t filteringTime = 0ll;
     
 #if 1
     //if(frame->serialNumber > 0XFFFC)
@@ -96,24 +100,45 @@ static bool depth_image_callback(const libeYs3D::video::Frame* frame)    {
     LOG_INFO(LOG_TAG": depth_image_callback", "%s", buffer);
 #endif
 #if 1
+    static libeYs3D::SerialGapDetector serialGaps(libeYs3D::DropStats::get().stream("depth"));
+    serialGaps.onSerial(frame->serialNumber);
+
+    auto &latencyStats = *sLatencyStats;
+    latencyStats.recordFrame(libeYs3D::devices::LatencyStream::DEPTH, frame);
     if((count++ % DURATION) == 0)    {
         if(count != 1)    {
             int64_t temp = 0ll;
-            LOG_INFO(LOG_TAG, "Depth image trancoding cost average: %" PRId64 " ms...",
-                     (transcodingTime / 1000 / DURATION));
-            LOG_INFO(LOG_TAG, "Depth image filtering cost average: %" PRId64 " ms...",
-                     (filteringTime / 1000 / DURATION));
+            const auto &t = latencyStats.histogram(libeYs3D::devices::LatencyStream::DEPTH,
+                                                   libeYs3D::devices::LatencyStage::RGB_TRANSCODE);
+            const auto &f = latencyStats.histogram(libeYs3D::devices::LatencyStream::DEPTH,
+                                                   libeYs3D::devices::LatencyStage::FILTER);
+            LOG_INFO(LOG_TAG, "Depth image trancoding cost p50/p99/p999: %" PRId64 "/%" PRId64 "/%" PRId64 " us...",
+                     t.getPercentileUs(50.0), t.getPercentileUs(99.0), t.getPercentileUs(99.9));
+            LOG_INFO(LOG_TAG, "Depth image filtering cost p50/p99/p999: %" PRId64 "/%" PRId64 "/%" PRId64 " us...",
+                     f.getPercentileUs(50.0), f.getPercentileUs(99.0), f.getPercentileUs(99.9));
             temp = (frame->tsUs - time) / 1000 / DURATION;
             LOG_INFO(LOG_TAG, "Depth image cost average: %" PRId64 " ms, %" PRId64 " fps...",
                      temp, ((int64_t)1000) / temp);    
         }
         
         time = frame->tsUs;
-        transcodingTime = frame->rgbTranscodingTimeUs;
-        filteringTime = frame->filteringTimeUs;
-    } else    {
-        transcodingTime += frame->rgbTranscodingTimeUs;
-        filteringTime += frame->filteringTimeUs;
+    }
+#endif
+#ifdef EYS3D_PC_PRODUCER_HOOKS_IMPLEMENTATION
+    static bool pcChecked = false;
+    if(!pcChecked)    {  // the stride 1 generator against APC_GetPointCloud(), see video/PCProducerHooks.h
+        pcChecked = true;
+        libeYs3D::video::PCGeneratorCheck check;
+        if(!libeYs3D::video::check_pc_generator(dDevice.get(), nullptr, frame->dataVec.data(),
+                                                frame->width, frame->height, &check))    {
+            LOG_ERR(LOG_TAG, "Point cloud check: deprojection failed");
+        } else if(!check.generated)    {
+            LOG_INFO(LOG_TAG, "Point cloud check: configuration left to the library");
+        } else    {
+            LOG_INFO(LOG_TAG, "Point cloud check: %zu points, %zu in both, %zu library only, %zu generator only, "
+                     "error mean %.3f mm max %.3f mm", check.points, check.bothValid, check.onlyLibrary,
+                     check.onlyGenerator, check.meanErrorMm, check.maxErrorMm);
+        }
     }
 #endif
 #if 0
@@ -195,6 +220,10 @@ static bool pc_frame_callback(const libeYs3D::video::PCFrame *pcFrame)    {
     file.append(".ply");
     PlyWriter::writePly(cloud, file);
 #endif
+#if 0
+    std::shared_ptr<const libeYs3D::video::PCMesh> mesh = libeYs3D::video::PCMeshStage::get().meshFor(pcFrame);
+    if(mesh)    PlyWriter::writePlyMesh(mesh->vertices, mesh->indices, std::to_string(pcFrame->serialNumber) + "_mesh.ply");
+#endif
 #if 0
     if((count++ % DURATION) == 0)    {
         if(count != 1)    {
@@ -333,6 +362,7 @@ start:
         LOG_INFO(LOG_TAG, "Unable to find any camera devices...");
         exit(-1);
     }
+    sLatencyStats = &device->getLatencyStats();
 #if 0
     unsigned short nFW_Value = 0;
     unsigned short nHW_Value = 0;
@@ -786,6 +816,13 @@ printf("========================Filter result: %d========================\n",mIs
         sleep(2);
     }
 
+    sLatencyStats = nullptr;
+    device->releaseLatencyStats();
+
+    std::string drops;
+    libeYs3D::DropStats::get().toString(drops);
+    LOG_INFO(LOG_TAG, "Frame drops:\n%s", drops.empty() ? "none\n" : drops.c_str());
+
 	dDevice = nullptr;  // <-- to tell the compiler we don't use camera device anymore.
 	eYs3DSystem.reset();
 	//device.reset();
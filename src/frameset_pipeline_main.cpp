@@ -5,9 +5,11 @@
  */
 #include "EYS3DSystem.h"
 #include "devices/CameraDevice.h"
+#include "DMPreview_utility/ModeConfigTable.h"
 #include "devices/FrameSetPipeline.h"
 #include "video/Frame.h"
 #include "base/threads/Async.h"
+#include "frame_trace.h"
 #include "debug.h"
 
 #ifdef _WIN32
@@ -41,7 +43,12 @@ static void frameset_reader(libeYs3D::devices::FrameSetPipeline *pipeline)     {
     //static int64_t lastSerialNumber = 0, c = -1;
     
     while(true) {
-        ret = pipeline->waitForFrameSet(&frameSet);
+        {
+            libeYs3D::trace::TraceScope waitScope("pipeline_wait", "frameset");
+            ret = pipeline->waitForFrameSet(&frameSet);
+            if(ret == libeYs3D::devices::FrameSetPipeline::RESULT::OK)
+                waitScope.setSerial(frameSet.colorFrame.serialNumber);
+        }
         if(ret < 0)    break;
         if(ret > 0)    continue;
         
@@ -75,6 +82,7 @@ static void frameset_reader(libeYs3D::devices::FrameSetPipeline *pipeline)     {
 int main(int argc, char** argv)    {
 #if 1
     LOG_INFO(LOG_TAG, "Starting EYS3DSystem...");
+    libeYs3D::trace::enableTracingFromEnv();
 
     //std::shared_ptr<EYS3DSystem> eYs3DSystem = EYS3DSystem::getEYS3DSystem();
     std::shared_ptr<EYS3DSystem> eYs3DSystem = std::make_shared<EYS3DSystem>(EYS3DSystem::COLOR_BYTE_ORDER::COLOR_BGR24);
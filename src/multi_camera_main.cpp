@@ -0,0 +1,394 @@
+/*
+ * Copyright (C) 2021 eYs3D Corporation
+ * All rights reserved.
+ * This project is licensed under the Apache License, Version 2.0.
+ *
+ */
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "EYS3DSystem.h"
+#include "devices/MultiCameraGroup.h"
+#include "devices/StreamReconfigurer.h"
+#define EYS3D_CALIBRATION_CACHE_IMPLEMENTATION
+#include "devices/CalibrationCache.h"
+#include "drop_stats.h"
+#include "synthetic_frames.h"
+#include "base/synchronization/ConditionVariable.h"
+#include "base/synchronization/Lock.h"
+#include "base/threads/FunctorThread.h"
+#include "debug.h"
+#include "utils.h"
+
+#define LOG_TAG "eys3d.multi_camera"
+
+using namespace libeYs3D;
+using namespace libeYs3D::devices;
+
+// Synthetic frames at the configured rate, with a random serial origin and
+// clock phase until synchronized with a VirtualCameraMember master
+class VirtualCameraMember : public GroupMember    {
+    DISALLOW_COPY_ASSIGN_AND_MOVE(VirtualCameraMember);
+
+public:
+    /**
+     * \param[in] seed             serial origin, clock phase and drops derive from it
+     * \param[in] dropPercent      frames the "device" loses, each stream separately
+     * \param[in] jitterUs         timestamp noise, uniform in [0, jitterUs)
+     */
+    explicit VirtualCameraMember(const char *name, uint32_t seed = 1u,
+                                 int dropPercent = 0, int32_t jitterUs = 500)
+        : mName(name), mRandom(seed * 2654435761u + 1u),
+          mDropPercent(dropPercent), mJitterUs(jitterUs)    {
+        mSerialOrigin = bench::next_random(mRandom) & 0xFFFF;
+        mPhaseUs = bench::next_random(mRandom) % 4000;
+    }
+
+    ~VirtualCameraMember()    { closeStream(); }
+
+    const char *getName() const override    { return mName.c_str(); }
+
+    int initStream(const GroupStreamConfig &config,
+                   video::Producer::Callback colorCallback,
+                   video::Producer::Callback depthCallback) override    {
+        if(mInitialized)    return 1;
+
+        mConfig = config;
+        mColorCallback = std::move(colorCallback);
+        mDepthCallback = std::move(depthCallback);
+
+        std::vector<uint8_t> pixels;
+        bench::make_yuy2(pixels, config.colorWidth, config.colorHeight);
+        fillFrame(mColor, pixels, config.colorWidth, config.colorHeight, (uint32_t)config.colorFormat);
+        bench::make_depth(pixels, config.depthWidth, config.depthHeight, bench::kD11MaxDisparity, true);
+        fillFrame(mDepth, pixels, config.depthWidth, config.depthHeight, (uint32_t)config.depthFormat);
+
+        mInitialized = true;
+        return 0;
+    }
+
+    int configureFrameSync(GroupMember *master, const GroupStreamConfig &config) override    {
+        (void)config;
+        VirtualCameraMember *masterDevice = dynamic_cast<VirtualCameraMember *>(master);
+        if(masterDevice == nullptr)    return -1;
+        if(masterDevice == this)    return 0;
+
+        mSerialOrigin = masterDevice->mSerialOrigin;
+        mPhaseUs = masterDevice->mPhaseUs;
+        mSyncMaster = masterDevice;
+        return 0;
+    }
+
+    void enableStream() override    {
+        if(!mInitialized || mThread)    return;
+
+        // a synchronized member ticks on the clock of its master
+        int64_t epochUs = mSyncMaster ? mSyncMaster->getEpochUs()
+                                      : now_in_microsecond_high_res_time_MONOTONIC();
+        {
+            base::AutoLock lock(mLock);
+            mEpochUs = epochUs;
+            mStopping = false;
+        }
+        mThread.reset(new base::FunctorThread([this]() { captureMain(); }));
+        mThread->start();
+    }
+
+    int closeStream() override    {
+        if(mThread)    {
+            {
+                base::AutoLock lock(mLock);
+                mStopping = true;
+                mCond.signal();
+            }
+            mThread->wait();
+            mThread.reset();
+        }
+        mInitialized = false;
+        return 0;
+    }
+
+private:
+    static void fillFrame(video::Frame &frame, const std::vector<uint8_t> &pixels,
+                          int32_t width, int32_t height, uint32_t dataFormat)    {
+        frame.width = width;
+        frame.height = height;
+        frame.dataFormat = dataFormat;
+        frame.dataVec.assign(pixels.begin(), pixels.end());
+        frame.dataBufferSize = frame.actualDataBufferSize = pixels.size();
+        frame.rgbBufferSize = frame.actualRGBBufferSize = 0;
+        frame.zdDepthBufferSize = frame.actualZDDepthBufferSize = 0;
+    }
+
+    int64_t getEpochUs()    {
+        base::AutoLock lock(mLock);
+        return mEpochUs;
+    }
+
+    bool lost()    {
+        return mDropPercent > 0 && (int)(bench::next_random(mRandom) % 100) < mDropPercent;
+    }
+
+    void captureMain()    {
+        const int64_t periodUs = 1000000ll / (mConfig.fps > 0 ? mConfig.fps : 30);
+
+        base::AutoLock lock(mLock);
+        const int64_t epochUs = mEpochUs + mPhaseUs;
+        for(uint32_t n = 0; !mStopping; n++)    {
+            int64_t dueUs = epochUs + (int64_t)n * periodUs;
+            int64_t waitUs = dueUs - now_in_microsecond_high_res_time_MONOTONIC();
+            if(waitUs > 0)    {
+                mCond.timedWait(&mLock, now_in_microsecond_high_res_time_REALTIME() + waitUs);
+                if(mStopping)    break;
+            }
+
+            int64_t jitterUs = mJitterUs > 0 ? (int64_t)(bench::next_random(mRandom) % mJitterUs) : 0ll;
+            uint32_t serialNumber = mSerialOrigin + n;
+            bool sendColor = !lost();
+            bool sendDepth = !lost();
+            lock.unlock();
+
+            // depth first, so the color companion is late for the default depth key
+            int64_t tsUs = now_in_microsecond_high_res_time_REALTIME() - jitterUs;
+            if(sendDepth && mDepthCallback)    {
+                mDepth.serialNumber = serialNumber;
+                mDepth.tsUs = tsUs;
+                mDepthCallback(&mDepth);
+            }
+            if(sendColor && mColorCallback)    {
+                mColor.serialNumber = serialNumber;
+                mColor.tsUs = tsUs;
+                mColorCallback(&mColor);
+            }
+
+            lock.lock();
+        }
+    }
+
+    const std::string mName;
+    uint32_t mRandom;
+    const int mDropPercent;
+    const int32_t mJitterUs;
+
+    GroupStreamConfig mConfig;
+    video::Producer::Callback mColorCallback;
+    video::Producer::Callback mDepthCallback;
+    video::Frame mColor;
+    video::Frame mDepth;
+
+    uint32_t mSerialOrigin = 0u;
+    int64_t mPhaseUs = 0ll;
+    VirtualCameraMember *mSyncMaster = nullptr;
+    bool mInitialized = false;
+
+    base::Lock mLock;
+    base::ConditionVariable mCond;
+    int64_t mEpochUs = 0ll;         // guarded by mLock
+    bool mStopping = false;
+
+    std::unique_ptr<base::FunctorThread> mThread;
+};
+
+// Switches a virtual camera to another mode and back with a
+// StreamReconfigurer, and checks that the callbacks stay up and see only
+// frames of the mode in effect once reconfigureStream() returned
+static int run_reconfigure_check(const GroupStreamConfig &config)    {
+    struct Seen    {
+        std::atomic<uint64_t> frames{0};
+        std::atomic<uint64_t> wrongSize{0};
+        std::atomic<int32_t> width{0};
+        std::atomic<int32_t> height{0};
+    } color, depth;
+    auto counter = [](Seen *seen)    {
+        return [seen](const video::Frame *frame) -> bool {
+            seen->frames.fetch_add(1, std::memory_order_relaxed);
+            if(frame->width != seen->width.load() || frame->height != seen->height.load())
+                seen->wrongSize.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        };
+    };
+    auto expect = [&](const GroupStreamConfig &mode)    {
+        color.width = mode.colorWidth;
+        color.height = mode.colorHeight;
+        depth.width = mode.depthWidth;
+        depth.height = mode.depthHeight;
+        color.wrongSize = 0;
+        depth.wrongSize = 0;
+    };
+
+    StreamReconfigurer stream(std::unique_ptr<GroupMember>(new VirtualCameraMember("virtual0")),
+                              counter(&color), counter(&depth));
+    int failures = 0;
+    auto check = [&](bool ok, const char *what)    {
+        fprintf(stdout, "   %-44s %s\n", what, ok ? "ok" : "FAILED");
+        if(!ok)    failures++;
+    };
+
+    expect(config);
+    check(stream.open(config) == 0, "open");
+    usleep(200000);
+    check(color.frames.load() > 0 && depth.frames.load() > 0, "frames in the first mode");
+
+    ReconfigureReport report;
+    check(stream.reconfigureStream(config, &report) == 0 && !report.reopened, "same mode does not reopen");
+
+    GroupStreamConfig half = config;
+    half.colorWidth /= 2;
+    half.colorHeight /= 2;
+    half.depthWidth /= 2;
+    half.depthHeight /= 2;
+    const GroupStreamConfig modes[] = { half, config };
+    for(const GroupStreamConfig &mode : modes)    {
+        int ret = stream.reconfigureStream(mode, &report);
+        expect(mode);
+        uint64_t colorFrames = color.frames.load(), depthFrames = depth.frames.load();
+        usleep(200000);
+
+        char what[64];
+        snprintf(what, sizeof(what), "switch to %dx%d", mode.colorWidth, mode.colorHeight);
+        check(ret == 0 && report.reopened && report.resumed, what);
+        check(color.frames.load() > colorFrames && depth.frames.load() > depthFrames,
+              "   frames after the switch");
+        check(color.wrongSize.load() == 0 && depth.wrongSize.load() == 0,
+              "   only frames of the new mode");
+        fprintf(stdout, "      gap %.1f ms (close %.1f ms, init %.1f ms)\n",
+                report.gapMs, report.closeMs, report.initMs);
+    }
+    stream.close();
+
+    fprintf(stdout, "reconfigure check: %s\n", failures ? "FAILED" : "passed");
+    return failures ? -1 : 0;
+}
+
+struct Options    {
+    int virtualCount = 0;       // 0: all the connected cameras
+    int dropPercent = 0;
+    bool noFrameSync = false;
+    bool reconfigureCheck = false;
+    MultiCameraGroup::MatchBy matchBy = MultiCameraGroup::MatchBy::SERIAL;
+    double durationS = 10.0;
+    GroupStreamConfig config;
+};
+
+static void usage(const char *program)    {
+    fprintf(stderr,
+            "usage: %s [--virtual <count>] [--drop-percent <%%>] [--match serial|timestamp]\n"
+            "          [--no-frame-sync] [--duration-s <s>] [--fps <fps>]\n"
+            "          [--color <width>x<height>] [--depth <width>x<height>]\n"
+            "          [--reconfigure-check]\n", program);
+}
+
+static bool parse_size(const char *value, int32_t *width, int32_t *height)    {
+    return sscanf(value, "%dx%d", width, height) == 2 && *width > 0 && *height > 0;
+}
+
+int main(int argc, char** argv)    {
+    Options options;
+
+    for(int i = 1; i < argc; i++)    {
+        bool hasValue = (i + 1 < argc);
+        if(!strcmp(argv[i], "--virtual") && hasValue)    options.virtualCount = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "--drop-percent") && hasValue)    options.dropPercent = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "--no-frame-sync"))    options.noFrameSync = true;
+        else if(!strcmp(argv[i], "--reconfigure-check"))    options.reconfigureCheck = true;
+        else if(!strcmp(argv[i], "--duration-s") && hasValue)    options.durationS = atof(argv[++i]);
+        else if(!strcmp(argv[i], "--fps") && hasValue)    options.config.fps = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "--match") && hasValue)    {
+            const char *match = argv[++i];
+            if(!strcmp(match, "serial"))    options.matchBy = MultiCameraGroup::MatchBy::SERIAL;
+            else if(!strcmp(match, "timestamp"))    options.matchBy = MultiCameraGroup::MatchBy::TIMESTAMP;
+            else    {
+                usage(argv[0]);
+                return -1;
+            }
+        }
+        else if(!strcmp(argv[i], "--color") && hasValue &&
+                parse_size(argv[++i], &options.config.colorWidth, &options.config.colorHeight))    {}
+        else if(!strcmp(argv[i], "--depth") && hasValue &&
+                parse_size(argv[++i], &options.config.depthWidth, &options.config.depthHeight))    {}
+        else    {
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if(options.durationS <= 0.0 || options.config.fps <= 0 || options.virtualCount < 0)    {
+        usage(argv[0]);
+        return -1;
+    }
+    if(options.reconfigureCheck)    return run_reconfigure_check(options.config);
+
+    std::atomic<uint64_t> setCount{0};
+    std::atomic<int64_t> setLatencyUs{0};
+    MultiCameraGroup group("multi_camera", [&](const MultiFrameSet *set)    {
+        int64_t latencyUs = now_in_microsecond_high_res_time_REALTIME() - set->tsUs;
+        setLatencyUs.fetch_add(latencyUs, std::memory_order_relaxed);
+        if(setCount.fetch_add(1, std::memory_order_relaxed) % (uint64_t)options.config.fps == 0)    {
+            fprintf(stdout, "set #%" PRIu32 ": %zu devices, skew %" PRId64 " us, latency %" PRId64 " us\n",
+                    set->serialNumber, set->depth.size(), set->skewUs, latencyUs);
+        }
+    });
+
+    std::shared_ptr<EYS3DSystem> eYs3DSystem;
+    if(options.virtualCount > 0)    {
+        for(int i = 0; i < options.virtualCount; i++)    {
+            std::string name = "virtual" + std::to_string(i);
+            group.addMember(std::unique_ptr<GroupMember>(
+                    new VirtualCameraMember(name.c_str(), (uint32_t)i + 1u, options.dropPercent)));
+        }
+    } else    {
+        eYs3DSystem = std::make_shared<EYS3DSystem>(EYS3DSystem::COLOR_BYTE_ORDER::COLOR_BGR24);
+        if(0 == eYs3DSystem->getCameraDeviceCount())    {
+            LOG_ERR(LOG_TAG, "NONE camera device found...");
+            return -1;
+        }
+        for(int i = 0; i < eYs3DSystem->getCameraDeviceCount(); i++)    {
+            std::shared_ptr<libeYs3D::devices::CameraDevice> device = eYs3DSystem->getCameraDevice(i);
+            if(device)    group.addMember(std::unique_ptr<GroupMember>(new CameraDeviceMember(device, i)));
+        }
+    }
+
+    MultiCameraGroup::Options groupOptions;
+    groupOptions.matchBy = options.matchBy;
+    groupOptions.frameSync = !options.noFrameSync;
+    int ret = group.start(options.config, groupOptions);
+    if(ret != 0)    {
+        LOG_ERR(LOG_TAG, "Unable to start the group of %d devices (%d)", group.getMemberCount(), ret);
+        return -1;
+    }
+
+    MultiCameraGroupStats stats = group.getStats();
+    fprintf(stdout, "%d devices up in %.1f ms, frame sync %s, matching by %s\n",
+            group.getMemberCount(), stats.bringUpUs / 1000.0, stats.frameSynced ? "on" : "off",
+            group.getMatchBy() == MultiCameraGroup::MatchBy::SERIAL ? "serial" : "timestamp");
+    if(eYs3DSystem && CalibrationCache::get().isEnabled())    {
+        CalibrationCacheStats cacheStats = CalibrationCache::get().getStats();
+        fprintf(stdout, "calibration cache: %" PRIu64 " hits, %" PRIu64 " misses\n",
+                cacheStats.hits, cacheStats.misses);
+    }
+
+    usleep((useconds_t)(options.durationS * 1000000.0));
+    group.stop();
+
+    stats = group.getStats();
+    uint64_t sets = setCount.load();
+    fprintf(stdout, "sets %" PRIu64 " (%.1f/s), unmatched %" PRIu64 ", slow consumer %" PRIu64
+                    ", missing companions %" PRIu64 ", max skew %" PRId64 " us, mean latency %.1f us\n",
+            stats.sets, stats.sets / options.durationS, stats.unmatched, stats.slowConsumer,
+            stats.missingCompanions, stats.maxSkewUs, sets ? (double)setLatencyUs.load() / sets : 0.0);
+
+    std::string drops;
+    DropStats::get().toString(drops);
+    fputs(drops.c_str(), stdout);
+
+    return 0;
+}
@@ -0,0 +1,1527 @@
+/*
+ * Copyright (C) 2021 eYs3D Corporation
+ * All rights reserved.
+ * This project is licensed under the Apache License, Version 2.0.
+ *
+ */
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "benchmark.h"
+#include "synthetic_frames.h"
+#include "drop_stats.h"
+#include "devices/LatencyStats.h"
+#include "devices/Pipeline.h"
+#include "devices/FrameSetPipeline.h"
+#include "ready_fd.h"
+#include "spin_wait.h"
+#include "devices/model/DepthFilterOptions.h"
+#include "video/coders.h"
+#include "video/Frame.h"
+#include "video/FrameProducer.h"
+#include "video/LatestFrameMailbox.h"
+#include "video/PCFrame.h"
+#include "sensors/SensorData.h"
+#include "sensors/HIDReportReader.h"
+#include "sensors/IMULog.h"
+#include "base/synchronization/Lock.h"
+#include "base/synchronization/ConditionVariable.h"
+#include "base/synchronization/MessageChannel.h"
+#include "base/threads/FunctorThread.h"
+#include "base/threads/ExecutorThreadPool.h"
+#include "ColorPaletteGenerator.h"
+#include "PlyWriter.h"
+#include "IMUData.h"
+#include "utils.h"
+#include "debug.h"
+
+#define LOG_TAG "eys3d.pipeline_bench"
+
+//
+// End-to-end throughput and latency of the streaming path, no camera needed:
+//
+//      eys3d.pipeline_bench [--json <file|->] [--scenario <substring>]
+//                           [--delivery callback|mailbox|pipeline|pipeline_poll|frameset]
+//                           [--duration-s <s>] [--warmup-s <s>] [--fps <fps>]
+//                           [--imu-hz <hz>] [--mjpeg-file <jpeg>] [--depth-filters]
+//                           [--spin-wait-us <us>] [--callback-cost-us <us>]
+//      eys3d.pipeline_bench --hid-check
+//      eys3d.pipeline_bench --imu-log-check
+//
+// Synthetic color, depth and IMU streams are paced at the scenario frame rate
+// and pushed through the stage layout of video::FrameProducer (reader, RGB
+// transcoding, filtering, sender; two frames in flight per stream, callbacks
+// on an ExecutorThreadPool), point clouds are generated from color/depth
+// pairs matched by serial number, and the frames are handed to the app
+// through one of the three delivery paths of CameraDevice:
+//
+//      callback    Producer::Callback wrapped by LatencyStats
+//      mailbox     the same callbacks behind a LatestFrameMailbox
+//      pipeline    Pipeline::CircularQueue, one consumer thread per stream
+//      pipeline_poll   the same queues, one thread polling their ready fds
+//      frameset    FrameSetPipeline::CircularQueue, depth then color by serial
+//
+// The prebuilt producers cannot be driven without an opened CameraDevice, so
+// the stages are rebuilt here from the same kernels, channels and queues.
+//
+// Per scenario and delivery path the sustained fps, end-to-end latency
+// percentiles (frame timestamp to app), CPU time per stage, drops and the
+// peak RSS are reported. Every run happens in its own process so the peak RSS
+// is that of the run alone.
+//
+// --hid-check replays synthetic IMU reports into sensors::HIDReportReader
+// through a socketpair and verifies the decoded packets, a short report, a
+// wait that times out and the hang up of the writer.
+//
+// --imu-log-check appends IMU reports to a sensors::IMULogWriter with small
+// segments, makes the creation of one segment fail by moving the log
+// directory away, and reads the whole log back with IMULogReader.
+//
+
+using namespace libeYs3D;
+using namespace libeYs3D::bench;
+using libeYs3D::devices::LatencyStats;
+using libeYs3D::devices::LatencyStream;
+using libeYs3D::devices::LatencyStage;
+using libeYs3D::devices::Pipeline;
+using libeYs3D::devices::FrameSetPipeline;
+using libeYs3D::video::Frame;
+using libeYs3D::video::PCFrame;
+using libeYs3D::sensors::SensorData;
+
+enum class ColorSource    {
+    NONE,
+    YUY2,
+    MJPEG
+};
+
+enum class Delivery    {
+    CALLBACK = 0,
+    MAILBOX,
+    PIPELINE,
+    PIPELINE_POLL,
+    FRAMESET,
+    COUNT
+};
+
+static const char *get_delivery_name(Delivery delivery)    {
+    static const char *kNames[] = { "callback", "mailbox", "pipeline", "pipeline_poll", "frameset" };
+    return kNames[(int)delivery];
+}
+
+struct Scenario    {
+    const char *name;
+    ColorSource colorSource;
+    int32_t colorWidth;
+    int32_t colorHeight;
+    APCImageType::Value depthType;  // IMAGE_UNKNOWN if there is no depth stream
+    int32_t depthWidth;
+    int32_t depthHeight;
+    bool pointCloud;
+    bool imu;
+    int fps;
+};
+
+static const Scenario kScenarios[] = {
+    { "color_depth_pc", ColorSource::YUY2, 1280, 720,
+      APCImageType::DEPTH_11BITS, 1280, 720, true, true, 30 },
+    { "depth_only", ColorSource::NONE, 0, 0,
+      APCImageType::DEPTH_14BITS, 1280, 720, false, false, 30 },
+    { "usb2_mjpeg", ColorSource::MJPEG, 1280, 720,
+      APCImageType::DEPTH_11BITS, 640, 360, true, true, 15 },
+};
+
+struct Options    {
+    double durationS = 5.0;
+    double warmupS = 1.0;
+    int fps = 0;                        // 0: the scenario frame rate
+    int imuHz = 500;
+    bool depthFilters = false;
+    int spinWaitUs = 0;                 // pipeline consumers spin before blocking
+    int callbackCostUs = 0;             // app time spent per delivered frame
+    const char *mjpegFile = nullptr;
+    const char *jsonPath = nullptr;
+    const char *scenarioFilter = nullptr;
+    const char *deliveryFilter = nullptr;
+};
+
+enum Stage    {
+    STAGE_READ = 0,
+    STAGE_RGB_TRANSCODE,
+    STAGE_FILTER,
+    STAGE_SEND,
+    STAGE_CALLBACK,
+    STAGE_PC_GENERATION,
+    STAGE_PIPELINE_CONSUMER,
+    STAGE_IMU,
+    STAGE_COUNT
+};
+
+static const char *kStageNames[] = { "reader", "rgb_transcode", "filter", "sender", "callback",
+                                     "pc_generation", "pipeline_consumer", "imu" };
+
+static int64_t thread_cpu_ns()    {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (int64_t)ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+static int64_t process_cpu_us()    {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (int64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000ll +
+           usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+// What the app does with a delivered frame: reads a sample of the pixels
+static void touch_buffer(const uint8_t *data, size_t size)    {
+    uint32_t sum = 0;
+    for(size_t i = 0; i < size; i += 64)    sum += data[i];
+    do_not_optimize(sum);
+}
+
+// A slow app, e.g. rendering: keeps the calling thread busy for |us|
+static void spend_app_time(int us)    {
+    if(us <= 0)    return;
+
+    int64_t endUs = now_in_microsecond_high_res_time_MONOTONIC() + us;
+    while(now_in_microsecond_high_res_time_MONOTONIC() < endUs);
+}
+
+// DepthFilterOptions defaults, the constructor is reserved to CameraDevice
+class BenchDepthFilterOptions : public libeYs3D::devices::DepthFilterOptions    {
+public:
+    BenchDepthFilterOptions()    {
+        resetDefault();
+        setBytesPerPixel(2);
+    }
+};
+
+class ScenarioRun;
+
+// The stage layout of video::FrameProducer for one stream
+class SyntheticFrameProducer    {
+    DISALLOW_COPY_ASSIGN_AND_MOVE(SyntheticFrameProducer);
+
+public:
+    SyntheticFrameProducer(ScenarioRun &run, LatencyStream stream, int32_t width, int32_t height,
+                           const std::vector<uint8_t> &source);
+    ~SyntheticFrameProducer()    { stop(); }
+
+    void start(int64_t firstTickUs);
+    void stop();
+
+    LatencyStream getStream() const    { return mStream; }
+
+private:
+    void readerMain(int64_t firstTickUs);
+    void rgbMain();
+    void filterMain();
+    void senderMain();
+
+    static constexpr int kMaxFrames = 2;
+
+    ScenarioRun &mRun;
+    const LatencyStream mStream;
+    const int32_t mWidth;
+    const int32_t mHeight;
+    const std::vector<uint8_t> &mSource;
+    DropCounters &mDrops;
+
+    std::atomic<bool> mStopped{false};
+    base::MessageChannel<Frame, kMaxFrames> mDataQueue;
+    base::MessageChannel<Frame, kMaxFrames> mStageQueue;
+    base::MessageChannel<Frame, kMaxFrames> mStage2Queue;
+    base::MessageChannel<Frame, kMaxFrames> mFreeQueue;
+    base::MessageChannel<int, 1> mCBFinishSignal;
+    std::unique_ptr<base::ExecutorThreadPool<libeYs3D::video::CallbackWorkItem>> mCBThreadPool;
+    std::vector<std::unique_ptr<base::FunctorThread>> mThreads;
+};
+
+// Pairs color and depth frames by serial number and generates the point cloud
+class PCStage    {
+    DISALLOW_COPY_ASSIGN_AND_MOVE(PCStage);
+
+public:
+    explicit PCStage(ScenarioRun &run);
+    ~PCStage()    { stop(); }
+
+    void start();
+    void stop();
+
+    // Called by the senders, |frame| is copied
+    void submit(LatencyStream stream, const Frame *frame);
+
+private:
+    struct Input    {
+        bool valid = false;
+        uint32_t serialNumber = 0;
+        int64_t tsUs = 0ll;
+        std::vector<uint8_t> buffer;
+    };
+
+    void main();
+
+    ScenarioRun &mRun;
+    DropCounters &mDrops;
+
+    base::Lock mLock;
+    base::ConditionVariable mCond;
+    bool mStopped = false;              // guarded by mLock
+    Input mColor;                       // guarded by mLock
+    Input mDepth;                       // guarded by mLock
+    bool mHasJob = false;               // guarded by mLock
+    Input mJobColor;                    // guarded by mLock
+    Input mJobDepth;                    // guarded by mLock
+    std::unique_ptr<base::FunctorThread> mThread;
+};
+
+struct RunResult    {
+    std::string text;
+    std::string json;
+};
+
+class ScenarioRun    {
+    DISALLOW_COPY_ASSIGN_AND_MOVE(ScenarioRun);
+
+public:
+    // RAII helper charging the CPU time of the calling thread to |stage|
+    class CpuScope    {
+    public:
+        CpuScope(ScenarioRun &run, Stage stage)
+            : mRun(run), mStage(stage), mStartNs(thread_cpu_ns())    {}
+        ~CpuScope()    {
+            if(mRun.isMeasuring())    mRun.mStageCpuNs[mStage] += thread_cpu_ns() - mStartNs;
+        }
+
+    private:
+        ScenarioRun &mRun;
+        Stage mStage;
+        int64_t mStartNs;
+    };
+
+    ScenarioRun(const Scenario &scenario, Delivery delivery, const Options &options);
+    ~ScenarioRun();
+
+    RunResult run();
+
+    bool isMeasuring() const    { return mMeasuring.load(std::memory_order_relaxed); }
+    void countDelivered(LatencyStream stream)    {
+        if(isMeasuring())    mDelivered[(int)stream]++;
+    }
+
+    // Stage bodies, called from the producer threads
+    void produceRGB(LatencyStream stream, Frame *frame);
+    void filter(LatencyStream stream, Frame *frame);
+    void deliver(LatencyStream stream, Frame *frame);
+    void deliverPC(PCFrame *pcFrame);
+    void generatePC(const std::vector<uint8_t> &depth, const std::vector<uint8_t> &rgb,
+                    PCFrame *pcFrame);
+
+    Delivery getDelivery() const    { return mDelivery; }
+    bool usesCallbacks() const    { return mDelivery == Delivery::CALLBACK || mDelivery == Delivery::MAILBOX; }
+    const Scenario &getScenario() const    { return mScenario; }
+    int getFps() const    { return mFps; }
+    LatencyStats &getStats()    { return mStats; }
+
+private:
+    using FrameQueue = Pipeline::CircularQueue<Frame, 2>;
+    using PCFrameQueue = Pipeline::CircularQueue<PCFrame, 1>;
+    using IMUQueue = Pipeline::CircularQueue<SensorData, 8>;
+    using FrameSetQueue = FrameSetPipeline::CircularQueue<Frame, 2>;
+
+    void prepareInputs();
+    void imuMain(int64_t firstTickUs);
+    void startConsumers();
+    void stopConsumers();
+    void frameConsumerMain(LatencyStream stream, FrameQueue *queue);
+    void frameSetConsumerMain();
+    void pollingConsumerMain(ReadySet readySet);
+    bool onFrame(LatencyStream stream, const Frame *frame);
+    bool onPCFrame(const PCFrame *pcFrame);
+    bool onSensorData(const SensorData *sensorData);
+    void formatResult(double measuredS, int64_t processCpuUs, RunResult &result);
+
+    const Scenario &mScenario;
+    const Delivery mDelivery;
+    const Options &mOptions;
+    const int mFps;
+
+    LatencyStats mStats;
+    std::atomic<bool> mMeasuring{false};
+    std::atomic<bool> mStopped{false};
+    std::atomic<int64_t> mStageCpuNs[STAGE_COUNT] = {};
+    std::atomic<uint64_t> mDelivered[(int)LatencyStream::COUNT] = {};
+
+    void *mAPCHandle = nullptr;
+    bool mMJPEGDecode = false;          // false: MJPEG decode emulated by YUY2 conversion
+    DEVSELINFO mDevSelInfo;
+    BenchDepthFilterOptions mDepthFilterOptions;
+    eSPCtrl_RectLogData mRectLog;
+    std::vector<RGBQUAD> mPalette;
+    std::vector<uint8_t> mColorSource;  // YUY2 or one MJPEG frame
+    std::vector<uint8_t> mYUY2;         // emulated MJPEG decode
+    std::vector<uint8_t> mDepthSource;
+    std::vector<CloudPoint> mCloud;     // PC stage only
+
+    std::vector<std::unique_ptr<SyntheticFrameProducer>> mProducers;
+    std::unique_ptr<PCStage> mPCStage;
+    std::unique_ptr<base::FunctorThread> mIMUThread;
+    std::vector<std::unique_ptr<base::FunctorThread>> mConsumers;
+
+    libeYs3D::video::Producer::Callback mColorCallback;
+    libeYs3D::video::Producer::Callback mDepthCallback;
+    libeYs3D::video::PCProducer::PCCallback mPCCallback;
+    libeYs3D::sensors::SensorDataProducer::AppCallback mIMUCallback;
+
+    FrameQueue mColorQueue{"pipeline_bench.color"};
+    FrameQueue mDepthQueue{"pipeline_bench.depth"};
+    PCFrameQueue mPCQueue{"pipeline_bench.pc"};
+    IMUQueue mIMUQueue{"pipeline_bench.imu"};
+    FrameSetQueue mFrameSetColorQueue;
+    FrameSetQueue mFrameSetDepthQueue;
+
+    // IMU packets carry no timestamp, the generation time is kept by serial
+    static constexpr int kIMUTimestampCount = 256;
+    std::atomic<int64_t> mIMUTimestampsUs[kIMUTimestampCount] = {};
+
+    // last, their threads call back into the members above
+    std::unique_ptr<libeYs3D::video::FrameMailbox> mColorMailbox;
+    std::unique_ptr<libeYs3D::video::FrameMailbox> mDepthMailbox;
+    std::unique_ptr<libeYs3D::video::PCFrameMailbox> mPCMailbox;
+};
+
+SyntheticFrameProducer::SyntheticFrameProducer(ScenarioRun &run, LatencyStream stream,
+                                               int32_t width, int32_t height,
+                                               const std::vector<uint8_t> &source)
+    : mRun(run), mStream(stream), mWidth(width), mHeight(height), mSource(source),
+      mDrops(DropStats::get().stream(stream == LatencyStream::COLOR ? "pipeline_bench.color.reader"
+                                                                    : "pipeline_bench.depth.reader"))    {
+    for(int i = 0; i < kMaxFrames; i++)    {
+        Frame frame(source.size(), 0, 0, 0, (uint64_t)width * height * 3, 0);
+        frame.dataVec.resize(source.size());
+        frame.rgbVec.resize((size_t)width * height * 3);
+        mFreeQueue.send(std::move(frame));
+    }
+
+    mCBThreadPool.reset(new base::ExecutorThreadPool<libeYs3D::video::CallbackWorkItem>(1,
+        [this](libeYs3D::video::CallbackWorkItem &&item) {
+            {
+                ScenarioRun::CpuScope scope(mRun, STAGE_CALLBACK);
+                item.callback(item.frame);
+            }
+            mCBFinishSignal.send(0);
+        }, base::TaskPriority::High));
+}
+
+void SyntheticFrameProducer::start(int64_t firstTickUs)    {
+    mCBThreadPool->start();
+
+    mThreads.emplace_back(new base::FunctorThread([this, firstTickUs]() { readerMain(firstTickUs); }));
+    mThreads.emplace_back(new base::FunctorThread([this]() { rgbMain(); }));
+    mThreads.emplace_back(new base::FunctorThread([this]() { filterMain(); }));
+    mThreads.emplace_back(new base::FunctorThread([this]() { senderMain(); }));
+    for(auto &thread : mThreads)    thread->start();
+}
+
+void SyntheticFrameProducer::stop()    {
+    if(mThreads.empty())    return;
+
+    mStopped = true;
+    mDataQueue.stop();
+    mStageQueue.stop();
+    mStage2Queue.stop();
+    mFreeQueue.stop();
+    mCBFinishSignal.stop();
+    for(auto &thread : mThreads)    thread->wait();
+    mThreads.clear();
+
+    mCBThreadPool->done();
+    mCBThreadPool->join();
+}
+
+// Paced like the device: one frame every 1/fps on absolute deadlines, a tick
+// without a free frame is a frame the device would have dropped
+void SyntheticFrameProducer::readerMain(int64_t firstTickUs)    {
+    const int64_t periodNs = 1000000000ll / mRun.getFps();
+    struct timespec deadline = { (time_t)(firstTickUs / 1000000ll), (long)(firstTickUs % 1000000ll) * 1000 };
+    uint32_t serialNumber = 0;
+
+    while(!mStopped)    {
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, nullptr);
+        deadline.tv_nsec += periodNs;
+        while(deadline.tv_nsec >= 1000000000l)    {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000l;
+        }
+        serialNumber += 1;
+
+        Frame frame;
+        if(!mFreeQueue.tryReceive(&frame))    {
+            if(mStopped)    break;
+            if(mRun.isMeasuring())    mDrops.record(DropReason::STAGE_OVERFLOW, serialNumber);
+            continue;
+        }
+
+        {
+            ScenarioRun::CpuScope scope(mRun, STAGE_READ);
+            LatencyStats::Scope latency(mRun.getStats(), mStream, LatencyStage::READ);
+
+            frame.tsUs = now_in_microsecond_high_res_time_REALTIME();
+            frame.serialNumber = serialNumber;
+            frame.width = mWidth;
+            frame.height = mHeight;
+            memcpy(frame.dataVec.data(), mSource.data(), mSource.size());
+            frame.actualDataBufferSize = mSource.size();
+        }
+
+        if(!mDataQueue.send(std::move(frame)))    break;
+    }
+}
+
+void SyntheticFrameProducer::rgbMain()    {
+    Frame frame;
+    while(mDataQueue.receive(&frame))    {
+        {
+            ScenarioRun::CpuScope scope(mRun, STAGE_RGB_TRANSCODE);
+            int64_t startUs = now_in_microsecond_high_res_time_MONOTONIC();
+            mRun.produceRGB(mStream, &frame);
+            frame.rgbTranscodingTimeUs = now_in_microsecond_high_res_time_MONOTONIC() - startUs;
+        }
+        if(!mStageQueue.send(std::move(frame)))    break;
+    }
+}
+
+void SyntheticFrameProducer::filterMain()    {
+    Frame frame;
+    while(mStageQueue.receive(&frame))    {
+        {
+            ScenarioRun::CpuScope scope(mRun, STAGE_FILTER);
+            int64_t startUs = now_in_microsecond_high_res_time_MONOTONIC();
+            mRun.filter(mStream, &frame);
+            frame.filteringTimeUs = now_in_microsecond_high_res_time_MONOTONIC() - startUs;
+        }
+        if(!mStage2Queue.send(std::move(frame)))    break;
+    }
+}
+
+void SyntheticFrameProducer::senderMain()    {
+    Frame frame;
+    while(mStage2Queue.receive(&frame))    {
+        if(mRun.usesCallbacks())    {
+            mCBThreadPool->enqueue(libeYs3D::video::CallbackWorkItem(
+                [this](const Frame *f) -> bool {
+                    mRun.deliver(mStream, const_cast<Frame *>(f));
+                    return true;
+                }, &frame));
+            int signal;
+            if(!mCBFinishSignal.receive(&signal))    break;
+        } else    {
+            ScenarioRun::CpuScope scope(mRun, STAGE_SEND);
+            mRun.deliver(mStream, &frame);
+        }
+
+        if(!mFreeQueue.send(std::move(frame)))    break;
+    }
+}
+
+PCStage::PCStage(ScenarioRun &run)
+    : mRun(run), mDrops(DropStats::get().stream("pipeline_bench.pc"))    {}
+
+void PCStage::start()    {
+    mThread.reset(new base::FunctorThread([this]() { main(); }));
+    mThread->start();
+}
+
+void PCStage::stop()    {
+    if(!mThread)    return;
+
+    {
+        base::AutoLock lock(mLock);
+        mStopped = true;
+        mCond.broadcast();
+    }
+    mThread->wait();
+    mThread.reset();
+}
+
+void PCStage::submit(LatencyStream stream, const Frame *frame)    {
+    base::AutoLock lock(mLock);
+
+    bool isColor = (stream == LatencyStream::COLOR);
+    Input &input = isColor ? mColor : mDepth;
+    Input &other = isColor ? mDepth : mColor;
+
+    // an unpaired input being replaced never makes it into a point cloud
+    if(input.valid && mRun.isMeasuring())    mDrops.record(DropReason::PC_PAIRING, input.serialNumber);
+
+    const auto &data = isColor ? frame->rgbVec : frame->dataVec;
+    size_t size = isColor ? frame->actualRGBBufferSize : frame->actualDataBufferSize;
+    input.buffer.assign(data.begin(), data.begin() + size);
+    input.serialNumber = frame->serialNumber;
+    input.tsUs = frame->tsUs;
+    input.valid = true;
+
+    if(!other.valid || other.serialNumber != input.serialNumber)    return;
+
+    if(mHasJob && mRun.isMeasuring())    mDrops.record(DropReason::PC_PAIRING, mJobDepth.serialNumber);
+    std::swap(mJobColor, mColor);
+    std::swap(mJobDepth, mDepth);
+    mColor.valid = false;
+    mDepth.valid = false;
+    mHasJob = true;
+    mCond.signal();
+}
+
+void PCStage::main()    {
+    const Scenario &scenario = mRun.getScenario();
+    const size_t pointCount = (size_t)scenario.depthWidth * scenario.depthHeight;
+    PCFrame pcFrame;
+    pcFrame.xyzDataVec.resize(pointCount * 3);
+    pcFrame.rgbDataVec.resize(pointCount * 3);
+    Input color, depth;
+
+    while(true)    {
+        {
+            base::AutoLock lock(mLock);
+            while(!mHasJob && !mStopped)    mCond.wait(&lock);
+            if(mStopped)    break;
+
+            std::swap(color, mJobColor);
+            std::swap(depth, mJobDepth);
+            mHasJob = false;
+        }
+
+        {
+            ScenarioRun::CpuScope scope(mRun, STAGE_PC_GENERATION);
+            int64_t startUs = now_in_microsecond_high_res_time_MONOTONIC();
+            mRun.generatePC(depth.buffer, color.buffer, &pcFrame);
+            pcFrame.tsUs = depth.tsUs;
+            pcFrame.serialNumber = depth.serialNumber;
+            pcFrame.transcodingTimeUs = now_in_microsecond_high_res_time_MONOTONIC() - startUs;
+        }
+        mRun.deliverPC(&pcFrame);
+    }
+}
+
+ScenarioRun::ScenarioRun(const Scenario &scenario, Delivery delivery, const Options &options)
+    : mScenario(scenario), mDelivery(delivery), mOptions(options),
+      mFps(options.fps > 0 ? options.fps : scenario.fps)    {
+    memset(&mDevSelInfo, 0, sizeof(mDevSelInfo));
+    if(APC_Init(&mAPCHandle, false) < 0)    mAPCHandle = nullptr;
+
+    prepareInputs();
+
+    mColorCallback = mStats.wrap(LatencyStream::COLOR, [this](const Frame *frame) -> bool {
+        return onFrame(LatencyStream::COLOR, frame);
+    });
+    mDepthCallback = mStats.wrap(LatencyStream::DEPTH, [this](const Frame *frame) -> bool {
+        return onFrame(LatencyStream::DEPTH, frame);
+    });
+    mPCCallback = mStats.wrap([this](const PCFrame *pcFrame) -> bool {
+        return onPCFrame(pcFrame);
+    });
+    mIMUCallback = mStats.wrap([this](const SensorData *sensorData) -> bool {
+        return onSensorData(sensorData);
+    });
+
+    if(mDelivery == Delivery::MAILBOX)    {
+        mColorMailbox.reset(new libeYs3D::video::FrameMailbox("pipeline_bench.color.mailbox", mColorCallback));
+        mDepthMailbox.reset(new libeYs3D::video::FrameMailbox("pipeline_bench.depth.mailbox", mDepthCallback));
+        mPCMailbox.reset(new libeYs3D::video::PCFrameMailbox("pipeline_bench.pc.mailbox", mPCCallback));
+        mColorCallback = mColorMailbox->callback();
+        mDepthCallback = mDepthMailbox->callback();
+        mPCCallback = mPCMailbox->callback();
+    }
+}
+
+ScenarioRun::~ScenarioRun()    {
+    mProducers.clear();
+    mPCStage.reset();
+    if(mAPCHandle)    APC_Release(&mAPCHandle);
+}
+
+void ScenarioRun::prepareInputs()    {
+    const Scenario &s = mScenario;
+
+    if(s.colorSource == ColorSource::YUY2)    {
+        make_yuy2(mColorSource, s.colorWidth, s.colorHeight);
+    } else if(s.colorSource == ColorSource::MJPEG)    {
+        make_yuy2(mYUY2, s.colorWidth, s.colorHeight);
+
+        // one decode up front tells whether eSPDI can decode the recorded frame
+        std::vector<uint8_t> rgb((size_t)s.colorWidth * s.colorHeight * 3);
+        if(mAPCHandle && load_raw(mOptions.mjpegFile, mColorSource, 0))    {
+            mMJPEGDecode = (APC_ColorFormat_to_RGB24(mAPCHandle, &mDevSelInfo, rgb.data(),
+                                                     mColorSource.data(), (int)mColorSource.size(),
+                                                     s.colorWidth, s.colorHeight,
+                                                     APCImageType::COLOR_MJPG) >= 0);
+        }
+        if(!mMJPEGDecode)    {
+            // MJPEG at ~1/8 of YUY2 for the USB read, the decode is emulated
+            mColorSource.assign(mYUY2.begin(), mYUY2.begin() + mYUY2.size() / 8);
+        }
+    }
+
+    if(s.depthType == APCImageType::DEPTH_11BITS)    {
+        make_depth(mDepthSource, s.depthWidth, s.depthHeight, kD11MaxDisparity, true);
+        mPalette.resize(kD11MaxDisparity + 1);
+        ColorPaletteGenerator::generatePaletteColor(mPalette.data(), kD11MaxDisparity + 1,
+                                                    0, 1, 2000, false);
+    } else if(s.depthType == APCImageType::DEPTH_14BITS)    {
+        make_depth(mDepthSource, s.depthWidth, s.depthHeight, kZ14MaxDepth, false);
+        mPalette.resize(COLOR_PALETTE_MAX_COUNT);
+        ColorPaletteGenerator::DmColorMode14(mPalette.data(), kZ14MaxDepth, 0.0f, false);
+    }
+    make_rect_log(mRectLog, s.depthWidth, s.depthHeight);
+    if(s.pointCloud)    mCloud.reserve((size_t)s.depthWidth * s.depthHeight);
+}
+
+void ScenarioRun::produceRGB(LatencyStream stream, Frame *frame)    {
+    const int32_t w = frame->width, h = frame->height;
+    uint64_t rgbSize = (uint64_t)w * h * 3;
+
+    if(stream == LatencyStream::DEPTH)    {
+        colorize_depth(mPalette.data(), (int)mPalette.size(), (const uint16_t *)frame->dataVec.data(),
+                       frame->rgbVec.data(), w * h);
+    } else if(mScenario.colorSource == ColorSource::MJPEG && mMJPEGDecode)    {
+        APC_ColorFormat_to_RGB24(mAPCHandle, &mDevSelInfo, frame->rgbVec.data(), frame->dataVec.data(),
+                                 (int)frame->actualDataBufferSize, w, h, APCImageType::COLOR_MJPG);
+    } else    {
+        uint8_t *yuy2 = (mScenario.colorSource == ColorSource::MJPEG) ? mYUY2.data()
+                                                                       : frame->dataVec.data();
+        libeYs3D::video::convert_yuv_to_rgb_buffer(yuy2, frame->rgbVec.data(), w, h, &rgbSize);
+    }
+    frame->actualRGBBufferSize = rgbSize;
+}
+
+void ScenarioRun::filter(LatencyStream stream, Frame *frame)    {
+    if(stream != LatencyStream::DEPTH || !mOptions.depthFilters || mAPCHandle == nullptr)    return;
+
+    BenchDepthFilterOptions &o = mDepthFilterOptions;
+    APC_HoleFill(mAPCHandle, &mDevSelInfo, frame->dataVec.data(), o.getBytesPerPixel(),
+                 o.getKernelSize(), frame->width, frame->height, o.getLevel(), o.isHorizontal());
+    APC_TemporalFilter(mAPCHandle, &mDevSelInfo, frame->dataVec.data(), o.getBytesPerPixel(),
+                       frame->width, frame->height, o.getAlpha(), o.getHistory());
+}
+
+void ScenarioRun::deliver(LatencyStream stream, Frame *frame)    {
+    if(mPCStage)    mPCStage->submit(stream, frame);
+
+    bool isColor = (stream == LatencyStream::COLOR);
+    switch(mDelivery)    {
+        case Delivery::CALLBACK:
+        case Delivery::MAILBOX:
+            (isColor ? mColorCallback : mDepthCallback)(frame);
+            break;
+        case Delivery::PIPELINE:
+        case Delivery::PIPELINE_POLL:
+            (isColor ? mColorQueue : mDepthQueue).enQueue(frame, 0);
+            break;
+        default:
+            (isColor ? mFrameSetColorQueue : mFrameSetDepthQueue).enQueue(frame, 0);
+            break;
+    }
+}
+
+void ScenarioRun::deliverPC(PCFrame *pcFrame)    {
+    if(usesCallbacks())    {
+        ScenarioRun::CpuScope scope(*this, STAGE_CALLBACK);
+        mPCCallback(pcFrame);
+    } else    {
+        mPCQueue.enQueue(pcFrame, 0);
+    }
+}
+
+void ScenarioRun::generatePC(const std::vector<uint8_t> &depth, const std::vector<uint8_t> &rgb,
+                             PCFrame *pcFrame)    {
+    const Scenario &s = mScenario;
+
+    mCloud.clear();
+    PlyWriter::apcFrameTo3D(s.depthWidth, s.depthHeight, const_cast<std::vector<uint8_t> &>(depth),
+                            s.colorWidth, s.colorHeight, const_cast<std::vector<uint8_t> &>(rgb),
+                            &mRectLog, s.depthType, mCloud,
+                            false, 0.0f, (float)kZ14MaxDepth, false, true, 1.0f);
+
+    size_t count = std::min(mCloud.size(), pcFrame->xyzDataVec.size() / 3);
+    for(size_t i = 0; i < count; i++)    {
+        const CloudPoint &point = mCloud[i];
+        pcFrame->xyzDataVec[i * 3 + 0] = point.x;
+        pcFrame->xyzDataVec[i * 3 + 1] = point.y;
+        pcFrame->xyzDataVec[i * 3 + 2] = point.z;
+        pcFrame->rgbDataVec[i * 3 + 0] = point.r;
+        pcFrame->rgbDataVec[i * 3 + 1] = point.g;
+        pcFrame->rgbDataVec[i * 3 + 2] = point.b;
+    }
+}
+
+bool ScenarioRun::onFrame(LatencyStream stream, const Frame *frame)    {
+    touch_buffer(frame->rgbVec.data(), frame->actualRGBBufferSize);
+    spend_app_time(mOptions.callbackCostUs);
+    countDelivered(stream);
+
+    return true;
+}
+
+bool ScenarioRun::onPCFrame(const PCFrame *pcFrame)    {
+    touch_buffer((const uint8_t *)pcFrame->xyzDataVec.data(), pcFrame->xyzDataVec.size() * sizeof(float));
+    spend_app_time(mOptions.callbackCostUs);
+    countDelivered(LatencyStream::PC);
+
+    return true;
+}
+
+bool ScenarioRun::onSensorData(const SensorData *sensorData)    {
+    int64_t tsUs = mIMUTimestampsUs[sensorData->serialNumber % kIMUTimestampCount].load();
+    if(isMeasuring())
+        mStats.record(LatencyStream::IMU, LatencyStage::END_TO_END,
+                      now_in_microsecond_high_res_time_REALTIME() - tsUs);
+    countDelivered(LatencyStream::IMU);
+
+    return true;
+}
+
+// Generates and parses one 64 bytes IMU packet per tick, as the HID reader does
+void ScenarioRun::imuMain(int64_t firstTickUs)    {
+    const int64_t periodNs = 1000000000ll / mOptions.imuHz;
+    struct timespec deadline = { (time_t)(firstTickUs / 1000000ll), (long)(firstTickUs % 1000000ll) * 1000 };
+    uint8_t packet[64];
+    uint32_t state = 3;
+    SensorData sensorData(SensorData::SensorDataType::IMU_DATA);
+    IMUData imuData;
+    sensorData.serialNumber = 0;
+
+    while(!mStopped)    {
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, nullptr);
+        deadline.tv_nsec += periodNs;
+        while(deadline.tv_nsec >= 1000000000l)    {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000l;
+        }
+
+        {
+            ScenarioRun::CpuScope scope(*this, STAGE_IMU);
+            sensorData.serialNumber += 1;
+            mIMUTimestampsUs[sensorData.serialNumber % kIMUTimestampCount] =
+                now_in_microsecond_high_res_time_REALTIME();
+            for(uint8_t &b : packet)    b = (uint8_t)next_random(state);
+            packet[0] = (uint8_t)(sensorData.serialNumber & 0xFF);
+            packet[1] = (uint8_t)((sensorData.serialNumber >> 8) & 0xFF);
+            imuData.parsePacket(packet, true);
+            memcpy(sensorData.data, &imuData, sizeof(imuData));
+        }
+
+        if(usesCallbacks())    {
+            mIMUCallback(&sensorData);
+        } else    {
+            mIMUQueue.enQueue(&sensorData, 0);
+        }
+    }
+}
+
+void ScenarioRun::frameConsumerMain(LatencyStream stream, FrameQueue *queue)    {
+    Frame frame;
+    while(!mStopped)    {
+        if(queue->deQueue(&frame) != Pipeline::RESULT::OK)    continue;
+
+        ScenarioRun::CpuScope scope(*this, STAGE_PIPELINE_CONSUMER);
+        if(isMeasuring())    mStats.recordFrame(stream, &frame, LatencyStage::PIPELINE_QUEUE_WAIT);
+        onFrame(stream, &frame);
+    }
+}
+
+// Waits for a depth frame, then for the color frame with the same serial
+// number, as FrameSetPipeline::waitForFrameSet() does
+void ScenarioRun::frameSetConsumerMain()    {
+    bool hasColor = (mScenario.colorSource != ColorSource::NONE);
+    Frame depth, color;
+
+    while(!mStopped)    {
+        if(mFrameSetDepthQueue.deQueue(&depth) != FrameSetPipeline::RESULT::OK)    continue;
+        if(hasColor && mFrameSetColorQueue.deQueue(&color, depth.serialNumber) != FrameSetPipeline::RESULT::OK)
+            continue;
+        if(hasColor && color.serialNumber != depth.serialNumber)    continue;
+
+        ScenarioRun::CpuScope scope(*this, STAGE_PIPELINE_CONSUMER);
+        if(isMeasuring())    {
+            mStats.recordFrame(LatencyStream::DEPTH, &depth, LatencyStage::PIPELINE_QUEUE_WAIT);
+            if(hasColor)    mStats.recordFrame(LatencyStream::COLOR, &color, LatencyStage::PIPELINE_QUEUE_WAIT);
+        }
+        onFrame(LatencyStream::DEPTH, &depth);
+        if(hasColor)    onFrame(LatencyStream::COLOR, &color);
+    }
+}
+
+enum { COLOR_READY = 1 << 0, DEPTH_READY = 1 << 1, PC_READY = 1 << 2, IMU_READY = 1 << 3 };
+
+// Serves all the streams from one thread, woken up by the ready fds of the
+// queues only
+void ScenarioRun::pollingConsumerMain(ReadySet readySet)    {
+    Frame frame;
+    PCFrame pcFrame;
+    SensorData sensorData;
+    while(!mStopped)    {
+        uint32_t ready = readySet.wait(-1);
+
+        // as frameConsumerMain(), the copy out of the queue is not counted
+        if((ready & COLOR_READY) && mColorQueue.deQueue(&frame, 0) == Pipeline::RESULT::OK)    {
+            ScenarioRun::CpuScope scope(*this, STAGE_PIPELINE_CONSUMER);
+            if(isMeasuring())    mStats.recordFrame(LatencyStream::COLOR, &frame, LatencyStage::PIPELINE_QUEUE_WAIT);
+            onFrame(LatencyStream::COLOR, &frame);
+        }
+        if((ready & DEPTH_READY) && mDepthQueue.deQueue(&frame, 0) == Pipeline::RESULT::OK)    {
+            ScenarioRun::CpuScope scope(*this, STAGE_PIPELINE_CONSUMER);
+            if(isMeasuring())    mStats.recordFrame(LatencyStream::DEPTH, &frame, LatencyStage::PIPELINE_QUEUE_WAIT);
+            onFrame(LatencyStream::DEPTH, &frame);
+        }
+        if((ready & PC_READY) && mPCQueue.deQueue(&pcFrame, 0) == Pipeline::RESULT::OK)    {
+            ScenarioRun::CpuScope scope(*this, STAGE_PIPELINE_CONSUMER);
+            if(isMeasuring())    mStats.recordPCFrame(&pcFrame, LatencyStage::PIPELINE_QUEUE_WAIT);
+            onPCFrame(&pcFrame);
+        }
+        if((ready & IMU_READY) && mIMUQueue.deQueue(&sensorData, 0) == Pipeline::RESULT::OK)    {
+            ScenarioRun::CpuScope scope(*this, STAGE_PIPELINE_CONSUMER);
+            onSensorData(&sensorData);
+        }
+    }
+}
+
+void ScenarioRun::startConsumers()    {
+    if(usesCallbacks())    return;
+
+    if(mDelivery == Delivery::PIPELINE_POLL)    {
+        // the descriptors are created before the producers start, see ready_fd.h
+        ReadySet readySet;
+        if(mScenario.colorSource != ColorSource::NONE)    readySet.add(mColorQueue.getReadyFd(), COLOR_READY);
+        readySet.add(mDepthQueue.getReadyFd(), DEPTH_READY);
+        if(mScenario.pointCloud)    readySet.add(mPCQueue.getReadyFd(), PC_READY);
+        if(mScenario.imu && mOptions.imuHz > 0)    readySet.add(mIMUQueue.getReadyFd(), IMU_READY);
+
+        mConsumers.emplace_back(new base::FunctorThread([this, readySet]() {
+            pollingConsumerMain(readySet);
+        }));
+        mConsumers.back()->start();
+        return;
+    }
+
+    if(mDelivery == Delivery::PIPELINE)    {
+        if(mOptions.spinWaitUs > 0)    {
+            SpinWaitPolicy policy;
+            policy.maxSpinUs = mOptions.spinWaitUs;
+            mColorQueue.setWaitStrategy(&policy);
+            mDepthQueue.setWaitStrategy(&policy);
+            mPCQueue.setWaitStrategy(&policy);
+        }
+
+        if(mScenario.colorSource != ColorSource::NONE)
+            mConsumers.emplace_back(new base::FunctorThread([this]() {
+                frameConsumerMain(LatencyStream::COLOR, &mColorQueue);
+            }));
+        mConsumers.emplace_back(new base::FunctorThread([this]() {
+            frameConsumerMain(LatencyStream::DEPTH, &mDepthQueue);
+        }));
+    } else    {
+        mConsumers.emplace_back(new base::FunctorThread([this]() { frameSetConsumerMain(); }));
+    }
+
+    if(mScenario.pointCloud)    {
+        mConsumers.emplace_back(new base::FunctorThread([this]() {
+            PCFrame pcFrame;
+            while(!mStopped)    {
+                if(mPCQueue.deQueue(&pcFrame) != Pipeline::RESULT::OK)    continue;
+
+                ScenarioRun::CpuScope scope(*this, STAGE_PIPELINE_CONSUMER);
+                if(isMeasuring())    mStats.recordPCFrame(&pcFrame, LatencyStage::PIPELINE_QUEUE_WAIT);
+                onPCFrame(&pcFrame);
+            }
+        }));
+    }
+
+    if(mScenario.imu && mOptions.imuHz > 0)    {
+        mConsumers.emplace_back(new base::FunctorThread([this]() {
+            SensorData sensorData;
+            while(!mStopped)    {
+                if(mIMUQueue.deQueue(&sensorData) != Pipeline::RESULT::OK)    continue;
+
+                ScenarioRun::CpuScope scope(*this, STAGE_PIPELINE_CONSUMER);
+                onSensorData(&sensorData);
+            }
+        }));
+    }
+
+    for(auto &consumer : mConsumers)    consumer->start();
+}
+
+void ScenarioRun::stopConsumers()    {
+    mColorQueue.stop();
+    mDepthQueue.stop();
+    mPCQueue.stop();
+    mIMUQueue.stop();
+    mFrameSetColorQueue.stop();
+    mFrameSetDepthQueue.stop();
+    for(auto &consumer : mConsumers)    consumer->wait();
+    mConsumers.clear();
+
+    // producers are stopped as well, the queues are idle
+    mColorQueue.releaseSideState();
+    mDepthQueue.releaseSideState();
+    mPCQueue.releaseSideState();
+    mIMUQueue.releaseSideState();
+}
+
+RunResult ScenarioRun::run()    {
+    const Scenario &s = mScenario;
+
+    if(s.colorSource != ColorSource::NONE)
+        mProducers.emplace_back(new SyntheticFrameProducer(*this, LatencyStream::COLOR,
+                                                           s.colorWidth, s.colorHeight, mColorSource));
+    mProducers.emplace_back(new SyntheticFrameProducer(*this, LatencyStream::DEPTH,
+                                                       s.depthWidth, s.depthHeight, mDepthSource));
+    if(s.pointCloud)    mPCStage.reset(new PCStage(*this));
+
+    startConsumers();
+    if(mPCStage)    mPCStage->start();
+
+    // color and depth share their ticks so serial numbers pair like on a synchronized device
+    int64_t firstTickUs = now_in_microsecond_high_res_time_MONOTONIC() + 10000ll;
+    for(auto &producer : mProducers)    producer->start(firstTickUs);
+    if(s.imu && mOptions.imuHz > 0)    {
+        mIMUThread.reset(new base::FunctorThread([this, firstTickUs]() { imuMain(firstTickUs); }));
+        mIMUThread->start();
+    }
+
+    usleep((useconds_t)(mOptions.warmupS * 1000000.0));
+    mStats.reset();
+    int64_t startCpuUs = process_cpu_us();
+    int64_t startUs = now_in_microsecond_high_res_time_MONOTONIC();
+    mMeasuring = true;
+
+    usleep((useconds_t)(mOptions.durationS * 1000000.0));
+
+    mMeasuring = false;
+    double measuredS = (double)(now_in_microsecond_high_res_time_MONOTONIC() - startUs) / 1000000.0;
+    int64_t processCpuUs = process_cpu_us() - startCpuUs;
+
+    mStopped = true;
+    for(auto &producer : mProducers)    producer->stop();
+    if(mPCStage)    mPCStage->stop();
+    if(mIMUThread)    mIMUThread->wait();
+    stopConsumers();
+
+    RunResult result;
+    formatResult(measuredS, processCpuUs, result);
+
+    return result;
+}
+
+void ScenarioRun::formatResult(double measuredS, int64_t processCpuUs, RunResult &result)    {
+    const Scenario &s = mScenario;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    char line[1024];
+
+    snprintf(line, sizeof(line), "== %s / %s: %d fps, %.1f s%s\n", s.name, get_delivery_name(mDelivery),
+             mFps, measuredS,
+             (s.colorSource == ColorSource::MJPEG && !mMJPEGDecode) ? ", MJPEG decode emulated" : "");
+    result.text = line;
+    snprintf(line, sizeof(line), "   %-6s %8s %8s %10s %10s %10s %10s\n",
+             "stream", "frames", "fps", "p50(us)", "p99(us)", "p999(us)", "max(us)");
+    result.text += line;
+
+    snprintf(line, sizeof(line),
+             "    {\"scenario\": \"%s\", \"delivery\": \"%s\", \"target_fps\": %d, \"duration_s\": %.3f, "
+             "\"mjpeg_decode\": \"%s\",\n     \"streams\": [",
+             s.name, get_delivery_name(mDelivery), mFps, measuredS,
+             (s.colorSource != ColorSource::MJPEG) ? "none" : (mMJPEGDecode ? "espdi" : "emulated"));
+    result.json = line;
+
+    bool first = true;
+    for(int i = 0; i < (int)LatencyStream::COUNT; i++)    {
+        LatencyStream stream = (LatencyStream)i;
+        const LatencyHistogram &e2e = mStats.histogram(stream, LatencyStage::END_TO_END);
+        uint64_t frames = mDelivered[i].load();
+        if(frames == 0 && e2e.getCount() == 0)    continue;
+
+        double fps = (double)frames / measuredS;
+        snprintf(line, sizeof(line), "   %-6s %8" PRIu64 " %8.2f %10" PRId64 " %10" PRId64 " %10" PRId64 " %10" PRId64 "\n",
+                 LatencyStats::getStreamName(stream), frames, fps,
+                 e2e.getPercentileUs(50.0), e2e.getPercentileUs(99.0), e2e.getPercentileUs(99.9),
+                 e2e.getMaxUs());
+        result.text += line;
+
+        snprintf(line, sizeof(line),
+                 "%s\n       {\"stream\": \"%s\", \"frames\": %" PRIu64 ", \"fps\": %.3f, "
+                 "\"e2e_p50_us\": %" PRId64 ", \"e2e_p99_us\": %" PRId64 ", \"e2e_p999_us\": %" PRId64 ", "
+                 "\"e2e_max_us\": %" PRId64 "}",
+                 first ? "" : ",", LatencyStats::getStreamName(stream), frames, fps,
+                 e2e.getPercentileUs(50.0), e2e.getPercentileUs(99.0), e2e.getPercentileUs(99.9),
+                 e2e.getMaxUs());
+        result.json += line;
+        first = false;
+    }
+    result.json += "],\n     \"stage_cpu_ms\": {";
+
+    result.text += "   cpu(ms):";
+    for(int i = 0; i < STAGE_COUNT; i++)    {
+        double cpuMs = (double)mStageCpuNs[i].load() / 1000000.0;
+        snprintf(line, sizeof(line), " %s=%.1f", kStageNames[i], cpuMs);
+        result.text += line;
+        snprintf(line, sizeof(line), "%s\"%s\": %.3f", i ? ", " : "", kStageNames[i], cpuMs);
+        result.json += line;
+    }
+    snprintf(line, sizeof(line), "\n   process cpu: %.1f%%, peak rss: %ld kB\n",
+             (double)processCpuUs / 10000.0 / measuredS, usage.ru_maxrss);
+    result.text += line;
+
+    snprintf(line, sizeof(line), "},\n     \"process_cpu_percent\": %.3f, \"peak_rss_kb\": %ld,\n     \"drops\": {",
+             (double)processCpuUs / 10000.0 / measuredS, usage.ru_maxrss);
+    result.json += line;
+
+    first = true;
+    DropStats::get().forEach([&](const DropCounters &counters)    {
+        for(int r = 0; r < (int)DropReason::COUNT; r++)    {
+            uint64_t count = counters.getCount((DropReason)r);
+            if(count == 0)    continue;
+
+            snprintf(line, sizeof(line), "   drop %s.%s: %" PRIu64 "\n", counters.getName().c_str(),
+                     getDropReasonName((DropReason)r), count);
+            result.text += line;
+            snprintf(line, sizeof(line), "%s\"%s.%s\": %" PRIu64, first ? "" : ", ",
+                     counters.getName().c_str(), getDropReasonName((DropReason)r), count);
+            result.json += line;
+            first = false;
+        }
+    });
+    result.json += "}";
+
+    if(mDelivery == Delivery::PIPELINE && mOptions.spinWaitUs > 0)    {
+        const std::pair<const char *, FrameQueue *> queues[] = { { "color", &mColorQueue },
+                                                                  { "depth", &mDepthQueue } };
+        result.json += ",\n     \"spin_wait\": {";
+        first = true;
+        for(const auto &queue : queues)    {
+            SpinWaitStats stats;
+            if(queue.second == &mColorQueue && mScenario.colorSource == ColorSource::NONE)    continue;
+            if(!queue.second->getWaitStats(&stats))    continue;
+
+            snprintf(line, sizeof(line), "   spin wait %s: immediate=%" PRIu64 " pause=%" PRIu64
+                     " yield=%" PRIu64 " blocked=%" PRIu64 " spin(ms)=%.1f budget(us)=%d\n",
+                     queue.first, stats.immediate, stats.pauseHits, stats.yieldHits, stats.blocked,
+                     (double)stats.spinUs / 1000.0, stats.budgetUs);
+            result.text += line;
+            snprintf(line, sizeof(line), "%s\"%s\": {\"immediate\": %" PRIu64 ", \"pause\": %" PRIu64
+                     ", \"yield\": %" PRIu64 ", \"blocked\": %" PRIu64 ", \"spin_us\": %" PRIu64 "}",
+                     first ? "" : ", ", queue.first, stats.immediate, stats.pauseHits, stats.yieldHits,
+                     stats.blocked, stats.spinUs);
+            result.json += line;
+            first = false;
+        }
+        result.json += "}";
+    }
+    result.json += "}";
+}
+
+// Runs in a child process, the result comes back through a pipe as
+// "<json>\0<text>"
+static bool run_isolated(const Scenario &scenario, Delivery delivery, const Options &options,
+                         RunResult &result)    {
+    int fds[2];
+    if(pipe(fds) != 0)    {
+        LOG_ERR_ERRNO(LOG_TAG, "pipe() failed");
+        return false;
+    }
+
+    pid_t pid = fork();
+    if(pid < 0)    {
+        LOG_ERR_ERRNO(LOG_TAG, "fork() failed");
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+
+    if(pid == 0)    {
+        close(fds[0]);
+        RunResult childResult;
+        {
+            ScenarioRun run(scenario, delivery, options);
+            childResult = run.run();
+        }
+        std::string message = childResult.json;
+        message.push_back('\0');
+        message += childResult.text;
+        const char *data = message.data();
+        size_t remaining = message.size();
+        while(remaining > 0)    {
+            ssize_t written = write(fds[1], data, remaining);
+            if(written <= 0)    _exit(1);
+            data += written;
+            remaining -= (size_t)written;
+        }
+        close(fds[1]);
+        _exit(0);
+    }
+
+    close(fds[1]);
+    std::string message;
+    char buffer[4096];
+    ssize_t length;
+    while((length = read(fds[0], buffer, sizeof(buffer))) > 0)    message.append(buffer, (size_t)length);
+    close(fds[0]);
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    size_t separator = message.find('\0');
+    if(!WIFEXITED(status) || WEXITSTATUS(status) != 0 || separator == std::string::npos)    {
+        LOG_ERR(LOG_TAG, "%s/%s did not complete (status 0x%x)", scenario.name,
+                get_delivery_name(delivery), status);
+        return false;
+    }
+
+    result.json = message.substr(0, separator);
+    result.text = message.substr(separator + 1);
+
+    return true;
+}
+
+struct HIDCheckState    {
+    base::Lock lock;
+    base::ConditionVariable cond;
+    std::vector<std::vector<uint8_t>> reports;  // guarded by lock
+    std::vector<int> frameCounts;               // IMUData::_frameCount of each full report
+    int shortReports = 0;
+};
+
+// returns false if |count| reports were not received before |timeoutMs|
+static bool wait_hid_reports(HIDCheckState &state, size_t count, int timeoutMs)    {
+    const int64_t deadlineUs = now_in_microsecond_high_res_time_REALTIME() + timeoutMs * 1000ll;
+
+    base::AutoLock lock(state.lock);
+    while(state.reports.size() < count)    {
+        if(!state.cond.timedWait(&state.lock, deadlineUs))    break;
+    }
+
+    return state.reports.size() >= count;
+}
+
+// A SOCK_SEQPACKET socketpair keeps the report boundaries, as a hidraw node does
+static int run_hid_check()    {
+    static constexpr int kReportSize = 64;
+    static constexpr int kReportCount = 32;
+    static constexpr int kShortReportSize = 10;
+    static constexpr int kTimeoutMs = 50;
+
+    int fds[2];
+    if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) != 0)    {
+        LOG_ERR_ERRNO(LOG_TAG, "socketpair() failed");
+        return -1;
+    }
+
+    HIDCheckState state;
+    sensors::HIDEventLoop loop;
+    sensors::HIDReportReader reader(&loop, [&state](const uint8_t *report, int length, int64_t tsUs) {
+        (void)tsUs;
+        base::AutoLock lock(state.lock);
+        state.reports.emplace_back(report, report + length);
+        if(length < kReportSize)    {
+            state.shortReports += 1;
+        } else    {
+            unsigned char packet[kReportSize];
+            memcpy(packet, report, sizeof(packet));
+            IMUData imuData;
+            imuData.parsePacket(packet, true);
+            state.frameCounts.push_back(imuData._frameCount);
+        }
+        state.cond.signal();
+    });
+
+    if(!loop.start() || reader.attach(fds[0], true) < 0)    {
+        LOG_ERR(LOG_TAG, "hid_check: unable to start the HID reader");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    std::vector<std::vector<uint8_t>> sent;
+    std::vector<int> expectedFrameCounts;
+    uint32_t seed = 7;
+    for(int i = 0; i < kReportCount; i++)    {
+        unsigned char packet[kReportSize];
+        for(unsigned char &b : packet)    b = (unsigned char)next_random(seed);
+        packet[0] = (unsigned char)((i + 1) & 0xFF);
+        packet[1] = (unsigned char)(((i + 1) >> 8) & 0xFF);
+        sent.emplace_back(packet, packet + kReportSize);
+
+        IMUData imuData;
+        imuData.parsePacket(packet, true);
+        expectedFrameCounts.push_back(imuData._frameCount);
+
+        if(send(fds[1], packet, sizeof(packet), MSG_NOSIGNAL) != kReportSize)    {
+            LOG_ERR_ERRNO(LOG_TAG, "hid_check: send() failed");
+            close(fds[1]);
+            return -1;
+        }
+    }
+    sent.emplace_back(sent[0].begin(), sent[0].begin() + kShortReportSize);
+    send(fds[1], sent.back().data(), kShortReportSize, MSG_NOSIGNAL);
+
+    const char *failure = nullptr;
+    if(!wait_hid_reports(state, sent.size(), 1000))    failure = "reports missing";
+
+    // nothing more is pending, the wait must time out without a report
+    int64_t waitStartUs = now_in_microsecond_high_res_time_REALTIME();
+    if(!failure && wait_hid_reports(state, sent.size() + 1, kTimeoutMs))    failure = "unexpected report";
+    int64_t waitedUs = now_in_microsecond_high_res_time_REALTIME() - waitStartUs;
+    if(!failure && waitedUs < kTimeoutMs * 1000ll)    failure = "wait returned before its timeout";
+
+    // a callback closing its own reader must neither deadlock nor read on
+    int closingFds[2] = { -1, -1 };
+    HIDCheckState closingState;
+    sensors::HIDReportReader closingReader(&loop, [&](const uint8_t *report, int length, int64_t tsUs) {
+        (void)tsUs;
+        closingReader.close();
+        base::AutoLock lock(closingState.lock);
+        closingState.reports.emplace_back(report, report + length);
+        closingState.cond.signal();
+    });
+    if(!failure && (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, closingFds) != 0 ||
+                    closingReader.attach(closingFds[0], true) < 0))    {
+        failure = "unable to attach the self-closing reader";
+    }
+    if(!failure)    {
+        send(closingFds[1], sent[0].data(), kReportSize, MSG_NOSIGNAL);
+        send(closingFds[1], sent[1].data(), kReportSize, MSG_NOSIGNAL);
+        if(!wait_hid_reports(closingState, 1, 1000))    failure = "self-closing reader deadlocked";
+        else if(wait_hid_reports(closingState, 2, kTimeoutMs))    failure = "read after close()";
+        else if(closingReader.isOpened())    failure = "self-closing reader still open";
+    }
+    if(closingFds[1] >= 0)    close(closingFds[1]);
+
+    // the reader mutes the fd on hang up, stopping the loop must not block
+    close(fds[1]);
+    reader.close();
+    loop.stop();
+
+    if(!failure)    {
+        base::AutoLock lock(state.lock);
+        if(state.reports != sent)    failure = "report bytes differ";
+        else if(state.frameCounts != expectedFrameCounts)    failure = "decoded frame counts differ";
+        else if(state.shortReports != 1)    failure = "short report not seen";
+        else if(reader.getReportCount() != sent.size())    failure = "reader report count differs";
+    }
+
+    if(failure)    {
+        LOG_ERR(LOG_TAG, "hid_check: %s", failure);
+        return -1;
+    }
+
+    printf("hid_check: %d reports, 1 short, %" PRIu64 " wakeups, timed out after %" PRId64 " us,"
+           " close() from a callback ok\n",
+           kReportCount, reader.getWakeupCount(), waitedUs);
+
+    return 0;
+}
+
+static void make_imu_report(uint32_t index, uint8_t *report, int length)    {
+    uint32_t seed = index * 2654435761u + 1;
+    for(int i = 0; i < length; i++)    report[i] = (uint8_t)next_random(seed);
+}
+
+static void remove_imu_log(const char *dirPath)    {
+    DIR *dir = opendir(dirPath);
+    if(dir == nullptr)    return;
+
+    struct dirent *entry;
+    while((entry = readdir(dir)) != nullptr)    {
+        if(strncmp(entry->d_name, "imu_", 4) == 0)
+            unlink((std::string(dirPath) + "/" + entry->d_name).c_str());
+    }
+    closedir(dir);
+    rmdir(dirPath);
+}
+
+// Every appended record must be read back unless it was counted as dropped
+static int run_imu_log_check()    {
+    static constexpr uint32_t kRecordsPerSegment = 256;
+    static constexpr int kReportSize = 64;
+    static constexpr int kAppendPeriodUs = 50;
+
+    char dirPath[] = "/tmp/eys3d_imu_log_XXXXXX";
+    if(mkdtemp(dirPath) == nullptr)    {
+        LOG_ERR_ERRNO(LOG_TAG, "mkdtemp() failed");
+        return -1;
+    }
+    std::string movedPath = std::string(dirPath) + ".moved";
+
+    sensors::IMULogWriter writer(dirPath, kRecordsPerSegment);
+    if(writer.open() < 0)    {
+        LOG_ERR(LOG_TAG, "imu_log_check: unable to open %s", dirPath);
+        return -1;
+    }
+
+    uint8_t report[kReportSize];
+    uint32_t appended = 0;
+    auto append = [&](uint32_t count)    {
+        for(uint32_t i = 0; i < count; i++, appended++)    {
+            make_imu_report(appended, report, kReportSize);
+            writer.append(report, kReportSize, 1000000ll + appended * 2000ll);
+            base::Thread::sleepUs(kAppendPeriodUs);
+        }
+    };
+
+    // segment 1 is requested at half of segment 0 and cannot be created
+    const char *failure = nullptr;
+    if(rename(dirPath, movedPath.c_str()) != 0)    failure = "unable to move the log directory";
+    if(!failure)    {
+        append(kRecordsPerSegment / 2);
+        for(int i = 0; i < 1000 && writer.getSegmentFailureCount() == 0; i++)    base::Thread::sleepMs(1);
+        append(kRecordsPerSegment / 2 + 16);
+        if(rename(movedPath.c_str(), dirPath) != 0)    failure = "unable to restore the log directory";
+    }
+    if(!failure)    append(kRecordsPerSegment * 4);
+    writer.close();
+
+    uint64_t dropped = writer.getDroppedCount();
+    sensors::IMULogReader reader;
+    if(!failure && writer.getSegmentFailureCount() == 0)    failure = "segment creation did not fail";
+    if(!failure && dropped == 0)    failure = "no record dropped while the segment was missing";
+    if(!failure && reader.open(dirPath) < 0)    failure = "unable to read the log back";
+    if(!failure && reader.count() + dropped != appended)    failure = "records missing";
+    if(!failure && reader.count() <= kRecordsPerSegment)    failure = "the writer did not recover";
+
+    for(size_t i = 0; !failure && i < reader.count(); i++)    {
+        const sensors::IMULogRecord *record = reader.record(i);
+        make_imu_report(record->sequence, report, kReportSize);
+        if(i > 0 && record->sequence <= reader.record(i - 1)->sequence)    failure = "sequences out of order";
+        else if(record->length != kReportSize || memcmp(record->data, report, kReportSize))
+            failure = "record payload differs";
+        else if(record->tsUs != 1000000ll + record->sequence * 2000ll)    failure = "record timestamp differs";
+        else if(reader.findSequence(record->sequence) != i)    failure = "findSequence() mismatch";
+        else if(reader.findTimestamp(record->tsUs) != i)    failure = "findTimestamp() mismatch";
+    }
+
+    size_t count = reader.count();
+    uint64_t failures = writer.getSegmentFailureCount();
+    reader.close();
+    remove_imu_log(dirPath);
+    rmdir(movedPath.c_str());
+
+    // the errno of the failing call is what comes back, not one clobbered by the logging
+    sensors::IMULogSegment missing;
+    std::string missingPath = movedPath + "/segment";
+    if(!failure && missing.create(missingPath.c_str(), 0, 1) != -ENOENT)    failure = "create() lost ENOENT";
+    if(!failure && missing.open(missingPath.c_str()) != -ENOENT)    failure = "open() lost ENOENT";
+
+    if(failure)    {
+        LOG_ERR(LOG_TAG, "imu_log_check: %s", failure);
+        return -1;
+    }
+
+    printf("imu_log_check: %u appended, %zu read back, %" PRIu64 " dropped, %" PRIu64
+           " failed segment creations\n", appended, count, dropped, failures);
+
+    return 0;
+}
+
+static void usage(const char *program)    {
+    fprintf(stderr,
+            "usage: %s [--json <file|->] [--scenario <substring>]\n"
+            "          [--delivery callback|mailbox|pipeline|pipeline_poll|frameset]\n"
+            "          [--duration-s <s>] [--warmup-s <s>] [--fps <fps>]\n"
+            "          [--imu-hz <hz>] [--mjpeg-file <jpeg>] [--depth-filters]\n"
+            "          [--spin-wait-us <us>] [--callback-cost-us <us>]\n"
+            "       %s --hid-check | --imu-log-check\n"
+            "scenarios:", program, program);
+    for(const Scenario &scenario : kScenarios)    fprintf(stderr, " %s", scenario.name);
+    fprintf(stderr, "\n");
+}
+
+static int write_json(const char *path, const std::vector<RunResult> &results)    {
+    char hostname[256] = "";
+    gethostname(hostname, sizeof(hostname) - 1);
+
+    FILE *file = (strcmp(path, "-") == 0) ? stdout : fopen(path, "w");
+    if(file == nullptr)    {
+        LOG_ERR_ERRNO(LOG_TAG, "Unable to open %s", path);
+        return -1;
+    }
+
+    fprintf(file, "{\n  \"timestamp_us\": %" PRId64 ",\n  \"host\": \"%s\",\n  \"cpus\": %ld,\n"
+                  "  \"cpu_model\": \"%s\",\n  \"runs\": [\n",
+            now_in_microsecond_high_res_time_REALTIME(), hostname,
+            sysconf(_SC_NPROCESSORS_ONLN), BenchRunner::getCpuModel().c_str());
+    for(size_t i = 0; i < results.size(); i++)
+        fprintf(file, "%s%s\n", results[i].json.c_str(), (i + 1 < results.size()) ? "," : "");
+    fprintf(file, "  ]\n}\n");
+
+    if(file != stdout)    fclose(file);
+
+    return (int)results.size();
+}
+
+int main(int argc, char** argv)    {
+    Options options;
+
+    for(int i = 1; i < argc; i++)    {
+        bool hasValue = (i + 1 < argc);
+        if(!strcmp(argv[i], "--json") && hasValue)    options.jsonPath = argv[++i];
+        else if(!strcmp(argv[i], "--scenario") && hasValue)    options.scenarioFilter = argv[++i];
+        else if(!strcmp(argv[i], "--delivery") && hasValue)    options.deliveryFilter = argv[++i];
+        else if(!strcmp(argv[i], "--duration-s") && hasValue)    options.durationS = atof(argv[++i]);
+        else if(!strcmp(argv[i], "--warmup-s") && hasValue)    options.warmupS = atof(argv[++i]);
+        else if(!strcmp(argv[i], "--fps") && hasValue)    options.fps = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "--imu-hz") && hasValue)    options.imuHz = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "--mjpeg-file") && hasValue)    options.mjpegFile = argv[++i];
+        else if(!strcmp(argv[i], "--depth-filters"))    options.depthFilters = true;
+        else if(!strcmp(argv[i], "--spin-wait-us") && hasValue)    options.spinWaitUs = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "--callback-cost-us") && hasValue)    options.callbackCostUs = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "--hid-check"))    return run_hid_check();
+        else if(!strcmp(argv[i], "--imu-log-check"))    return run_imu_log_check();
+        else    {
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if(options.durationS <= 0.0 || options.warmupS < 0.0 || options.fps < 0 || options.imuHz < 0)    {
+        usage(argv[0]);
+        return -1;
+    }
+
+    std::vector<RunResult> results;
+    for(const Scenario &scenario : kScenarios)    {
+        if(options.scenarioFilter && !strstr(scenario.name, options.scenarioFilter))    continue;
+
+        for(int d = 0; d < (int)Delivery::COUNT; d++)    {
+            Delivery delivery = (Delivery)d;
+            if(options.deliveryFilter && strcmp(options.deliveryFilter, get_delivery_name(delivery)))
+                continue;
+
+            RunResult result;
+            if(!run_isolated(scenario, delivery, options, result))    return -1;
+
+            fputs(result.text.c_str(), stdout);
+            fflush(stdout);
+            results.push_back(std::move(result));
+        }
+    }
+
+    if(options.jsonPath && write_json(options.jsonPath, results) < 0)    return -1;
+
+    return 0;
+}
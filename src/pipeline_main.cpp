@@ -7,10 +7,12 @@
 
 #include "EYS3DSystem.h"
 #include "devices/CameraDevice.h"
+#include "DMPreview_utility/ModeConfigTable.h"
 #include "devices/Pipeline.h"
 #include "video/Frame.h"
 #include "sensors/SensorData.h"
 #include "base/threads/Async.h"
+#include "frame_trace.h"
 #include "debug.h"
 
 #ifdef _WIN32
@@ -44,7 +46,11 @@ static void color_image_reader(libeYs3D::devices::Pipeline *pipeline)     {
     libeYs3D::devices::Pipeline::RESULT ret;
     
     while(true) {
-        ret = pipeline->waitForColorFrame(&frame);
+        {
+            libeYs3D::trace::TraceScope waitScope("pipeline_wait", "color");
+            ret = pipeline->waitForColorFrame(&frame);
+            if(ret == libeYs3D::devices::Pipeline::RESULT::OK)    waitScope.setSerial(frame.serialNumber);
+        }
         //ret = pipeline->pollColorFrame(&frame);
         if(ret < 0)    break;
         if(ret > 0)    continue;
@@ -74,7 +80,11 @@ static void depth_image_reader(libeYs3D::devices::Pipeline *pipeline)     {
     libeYs3D::devices::Pipeline::RESULT ret;
     
     while(true) {
-        ret = pipeline->waitForDepthFrame(&frame);
+        {
+            libeYs3D::trace::TraceScope waitScope("pipeline_wait", "depth");
+            ret = pipeline->waitForDepthFrame(&frame);
+            if(ret == libeYs3D::devices::Pipeline::RESULT::OK)    waitScope.setSerial(frame.serialNumber);
+        }
         if(ret < 0)    break;
         if(ret > 0)    continue;
         
@@ -100,7 +110,11 @@ static void pc_frame_reader(libeYs3D::devices::Pipeline *pipeline)     {
     libeYs3D::devices::Pipeline::RESULT ret;
     
     while(true) {
-        ret = pipeline->waitForPCFrame(&pcFrame);
+        {
+            libeYs3D::trace::TraceScope waitScope("pipeline_wait", "pc");
+            ret = pipeline->waitForPCFrame(&pcFrame);
+            if(ret == libeYs3D::devices::Pipeline::RESULT::OK)    waitScope.setSerial(pcFrame.serialNumber);
+        }
         if(ret < 0)    break;
         if(ret > 0)    continue;
 
@@ -129,7 +143,11 @@ static void imu_data_reader(libeYs3D::devices::Pipeline *pipeline)     {
     libeYs3D::devices::Pipeline::RESULT ret;
     
     while(true) {
-        ret = pipeline->waitForIMUData(&sensorData);
+        {
+            libeYs3D::trace::TraceScope waitScope("pipeline_wait", "imu");
+            ret = pipeline->waitForIMUData(&sensorData);
+            if(ret == libeYs3D::devices::Pipeline::RESULT::OK)    waitScope.setSerial(sensorData.serialNumber);
+        }
         if(ret < 0)    break;
         if(ret > 0)    continue;
         
@@ -149,6 +167,7 @@ static void imu_data_reader(libeYs3D::devices::Pipeline *pipeline)     {
 int main(int argc, char** argv)    {
 #if 1
     LOG_INFO(LOG_TAG, "Starting EYS3DSystem...");
+    libeYs3D::trace::enableTracingFromEnv();
 
     //std::shared_ptr<EYS3DSystem> eYs3DSystem = EYS3DSystem::getEYS3DSystem();
     std::shared_ptr<EYS3DSystem> eYs3DSystem = std::make_shared<EYS3DSystem>(EYS3DSystem::COLOR_BYTE_ORDER::COLOR_BGR24);